@@ -0,0 +1,123 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+
+#include "common.h"
+
+
+// Allocations are aligned to this, enough for anything the loaders store.
+#define Z_ARENA_ALIGN 8
+
+#define Z_ARENA_ROUND(x) (((x) + Z_ARENA_ALIGN - 1) & ~((size_t) Z_ARENA_ALIGN - 1))
+
+
+struct ZArenaChunk
+{
+    ZArenaChunk *next;
+    size_t size;
+    size_t used;
+
+    // Keeps data aligned, whatever the size of the fields above.
+    union {
+        char data[1];
+        double align;
+        void *align_ptr;
+    } u;
+};
+
+
+
+// Setup an empty arena, initial_size is the size of the first chunk.
+void zArenaInit(ZArena *arena, size_t initial_size)
+{
+    arena->chunks = NULL;
+    arena->initial_size = MAX(Z_ARENA_ROUND(initial_size), Z_ARENA_ALIGN);
+    arena->next_size = arena->initial_size;
+    arena->total = 0;
+    arena->last = NULL;
+}
+
+
+
+// Returns size bytes of memory from arena, or NULL if memory ran out.
+void *zArenaAlloc(ZArena *arena, size_t size)
+{
+    ZArenaChunk *chunk = arena->chunks;
+    void *ptr;
+
+    size = Z_ARENA_ROUND(MAX(size, 1));
+
+    if (!chunk || chunk->size - chunk->used < size) {
+
+        size_t chunk_size = arena->next_size;
+
+        while (chunk_size < size) chunk_size *= 2;
+
+        if ( !(chunk = malloc(offsetof(ZArenaChunk, u) + chunk_size)) )
+            return NULL;
+
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->next_size = chunk_size * 2;
+        arena->total += chunk_size;
+    }
+
+    ptr = chunk->u.data + chunk->used;
+    chunk->used += size;
+    arena->last = ptr;
+
+    return ptr;
+}
+
+
+
+// Resize ptr, an allocation of old_size bytes from arena, to new_size bytes. ptr may be NULL, in
+// which case this is the same as zArenaAlloc. Returns the (possibly moved) memory, or NULL if
+// memory ran out, ptr is still valid then.
+void *zArenaGrow(ZArena *arena, void *ptr, size_t old_size, size_t new_size)
+{
+    ZArenaChunk *chunk = arena->chunks;
+    void *new_ptr;
+
+    if (!ptr) return zArenaAlloc(arena, new_size);
+
+    assert(new_size >= old_size);
+
+    // Extend in place if ptr is at the end of the current chunk and there is room left.
+    if (ptr == arena->last) {
+
+        size_t start = (char *) ptr - chunk->u.data;
+
+        if (chunk->size - start >= Z_ARENA_ROUND(new_size)) {
+            chunk->used = start + Z_ARENA_ROUND(new_size);
+            return ptr;
+        }
+    }
+
+    if ( !(new_ptr = zArenaAlloc(arena, new_size)) )
+        return NULL;
+
+    memcpy(new_ptr, ptr, old_size);
+
+    return new_ptr;
+}
+
+
+
+// Free all memory allocated from arena. It can be used again afterwards, starting over with a chunk
+// of the initial size.
+void zArenaFree(ZArena *arena)
+{
+    ZArenaChunk *next, *chunk = arena->chunks;
+
+    while (chunk) {
+        next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    zArenaInit(arena, arena->initial_size);
+}
@@ -0,0 +1,36 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+// Linear allocator for scratch memory that is thrown away all at once, like the buffers a mesh
+// loader fills while parsing. Allocations are carved from big chunks, each new chunk being twice
+// the size of the one before it (or bigger if a single allocation needs that), and nothing is
+// freed until zArenaFree releases the whole lot.
+//
+// Buffers that grow while they are filled can be resized with zArenaGrow. The most recent
+// allocation is extended in place when its chunk has room, anything else is copied to a new block
+// and the old one is left as is. Callers should grow buffers geometrically (doubling them, say), so
+// the total amount of copying stays linear in the final size.
+
+typedef struct ZArenaChunk ZArenaChunk;
+
+typedef struct ZArena
+{
+    ZArenaChunk *chunks; // Most recent chunk first.
+    size_t initial_size; // Size of the first chunk.
+    size_t next_size;    // Size of the next chunk to be allocated.
+    size_t total;        // Bytes allocated for all chunks.
+
+    void *last;          // Most recent allocation, which can still be extended in place.
+
+} ZArena;
+
+
+void zArenaInit(ZArena *arena, size_t initial_size);
+
+void *zArenaAlloc(ZArena *arena, size_t size);
+
+void *zArenaGrow(ZArena *arena, void *ptr, size_t old_size, size_t new_size);
+
+void zArenaFree(ZArena *arena);
+
+#endif
@@ -0,0 +1,694 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+
+#include "common.h"
+
+
+#define Z_ATLAS_UV_EPSILON 0.001f // Slack for texture coordinates that are just outside 0-1.
+
+
+// A material that may have its diffuse map packed.
+typedef struct ZAtlasEntry
+{
+    ZMaterial *mat;
+    int bucket; // Entries in the same bucket only differ in their diffuse map.
+    int image;  // Index into ZAtlasPack.images.
+    int item;   // Index into ZAtlasPack.items, -1 if not packed.
+
+} ZAtlasEntry;
+
+
+// An image to be placed in an atlas, one for each distinct image in a bucket.
+typedef struct ZAtlasItem
+{
+    int bucket;
+    int image;
+
+    int width;  // Size including padding (and rounded up to the alignment).
+    int height;
+    int x;      // Position of the padded rectangle in the atlas.
+    int y;
+
+    int atlas;  // Index of the atlas the item was placed in, -1 if it wasn't.
+
+} ZAtlasItem;
+
+
+// Each of the arrays has room for one element per group of the mesh, there can't be more entries,
+// images, items or atlases than that.
+typedef struct ZAtlasPack
+{
+    ZMesh *mesh;
+
+    ZAtlasEntry *entries;
+    int num_entries;
+
+    const char **names; // Diffuse map names of the images.
+    ZImage **images;    // Decoded by zDecodeAtlasImage.
+    int num_images;
+
+    ZAtlasItem *items;
+    int num_items;
+
+    ZMaterial **atlas_mats; // Material for each atlas, NULL if it wasn't used.
+    int *atlas_width;
+    int *atlas_height;
+    int num_atlases;
+
+} ZAtlasPack;
+
+
+// Node of the skyline, the top edge of the packed area from x to x+width is at y.
+typedef struct ZSkylineNode
+{
+    int x;
+    int y;
+    int width;
+
+} ZSkylineNode;
+
+
+
+// Returns the y at which a width x height rectangle fits on the skyline starting at node i, or -1
+// if it doesn't fit there.
+static int zSkylineFit(const ZSkylineNode *nodes, int num_nodes, int i, int width, int height,
+    int atlas_width, int atlas_height)
+{
+    int y = 0, left = width;
+
+    if (nodes[i].x + width > atlas_width) return -1;
+
+    // The nodes always cover the full width, so this never runs past the last one.
+    while (left > 0 && i < num_nodes) {
+        y = MAX(y, nodes[i].y);
+        if (y + height > atlas_height) return -1;
+        left -= nodes[i].width;
+        i++;
+    }
+
+    return y;
+}
+
+
+
+// Place a width x height rectangle on the skyline where its top ends up lowest (and if there's a
+// tie, on the narrowest node). Returns FALSE if it doesn't fit anywhere.
+static int zSkylineInsert(ZSkylineNode *nodes, int *num_nodes, int width, int height,
+    int atlas_width, int atlas_height, int *x, int *y)
+{
+    int i, fit, end, shrink, best = -1, best_top = INT_MAX, best_width = INT_MAX;
+
+    for (i = 0; i < *num_nodes; i++) {
+
+        fit = zSkylineFit(nodes, *num_nodes, i, width, height, atlas_width, atlas_height);
+
+        if ( fit >= 0 && (fit + height < best_top ||
+                          (fit + height == best_top && nodes[i].width < best_width)) ) {
+            best = i;
+            best_top = fit + height;
+            best_width = nodes[i].width;
+        }
+    }
+
+    if (best < 0) return FALSE;
+
+    *x = nodes[best].x;
+    *y = best_top - height;
+
+    // Add a node for the top of the new rectangle.
+    memmove(nodes + best + 1, nodes + best, (*num_nodes - best) * sizeof(ZSkylineNode));
+    nodes[best].x = *x;
+    nodes[best].y = best_top;
+    nodes[best].width = width;
+    (*num_nodes)++;
+
+    // Cut away the parts of the following nodes that are now covered.
+    end = *x + width;
+
+    for (i = best+1; i < *num_nodes && nodes[i].x < end; ) {
+
+        shrink = end - nodes[i].x;
+        nodes[i].x += shrink;
+        nodes[i].width -= shrink;
+
+        if (nodes[i].width > 0) break;
+
+        memmove(nodes + i, nodes + i + 1, (*num_nodes - i - 1) * sizeof(ZSkylineNode));
+        (*num_nodes)--;
+    }
+
+    // Merge neighbours at the same height.
+    for (i = 0; i < *num_nodes - 1; ) {
+        if (nodes[i].y == nodes[i+1].y) {
+            nodes[i].width += nodes[i+1].width;
+            memmove(nodes + i + 1, nodes + i + 2, (*num_nodes - i - 2) * sizeof(ZSkylineNode));
+            (*num_nodes)--;
+        } else {
+            i++;
+        }
+    }
+
+    return TRUE;
+}
+
+
+
+// Returns TRUE if a and b only differ in things the atlas makes irrelevant (their diffuse map and
+// its wrap mode), so they can be replaced by the same material.
+static int zCanShareAtlas(const ZMaterial *a, const ZMaterial *b)
+{
+    return a->flags == b->flags && a->blend_type == b->blend_type &&
+           memcmp(a->ambient_color,  b->ambient_color,  sizeof(a->ambient_color))  == 0 &&
+           memcmp(a->diffuse_color,  b->diffuse_color,  sizeof(a->diffuse_color))  == 0 &&
+           memcmp(a->specular_color, b->specular_color, sizeof(a->specular_color)) == 0 &&
+           memcmp(a->emission_color, b->emission_color, sizeof(a->emission_color)) == 0 &&
+           a->shininess == b->shininess && a->min_filter == b->min_filter &&
+           a->mag_filter == b->mag_filter && a->vertex_shader == b->vertex_shader &&
+           a->fragment_shader == b->fragment_shader;
+}
+
+
+
+// Returns TRUE if all texture coordinates of group lie within 0-1, so its texture doesn't repeat.
+static int zGroupInUnitSquare(ZMesh *mesh, ZMeshGroup *group)
+{
+    unsigned int i, v;
+    const float *vt;
+
+    for (i = group->start; i < group->start + group->count; i++) {
+
+        v = (mesh->flags & Z_MESH_VA_INDEXED) ? mesh->indices[i] : i;
+        vt = mesh->vertices + v * mesh->elem_size;
+
+        if ( vt[0] < -Z_ATLAS_UV_EPSILON || vt[0] > 1.0f + Z_ATLAS_UV_EPSILON ||
+             vt[1] < -Z_ATLAS_UV_EPSILON || vt[1] > 1.0f + Z_ATLAS_UV_EPSILON )
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+
+// Collect materials of mesh that could have their diffuse maps packed, and sort them into buckets.
+static void zFindAtlasEntries(ZAtlasPack *pack)
+{
+    unsigned int i, j;
+    int k, num_buckets = 0;
+    ZMesh *mesh = pack->mesh;
+    ZMaterial *mat;
+    ZAtlasEntry *entry;
+
+    for (i = 0; i < mesh->num_groups; i++) {
+
+        mat = mesh->groups[i].material;
+
+        if ( !mat->diffuse_map_name[0] || mat->normal_map_name[0] || mat->specular_map_name[0] ||
+             mat->virtual_map_name[0] )
+            continue;
+
+        // Only look at each material once, it can only be packed if none of its groups repeat the
+        // texture.
+        for (j = 0; j < i && mesh->groups[j].material != mat; j++);
+        if (j < i) continue;
+
+        for (j = i; j < mesh->num_groups; j++) {
+            if (mesh->groups[j].material == mat && !zGroupInUnitSquare(mesh, &(mesh->groups[j])))
+                break;
+        }
+        if (j < mesh->num_groups) continue;
+
+        entry = &(pack->entries[pack->num_entries++]);
+        entry->mat  = mat;
+        entry->item = -1;
+
+        // Find a bucket of compatible materials.
+        entry->bucket = num_buckets;
+        for (k = 0; k < pack->num_entries-1; k++) {
+            if (zCanShareAtlas(pack->entries[k].mat, mat)) {
+                entry->bucket = pack->entries[k].bucket;
+                break;
+            }
+        }
+        if (entry->bucket == num_buckets) num_buckets++;
+
+        // Materials may share images.
+        for (k = 0; k < pack->num_images && pack->names[k] != mat->diffuse_map_name; k++);
+        if (k == pack->num_images) {
+            pack->names[k] = mat->diffuse_map_name;
+            pack->images[k] = NULL;
+            pack->num_images++;
+        }
+        entry->image = k;
+    }
+}
+
+
+
+// zParallelFor callback, decodes one of the images.
+static void zDecodeAtlasImage(void *data, int index)
+{
+    ZAtlasPack *pack = data;
+    const char *path = zGetPath(pack->names[index], NULL, Z_FILE_REWRITE_DIRSEP | Z_FILE_TRYUSER);
+
+    pack->images[index] = path ? zLoadImage(path) : NULL;
+
+    // Don't hold on to images that won't be packed anyway.
+    if ( pack->images[index] && (pack->images[index]->width > r_texatlasmax ||
+                                 pack->images[index]->height > r_texatlasmax) ) {
+        zDeleteImage(pack->images[index]);
+        pack->images[index] = NULL;
+    }
+}
+
+
+
+static int zCompareItems(const void *a, const void *b)
+{
+    const ZAtlasItem *ia = a, *ib = b;
+
+    // Tallest first packs best with a skyline, group by bucket so each atlas gets one bucket.
+    if (ia->bucket != ib->bucket) return ia->bucket - ib->bucket;
+    return ib->height - ia->height;
+}
+
+
+
+// Create an item for each distinct image in each bucket, and pack them into atlases.
+static void zPackAtlasItems(ZAtlasPack *pack)
+{
+    int i, j, align = r_texatlaspadding * 2, num_nodes, bucket, first, packed;
+    ZAtlasEntry *entry;
+    ZAtlasItem *item;
+    ZImage *img;
+    ZSkylineNode *nodes;
+
+    for (i = 0; i < pack->num_entries; i++) {
+
+        entry = &(pack->entries[i]);
+
+        if ( !(img = pack->images[entry->image]) ) continue;
+
+        for (j = 0; j < pack->num_items; j++) {
+            if (pack->items[j].bucket == entry->bucket && pack->items[j].image == entry->image)
+                break;
+        }
+
+        if (j == pack->num_items) {
+            item = &(pack->items[pack->num_items++]);
+            item->bucket = entry->bucket;
+            item->image  = entry->image;
+            item->width  = (img->width  + 2*r_texatlaspadding + align-1) / align * align;
+            item->height = (img->height + 2*r_texatlaspadding + align-1) / align * align;
+            item->atlas  = -1;
+        }
+    }
+
+    qsort(pack->items, pack->num_items, sizeof(ZAtlasItem), zCompareItems);
+
+    // Items are sorted now, so entries look them up by bucket and image again.
+    for (i = 0; i < pack->num_entries; i++) {
+        for (j = 0; j < pack->num_items; j++) {
+            if (pack->items[j].bucket == pack->entries[i].bucket &&
+                pack->items[j].image == pack->entries[i].image)
+                pack->entries[i].item = j;
+        }
+    }
+
+    if ( !(nodes = malloc((pack->num_items + 1) * sizeof(ZSkylineNode))) ) {
+        zError("%s: Failed to allocate memory.", __func__);
+        return;
+    }
+
+    // Fill atlases for each bucket until all of its items are placed (or don't fit at all).
+    for (first = 0; first < pack->num_items; ) {
+
+        bucket = pack->items[first].bucket;
+
+        nodes[0].x = nodes[0].y = 0;
+        nodes[0].width = r_texatlassize;
+        num_nodes = 1;
+        packed = 0;
+
+        pack->atlas_width[pack->num_atlases]  = r_texatlassize;
+        pack->atlas_height[pack->num_atlases] = 0;
+
+        for (i = first; i < pack->num_items && pack->items[i].bucket == bucket; i++) {
+
+            item = &(pack->items[i]);
+
+            if (item->atlas >= 0) continue;
+
+            if (zSkylineInsert(nodes, &num_nodes, item->width, item->height, r_texatlassize,
+                               r_texatlassize, &(item->x), &(item->y))) {
+                item->atlas = pack->num_atlases;
+                pack->atlas_height[pack->num_atlases] =
+                    MAX(pack->atlas_height[pack->num_atlases], item->y + item->height);
+                packed++;
+            }
+        }
+
+        if (packed) pack->num_atlases++;
+
+        // Move on to the next bucket once nothing more could be placed.
+        if (!packed || i == first) {
+            while (first < pack->num_items && pack->items[first].bucket == bucket) first++;
+        } else {
+            while (first < pack->num_items && pack->items[first].bucket == bucket &&
+                   pack->items[first].atlas >= 0)
+                first++;
+        }
+    }
+
+    free(nodes);
+}
+
+
+
+// Build the image for atlas index, save it and create the material that uses it. Atlases holding
+// just one image aren't worth it and are skipped.
+static void zBuildAtlas(ZAtlasPack *pack, int index)
+{
+    int i, x, y, sx, sy, count = 0, pad = r_texatlaspadding;
+    ZAtlasItem *item;
+    ZImage atlas, *img;
+    ZMaterial template, *mat = NULL;
+    const char *dir, *path, *atlas_name;
+    char name[Z_RESOURCE_NAME_SIZE];
+    unsigned long long hash;
+
+    for (i = 0; i < pack->num_items; i++) {
+        if (pack->items[i].atlas == index) count++;
+    }
+
+    if (count < 2) return;
+
+    // Round the height up to a power of two, the width already is one.
+    atlas.width = pack->atlas_width[index];
+    for (atlas.height = 1; atlas.height < pack->atlas_height[index]; atlas.height *= 2);
+
+    if ( !(atlas.data = calloc((size_t) atlas.width * atlas.height, 4)) ) {
+        zError("%s: Failed to allocate memory.", __func__);
+        return;
+    }
+
+    for (i = 0; i < pack->num_items; i++) {
+
+        item = &(pack->items[i]);
+        if (item->atlas != index) continue;
+
+        img = pack->images[item->image];
+
+        // Copy the image, with its edges repeated into the padding around it.
+        for (y = 0; y < item->height; y++) {
+
+            sy = MIN(MAX(y - pad, 0), img->height-1);
+
+            for (x = 0; x < item->width; x++) {
+                sx = MIN(MAX(x - pad, 0), img->width-1);
+                memcpy(atlas.data + ((size_t) (item->y + y) * atlas.width + item->x + x) * 4,
+                    img->data + ((size_t) sy * img->width + sx) * 4, 4);
+            }
+        }
+    }
+
+    // Name the atlas after its contents, so an unchanged atlas keeps its file (and its entry in the
+    // texture cache).
+    hash = zHashData(Z_HASH_INIT, &(atlas.width), sizeof(atlas.width));
+    hash = zHashData(hash, &(atlas.height), sizeof(atlas.height));
+    hash = zHashData(hash, atlas.data, (size_t) atlas.width * atlas.height * 4);
+
+    snprintf(name, sizeof(name), Z_ATLAS_DIR "/%016llx.tga", hash);
+    name[sizeof(name)-1] = '\0';
+    atlas_name = zIntern(name);
+
+    if ( !(dir = zGetPath(Z_ATLAS_DIR, NULL, Z_FILE_FORCEUSER)) || !zMakeDir(dir) ||
+         !(path = zGetPath(name, NULL, Z_FILE_FORCEUSER | Z_FILE_REWRITE_DIRSEP)) ) {
+        zWarning("Failed to create texture atlas directory.");
+        free(atlas.data);
+        return;
+    }
+
+    // The new material is based on any of the entries in the atlas, they are all the same apart
+    // from their diffuse map.
+    for (i = 0; i < pack->num_entries; i++) {
+        if (pack->entries[i].item >= 0 && pack->items[pack->entries[i].item].atlas == index)
+            break;
+    }
+
+    assert(i < pack->num_entries);
+
+    template = *(pack->entries[i].mat);
+    template.next = NULL;
+
+    if ( (zPathExists(path) == Z_EXISTS_REGULAR || zSaveImage(path, &atlas)) &&
+         (mat = zCopyMaterial(&template)) ) {
+
+        snprintf(name, sizeof(name), "%s#atlas%d", template.name, index);
+        name[sizeof(name)-1] = '\0';
+        mat->name = zIntern(name);
+        mat->diffuse_map_name = atlas_name;
+        mat->wrap_mode = Z_TEX_WRAP_CLAMPEDGE;
+        mat->is_resident = 0;
+        mat->diffuse_map = NULL;
+        mat->program = NULL;
+
+        mat->next = pack->mesh->materials;
+        pack->mesh->materials = mat;
+
+        zDebug("Packed %d textures of mesh \"%s\" into %dx%d atlas \"%s\".", count,
+            pack->mesh->name, atlas.width, atlas.height, atlas_name);
+    }
+
+    pack->atlas_mats[index] = mat;
+    pack->atlas_height[index] = atlas.height;
+
+    free(atlas.data);
+}
+
+
+
+// Remap the texture coordinates of group from its original image into item's place in the atlas.
+// done marks vertices already remapped, in case groups share them (see zResolveSharedVertices).
+static void zRemapGroup(ZAtlasPack *pack, ZMeshGroup *group, ZAtlasItem *item, unsigned char *done)
+{
+    unsigned int i, v;
+    float *vt;
+    ZMesh *mesh = pack->mesh;
+    ZImage *img = pack->images[item->image];
+    float width  = pack->atlas_width[item->atlas];
+    float height = pack->atlas_height[item->atlas];
+
+    for (i = group->start; i < group->start + group->count; i++) {
+
+        v = (mesh->flags & Z_MESH_VA_INDEXED) ? mesh->indices[i] : i;
+
+        if (done[v]) continue;
+        done[v] = 1;
+
+        vt = mesh->vertices + v * mesh->elem_size;
+        vt[0] = (item->x + r_texatlaspadding + MIN(MAX(vt[0], 0.0f), 1.0f) * img->width) / width;
+        vt[1] = (item->y + r_texatlaspadding + MIN(MAX(vt[1], 0.0f), 1.0f) * img->height) / height;
+    }
+}
+
+
+
+// Returns the index of the atlas item the diffuse map of group was packed as, or -1 if it can't be
+// remapped to an atlas.
+static int zGroupAtlasItem(ZAtlasPack *pack, ZMeshGroup *group)
+{
+    int j;
+    ZAtlasItem *item;
+
+    for (j = 0; j < pack->num_entries; j++) {
+        if (pack->entries[j].mat == group->material)
+            break;
+    }
+
+    if (j == pack->num_entries || pack->entries[j].item < 0) return -1;
+
+    item = &(pack->items[pack->entries[j].item]);
+
+    if (item->atlas < 0 || !pack->atlas_mats[item->atlas]) return -1;
+
+    return pack->entries[j].item;
+}
+
+
+
+// Groups of indexed meshes can share vertices, and a vertex only has one set of texture
+// coordinates. So a group can only be remapped if all of its vertices are used by groups that are
+// remapped to the same item, otherwise its target in targets is set back to -1. Groups that are
+// left alone claim their vertices as well, which can in turn rule out other groups, so this goes on
+// until nothing changes. owner is scratch space for one int per vertex.
+static void zResolveSharedVertices(ZAtlasPack *pack, int *targets, int *owner)
+{
+    ZMesh *mesh = pack->mesh;
+    ZMeshGroup *group;
+    unsigned int i, k, v;
+    int code, changed = 1;
+
+    if (!(mesh->flags & Z_MESH_VA_INDEXED)) return;
+
+    // Owner codes are item+1 for remapped groups, -1 for groups left alone, -2 for vertices used by
+    // both kinds (or by different items), and 0 for vertices not used yet.
+    while (changed) {
+
+        changed = 0;
+        memset(owner, '\0', mesh->num_vertices * sizeof(int));
+
+        for (i = 0; i < mesh->num_groups; i++) {
+
+            group = &(mesh->groups[i]);
+            code = targets[i] >= 0 ? targets[i] + 1 : -1;
+
+            for (k = group->start; k < group->start + group->count; k++) {
+                v = mesh->indices[k];
+                if (!owner[v])
+                    owner[v] = code;
+                else if (owner[v] != code)
+                    owner[v] = -2;
+            }
+        }
+
+        for (i = 0; i < mesh->num_groups; i++) {
+
+            if (targets[i] < 0) continue;
+
+            group = &(mesh->groups[i]);
+
+            for (k = group->start; k < group->start + group->count; k++) {
+                if (owner[mesh->indices[k]] != targets[i] + 1) {
+                    zDebug("Not packing group %u of mesh \"%s\", it shares vertices with a group "
+                        "using another texture.", i, mesh->name);
+                    targets[i] = -1;
+                    changed = 1;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+
+
+static void zDeleteAtlasPack(ZAtlasPack *pack)
+{
+    int i;
+
+    for (i = 0; i < pack->num_images; i++) {
+        if (pack->images[i])
+            zDeleteImage(pack->images[i]);
+    }
+
+    free(pack->entries);
+    free(pack->names);
+    free(pack->images);
+    free(pack->items);
+    free(pack->atlas_mats);
+    free(pack->atlas_width);
+    free(pack->atlas_height);
+    free(pack);
+}
+
+
+
+// Returns a new, empty ZAtlasPack with arrays sized for mesh, or NULL if memory ran out.
+static ZAtlasPack *zNewAtlasPack(ZMesh *mesh)
+{
+    ZAtlasPack *pack;
+    unsigned int n = mesh->num_groups;
+
+    if ( !(pack = calloc(1, sizeof(ZAtlasPack))) ) return NULL;
+
+    pack->mesh         = mesh;
+    pack->entries      = calloc(n, sizeof(ZAtlasEntry));
+    pack->names        = calloc(n, sizeof(const char *));
+    pack->images       = calloc(n, sizeof(ZImage *));
+    pack->items        = calloc(n, sizeof(ZAtlasItem));
+    pack->atlas_mats   = calloc(n, sizeof(ZMaterial *));
+    pack->atlas_width  = calloc(n, sizeof(int));
+    pack->atlas_height = calloc(n, sizeof(int));
+
+    if (!pack->entries || !pack->names || !pack->images || !pack->items || !pack->atlas_mats ||
+        !pack->atlas_width || !pack->atlas_height) {
+        zDeleteAtlasPack(pack);
+        return NULL;
+    }
+
+    return pack;
+}
+
+
+
+// Pack the small diffuse maps of mesh into atlases, see atlas.h. This should be called right after
+// the mesh is loaded, before it's uploaded or tangents are built.
+void zPackMeshTextures(ZMesh *mesh)
+{
+    ZAtlasPack *pack;
+    ZAtlasItem *item;
+    unsigned char *done;
+    int *targets, *owner;
+    unsigned int i;
+    int j, changed = 0;
+
+    assert(!mesh->is_resident);
+
+    if ( !(pack = zNewAtlasPack(mesh)) ) {
+        zError("%s: Failed to allocate memory.", __func__);
+        return;
+    }
+
+    zFindAtlasEntries(pack);
+
+    if (pack->num_entries < 2) {
+        zDeleteAtlasPack(pack);
+        return;
+    }
+
+    zParallelFor(pack->num_images, zDecodeAtlasImage, pack);
+
+    zPackAtlasItems(pack);
+
+    for (j = 0; j < pack->num_atlases; j++)
+        zBuildAtlas(pack, j);
+
+    // Point groups at the atlas materials.
+    done    = calloc(mesh->num_vertices, 1);
+    targets = malloc(mesh->num_groups * sizeof(int));
+    owner   = malloc(mesh->num_vertices * sizeof(int));
+
+    if (done && targets && owner) {
+
+        for (i = 0; i < mesh->num_groups; i++)
+            targets[i] = zGroupAtlasItem(pack, &(mesh->groups[i]));
+
+        zResolveSharedVertices(pack, targets, owner);
+
+        for (i = 0; i < mesh->num_groups; i++) {
+
+            if (targets[i] < 0) continue;
+
+            item = &(pack->items[targets[i]]);
+
+            zRemapGroup(pack, &(mesh->groups[i]), item, done);
+            mesh->groups[i].material = pack->atlas_mats[item->atlas];
+            changed = 1;
+        }
+
+    } else {
+        zError("%s: Failed to allocate memory.", __func__);
+    }
+
+    free(done);
+    free(targets);
+    free(owner);
+
+    if (changed) zMergeMeshGroups(mesh);
+
+    zDeleteAtlasPack(pack);
+}
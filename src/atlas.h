@@ -0,0 +1,19 @@
+#ifndef __ATLAS_H__
+#define __ATLAS_H__
+
+// With r_texatlas set, meshes that use lots of small textures get them packed into shared atlases
+// when they are loaded. Materials that only differ in their (small) diffuse map are replaced by one
+// material using the atlas, texture coordinates of the groups using them are remapped into the
+// atlas, and those groups are merged so the material is only made active once.
+//
+// Each texture is surrounded by r_texatlaspadding texels of its own edges and placed at a multiple
+// of twice the padding, so the first few mipmap levels don't bleed between neighbours. Only
+// textures that aren't repeated (texture coordinates within 0-1) can be packed. Atlases are written
+// as TGA images to Z_ATLAS_DIR in the user directory, named after a hash of their contents, and
+// from then on are loaded (and cached, compressed, evicted) like any other texture.
+
+#define Z_ATLAS_DIR "atlas"
+
+void zPackMeshTextures(ZMesh *mesh);
+
+#endif
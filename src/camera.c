@@ -233,20 +233,25 @@ void zCameraUpdate(ZCamera *camera, float tdelta)
 
 
 
+// Returns the aspect ratio used for the projection transform.
+static float zCameraAspectRatio(void)
+{
+	if (r_aspectratio > 0.0009765625)
+		return r_aspectratio;
+	else
+		return (float) viewport_width / (float) viewport_height;
+}
+
+
+
 // Apply camera projection matrix.
 void zCameraApplyProjection(ZCamera *camera)
 {
-	float ratio;
+	float ratio = zCameraAspectRatio();
 
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
 
-
-	if (r_aspectratio > 0.0009765625)
-		ratio = r_aspectratio;
-	else
-		ratio = (float) viewport_width / (float) viewport_height;
-
     //glOrtho(-1.0*ratio, 1.0*ratio, -1.0, 1.0, 0.1, 100.0);
     gluPerspective(camera->fov, ratio, r_nearplane, r_farplane);
     glMatrixMode(GL_MODELVIEW);
@@ -277,3 +282,77 @@ void zCameraApplyViewing(ZCamera *cam, int skip_translate)
 }
 
 
+
+
+// Set plane to have normal n (normalized here) and pass through point p.
+static void zSetFrustumPlane(float *plane, ZVec3 *n, ZVec3 *p)
+{
+    zNormalize3(n);
+
+    plane[0] = n->x;
+    plane[1] = n->y;
+    plane[2] = n->z;
+    plane[3] = -zDot3(n, p);
+}
+
+
+
+// Derive the view frustum for camera, matching the transforms set up by zCameraApplyProjection and
+// zCameraApplyViewing. If skip_translate is set, the frustum is positioned at the origin, like the
+// viewing transform used for drawing the sky.
+void zCameraGetFrustum(ZCamera *camera, ZFrustum *frustum, int skip_translate)
+{
+    ZVec3 f = camera->forward, u = camera->up, r, n, p;
+    float half_v = tanf(DEG_TO_RAD(camera->fov) * 0.5f);
+    float half_h = half_v * zCameraAspectRatio();
+
+    zNormalize3(&f);
+    zNormalize3(&u);
+    r = zCross3(&f, &u);
+
+    if (skip_translate) {
+        zSetFloat3(&frustum->origin, 0.0f, 0.0f, 0.0f);
+    } else {
+        frustum->origin = camera->position;
+    }
+
+    // The four side planes all pass through the viewpoint.
+    p = frustum->origin;
+
+    zSetFloat3(&n, r.x + f.x*half_h, r.y + f.y*half_h, r.z + f.z*half_h);   // left
+    zSetFrustumPlane(frustum->planes[0], &n, &p);
+    zSetFloat3(&n, -r.x + f.x*half_h, -r.y + f.y*half_h, -r.z + f.z*half_h); // right
+    zSetFrustumPlane(frustum->planes[1], &n, &p);
+    zSetFloat3(&n, u.x + f.x*half_v, u.y + f.y*half_v, u.z + f.z*half_v);   // bottom
+    zSetFrustumPlane(frustum->planes[2], &n, &p);
+    zSetFloat3(&n, -u.x + f.x*half_v, -u.y + f.y*half_v, -u.z + f.z*half_v); // top
+    zSetFrustumPlane(frustum->planes[3], &n, &p);
+
+    // Near and far planes.
+    n = f;
+    zSetFloat3(&p, p.x + f.x*r_nearplane, p.y + f.y*r_nearplane, p.z + f.z*r_nearplane);
+    zSetFrustumPlane(frustum->planes[4], &n, &p);
+
+    zSetFloat3(&n, -f.x, -f.y, -f.z);
+    p = frustum->origin;
+    zSetFloat3(&p, p.x + f.x*r_farplane, p.y + f.y*r_farplane, p.z + f.z*r_farplane);
+    zSetFrustumPlane(frustum->planes[5], &n, &p);
+}
+
+
+
+// Returns TRUE if the sphere at center with given radius is (partially) inside frustum, else FALSE.
+int zFrustumTestSphere(const ZFrustum *frustum, const ZVec3 *center, float radius)
+{
+    int i;
+
+    for (i = 0; i < 6; i++) {
+
+        const float *plane = frustum->planes[i];
+
+        if (plane[0]*center->x + plane[1]*center->y + plane[2]*center->z + plane[3] < -radius)
+            return FALSE;
+    }
+
+    return TRUE;
+}
@@ -19,6 +19,18 @@ typedef struct ZCamera
 } ZCamera;
 
 
+// ZFrustum - View frustum planes in world space, along with the viewpoint they were derived from.
+// Used for culling, plane normals point inward so a point p is inside a plane if
+// dot(plane.xyz, p) + plane.w >= 0.
+typedef struct ZFrustum
+{
+    ZVec3 origin;
+
+    float planes[6][4];
+
+} ZFrustum;
+
+
 void zCameraInit(ZCamera *camera);
 
 void zCameraSetPosition(ZCamera *camera, float x, float y, float z);
@@ -41,5 +53,9 @@ void zCameraApplyProjection(ZCamera *camera);
 
 void zCameraApplyViewing(ZCamera *camera, int skip_translate);
 
+void zCameraGetFrustum(ZCamera *camera, ZFrustum *frustum, int skip_translate);
+
+int zFrustumTestSphere(const ZFrustum *frustum, const ZVec3 *center, float radius);
+
 
 #endif
@@ -26,6 +26,9 @@
     // MS compiler doesn't have __func__, but does have __FUNCTION__, which does the same.
     #define __func__ __FUNCTION__
 
+    // For static buffers that are used from worker threads as well.
+    #define Z_THREAD_LOCAL __declspec(thread)
+
     // Make sure user has a chance to see console output before program exits.
     #define exit(x) printf("Press any key to exit...\n");\
                     _getch();\
@@ -58,6 +61,8 @@
     #include "config.h"
     #endif
 
+    #define Z_THREAD_LOCAL __thread
+
     #define Z_DIR_SEPARATOR "/"
     #define Z_DIR_USERDATA  "." PACKAGE_NAME
     #define Z_DIR_SYSDATA   ASSET_DIR
@@ -76,6 +81,10 @@
 #define MIN(x, y) ((x)<(y) ? (x):(y))
 #endif
 
+#ifndef MAX
+#define MAX(x, y) ((x)>(y) ? (x):(y))
+#endif
+
 
 // Generic error codes.
 #define Z_ERROR         1 // Unspecified error.
@@ -102,15 +111,29 @@
 #define Z_FILE_STARTUP     "startup.lua"
 
 
+#include "arena.h"
+#include "table.h"
+#include "intern.h"
 #include "renderer.h"
+#include "stream.h"
 #include "shader.h"
 #include "image.h"
+#include "mipmap.h"
+#include "texcache.h"
+#include "texarray.h"
+#include "vtexture.h"
 #include "material.h"
+#include "texload.h"
 #include "mesh.h"
+#include "meshload.h"
+#include "meshcache.h"
+#include "atlas.h"
+#include "impostor.h"
 #include "zmath.h"
 #include "camera.h"
 #include "main.h"
 #include "util.h"
+#include "jobs.h"
 
 #include "zlua.h"
 #include "input.h"
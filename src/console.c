@@ -91,7 +91,7 @@ void zDrawConsole(void)
 {
     if (console_active) {
 
-        glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+        zTextRenderColor(1.0f, 1.0f, 1.0f, 1.0f);
 
         // Draw prompt first.
         zTextRenderString(5.0f, 7.0f, "> ", Z_FONT_CONSOLE);
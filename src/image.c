@@ -3,19 +3,255 @@
 #include <IL/ilu.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
 #include <assert.h>
 
 #include "common.h"
 
+// These depend on config.h, so they have to come after common.h.
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
+#ifdef HAVE_LIBJPEG
+#include <jpeglib.h>
+#endif
 
-ZImage *zLoadImage(const char *filename)
+
+// Results of the individual decoders.
+#define Z_DECODE_OK          0
+#define Z_DECODE_FAILED      1
+#define Z_DECODE_UNSUPPORTED 2 // Decoder can't handle this image, try the next one.
+
+
+static ZMutex *devil_lock; // See zDecodeImage.
+
+
+
+void zImageInit(void)
+{
+    ilInit();
+    iluInit();
+
+    if ( !(devil_lock = zCreateMutex()) )
+        zWarning("Failed to create DevIL lock, images can only be loaded from the main thread.");
+}
+
+
+
+void zImageDeinit(void)
+{
+    if (devil_lock) zDeleteMutex(devil_lock);
+    devil_lock = NULL;
+}
+
+
+
+#ifdef HAVE_LIBJPEG
+// Expand a row of width pixels with the given number of channels (1 or 3) to RGBA in place. The row
+// must be stored at the start of a buffer large enough for the RGBA version.
+static void zExpandRow(unsigned char *row, int width, int channels)
+{
+    const unsigned char *src;
+    unsigned char *dst;
+    int x;
+
+    // Going backwards, so I never overwrite pixels I still need.
+    for (x = width-1; x >= 0; x--) {
+
+        src = row + x*channels;
+        dst = row + x*4;
+
+        if (channels == 1) {
+            dst[3] = 255;
+            dst[2] = dst[1] = dst[0] = src[0];
+        } else {
+            dst[3] = 255;
+            dst[2] = src[2];
+            dst[1] = src[1];
+            dst[0] = src[0];
+        }
+    }
+}
+#endif
+
+
+
+#ifdef HAVE_LIBPNG
+static void zPNGError(png_structp png, png_const_charp msg)
+{
+    zWarning("Failed to decode PNG image \"%s\": %s.", (const char *) png_get_error_ptr(png), msg);
+    longjmp(png_jmpbuf(png), 1);
+}
+
+
+
+static void zPNGWarning(png_structp png, png_const_charp msg)
+{
+    zDebug("While decoding PNG image \"%s\": %s.", (const char *) png_get_error_ptr(png), msg);
+}
+
+
+
+static int zDecodePNG(FILE *fp, const char *filename, ZImageAllocFunc alloc, void *data)
+{
+    png_structp png;
+    png_infop info;
+    png_bytep * volatile rows = NULL;
+    unsigned char *pixels;
+    png_uint_32 width, height, y;
+
+    if ( !(png = png_create_read_struct(PNG_LIBPNG_VER_STRING, (png_voidp) filename, zPNGError,
+        zPNGWarning)) )
+        return Z_DECODE_FAILED;
+
+    if ( !(info = png_create_info_struct(png)) ) {
+        png_destroy_read_struct(&png, NULL, NULL);
+        return Z_DECODE_FAILED;
+    }
+
+    if (setjmp(png_jmpbuf(png))) {
+        free(rows);
+        png_destroy_read_struct(&png, &info, NULL);
+        return Z_DECODE_FAILED;
+    }
+
+    png_init_io(png, fp);
+    png_read_info(png, info);
+
+    // Whatever the source format is, have libpng deliver 8-bit RGBA.
+    png_set_expand(png);
+    png_set_strip_16(png);
+    png_set_gray_to_rgb(png);
+    png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+    png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+
+    width  = png_get_image_width(png, info);
+    height = png_get_image_height(png, info);
+
+    if ( !(pixels = alloc(data, width, height)) || !(rows = malloc(height * sizeof(png_bytep))) ) {
+        png_destroy_read_struct(&png, &info, NULL);
+        return Z_DECODE_FAILED;
+    }
+
+    // Point the rows bottom-up, so the image gets flipped for OpenGL while decoding.
+    for (y = 0; y < height; y++)
+        rows[y] = pixels + (height-1-y) * width * 4;
+
+    png_read_image(png, rows);
+    png_read_end(png, NULL);
+
+    free(rows);
+    png_destroy_read_struct(&png, &info, NULL);
+
+    return Z_DECODE_OK;
+}
+#endif
+
+
+
+#ifdef HAVE_LIBJPEG
+typedef struct ZJPEGError
+{
+    struct jpeg_error_mgr pub;
+    const char *filename;
+    jmp_buf jump;
+
+} ZJPEGError;
+
+
+
+static void zJPEGError(j_common_ptr cinfo)
 {
-    ZImage *img = NULL;
+    ZJPEGError *err = (ZJPEGError *) cinfo->err;
+    char msg[JMSG_LENGTH_MAX];
+
+    cinfo->err->format_message(cinfo, msg);
+    zWarning("Failed to decode JPEG image \"%s\": %s.", err->filename, msg);
+
+    longjmp(err->jump, 1);
+}
+
+
+
+static void zJPEGMessage(j_common_ptr cinfo)
+{
+    char msg[JMSG_LENGTH_MAX];
+
+    cinfo->err->format_message(cinfo, msg);
+    zDebug("While decoding JPEG image \"%s\": %s.", ((ZJPEGError *) cinfo->err)->filename, msg);
+}
+
+
+
+static int zDecodeJPEG(FILE *fp, const char *filename, ZImageAllocFunc alloc, void *data)
+{
+    struct jpeg_decompress_struct cinfo;
+    ZJPEGError err;
+    unsigned char *pixels;
+    JSAMPROW row;
+    int width, height;
+
+    cinfo.err = jpeg_std_error(&(err.pub));
+    err.pub.error_exit = zJPEGError;
+    err.pub.output_message = zJPEGMessage;
+    err.filename = filename;
+
+    if (setjmp(err.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        return Z_DECODE_FAILED;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, fp);
+    jpeg_read_header(&cinfo, TRUE);
+
+    // libjpeg only converts to RGB from YCbCr, leave anything more exotic (CMYK) to DevIL.
+    if (cinfo.jpeg_color_space == JCS_GRAYSCALE) {
+        cinfo.out_color_space = JCS_GRAYSCALE;
+    } else if (cinfo.jpeg_color_space == JCS_YCbCr || cinfo.jpeg_color_space == JCS_RGB) {
+        cinfo.out_color_space = JCS_RGB;
+    } else {
+        jpeg_destroy_decompress(&cinfo);
+        return Z_DECODE_UNSUPPORTED;
+    }
 
+    jpeg_start_decompress(&cinfo);
+
+    width  = cinfo.output_width;
+    height = cinfo.output_height;
+
+    if ( !(pixels = alloc(data, width, height)) ) {
+        jpeg_destroy_decompress(&cinfo);
+        return Z_DECODE_FAILED;
+    }
+
+    // Decode each scanline into the start of the row it belongs to (bottom-up, for OpenGL), and
+    // expand it to RGBA from there.
+    while (cinfo.output_scanline < cinfo.output_height) {
+        row = pixels + (height-1-cinfo.output_scanline) * width * 4;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+        zExpandRow(row, width, cinfo.output_components);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    return Z_DECODE_OK;
+}
+#endif
+
+
+
+static int zDecodeDevIL(const char *filename, ZImageAllocFunc alloc, void *data)
+{
     ILuint image_name;
     ILenum error;
     ILconst_string error_str;
     ILint cur_format;
+    unsigned char *pixels;
+    int width, height;
 
     ilGenImages(1, &image_name);
     ilBindImage(image_name);
@@ -24,55 +260,187 @@ ZImage *zLoadImage(const char *filename)
     ilEnable(IL_ORIGIN_SET);
     ilOriginFunc(IL_ORIGIN_LOWER_LEFT);
 
-    if (ilLoadImage(filename)) {
+    if (!ilLoadImage(filename)) {
+        //zWarning("%s: Failed to load image \"%s\".", __func__, filename);
+        ilDeleteImages(1, &image_name);
+        return Z_DECODE_FAILED;
+    }
 
-        cur_format = ilGetInteger(IL_IMAGE_FORMAT);
+    cur_format = ilGetInteger(IL_IMAGE_FORMAT);
 
-        if ( cur_format == IL_COLOR_INDEX ) {
+    if ( cur_format == IL_COLOR_INDEX ) {
 
-            zDebug("%s: Image format for \"%s\" is COLOR_INDEX, converting to RGBA", __func__,
-                filename);
+        zDebug("%s: Image format for \"%s\" is COLOR_INDEX, converting to RGBA", __func__,
+            filename);
 
-            if ( !ilConvertImage(IL_RGBA, IL_UNSIGNED_BYTE) ) {
+        if ( !ilConvertImage(IL_RGBA, IL_UNSIGNED_BYTE) ) {
 
-                zWarning("%s: Failed to convert color indexed image \"%s\" to RGBA.", __func__,
-                    filename);
-                ilDeleteImages(1, &image_name);
-                return NULL;
-            }
+            zWarning("%s: Failed to convert color indexed image \"%s\" to RGBA.", __func__,
+                filename);
+            ilDeleteImages(1, &image_name);
+            return Z_DECODE_FAILED;
         }
+    }
 
-        img = (ZImage *) malloc(sizeof(ZImage));
-        img->width  = ilGetInteger(IL_IMAGE_WIDTH);
-        img->height = ilGetInteger(IL_IMAGE_HEIGHT);
-        img->data   = (unsigned char *) malloc(img->width * img->height * 4);
-
-        if( !ilCopyPixels(0, 0, 0, img->width, img->height, 1, IL_RGBA, IL_UNSIGNED_BYTE, img->data)
-            ) {
+    width  = ilGetInteger(IL_IMAGE_WIDTH);
+    height = ilGetInteger(IL_IMAGE_HEIGHT);
 
-            error = ilGetError();
-            error_str = iluErrorString(error);
-            zWarning("%s: Failed to read image data for \"%s\". (Last error given by DevIL was"
-                " \"%s (code %d)\".)", __func__, filename, error_str, error);
-            free( (void *) img->data );
-            free(img);
-            ilDeleteImages(1, &image_name);
-            return NULL;
-        }
+    if ( !(pixels = alloc(data, width, height)) ) {
+        ilDeleteImages(1, &image_name);
+        return Z_DECODE_FAILED;
+    }
 
-    } else {
+    if ( !ilCopyPixels(0, 0, 0, width, height, 1, IL_RGBA, IL_UNSIGNED_BYTE, pixels) ) {
 
-        //zWarning("%s: Failed to load image \"%s\".", __func__, filename);
+        error = ilGetError();
+        error_str = iluErrorString(error);
+        zWarning("%s: Failed to read image data for \"%s\". (Last error given by DevIL was"
+            " \"%s (code %d)\".)", __func__, filename, error_str, error);
         ilDeleteImages(1, &image_name);
-        return NULL;
+        return Z_DECODE_FAILED;
     }
 
     ilDeleteImages(1, &image_name);
 
+    return Z_DECODE_OK;
+}
+
+
+
+// Decode filename into 8-bit RGBA pixels, bottom row first. Once the size is known, alloc is called
+// with data to get the width*height*4 bytes to decode into, so the pixels can go straight to where
+// they are needed. PNG and JPEG images are decoded with libpng/libjpeg if available, anything else
+// goes through DevIL. Returns FALSE on failure, the caller is responsible for cleaning up whatever
+// alloc allocated in that case. This may be called from worker threads.
+int zDecodeImage(const char *filename, ZImageAllocFunc alloc, void *data)
+{
+    int result = Z_DECODE_UNSUPPORTED;
+
+#if defined(HAVE_LIBPNG) || defined(HAVE_LIBJPEG)
+    unsigned char sig[8];
+    FILE *fp;
+
+    if ( !(fp = fopen(filename, "rb")) )
+        return FALSE;
+
+    // Pick the decoder by signature rather than by extension.
+    memset(sig, '\0', sizeof(sig));
+    if (fread(sig, 1, sizeof(sig), fp) > 0)
+        rewind(fp);
+
+#ifdef HAVE_LIBPNG
+    if (!png_sig_cmp(sig, 0, 8))
+        result = zDecodePNG(fp, filename, alloc, data);
+#endif
+#ifdef HAVE_LIBJPEG
+    if (sig[0] == 0xff && sig[1] == 0xd8 && sig[2] == 0xff)
+        result = zDecodeJPEG(fp, filename, alloc, data);
+#endif
+
+    fclose(fp);
+#endif
+
+    // DevIL isn't thread-safe, so only one thread may use it at a time.
+    if (result == Z_DECODE_UNSUPPORTED) {
+        if (devil_lock) zLockMutex(devil_lock);
+        result = zDecodeDevIL(filename, alloc, data);
+        if (devil_lock) zUnlockMutex(devil_lock);
+    }
+
+    return result == Z_DECODE_OK;
+}
+
+
+
+static void *zAllocImage(void *data, int width, int height)
+{
+    ZImage *img = data;
+
+    img->width  = width;
+    img->height = height;
+
+    return img->data = malloc(width * height * 4);
+}
+
+
+
+// Load image from filename into a ZImage with 8-bit RGBA pixels, or return NULL on failure. This may
+// be called from worker threads.
+ZImage *zLoadImage(const char *filename)
+{
+    ZImage *img;
+
+    if ( !(img = malloc(sizeof(ZImage))) )
+        return NULL;
+
+    img->data = NULL;
+
+    if (!zDecodeImage(filename, zAllocImage, img)) {
+        free(img->data);
+        free(img);
+        return NULL;
+    }
+
     return img;
 }
 
 
+
+// Write img to filename as an uncompressed 32-bit TGA, which any of the decoders (DevIL, that is)
+// can read back. Rows are stored bottom to top, just like in ZImage. Returns FALSE on failure.
+int zSaveImage(const char *filename, const ZImage *img)
+{
+    FILE *fp;
+    unsigned char header[18], *row;
+    int x, y, ok;
+
+    if ( !(row = malloc(img->width * 4)) ) {
+        zError("%s: Failed to allocate memory.", __func__);
+        return FALSE;
+    }
+
+    if ( !(fp = fopen(filename, "wb")) ) {
+        zError("Failed to open \"%s\" for writing.", filename);
+        free(row);
+        return FALSE;
+    }
+
+    memset(header, '\0', sizeof(header));
+    header[2]  = 2; // Uncompressed true-color.
+    header[12] = img->width & 0xff;
+    header[13] = img->width >> 8;
+    header[14] = img->height & 0xff;
+    header[15] = img->height >> 8;
+    header[16] = 32;
+    header[17] = 8; // Bits of alpha, origin in the lower left.
+
+    ok = fwrite(header, sizeof(header), 1, fp) == 1;
+
+    // TGA wants BGRA.
+    for (y = 0; y < img->height && ok; y++) {
+
+        const unsigned char *src = img->data + (size_t) y * img->width * 4;
+
+        for (x = 0; x < img->width; x++) {
+            row[x*4+0] = src[x*4+2];
+            row[x*4+1] = src[x*4+1];
+            row[x*4+2] = src[x*4+0];
+            row[x*4+3] = src[x*4+3];
+        }
+
+        ok = fwrite(row, img->width * 4, 1, fp) == 1;
+    }
+
+    fclose(fp);
+    free(row);
+
+    if (!ok) zError("Failed to write image \"%s\".", filename);
+
+    return ok;
+}
+
+
+
 void zDrawImage(ZImage *img, int x, int y)
 {
     assert(NULL != img);
@@ -10,7 +10,17 @@ typedef struct ZImage
 
 } ZImage;
 
+// Called by zDecodeImage once the size of the image is known, should return width*height*4 bytes to
+// decode the pixels into, or NULL to give up.
+typedef void *(*ZImageAllocFunc)(void *data, int width, int height);
+
+
+void zImageInit(void);
+void zImageDeinit(void);
+
+int zDecodeImage(const char *filename, ZImageAllocFunc alloc, void *data);
 ZImage *zLoadImage(const char *filename);
+int zSaveImage(const char *filename, const ZImage *img);
 void zDrawImage(ZImage *img, int x, int y);
 void zDeleteImage(ZImage *img);
 
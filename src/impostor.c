@@ -0,0 +1,375 @@
+#ifdef WIN32
+#define _USE_MATH_DEFINES
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <GL/glew.h>
+
+#include "common.h"
+
+
+// Meshes queued for drawing as impostors this frame, see zQueueImpostor.
+static ZMesh **queue;
+static unsigned int queue_count;
+static unsigned int queue_size;
+
+// Client-side vertex array (T2F_V3F) used to draw all quads sharing an atlas in one go, if the
+// stream buffer is unavailable. OpenGL 1.4 has no instancing so I just expand each instance into a
+// quad.
+static float *quads;
+static unsigned int quads_size; // Number of quads that fit in quads.
+
+
+
+// Delete the atlas texture for mesh's impostor, if it has one. This is used when the OpenGL context
+// goes away, the impostor gets baked again when it is needed next.
+static void zMakeImpostorNonResident(ZMesh *mesh, void *ignored)
+{
+    if (!mesh->impostor) return;
+
+    if (mesh->impostor->texture) {
+        glDeleteTextures(1, &(mesh->impostor->texture));
+        mesh->impostor->texture = 0;
+    }
+    mesh->impostor->failed = 0;
+}
+
+
+
+void zImpostorDeinit(void)
+{
+    zIterMeshes(zMakeImpostorNonResident, NULL);
+
+    free(queue);
+    free(quads);
+    queue = NULL;
+    quads = NULL;
+    queue_size = queue_count = quads_size = 0;
+}
+
+
+
+// Render mesh from Z_IMPOSTOR_VIEWS directions around the Y axis into an atlas texture, using an
+// offscreen framebuffer object. Returns TRUE if the mesh has a usable impostor afterwards (which
+// may have been baked earlier), else FALSE.
+int zBakeImpostor(ZMesh *mesh)
+{
+    ZImpostor *imp = mesh->impostor;
+    GLuint fbo, depth;
+    GLenum status;
+    GLsizei width = Z_IMPOSTOR_VIEWS * Z_IMPOSTOR_VIEW_SIZE;
+    float r = mesh->radius;
+    int i;
+
+    assert(renderer_active);
+
+    if (!imp) {
+        if ( !(imp = malloc(sizeof(ZImpostor))) ) {
+            zError("Failed to allocate memory for impostor of mesh \"%s\".", mesh->name);
+            return FALSE;
+        }
+        memset(imp, '\0', sizeof(ZImpostor));
+        mesh->impostor = imp;
+    }
+
+    if (imp->texture) return TRUE;
+    if (imp->failed) return FALSE;
+
+    // Assume failure until the bake completes.
+    imp->failed = 1;
+
+    if (!GLEW_EXT_framebuffer_object) {
+        zWarning("Not baking impostor for mesh \"%s\", EXT_framebuffer_object is not supported.",
+            mesh->name);
+        return FALSE;
+    }
+
+    if (r <= 0.0f) return FALSE;
+
+    if (fs_printdiskload) zDebug("Baking impostor for mesh \"%s\".", mesh->name);
+
+    // Set up the atlas texture.
+    glGenTextures(1, &(imp->texture));
+    glBindTexture(GL_TEXTURE_2D, imp->texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, Z_IMPOSTOR_VIEW_SIZE, 0, GL_RGBA,
+        GL_UNSIGNED_BYTE, NULL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // Set up the framebuffer, with a depth buffer so the mesh is drawn properly.
+    glGenFramebuffersEXT(1, &fbo);
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo);
+    glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D,
+        imp->texture, 0);
+
+    glGenRenderbuffersEXT(1, &depth);
+    glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, depth);
+    glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_DEPTH_COMPONENT24, width,
+        Z_IMPOSTOR_VIEW_SIZE);
+    glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT, GL_RENDERBUFFER_EXT,
+        depth);
+
+    status = glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT);
+
+    if (status == GL_FRAMEBUFFER_COMPLETE_EXT) {
+
+        glPushAttrib(GL_VIEWPORT_BIT | GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_ENABLE_BIT);
+
+        // Clear to transparent black, the alpha channel is used to cut out the quad when drawing.
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glDepthMask(GL_TRUE);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glEnable(GL_DEPTH_TEST);
+
+        // Orthographic projection fitting the bounding sphere, with the viewpoint on the sphere.
+        glMatrixMode(GL_PROJECTION);
+        glPushMatrix();
+        glLoadIdentity();
+        glOrtho(-r, r, -r, r, 0.0, 2.0*r);
+        glMatrixMode(GL_MODELVIEW);
+        glPushMatrix();
+
+        for (i = 0; i < Z_IMPOSTOR_VIEWS; i++) {
+
+            glViewport(i*Z_IMPOSTOR_VIEW_SIZE, 0, Z_IMPOSTOR_VIEW_SIZE, Z_IMPOSTOR_VIEW_SIZE);
+
+            // View i looks at the mesh from direction (sin a, 0, cos a).
+            glLoadIdentity();
+            glTranslatef(0.0f, 0.0f, -r);
+            glRotatef(-(360.0f/Z_IMPOSTOR_VIEWS) * i, 0.0f, 1.0f, 0.0f);
+            glTranslatef(-mesh->center.x, -mesh->center.y, -mesh->center.z);
+
+            zDrawMesh(mesh, NULL);
+        }
+
+        glMatrixMode(GL_PROJECTION);
+        glPopMatrix();
+        glMatrixMode(GL_MODELVIEW);
+        glPopMatrix();
+
+        glPopAttrib();
+
+        imp->failed = 0;
+
+    } else {
+        zWarning("Failed to set up framebuffer for baking impostor of mesh \"%s\" (status 0x%x).",
+            mesh->name, status);
+    }
+
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+    glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, 0);
+    glDeleteRenderbuffersEXT(1, &depth);
+    glDeleteFramebuffersEXT(1, &fbo);
+
+    // zDrawMesh may have left material state behind that no longer matches what the material
+    // tracking thinks is active.
+    zResetMaterialState();
+
+    if (imp->failed) {
+        glDeleteTextures(1, &(imp->texture));
+        imp->texture = 0;
+        return FALSE;
+    }
+
+    glBindTexture(GL_TEXTURE_2D, imp->texture);
+    glGenerateMipmapEXT(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    return TRUE;
+}
+
+
+
+// See if mesh should be drawn as an impostor given the current view, in which case it is queued to
+// be drawn by zDrawImpostors and TRUE is returned. Returns FALSE if the mesh should be drawn
+// normally.
+int zQueueImpostor(ZMesh *mesh, const ZFrustum *frustum)
+{
+    ZVec3 d;
+
+    if (r_impostordist <= 0.0f || !frustum)
+        return FALSE;
+
+    zSubtractVec3r(&d, &mesh->center, (ZVec3 *) &frustum->origin);
+
+    if (zLength3(&d) < r_impostordist)
+        return FALSE;
+
+    // It's far enough for an impostor, but it might not be visible at all. This doesn't depend on
+    // r_clustercull, so impostors stay culled when that is off, and nothing is baked for meshes
+    // that aren't in view.
+    if (!zFrustumTestSphere(frustum, &mesh->center, mesh->radius))
+        return TRUE;
+
+    if (!zBakeImpostor(mesh))
+        return FALSE;
+
+    if (queue_count == queue_size) {
+
+        unsigned int size = queue_size ? queue_size*2 : 64;
+        ZMesh **tmp = realloc(queue, size * sizeof(ZMesh *));
+
+        if (!tmp) {
+            zWarning("Failed to allocate memory for impostor queue.");
+            return FALSE;
+        }
+        queue = tmp;
+        queue_size = size;
+    }
+
+    queue[queue_count++] = mesh;
+
+    return TRUE;
+}
+
+
+
+// For sorting the queue so that impostors sharing an atlas end up next to each other.
+static int zCompareQueued(const void *a, const void *b)
+{
+    const ZMesh *ma = *(ZMesh * const *) a;
+    const ZMesh *mb = *(ZMesh * const *) b;
+
+    return ma < mb ? -1 : (ma > mb ? 1 : 0);
+}
+
+
+
+// Write a single camera-facing quad for mesh into dest (20 floats, T2F_V3F).
+static void zBuildImpostorQuad(float *dest, ZMesh *mesh, const ZFrustum *frustum)
+{
+    float dx = frustum->origin.x - mesh->center.x;
+    float dz = frustum->origin.z - mesh->center.z;
+    float angle = atan2f(dx, dz) * (180.0f / (float) M_PI);
+    float len = sqrtf(dx*dx + dz*dz);
+    float rx, rz, u0, u1, r = mesh->radius;
+    ZVec3 *c = &mesh->center;
+    int view;
+
+    // Pick the view closest to the direction the mesh is seen from.
+    view = (int) floorf(angle / (360.0f/Z_IMPOSTOR_VIEWS) + 0.5f);
+    view = ((view % Z_IMPOSTOR_VIEWS) + Z_IMPOSTOR_VIEWS) % Z_IMPOSTOR_VIEWS;
+    u0 = (float) view / Z_IMPOSTOR_VIEWS;
+    u1 = (float) (view+1) / Z_IMPOSTOR_VIEWS;
+
+    // The quad only rotates about the Y axis, right = up x to_camera.
+    if (len > 0.0f) {
+        rx =  dz / len * r;
+        rz = -dx / len * r;
+    } else {
+        rx = r;
+        rz = 0.0f;
+    }
+
+    dest[0]  = u0; dest[1]  = 0.0f; dest[2]  = c->x - rx; dest[3]  = c->y - r; dest[4]  = c->z - rz;
+    dest[5]  = u1; dest[6]  = 0.0f; dest[7]  = c->x + rx; dest[8]  = c->y - r; dest[9]  = c->z + rz;
+    dest[10] = u1; dest[11] = 1.0f; dest[12] = c->x + rx; dest[13] = c->y + r; dest[14] = c->z + rz;
+    dest[15] = u0; dest[16] = 1.0f; dest[17] = c->x - rx; dest[18] = c->y + r; dest[19] = c->z - rz;
+}
+
+
+
+// Draw the impostors queued with zQueueImpostor, and empty the queue. Expects the viewing and
+// projection transforms to be set up for the scene.
+void zDrawImpostors(const ZFrustum *frustum)
+{
+    unsigned int i, start, count;
+    GLintptr offset;
+    float *dest;
+
+    if (!queue_count) return;
+
+    qsort(queue, queue_count, sizeof(ZMesh *), zCompareQueued);
+
+    // Write the quads to the stream buffer if possible, or else to the client-side array.
+    if ( (dest = zStreamMap(queue_count * 20 * sizeof(float), &offset)) ) {
+
+        for (i = 0; i < queue_count; i++)
+            zBuildImpostorQuad(dest + i*20, queue[i], frustum);
+
+        zStreamUnmap();
+
+    } else {
+
+        if (quads_size < queue_count) {
+
+            float *tmp = realloc(quads, queue_count * 20 * sizeof(float));
+
+            if (!tmp) {
+                zWarning("Failed to allocate memory for impostor quads.");
+                queue_count = 0;
+                return;
+            }
+            quads = tmp;
+            quads_size = queue_count;
+        }
+
+        for (i = 0; i < queue_count; i++)
+            zBuildImpostorQuad(quads + i*20, queue[i], frustum);
+
+        glBindBufferARB(GL_ARRAY_BUFFER, 0);
+        offset = (GLintptr) quads;
+    }
+
+    glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_CURRENT_BIT |
+        GL_TEXTURE_BIT);
+    glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+
+    // I'm about to clobber the texture binding, this also unbinds the material's samplers so the
+    // atlas's own texture parameters apply.
+    zResetMaterialState();
+
+    if (glUseProgram) glUseProgram(0);
+    glDisable(GL_LIGHTING);
+    glDisable(GL_BLEND);
+    glDepthMask(GL_TRUE);
+    glEnable(GL_ALPHA_TEST);
+    glAlphaFunc(GL_GREATER, 0.5f);
+
+    glActiveTexture(GL_TEXTURE0);
+    glEnable(GL_TEXTURE_2D);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+    glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+
+    // Either the stream buffer or no buffer is bound at this point.
+    glInterleavedArrays(GL_T2F_V3F, 0, (void *) offset);
+
+    // Draw each run of queued meshes that share an atlas with a single call.
+    for (start = 0; start < queue_count; start += count) {
+
+        ZMesh *mesh = queue[start];
+
+        for (count = 0; start+count < queue_count && queue[start+count] == mesh; count++);
+
+        glBindTexture(GL_TEXTURE_2D, mesh->impostor->texture);
+        glDrawArrays(GL_QUADS, start*4, count*4);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindBufferARB(GL_ARRAY_BUFFER, 0);
+
+    glPopClientAttrib();
+    glPopAttrib();
+
+    queue_count = 0;
+}
+
+
+
+// Free impostor, deleting the atlas texture if it has one.
+void zDeleteImpostor(ZImpostor *impostor)
+{
+    if (!impostor) return;
+
+    if (impostor->texture)
+        glDeleteTextures(1, &(impostor->texture));
+
+    free(impostor);
+}
@@ -0,0 +1,34 @@
+#ifndef __IMPOSTOR_H__
+#define __IMPOSTOR_H__
+
+#include <GL/glew.h>
+
+#include "mesh.h"
+
+#define Z_IMPOSTOR_VIEWS     8   // Number of views around the Y axis that are baked for a mesh.
+#define Z_IMPOSTOR_VIEW_SIZE 128 // Width/height of a single view in the atlas, in pixels.
+
+
+// ZImpostor - A set of pre-rendered views of a mesh, stored side by side in a single texture atlas
+// and used to draw the mesh as a camera-facing quad when it is far away.
+typedef struct ZImpostor
+{
+    GLuint texture; // Atlas texture, 0 if not baked (yet).
+
+    int failed; // Set if baking failed, so I don't retry every frame.
+
+} ZImpostor;
+
+
+
+void zImpostorDeinit(void);
+
+int zBakeImpostor(ZMesh *mesh);
+
+int zQueueImpostor(ZMesh *mesh, const ZFrustum *frustum);
+
+void zDrawImpostors(const ZFrustum *frustum);
+
+void zDeleteImpostor(ZImpostor *impostor);
+
+#endif
@@ -0,0 +1,153 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "common.h"
+
+
+#define Z_INTERN_BLOCK_SIZE 65536
+
+
+// Interned strings are packed into big blocks, which are never moved or freed before
+// zInternDeinit, so the pointers handed out stay valid.
+typedef struct ZInternBlock
+{
+    struct ZInternBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+
+} ZInternBlock;
+
+
+static ZTable strings;
+static ZInternBlock *blocks;
+static ZMutex *intern_lock;
+static size_t intern_bytes;
+
+
+
+void zInternInit(void)
+{
+    if ( !(intern_lock = zCreateMutex()) ) {
+        zFatal("Failed to create mutex for string interning.");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+
+void zInternDeinit(void)
+{
+    ZInternBlock *next;
+
+    zTableClear(&strings);
+
+    while (blocks) {
+        next = blocks->next;
+        free(blocks);
+        blocks = next;
+    }
+
+    intern_bytes = 0;
+
+    zDeleteMutex(intern_lock);
+    intern_lock = NULL;
+}
+
+
+
+static int zMatchString(const void *item, const void *key)
+{
+    return strcmp(item, key) == 0;
+}
+
+
+
+// Copy str into a block, starting a new one if it doesn't fit in the current one.
+static const char *zStoreString(const char *str, size_t len)
+{
+    ZInternBlock *block = blocks;
+    char *copy;
+
+    if (!block || block->size - block->used < len + 1) {
+
+        size_t size = MAX(Z_INTERN_BLOCK_SIZE, len + 1);
+
+        if ( !(block = malloc(sizeof(ZInternBlock) + size)) )
+            return NULL;
+
+        block->size = size;
+        block->used = 0;
+        block->next = blocks;
+        blocks = block;
+    }
+
+    copy = block->data + block->used;
+    memcpy(copy, str, len + 1);
+    block->used += len + 1;
+    intern_bytes += len + 1;
+
+    return copy;
+}
+
+
+
+// Returns the interned copy of str, adding it if it wasn't interned yet.
+const char *zIntern(const char *str)
+{
+    unsigned int hash;
+    const char *found;
+
+    assert(str && intern_lock);
+
+    hash = zHashString(str);
+
+    zLockMutex(intern_lock);
+
+    if ( !(found = zTableFind(&strings, hash, zMatchString, str)) &&
+         (found = zStoreString(str, strlen(str))) ) {
+        if (!zTableInsert(&strings, hash, (void *) found))
+            found = NULL;
+    }
+
+    zUnlockMutex(intern_lock);
+
+    // There is no sane way to go on without names.
+    if (!found) {
+        zFatal("%s: Failed to allocate memory.", __func__);
+        exit(EXIT_FAILURE);
+    }
+
+    return found;
+}
+
+
+
+// Returns the interned copy of str, or NULL if it was never interned (which means no resource has
+// that name).
+const char *zFindInterned(const char *str)
+{
+    unsigned int hash;
+    const char *found;
+
+    assert(str && intern_lock);
+
+    hash = zHashString(str);
+
+    zLockMutex(intern_lock);
+    found = zTableFind(&strings, hash, zMatchString, str);
+    zUnlockMutex(intern_lock);
+
+    return found;
+}
+
+
+
+void zInternInfo(void)
+{
+    zLockMutex(intern_lock);
+    zPrint("Interned strings: %u (%u KB), table size %u\n", strings.count,
+        (unsigned int) (intern_bytes / 1024), strings.size);
+    zUnlockMutex(intern_lock);
+}
@@ -0,0 +1,23 @@
+#ifndef __INTERN_H__
+#define __INTERN_H__
+
+// Resource names (of meshes, materials, textures and shaders) are interned: each distinct string is
+// stored just once, and zIntern returns the same pointer for equal strings. Resources hold such a
+// pointer instead of a Z_RESOURCE_NAME_SIZE array of their own, names can be compared by pointer,
+// and the registries hash them by address (see zHashPointer) instead of hashing the characters on
+// every lookup. Lookup functions like zLookupTexture expect interned names.
+//
+// Interned strings stay around until zInternDeinit. zIntern and zFindInterned may be called from
+// any thread.
+
+void zInternInit(void);
+
+void zInternDeinit(void);
+
+const char *zIntern(const char *str);
+
+const char *zFindInterned(const char *str);
+
+void zInternInfo(void);
+
+#endif
@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "common.h"
+
+
+typedef struct ZJob
+{
+    ZJobFunc func;
+    void *data;
+
+    struct ZJob *next;
+
+} ZJob;
+
+
+// A zParallelFor call in progress. Helper jobs and the caller claim indices until none are left.
+typedef struct ZJobGroup
+{
+    ZParallelFunc func;
+    void *data;
+
+    int count;
+    int next;    // Next index to claim.
+    int running; // Indices claimed but not yet finished.
+    int refs;    // Caller plus helper jobs that haven't run yet, the last one frees the group.
+
+    int waiting;       // Set when the caller waits on done for the last running index.
+    ZSemaphore *done;
+
+} ZJobGroup;
+
+
+static ZThread *threads[Z_JOBS_MAX_THREADS];
+static int num_threads;
+
+static ZMutex *lock;          // Protects everything below.
+static ZSemaphore *available; // Counts jobs in the queue, plus one per thread when quitting.
+
+static ZJob *queue_head;
+static ZJob *queue_tail;
+
+static int busy; // Number of jobs queued or running.
+static int quit;
+
+
+
+static void zJobThread(void *ignored)
+{
+    ZJob *job;
+
+    while (1) {
+
+        zWaitSemaphore(available);
+
+        zLockMutex(lock);
+
+        // Finish whatever is left in the queue before quitting.
+        if (!queue_head) {
+            assert(quit);
+            zUnlockMutex(lock);
+            return;
+        }
+
+        job = queue_head;
+        queue_head = job->next;
+        if (!queue_head) queue_tail = NULL;
+
+        zUnlockMutex(lock);
+
+        job->func(job->data);
+        free(job);
+
+        zLockMutex(lock);
+        busy--;
+        zUnlockMutex(lock);
+    }
+}
+
+
+
+// Start the worker threads, fs_loadthreads determines how many. If no threads can be started, jobs
+// are just run right away by zAddJob.
+void zJobsInit(void)
+{
+    int i, want = fs_loadthreads;
+
+    assert(!num_threads);
+
+    // Leave one CPU for the main thread.
+    if (!want) want = zGetNumCPUs() - 1;
+    if (want < 1) want = 1;
+    if (want > Z_JOBS_MAX_THREADS) want = Z_JOBS_MAX_THREADS;
+
+    // Make sure the user directory is looked up before any job could race for it.
+    zGetUserDir();
+
+    quit = 0;
+    busy = 0;
+
+    if ( !(lock = zCreateMutex()) || !(available = zCreateSemaphore(0)) ) {
+        zWarning("Failed to set up job queue, loading everything on the main thread.");
+        return;
+    }
+
+    for (i = 0; i < want; i++) {
+        if ( !(threads[num_threads] = zCreateThread(zJobThread, NULL)) )
+            break;
+        num_threads++;
+    }
+
+    if (!num_threads)
+        zWarning("Failed to start worker threads, loading everything on the main thread.");
+    else
+        zDebug("Started %d worker threads.", num_threads);
+}
+
+
+
+// Run whatever is still queued up and stop the worker threads.
+void zJobsDeinit(void)
+{
+    int i;
+
+    if (num_threads) {
+
+        zLockMutex(lock);
+        quit = 1;
+        zUnlockMutex(lock);
+
+        for (i = 0; i < num_threads; i++)
+            zPostSemaphore(available);
+
+        for (i = 0; i < num_threads; i++) {
+            zJoinThread(threads[i]);
+            threads[i] = NULL;
+        }
+
+        num_threads = 0;
+    }
+
+    if (available) zDeleteSemaphore(available);
+    if (lock)      zDeleteMutex(lock);
+
+    available = NULL;
+    lock = NULL;
+}
+
+
+
+// Queue func to be called with data on one of the worker threads.
+void zAddJob(ZJobFunc func, void *data)
+{
+    ZJob *job;
+
+    // No threads or out of memory, just run it now.
+    if ( !num_threads || !(job = malloc(sizeof(ZJob))) ) {
+        func(data);
+        return;
+    }
+
+    job->func = func;
+    job->data = data;
+    job->next = NULL;
+
+    zLockMutex(lock);
+
+    if (queue_tail)
+        queue_tail->next = job;
+    else
+        queue_head = job;
+
+    queue_tail = job;
+    busy++;
+
+    zUnlockMutex(lock);
+
+    zPostSemaphore(available);
+}
+
+
+
+// Wait until all jobs added so far are done.
+void zFlushJobs(void)
+{
+    int remaining;
+
+    if (!num_threads) return;
+
+    while (1) {
+
+        zLockMutex(lock);
+        remaining = busy;
+        zUnlockMutex(lock);
+
+        if (!remaining) break;
+
+        zSleep(1.0f);
+    }
+}
+
+
+
+// Run func for the next unclaimed index of group, returns FALSE if none were left.
+static int zRunGroupIndex(ZJobGroup *group)
+{
+    int index, wake;
+
+    zLockMutex(lock);
+    index = group->next < group->count ? group->next++ : -1;
+    if (index >= 0) group->running++;
+    zUnlockMutex(lock);
+
+    if (index < 0) return FALSE;
+
+    group->func(group->data, index);
+
+    zLockMutex(lock);
+    wake = --group->running == 0 && group->waiting;
+    if (wake) group->waiting = 0;
+    zUnlockMutex(lock);
+
+    if (wake) zPostSemaphore(group->done);
+
+    return TRUE;
+}
+
+
+
+static void zReleaseJobGroup(ZJobGroup *group)
+{
+    int refs;
+
+    zLockMutex(lock);
+    refs = --group->refs;
+    zUnlockMutex(lock);
+
+    if (!refs) {
+        zDeleteSemaphore(group->done);
+        free(group);
+    }
+}
+
+
+
+static void zJobGroupHelper(void *data)
+{
+    ZJobGroup *group = data;
+
+    while (zRunGroupIndex(group));
+
+    zReleaseJobGroup(group);
+}
+
+
+
+// Call func with data and every index from 0 to count-1, spread over the worker threads, and wait
+// until all calls are done. Can be used from jobs as well. The caller works on indices too, so this
+// never waits for helpers that haven't started yet (for example because all workers are busy
+// calling zParallelFor themselves).
+void zParallelFor(int count, ZParallelFunc func, void *data)
+{
+    ZJobGroup *group = NULL;
+    int i, helpers, wait;
+
+    if ( count < 2 || !num_threads || !(group = malloc(sizeof(ZJobGroup))) ||
+         !(group->done = zCreateSemaphore(0)) ) {
+        free(group);
+        for (i = 0; i < count; i++)
+            func(data, i);
+        return;
+    }
+
+    helpers = MIN(count-1, num_threads);
+
+    group->func    = func;
+    group->data    = data;
+    group->count   = count;
+    group->next    = 0;
+    group->running = 0;
+    group->refs    = 1 + helpers;
+    group->waiting = 0;
+
+    for (i = 0; i < helpers; i++)
+        zAddJob(zJobGroupHelper, group);
+
+    while (zRunGroupIndex(group));
+
+    // Everything is claimed, so running can only go down from here. If helpers are still working
+    // on indices, the one finishing the last of them wakes me up.
+    zLockMutex(lock);
+    wait = group->waiting = group->running > 0;
+    zUnlockMutex(lock);
+
+    if (wait) zWaitSemaphore(group->done);
+
+    zReleaseJobGroup(group);
+}
@@ -0,0 +1,24 @@
+#ifndef __JOBS_H__
+#define __JOBS_H__
+
+// A small pool of worker threads that run jobs (a function plus a pointer to its data) in the
+// background, in the order they were added. Jobs must not touch OpenGL or anything else that isn't
+// safe to use from another thread.
+
+#define Z_JOBS_MAX_THREADS 8
+
+typedef void (*ZJobFunc)(void *data);
+typedef void (*ZParallelFunc)(void *data, int index);
+
+
+void zJobsInit(void);
+
+void zJobsDeinit(void);
+
+void zAddJob(ZJobFunc func, void *data);
+
+void zFlushJobs(void);
+
+void zParallelFor(int count, ZParallelFunc func, void *data);
+
+#endif
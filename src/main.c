@@ -1,6 +1,4 @@
 #include <GL/glew.h>
-#include <IL/il.h>
-#include <IL/ilu.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -26,6 +24,9 @@ static void zDrawGUI(void)
 
     zApplyGUITransforms();
     zDrawConsole();
+
+    // Draw all text queued up above in one go.
+    zTextRenderFlush();
 }
 
 
@@ -35,6 +36,24 @@ static void zDrawFrame(void)
 {
     frame_count++;
 
+    zStreamBeginFrame();
+
+    // Free whatever the previous scene left unused.
+    if (collect_pending) zCollectResources(0);
+
+    // Finish any shader programs that were compiling in the background.
+    zPollShaderPrograms();
+
+    // Upload meshes and textures that finished loading in the background.
+    zUpdateMeshLoads();
+    zUpdateMeshCache();
+    zUpdateTextureLoads();
+    zEnforceTextureBudget();
+
+    // Stream in virtual texture pages requested by the last feedback pass, then start a new one.
+    zUpdateVirtualTextures();
+    if (scene) zVirtualTextureFeedback(scene);
+
     // Clear buffers, only clear color buffer if r_clear is set.
     glDepthMask(GL_TRUE);
     if (r_clearcolor)
@@ -48,6 +67,8 @@ static void zDrawFrame(void)
     // And finally draw the GUI.
     zDrawGUI();
 
+    zStreamEndFrame();
+
     // Periodic check for OpenGL errors, just in-case..
     zCheckRendererError();
 
@@ -63,13 +84,19 @@ int zMain(int argc, char** argv)
 
     zPrint("\n%s starting up...\n", PACKAGE_STRING);
 
-    ilInit();
-    iluInit();
+    zInternInit();
+    zImageInit();
+    zMipmapInit();
 
     zLuaInit();
 
     zLoadMaterials();
     zLoadConfig();
+
+    // Needs fs_loadthreads from the config.
+    zJobsInit();
+    zMeshLoadInit();
+    zMeshCacheInit();
     zLoadKeyBindings();
 
     zPrint("Running script \"%s\".\n", Z_FILE_STARTUP);
@@ -100,8 +127,16 @@ int zMain(int argc, char** argv)
 
     zCloseWindow();
 
+    zMeshCacheDeinit();
+    zMeshLoadDeinit();
+    zJobsDeinit();
+    zImageDeinit();
+
     zLuaDeinit();
 
+    // Loaded resources still point at interned names, but nothing touches them after this.
+    zInternDeinit();
+
     zShutdown();
 
     return EXIT_SUCCESS;
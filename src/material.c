@@ -11,27 +11,67 @@
 #include "common.h"
 
 
-#define Z_MTL_HASH_SIZE 2048
-#define Z_TEX_HASH_SIZE 4096
+#define Z_MAX_SAMPLERS  32
 
 
-static ZMaterial *materials[Z_MTL_HASH_SIZE];
+// Sampler object for a combination of texture parameters, see zLookupSampler.
+typedef struct ZSampler
+{
+    unsigned char wrap_mode;
+    unsigned char min_filter;
+    unsigned char mag_filter;
+    unsigned char mipmap;
+    float lod_bias;
+
+    GLuint glsampler;
+
+} ZSampler;
+
+
+// Materials and textures, keyed on their interned names.
+static ZTable materials;
+
+static ZTable material_libs; // Keyed on the interned library keys.
+
+// Mesh loaders add libraries from worker threads (see meshload.h), so material_libs is protected by
+// this.
+static ZMutex *lib_lock;
 
-static ZTexture *textures[Z_TEX_HASH_SIZE];
+static ZTable textures;
+
+// Textures that others may alias, keyed on their content hashes, see zDedupTexture.
+static ZTable texture_contents;
+
+typedef struct ZTextureContentKey
+{
+    unsigned long long hash;
+    unsigned int flags;
+
+} ZTextureContentKey;
 
 static ZMaterial *previous_mat;
 
+static size_t texture_bytes; // Sum of the sizes of all textures.
+
+static ZSampler samplers[Z_MAX_SAMPLERS];
+static int num_samplers;
+static int samplers_bound; // Set if material samplers may be bound to texture units 0-2.
+
+static GLuint bound_arrays[3]; // Texture arrays bound to units 0-2, see zBindTextureArray.
+
+static void zReleaseTexture(ZTexture *tex);
+
 ZMaterial default_material = {
     /*name*/ "default",
-    /*is_resident*/ 0, /*flags*/ 0, /*blend_type*/ 0,
+    /*is_resident*/ 0, /*refcount*/ 0, /*released*/ 0, /*flags*/ 0, /*blend_type*/ 0,
     /*ambient*/  { 1.0f, 1.0f, 1.0f, 1.0f },
     /*diffuse*/  { 0.5f, 0.5f, 0.5f, 1.0f },
     /*specular*/ { 1.0f, 1.0f, 1.0f, 1.0f },
     /*emission*/ { 0.0f, 0.0f, 0.0f, 1.0f },
     /*shininess*/ 100.0f,
     /*wrap*/ Z_TEX_WRAP_REPEAT, /*min*/ Z_TEX_FILTER_LINEAR, /*mag*/ Z_TEX_FILTER_LINEAR,
-    "textures/default.png", "", "",
-    NULL, NULL, NULL,
+    "textures/default.png", "", "", "",
+    NULL, NULL, NULL, NULL,
     "shaders/gouraud.zvs", "shaders/gouraud.zfs",
     NULL, NULL
 };
@@ -44,8 +84,6 @@ ZMaterial default_material = {
 // free() mat) after itself.
 static int zAddMaterial(ZMaterial *mat)
 {
-    unsigned int i;
-
     assert(mat->next == NULL);
     assert(strlen(mat->name)); // Makes no sense to add a material without a name.
 
@@ -55,9 +93,21 @@ static int zAddMaterial(ZMaterial *mat)
         return FALSE;
     }
 
-    i = zHashString(mat->name, Z_MTL_HASH_SIZE);
-    mat->next = materials[i];
-    materials[i] = mat;
+    return zTableInsert(&materials, zHashPointer(mat->name), mat);
+}
+
+
+
+// Get the string field key from the table at the top of the lua stack into name, interned. name is
+// left alone if there is no such field. Returns FALSE in that case.
+static int zLuaGetDataName(lua_State *L, const char *key, const char **name)
+{
+    char buf[Z_RESOURCE_NAME_SIZE];
+
+    if (!zLuaGetDataString(L, key, buf, Z_RESOURCE_NAME_SIZE))
+        return FALSE;
+
+    *name = zIntern(buf);
 
     return TRUE;
 }
@@ -82,7 +132,7 @@ static int zLuaMaterial(lua_State *L)
     }
 
     // Get name, this is the one required field..
-    if (!zLuaGetDataString(L, "name", newmtl->name, Z_RESOURCE_NAME_SIZE)) {
+    if (!zLuaGetDataName(L, "name", &(newmtl->name)) || !newmtl->name[0]) {
         zLuaWarning(L, 1, "No valid name given for material, ignoring.");
         zDeleteMaterial(newmtl);
         return 0;
@@ -98,11 +148,12 @@ static int zLuaMaterial(lua_State *L)
     zLuaGetDataUchar (L, "wrap_mode",       &(newmtl->wrap_mode));
     zLuaGetDataUchar (L, "min_filter",      &(newmtl->min_filter));
     zLuaGetDataUchar (L, "mag_filter",      &(newmtl->mag_filter));
-    zLuaGetDataString(L, "diffuse_map_name",  newmtl->diffuse_map_name,  Z_RESOURCE_NAME_SIZE);
-    zLuaGetDataString(L, "normal_map_name",   newmtl->normal_map_name,   Z_RESOURCE_NAME_SIZE);
-    zLuaGetDataString(L, "specular_map_name", newmtl->specular_map_name, Z_RESOURCE_NAME_SIZE);
-    zLuaGetDataString(L, "vertex_shader",     newmtl->vertex_shader,     Z_RESOURCE_NAME_SIZE);
-    zLuaGetDataString(L, "fragment_shader",   newmtl->fragment_shader,   Z_RESOURCE_NAME_SIZE);
+    zLuaGetDataName  (L, "diffuse_map_name",  &(newmtl->diffuse_map_name));
+    zLuaGetDataName  (L, "normal_map_name",   &(newmtl->normal_map_name));
+    zLuaGetDataName  (L, "specular_map_name", &(newmtl->specular_map_name));
+    zLuaGetDataName  (L, "virtual_map_name",  &(newmtl->virtual_map_name));
+    zLuaGetDataName  (L, "vertex_shader",     &(newmtl->vertex_shader));
+    zLuaGetDataName  (L, "fragment_shader",   &(newmtl->fragment_shader));
 
     // Add material to hash table.
     if (!zAddMaterial(newmtl)) {
@@ -120,6 +171,21 @@ void zLoadMaterials(void)
 {
     char *file;
     lua_State *L;
+    ZMaterial *def = &default_material;
+
+    if ( !lib_lock && !(lib_lock = zCreateMutex()) ) {
+        zFatal("Failed to create mutex for material libraries.");
+        exit(EXIT_FAILURE);
+    }
+
+    // The default material is initialized with string literals, intern them like any other name.
+    def->name              = zIntern(def->name);
+    def->diffuse_map_name  = zIntern(def->diffuse_map_name);
+    def->normal_map_name   = zIntern(def->normal_map_name);
+    def->specular_map_name = zIntern(def->specular_map_name);
+    def->virtual_map_name  = zIntern(def->virtual_map_name);
+    def->vertex_shader     = zIntern(def->vertex_shader);
+    def->fragment_shader   = zIntern(def->fragment_shader);
 
     // Crerate temporary lua state.
     L = luaL_newstate();
@@ -167,12 +233,25 @@ void zMaterialInit(void)
 // Any clean-up that needs to be done when the renderer is destroyed.
 void zMaterialDeinit(void)
 {
-    // Delete all textures and make materials non-resident.
-    zDeleteTextures();
+#ifdef GL_ARB_sampler_objects
+    int i;
+
+    for (i = 0; i < num_samplers; i++)
+        glDeleteSamplers(1, &(samplers[i].glsampler));
+#endif
+
+    num_samplers = 0;
+    samplers_bound = 0;
+    bound_arrays[0] = bound_arrays[1] = bound_arrays[2] = 0;
+
+    // Make materials non-resident and delete all textures, in that order since making a material
+    // non-resident releases its textures.
     zIterMaterials(zMakeMaterialNonResident, NULL);
 
     // Don't forget the hard-coded default material.
     zMakeMaterialNonResident(&default_material, NULL);
+
+    zDeleteTextures();
 }
 
 
@@ -218,6 +297,7 @@ void zMaterialInfo(ZMaterial *mtl)
     zPrint("  diffuse map:     %s\n", mtl->diffuse_map_name);
     zPrint("  normal map:      %s\n", mtl->normal_map_name);
     zPrint("  specular map:    %s\n", mtl->specular_map_name);
+    zPrint("  virtual map:     %s\n", mtl->virtual_map_name);
     zPrint("  vertex shader:   %s\n", mtl->vertex_shader);
     zPrint("  fragment shader: %s\n", mtl->fragment_shader);
 
@@ -226,123 +306,329 @@ void zMaterialInfo(ZMaterial *mtl)
 
 
 
-// Iterate over each material and call iter with it.
+// Iterate over each material, including those from material libraries, and call iter with it.
 void zIterMaterials(void (*iter)(ZMaterial *, void *), void *data)
 {
-    int i;
+    unsigned int i;
     ZMaterial *cur;
 
-    for (i = 0; i < Z_MTL_HASH_SIZE; i++) {
+    for (i = 0; i < materials.size; i++) {
+        if (materials.items[i])
+            iter(materials.items[i], data);
+    }
 
-        cur = materials[i];
+    zLockMutex(lib_lock);
 
-        while (cur != NULL) {
-            iter(cur, data);
-            cur = cur->next;
+    for (i = 0; i < material_libs.size; i++) {
+        if (material_libs.items[i]) {
+            for (cur = ((ZMaterialLib *) material_libs.items[i])->materials; cur; cur = cur->next)
+                iter(cur, data);
         }
     }
+
+    zUnlockMutex(lib_lock);
 }
 
 
 
-// Look up material by name. Returns pointer if found or NULL if not.
-ZMaterial *zLookupMaterial(const char *name)
+static int zMatchMaterial(const void *item, const void *key)
 {
-    unsigned int i;
-    ZMaterial *cur;
+    return ((const ZMaterial *) item)->name == key;
+}
+
+
 
+// Look up material by (interned) name. Returns pointer if found or NULL if not.
+ZMaterial *zLookupMaterial(const char *name)
+{
     assert(name);
     assert(strlen(name));
 
-    i = zHashString(name, Z_MTL_HASH_SIZE);
-    cur = materials[i];
+    return zTableFind(&materials, zHashPointer(name), zMatchMaterial, name);
+}
 
-    while (cur != NULL) {
 
-        if ( strcmp(cur->name, name) == 0)
-            return cur;
 
-        cur = cur->next;
+// Create the OpenGL texture object for tex with a 1x1 placeholder image, and start loading the real
+// image in the background (see texload.c).
+static void zCreateTextureObject(ZTexture *tex)
+{
+    static const unsigned char white[4] = { 255, 255, 255, 255 };
+    static const unsigned char flat_normal[4] = { 128, 128, 255, 255 };
+
+    assert(!tex->gltexname && !tex->array && !tex->size);
+
+    tex->evicted = 0;
+
+    // With texture arrays the placeholder is a layer in a shared array, and the texture only gets a
+    // layer of its own once it's loaded.
+    if (texarrays_active) {
+        tex->array = zGetPlaceholderArray(tex->flags, &(tex->layer));
+        zQueueTextureLoad(tex);
+        return;
     }
 
-    return NULL;
+    glGenTextures(1, &(tex->gltexname));
+
+    assert(tex->gltexname);
+
+    glBindTexture(GL_TEXTURE_2D, tex->gltexname);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_LOD_BIAS, r_mipmapbias);
+
+    // No other parameters are set here. Because wrap_mode/(min|mag)_filter are initialized to 0 they
+    // will be set the first time a material that uses the texture is made active.
+    tex->wrap_mode = tex->min_filter = tex->mag_filter = 0;
+
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+        (tex->flags & Z_TEX_NORMALMAP) ? flat_normal : white);
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    zQueueTextureLoad(tex);
 }
 
 
 
-// Set texture parameters according to those specified in the material, if neccesary. Unlike OpenGL
-// itself, I store parameters (like repeat, clamping, filtering) per-material rather than
-// per-texture. This allows me to share textures between materials, but it means I may need to
-// update these parameters when switching to a different material that uses a shared texture but
-// possibly with different parameters.
-static void zSetTextureParams(ZMaterial *mat, ZTexture *tex)
+// Drop the OpenGL texture object for tex to free up texture memory. tex itself stays around (since
+// materials point to it) and is loaded again by zUseTexture when it's needed.
+static void zEvictTexture(ZTexture *tex)
 {
-    int bound = 0;
+    if (fs_printdiskload)
+        zDebug("Evicting texture \"%s\" (%u KB, last used %u frames ago).", tex->name,
+            tex->size/1024, frame_count - tex->last_used);
 
-    if (!tex) return;
+    zCancelTextureLoad(tex);
 
-    assert(tex->gltexname > 0);
+    glDeleteTextures(1, &(tex->gltexname));
+    tex->gltexname = 0;
+
+    if (tex->array) zFreeTextureLayer(tex->array, tex->layer);
+    tex->array = NULL;
 
-    if (mat->wrap_mode != tex->wrap_mode) {
+    texture_bytes -= tex->size;
+    tex->size = 0;
+    tex->evicted = 1;
+}
 
-        //zDebug("Setting wrap_mode for texture \"%s\".", tex->name);
 
-        if (!bound) {
-            glBindTexture(GL_TEXTURE_2D, tex->gltexname);
-            bound = 1;
-        }
+
+// Returns a sampler object with the texture parameters of mat, creating it if needed. Materials
+// tend to share just a few combinations, so a handful of samplers covers all of them. Returns 0 if
+// sampler objects aren't supported or I ran out of slots, textures then get their parameters set
+// directly by zSetTextureParams.
+static GLuint zLookupSampler(ZMaterial *mat)
+{
+#ifdef GL_ARB_sampler_objects
+    ZSampler *sampler;
+    int i;
+
+    if (!Z_SAMPLER_OBJECTS) return 0;
+
+    for (i = 0; i < num_samplers; i++) {
+
+        sampler = samplers + i;
+
+        if (sampler->wrap_mode == mat->wrap_mode && sampler->min_filter == mat->min_filter &&
+            sampler->mag_filter == mat->mag_filter && sampler->mipmap == r_mipmap &&
+            sampler->lod_bias == r_mipmapbias)
+            return sampler->glsampler;
+    }
+
+    if (num_samplers == Z_MAX_SAMPLERS) return 0;
+
+    sampler = samplers + num_samplers;
+    sampler->wrap_mode  = mat->wrap_mode;
+    sampler->min_filter = mat->min_filter;
+    sampler->mag_filter = mat->mag_filter;
+    sampler->mipmap     = r_mipmap;
+    sampler->lod_bias   = r_mipmapbias;
+
+    glGenSamplers(1, &(sampler->glsampler));
+
+    if (!sampler->glsampler) return 0;
+
+    if (mat->wrap_mode == Z_TEX_WRAP_REPEAT) {
+        glSamplerParameteri(sampler->glsampler, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glSamplerParameteri(sampler->glsampler, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    } else if (mat->wrap_mode == Z_TEX_WRAP_CLAMP) {
+        glSamplerParameteri(sampler->glsampler, GL_TEXTURE_WRAP_S, GL_CLAMP);
+        glSamplerParameteri(sampler->glsampler, GL_TEXTURE_WRAP_T, GL_CLAMP);
+    } else if (mat->wrap_mode == Z_TEX_WRAP_CLAMPEDGE) {
+        glSamplerParameteri(sampler->glsampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glSamplerParameteri(sampler->glsampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+
+    if (mat->min_filter == Z_TEX_FILTER_NEAREST)
+        glSamplerParameteri(sampler->glsampler, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    else if (mat->min_filter == Z_TEX_FILTER_LINEAR)
+        glSamplerParameteri(sampler->glsampler, GL_TEXTURE_MIN_FILTER, r_mipmap ?
+            GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+
+    if (mat->mag_filter == Z_TEX_FILTER_NEAREST)
+        glSamplerParameteri(sampler->glsampler, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    else if (mat->mag_filter == Z_TEX_FILTER_LINEAR)
+        glSamplerParameteri(sampler->glsampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    glSamplerParameterf(sampler->glsampler, GL_TEXTURE_LOD_BIAS, r_mipmapbias);
+
+    num_samplers++;
+
+    return sampler->glsampler;
+#else
+    return 0;
+#endif
+}
+
+
+
+// Set the texture parameters of mat on the texture bound to target on the active unit, as far as
+// they differ from the ones wrap_mode, min_filter and mag_filter say are set, and update those.
+static void zApplyTextureParams(ZMaterial *mat, GLenum target, unsigned char *wrap_mode,
+                                unsigned char *min_filter, unsigned char *mag_filter)
+{
+    if (mat->wrap_mode != *wrap_mode) {
 
         if (mat->wrap_mode == Z_TEX_WRAP_REPEAT) {
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+            glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_REPEAT);
+            glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_REPEAT);
         } else if (mat->wrap_mode == Z_TEX_WRAP_CLAMP) {
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+            glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP);
+            glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP);
         } else if (mat->wrap_mode == Z_TEX_WRAP_CLAMPEDGE) {
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
         }
-        tex->wrap_mode = mat->wrap_mode;
+        *wrap_mode = mat->wrap_mode;
     }
 
-    if (mat->min_filter != tex->min_filter) {
-
-        if (!bound) {
-            glBindTexture(GL_TEXTURE_2D, tex->gltexname);
-            bound = 1;
-        }
-
-        //zDebug("Setting min_filter for texture \"%s\".", tex->name);
+    if (mat->min_filter != *min_filter) {
 
         if (mat->min_filter == Z_TEX_FILTER_NEAREST) {
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 
         } else if (mat->min_filter == Z_TEX_FILTER_LINEAR) {
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, r_mipmap ?
+            glTexParameteri(target, GL_TEXTURE_MIN_FILTER, r_mipmap ?
             GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
         }
-        tex->min_filter = mat->min_filter;
+        *min_filter = mat->min_filter;
     }
 
-    if (mat->mag_filter != tex->mag_filter) {
-
-        if (!bound) {
-            glBindTexture(GL_TEXTURE_2D, tex->gltexname);
-            bound = 1;
-        }
-
-        //zDebug("Setting mag_filter for texture \"%s\".", tex->name);
+    if (mat->mag_filter != *mag_filter) {
 
         if (mat->mag_filter == Z_TEX_FILTER_NEAREST)
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
         else if (mat->mag_filter == Z_TEX_FILTER_LINEAR)
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-        tex->mag_filter = mat->mag_filter;
+        *mag_filter = mat->mag_filter;
     }
+}
+
 
-    if (bound) glBindTexture(GL_TEXTURE_2D, 0);
 
+// Set texture parameters according to those specified in the material, if neccesary. Unlike OpenGL
+// itself, I store parameters (like repeat, clamping, filtering) per-material rather than
+// per-texture. This allows me to share textures between materials, but it means I may need to
+// update these parameters when switching to a different material that uses a shared texture but
+// possibly with different parameters.
+static void zSetTextureParams(ZMaterial *mat, ZTexture *tex)
+{
+    if (!tex) return;
+
+    assert(tex->gltexname > 0);
+
+    if (mat->wrap_mode == tex->wrap_mode && mat->min_filter == tex->min_filter &&
+        mat->mag_filter == tex->mag_filter)
+        return;
+
+    glBindTexture(GL_TEXTURE_2D, tex->gltexname);
+    zApplyTextureParams(mat, GL_TEXTURE_2D, &(tex->wrap_mode), &(tex->min_filter),
+        &(tex->mag_filter));
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+
+
+// Same as zSetTextureParams, but for the array holding tex, which must already be bound to unit
+// (see zBindTextureArray). The parameters apply to all layers, so materials with different ones
+// that share an array have to set them again on every switch.
+static void zSetTextureArrayParams(ZMaterial *mat, int unit, ZTexture *tex)
+{
+    ZTextureArray *array;
+
+    if (!tex) return;
+
+    array = tex->array;
+
+    if (mat->wrap_mode == array->wrap_mode && mat->min_filter == array->min_filter &&
+        mat->mag_filter == array->mag_filter)
+        return;
+
+    glActiveTexture(GL_TEXTURE0 + unit);
+    zApplyTextureParams(mat, GL_TEXTURE_2D_ARRAY_EXT, &(array->wrap_mode), &(array->min_filter),
+        &(array->mag_filter));
+    glActiveTexture(GL_TEXTURE0);
+}
+
+
+
+// Bind sampler to texture units 0-2, or if it's 0, unbind material samplers from them so the
+// parameters of whatever texture gets bound there next apply again.
+static void zBindSamplers(GLuint sampler)
+{
+#ifdef GL_ARB_sampler_objects
+    glBindSampler(0, sampler);
+    glBindSampler(1, sampler);
+    glBindSampler(2, sampler);
+#endif
+    samplers_bound = sampler != 0;
+}
+
+
+
+static void zUnbindSamplers(void)
+{
+    if (samplers_bound) zBindSamplers(0);
+}
+
+
+
+// Returns the texture that is actually drawn for tex, which is a different one if tex is an alias.
+static inline ZTexture *zResolveTexture(ZTexture *tex)
+{
+    return (tex && tex->alias) ? tex->alias : tex;
+}
+
+
+
+// Mark tex as used this frame, bringing it back if it was evicted. tex should be resolved already.
+static void zUseTexture(ZTexture *tex)
+{
+    if (!tex) return;
+
+    tex->last_used = frame_count;
+
+    if (tex->evicted) {
+        if (fs_printdiskload) zDebug("Reloading evicted texture \"%s\".", tex->name);
+        zCreateTextureObject(tex);
+    }
+}
+
+
+
+// Bind the array holding tex to the given texture unit, unless it's already bound there. Materials
+// using similar textures share arrays, so most material switches end up skipping this.
+static void zBindTextureArray(int unit, ZTexture *tex)
+{
+    GLuint gltexname = tex ? tex->array->gltexname : 0;
+
+    if (bound_arrays[unit] == gltexname) return;
+
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, gltexname);
+    glActiveTexture(GL_TEXTURE0);
+
+    bound_arrays[unit] = gltexname;
 }
 
 
@@ -350,12 +636,36 @@ static void zSetTextureParams(ZMaterial *mat, ZTexture *tex)
 // Set OpenGL state for rendering material
 static void zApplyMaterialState(ZMaterial *mat)
 {
+    GLuint sampler;
+    ZTexture *diffuse_map  = zResolveTexture(mat->diffuse_map);
+    ZTexture *normal_map   = zResolveTexture(mat->normal_map);
+    ZTexture *specular_map = zResolveTexture(mat->specular_map);
+
+    zUseTexture(diffuse_map);
+    zUseTexture(normal_map);
+    zUseTexture(specular_map);
+
     // Make sure the texture parameters (texture filtering, wrap modes, etc) are set right for the
-    // material. I keep track of what the texture paremeters are set to in ZTexture, so that I don't
-    // set them if I don't need to.
-    zSetTextureParams(mat, mat->diffuse_map);
-    zSetTextureParams(mat, mat->normal_map);
-    zSetTextureParams(mat, mat->specular_map);
+    // material. These come from a sampler object bound to each unit, so textures shared between
+    // materials don't need to be touched. Without sampler objects I fall back to setting them on the
+    // textures themselves, I keep track of what they are set to in ZTexture so that I don't set them
+    // if I don't need to. Texture arrays get theirs once they are bound, below.
+    if ( (sampler = zLookupSampler(mat)) ) {
+
+        zBindSamplers(sampler);
+
+    } else if (texarrays_active) {
+
+        zUnbindSamplers();
+
+    } else {
+
+        zUnbindSamplers();
+
+        zSetTextureParams(mat, diffuse_map);
+        zSetTextureParams(mat, normal_map);
+        zSetTextureParams(mat, specular_map);
+    }
 
     glMaterialfv(GL_FRONT, GL_AMBIENT,   mat->ambient_color);
     glMaterialfv(GL_FRONT, GL_DIFFUSE,   mat->diffuse_color);
@@ -381,26 +691,41 @@ static void zApplyMaterialState(ZMaterial *mat)
     // Bind texture maps to the right texture units. For now, diffuse textures get bound to unit 0,
     // normalmaps to unit 1, and specular maps to unit 2. I may need to make this more flexible at
     // some point..
-    glActiveTexture(GL_TEXTURE0);
-    if (mat->diffuse_map) {
-        glBindTexture(GL_TEXTURE_2D, mat->diffuse_map->gltexname);
-        glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
-    } else {
-        glBindTexture(GL_TEXTURE_2D, 0);
-    }
+    if (texarrays_active) {
 
-    glActiveTexture(GL_TEXTURE1);
-    if (mat->normal_map) {
-        glBindTexture(GL_TEXTURE_2D, mat->normal_map->gltexname);
-    } else {
-        glBindTexture(GL_TEXTURE_2D, 0);
-    }
+        zBindTextureArray(0, diffuse_map);
+        zBindTextureArray(1, normal_map);
+        zBindTextureArray(2, specular_map);
+
+        if (!sampler) {
+            zSetTextureArrayParams(mat, 0, diffuse_map);
+            zSetTextureArrayParams(mat, 1, normal_map);
+            zSetTextureArrayParams(mat, 2, specular_map);
+        }
 
-    glActiveTexture(GL_TEXTURE2);
-    if (mat->specular_map) {
-        glBindTexture(GL_TEXTURE_2D, mat->specular_map->gltexname);
     } else {
-        glBindTexture(GL_TEXTURE_2D, 0);
+
+        glActiveTexture(GL_TEXTURE0);
+        if (diffuse_map) {
+            glBindTexture(GL_TEXTURE_2D, diffuse_map->gltexname);
+            glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+        } else {
+            glBindTexture(GL_TEXTURE_2D, 0);
+        }
+
+        glActiveTexture(GL_TEXTURE1);
+        if (normal_map) {
+            glBindTexture(GL_TEXTURE_2D, normal_map->gltexname);
+        } else {
+            glBindTexture(GL_TEXTURE_2D, 0);
+        }
+
+        glActiveTexture(GL_TEXTURE2);
+        if (specular_map) {
+            glBindTexture(GL_TEXTURE_2D, specular_map->gltexname);
+        } else {
+            glBindTexture(GL_TEXTURE_2D, 0);
+        }
     }
 
     glActiveTexture(GL_TEXTURE0);
@@ -411,6 +736,52 @@ static void zApplyMaterialState(ZMaterial *mat)
         else
             glUseProgram(0);
     }
+
+    // Tell the shader which layers of the bound arrays to use.
+    if (texarrays_active && mat->program && mat->program->uniforms[Z_UNIFORM_TEX_LAYERS] >= 0) {
+        glUniform3f(mat->program->uniforms[Z_UNIFORM_TEX_LAYERS],
+            diffuse_map  ? diffuse_map->layer  : 0,
+            normal_map   ? normal_map->layer   : 0,
+            specular_map ? specular_map->layer : 0);
+    }
+
+    zBindVirtualTexture(mat->virtual_map, mat->program);
+}
+
+
+
+// Returns the format a texture with the given Z_TEX_* flags ends up with once it's loaded. This has
+// to be known before the load finishes since the normal map format decides which shader is used, so
+// texload.c compresses normal maps on the spot if they aren't in the cache yet.
+static GLenum zTextureFormat(unsigned int flags)
+{
+    GLenum format;
+
+    if ( (flags & Z_TEX_NORMALMAP) && r_texcompress && (format = zTexCacheFormat(flags, 0)) )
+        return format;
+
+    return GL_RGBA;
+}
+
+
+
+// Figure out which flags need to be passed on to the shader for mat, given the format of its normal
+// map (0 if it has none) and whether it has a specular map and virtual texture.
+static unsigned int zMaterialShaderFlags(ZMaterial *mat, GLenum normal_format, int specular_map,
+    int virtual_map)
+{
+    unsigned int flags = 0;
+
+    if (mat->flags & Z_MTL_FRESNEL) flags |= Z_SHADER_FRESNEL;
+    if (normal_format)              flags |= Z_SHADER_NORMALMAP;
+    if (specular_map)               flags |= Z_SHADER_SPECULARMAP;
+    if (texarrays_active)           flags |= Z_SHADER_TEXARRAY;
+    if (virtual_map)                flags |= Z_SHADER_VTEXTURE;
+
+    // Two-channel normal maps need Z reconstructed in the shader.
+    if (normal_format == GL_COMPRESSED_RG_RGTC2) flags |= Z_SHADER_NORMALMAP_RG;
+
+    return flags;
 }
 
 
@@ -422,7 +793,7 @@ void zMakeMaterialResident(ZMaterial *mat)
 
     // Make sure mat was initialized / made non-resident properly.
     assert(mat->is_resident == 0 && !mat->diffuse_map && !mat->specular_map && !mat->normal_map &&
-           !mat->program);
+           !mat->virtual_map && !mat->program);
 
     // Always make resident even if some resources fail to load, this is so I don't get stuck in an
     // infinite loop. Should probably give a warning if something fails to load however..
@@ -430,47 +801,87 @@ void zMakeMaterialResident(ZMaterial *mat)
 
     // Load texture maps.
     if (mat->diffuse_map_name[0]) {
-        if ( !(mat->diffuse_map = zLookupTexture(mat->diffuse_map_name)) )
+        if ( !(mat->diffuse_map = zLookupTexture(mat->diffuse_map_name, Z_TEX_COLOR)) )
             zWarning("Failed to load texture \"%s\" for material \"%s\".", mat->diffuse_map_name,
                 mat->name);
     }
     if (mat->specular_map_name[0]) {
-        if ( !(mat->specular_map = zLookupTexture(mat->specular_map_name)) )
+        if ( !(mat->specular_map = zLookupTexture(mat->specular_map_name, 0)) )
             zWarning("Failed to load texture \"%s\" for material \"%s\".", mat->specular_map_name,
                 mat->name);
     }
     if (mat->normal_map_name[0]) {
-        if ( !(mat->normal_map = zLookupTexture(mat->normal_map_name)) )
+        if ( !(mat->normal_map = zLookupTexture(mat->normal_map_name, Z_TEX_NORMALMAP)) )
             zWarning("Failed to load texture \"%s\" for material \"%s\".", mat->normal_map_name,
                 mat->name);
     }
+    if (mat->virtual_map_name[0]) {
+        if ( !(mat->virtual_map = zLookupVirtualTexture(mat->virtual_map_name)) )
+            zWarning("Failed to load virtual texture \"%s\" for material \"%s\".",
+                mat->virtual_map_name, mat->name);
+    }
 
     // Load shader.
     if ( !r_noshaders && (mat->vertex_shader[0] || mat->fragment_shader[0]) ) {
-        unsigned int flags = 0;
 
-        // Figure out which flags need to be passed on to the shader.
-        if (mat->flags & Z_MTL_FRESNEL) flags |= Z_SHADER_FRESNEL;
-        if (mat->normal_map)            flags |= Z_SHADER_NORMALMAP;
-        if (mat->specular_map)          flags |= Z_SHADER_SPECULARMAP;
+        unsigned int flags = zMaterialShaderFlags(mat, mat->normal_map ? mat->normal_map->format : 0,
+                                                  mat->specular_map != NULL,
+                                                  mat->virtual_map != NULL);
 
         mat->program = zLookupShaderProgram(flags, mat->vertex_shader, mat->fragment_shader);
         if (!mat->program) {
             zWarning("Failed to load shader program for material \"%s\".", mat->name);
         }
     }
+
+    // Hold on to everything that was loaded, until the material is made non-resident again.
+    if (mat->diffuse_map)  mat->diffuse_map->refcount++;
+    if (mat->specular_map) mat->specular_map->refcount++;
+    if (mat->normal_map)   mat->normal_map->refcount++;
+    if (mat->program)      mat->program->refcount++;
+    if (mat->virtual_map)  mat->virtual_map->refcount++;
+}
+
+
+
+// Queue the shader program mat will use for compiling, so it is (hopefully) done by the time mat is
+// first drawn. Textures aren't loaded yet at this point so I guess the flags from the texture map
+// names, if a texture then fails to load, zMakeMaterialResident just ends up compiling another
+// permutation.
+void zQueueMaterialShaders(ZMaterial *mat, void *ignored)
+{
+    unsigned int flags;
+    GLenum normal_format = 0;
+
+    if ( r_noshaders || mat->is_resident || !(mat->vertex_shader[0] || mat->fragment_shader[0]) )
+        return;
+
+    if (mat->normal_map_name[0])
+        normal_format = zTextureFormat(Z_TEX_NORMALMAP);
+
+    flags = zMaterialShaderFlags(mat, normal_format, mat->specular_map_name[0] != '\0',
+                                 mat->virtual_map_name[0] && vtextures_active);
+
+    zQueueShaderProgram(flags, mat->vertex_shader, mat->fragment_shader);
 }
 
 
 
-// Mark material non-resident
+// Mark material non-resident, releasing its textures and shader program.
 void zMakeMaterialNonResident(ZMaterial *mat, void *ignored)
 {
     if (!mat->is_resident) return;
 
+    if (mat->diffuse_map)  zReleaseTexture(mat->diffuse_map);
+    if (mat->specular_map) zReleaseTexture(mat->specular_map);
+    if (mat->normal_map)   zReleaseTexture(mat->normal_map);
+    if (mat->program)      zReleaseShaderProgram(mat->program);
+    if (mat->virtual_map)  zReleaseVirtualTexture(mat->virtual_map);
+
     mat->diffuse_map  = NULL;
     mat->specular_map = NULL;
     mat->normal_map   = NULL;
+    mat->virtual_map  = NULL;
     mat->program      = NULL;
     mat->is_resident  = 0;
 }
@@ -483,6 +894,14 @@ void zMakeMaterialNonResident(ZMaterial *mat, void *ignored)
 // Update OpenGL state for drawing with given material.
 void zMakeMaterialActive(ZMaterial *mat)
 {
+    // The virtual texture feedback pass only cares about which virtual texture is used.
+    if (vt_feedback) {
+        if (!mat->is_resident) zMakeMaterialResident(mat);
+        zApplyVirtualFeedback(mat->virtual_map);
+        previous_mat = NULL;
+        return;
+    }
+
     if (mat && previous_mat == mat)
         return;
 
@@ -512,11 +931,15 @@ ZMaterial *zNewMaterial(void)
 
     memset(new, '\0', sizeof(ZMaterial));
 
+    new->name = new->diffuse_map_name = new->normal_map_name = new->specular_map_name =
+        new->virtual_map_name = new->vertex_shader = new->fragment_shader = zIntern("");
+
     zSetFloat4(new->ambient_color,  1.0f, 1.0f, 1.0f, 1.0f);
     zSetFloat4(new->diffuse_color,  1.0f, 1.0f, 1.0f, 1.0f);
     zSetFloat4(new->specular_color, 1.0f, 1.0f, 1.0f, 1.0f);
     zSetFloat4(new->emission_color, 0.0f, 0.0f, 0.0f, 1.0f);
 
+    new->released   = sceneload_count;
     new->blend_type = Z_MTL_BLEND_NONE;
     new->shininess  = 80.0f;
     new->wrap_mode  = Z_TEX_WRAP_REPEAT;
@@ -530,8 +953,8 @@ ZMaterial *zNewMaterial(void)
 
 
 
-// Makes a proper copy (= makes sure to copy dynamically allocated members) of material. Returns
-// pointer to new copy or NULL on failure.
+// Makes a proper copy (= makes sure to copy dynamically allocated members) of material. The copy is
+// non-resident and unreferenced, even if mat isn't. Returns pointer to new copy or NULL on failure.
 ZMaterial *zCopyMaterial(ZMaterial *mat)
 {
     ZMaterial *new;
@@ -546,6 +969,16 @@ ZMaterial *zCopyMaterial(ZMaterial *mat)
 
     *new = *mat;
 
+    // The copy didn't take references to the textures and program of mat, so it can't share them.
+    new->is_resident  = 0;
+    new->refcount     = 0;
+    new->released     = sceneload_count;
+    new->diffuse_map  = NULL;
+    new->specular_map = NULL;
+    new->normal_map   = NULL;
+    new->virtual_map  = NULL;
+    new->program      = NULL;
+
     return new;
 }
 
@@ -555,11 +988,167 @@ ZMaterial *zCopyMaterial(ZMaterial *mat)
 void zDeleteMaterial(ZMaterial *mat)
 {
     assert(mat);
+
+    // Another material might end up at the same address.
+    if (mat == previous_mat) previous_mat = NULL;
+
     free(mat);
 }
 
 
 
+// Drop a reference to mat, taken for each mesh group that uses it.
+void zReleaseMaterial(ZMaterial *mat)
+{
+    assert(mat->refcount > 0);
+
+    if (--mat->refcount == 0)
+        mat->released = sceneload_count;
+}
+
+
+
+static int zMatchMaterialLib(const void *item, const void *key)
+{
+    return ((const ZMaterialLib *) item)->key == key;
+}
+
+
+
+// Look up material library by (interned) key. Returns NULL if it wasn't loaded (or was collected).
+ZMaterialLib *zLookupMaterialLib(const char *key)
+{
+    ZMaterialLib *lib;
+
+    assert(key);
+
+    zLockMutex(lib_lock);
+    lib = zTableFind(&material_libs, zHashPointer(key), zMatchMaterialLib, key);
+    zUnlockMutex(lib_lock);
+
+    return lib;
+}
+
+
+
+// Add a library with the given materials (linked through next), which it takes ownership of. key
+// and tex_prefix should be interned. Returns the library, or NULL if memory ran out, the caller
+// still owns the materials then.
+ZMaterialLib *zAddMaterialLib(const char *key, ZMaterial *materials, const char *tex_prefix)
+{
+    ZMaterialLib *lib;
+
+    assert(!zLookupMaterialLib(key));
+
+    if ( !(lib = malloc(sizeof(ZMaterialLib))) ) {
+        zError("%s: Failed to allocate memory.", __func__);
+        return NULL;
+    }
+
+    lib->key = key;
+    lib->tex_prefix = tex_prefix;
+    lib->materials = materials;
+
+    zLockMutex(lib_lock);
+
+    if (!zTableInsert(&material_libs, zHashPointer(key), lib)) {
+        free(lib);
+        lib = NULL;
+    }
+
+    zUnlockMutex(lib_lock);
+
+    return lib;
+}
+
+
+
+// Returns the number of material libraries loaded.
+unsigned int zMaterialLibCount(void)
+{
+    unsigned int count;
+
+    zLockMutex(lib_lock);
+    count = material_libs.count;
+    zUnlockMutex(lib_lock);
+
+    return count;
+}
+
+
+
+// Make materials of libraries that no mesh uses any more non-resident, and delete the libraries
+// once none of their materials has been used for more than r_retainscenes scene loads (or right
+// away if force is set). Libraries are never deleted while meshes are loading, those may be using
+// them without holding references yet. Returns the number of materials made non-resident.
+static int zCollectMaterialLibs(int force)
+{
+    unsigned int i;
+    int count = 0, unused, loading = zMeshLoadsPending();
+    ZMaterialLib *lib;
+    ZMaterial *cur, *next;
+
+    zLockMutex(lib_lock);
+
+    for (i = 0; i < material_libs.size; i++) {
+
+        if ( !(lib = material_libs.items[i]) ) continue;
+
+        unused = 1;
+
+        for (cur = lib->materials; cur; cur = cur->next) {
+            if (cur->refcount || !zResourceExpired(cur->released, force)) {
+                unused = 0;
+            } else if (cur->is_resident) {
+                zMakeMaterialNonResident(cur, NULL);
+                count++;
+            }
+        }
+
+        if (!unused || loading) continue;
+
+        for (cur = lib->materials; cur; cur = next) {
+            next = cur->next;
+            zDeleteMaterial(cur);
+        }
+
+        zTableRemoveAt(&material_libs, i);
+        free(lib);
+        i--; // Check the slot again, another library may have moved into it.
+    }
+
+    zUnlockMutex(lib_lock);
+
+    return count;
+}
+
+
+
+// Make materials that no mesh has used for more than r_retainscenes scene loads (or all unused ones
+// if force is set) non-resident, so their textures and shader programs can be collected. The
+// materials themselves stay, they are defined once at startup and cost next to nothing (unlike
+// material libraries, see zCollectMaterialLibs). Returns the number of materials made non-resident.
+int zCollectMaterials(int force)
+{
+    unsigned int i;
+    int count = 0;
+    ZMaterial *cur;
+
+    for (i = 0; i < materials.size; i++) {
+        cur = materials.items[i];
+        if (cur && cur->is_resident && !cur->refcount && zResourceExpired(cur->released, force)) {
+            zMakeMaterialNonResident(cur, NULL);
+            count++;
+        }
+    }
+
+    count += zCollectMaterialLibs(force);
+
+    return count;
+}
+
+
+
 // This should be called when material OpenGL state has been changed in between zMaterialMakeActive
 // calls. This is because I keep track of the previously active material and skip needlessly setting
 // its state again if the same material is activated. This assumption wouldn't hold if something
@@ -569,110 +1158,85 @@ void zDeleteMaterial(ZMaterial *mat)
 void zResetMaterialState(void)
 {
     previous_mat = NULL;
-}
 
+    // Other code binding textures expects their own parameters to apply.
+    zUnbindSamplers();
 
+    // Array bindings may have been clobbered too.
+    bound_arrays[0] = bound_arrays[1] = bound_arrays[2] = (GLuint) -1;
+}
 
-// Add texture to hash table.
-static void zAddTexture(ZTexture *tex)
-{
-    unsigned int i;
-
-    assert(tex->next == NULL);
 
-    i = zHashString(tex->name, Z_TEX_HASH_SIZE);
-    tex->next = textures[i];
-    textures[i] = tex;
 
-    return;
+static int zMatchTexture(const void *item, const void *key)
+{
+    return ((const ZTexture *) item)->name == key;
 }
 
 
 
-// Load texture and add to texture list. Returns pointer to loaded texture or NULL on error.
-static ZTexture *zLoadTexture(const char *name)
+// Create texture and add to texture list. The image itself is loaded in the background (see
+// texload.c), until then the texture is a 1x1 placeholder. Returns pointer to the texture or NULL if
+// the image doesn't exist. name should be interned, hash is its hash in the textures table.
+static ZTexture *zLoadTexture(const char *name, unsigned int hash, unsigned int flags)
 {
     ZTexture *tex;
-    ZImage *img;
-    int namelen;
+    const char *path;
 
-    if ( (namelen = strlen(name)) >= Z_RESOURCE_NAME_SIZE) {
+    if (strlen(name) >= Z_RESOURCE_NAME_SIZE) {
         zError("Texture name \"%s\" exceeds RESOURCE_NAME_SIZE, ignoring.", name);
         return NULL;
     }
 
+    // Decoding failures only show up later, but a missing image I can catch here.
+    path = zGetPath(name, NULL, Z_FILE_REWRITE_DIRSEP | Z_FILE_TRYUSER);
+    if (!path || zPathExists(path) != Z_EXISTS_REGULAR) {
+        zWarning("Texture image \"%s\" not found.", name);
+        return NULL;
+    }
+
     if ( !(tex = malloc(sizeof(ZTexture))) ) {
         zError("%s: Failed to allocate memory for while loading texture \"%s\".", __func__, name);
         return NULL;
     }
 
     memset(tex, '\0', sizeof(ZTexture));
-    memcpy(tex->name, name, namelen);
-    tex->name[namelen] = '\0';
-
+    tex->name = name;
     tex->gltexname = 0;
-    tex->next = NULL;
+    tex->flags = flags;
+    tex->format = zTextureFormat(flags);
+    tex->released = sceneload_count;
 
-    if (fs_printdiskload) zDebug("Loading texture \"%s\" from disk.", tex->name);
-
-    // Load image and load OpenGL texture.
-    if ( (img = zLoadImage(zGetPath(tex->name, NULL, Z_FILE_REWRITE_DIRSEP | Z_FILE_TRYUSER))) ) {
-
-        glGenTextures(1, &(tex->gltexname));
-
-        assert(tex->gltexname);
-
-        glBindTexture(GL_TEXTURE_2D, tex->gltexname);
-        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_LOD_BIAS, r_mipmapbias);
-
-        // No other parameters are set here. Because wrap_mode/(min|mag)_filter are initialized to
-        // 0 they will be set the first time a material that uses the texture is made active.
-
-        if (r_mipmap)
-            gluBuild2DMipmaps(GL_TEXTURE_2D, GL_RGBA, img->width, img->height, GL_RGBA,
-                GL_UNSIGNED_BYTE, img->data);
-        else
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, img->width, img->height, 0, GL_RGBA,
-                GL_UNSIGNED_BYTE, img->data);
-
-        glBindTexture(GL_TEXTURE_2D, 0);
-        zDeleteImage(img);
-
-        zAddTexture(tex);
-        return tex;
+    if (!zTableInsert(&textures, hash, tex)) {
+        free(tex);
+        return NULL;
     }
 
-    // Failed to load or add texture image, so delete it return NULL.
-    zDeleteTexture(tex);
+    zCreateTextureObject(tex);
 
-    return NULL;
+    return tex;
 }
 
 
 
-// Lookup texture in list of textures, if not found, attempt to load it. Returns NULL on failure.
-ZTexture *zLookupTexture(const char *name)
+// Lookup texture by (interned) name, if not found, attempt to load it with the given Z_TEX_* flags.
+// Returns NULL on failure.
+ZTexture *zLookupTexture(const char *name, unsigned int flags)
 {
-    unsigned int i;
+    unsigned int hash;
     ZTexture *cur;
 
     assert(name);
     assert(strlen(name) > 0);
 
     // See if the texture is already loaded, return a pointer to it if so.
-    i = zHashString(name, Z_TEX_HASH_SIZE);
-    cur = textures[i];
-
-    while (cur != NULL) {
+    hash = zHashPointer(name);
 
-        if ( strcmp(cur->name, name) == 0)
-            return cur;
-
-        cur = cur->next;
-    }
+    if ( (cur = zTableFind(&textures, hash, zMatchTexture, name)) )
+        return cur;
 
     // Load the texture.
-    return zLoadTexture(name);
+    return zLoadTexture(name, hash, flags);
 }
 
 
@@ -682,6 +1246,18 @@ void zDeleteTexture(ZTexture *tex)
 {
     assert(tex);
 
+    zCancelTextureLoad(tex);
+
+    // An alias has nothing to delete but the reference to the texture it shares.
+    if (tex->alias)
+        zReleaseTexture(tex->alias);
+    else if (tex->content_hash)
+        zTableRemove(&texture_contents, (unsigned int) tex->content_hash, tex);
+
+    if (tex->array) zFreeTextureLayer(tex->array, tex->layer);
+
+    texture_bytes -= tex->size;
+
     // This is safe even for textures that for some reason aren't loaded (i.e. gltextname == 0), as
     // glDeleteTextures silently ignores invalid texture names/0s.
     glDeleteTextures(1, &(tex->gltexname));
@@ -691,24 +1267,63 @@ void zDeleteTexture(ZTexture *tex)
 
 
 
-// Delete all currently loaded textures.
-void zDeleteTextures(void)
+// Drop a reference to tex, taken by zMakeMaterialResident.
+static void zReleaseTexture(ZTexture *tex)
 {
-    int i;
-    ZTexture *cur, *tmp;
+    assert(tex->refcount > 0);
+
+    if (--tex->refcount == 0)
+        tex->released = sceneload_count;
+}
+
 
-    for (i = 0; i < Z_TEX_HASH_SIZE; i++) {
 
-        cur = textures[i];
+// Delete textures that no material has used for more than r_retainscenes scene loads (or all
+// unused ones if force is set). Returns the number of textures deleted.
+int zCollectTextures(int force)
+{
+    unsigned int i;
+    int count = 0;
+    ZTexture *tex;
 
-        while (cur != NULL) {
-            tmp = cur->next;
-            zDeleteTexture(cur);
-            cur = tmp;
+    for (i = 0; i < textures.size; i++) {
+
+        tex = textures.items[i];
+
+        if (tex && !tex->refcount && zResourceExpired(tex->released, force)) {
+            zTableRemoveAt(&textures, i);
+            zDeleteTexture(tex);
+            count++;
+            i--; // Check the slot again, another texture may have moved into it.
         }
+    }
+
+    return count;
+}
+
+
+
+// Delete all currently loaded textures.
+void zDeleteTextures(void)
+{
+    unsigned int i;
+    ZTexture *tex;
 
-        textures[i] = NULL;
+    // Aliases go first, they release the textures they share when deleted.
+    for (i = 0; i < textures.size; i++) {
+        if ( (tex = textures.items[i]) && tex->alias ) {
+            zDeleteTexture(tex);
+            textures.items[i] = NULL;
+        }
+    }
+
+    for (i = 0; i < textures.size; i++) {
+        if (textures.items[i])
+            zDeleteTexture(textures.items[i]);
     }
+
+    zTableClear(&textures);
+    zTableClear(&texture_contents);
 }
 
 
@@ -716,20 +1331,170 @@ void zDeleteTextures(void)
 // Iterate over textures in the hash table and call iter with it.
 void zIterTextures(void (*iter)(ZTexture *, void *), void *data)
 {
-    int i;
-    ZTexture *cur;
+    unsigned int i;
+
+    for (i = 0; i < textures.size; i++) {
+        if (textures.items[i])
+            iter(textures.items[i], data);
+    }
+}
+
+
+
+// Account for size bytes of texture data that were uploaded to tex.
+void zAddTextureSize(ZTexture *tex, unsigned int size)
+{
+    tex->size += size;
+    texture_bytes += size;
+}
+
+
+
+static int zMatchTextureContent(const void *item, const void *key)
+{
+    const ZTexture *tex = item;
+    const ZTextureContentKey *k = key;
+
+    return tex->content_hash == k->hash && tex->flags == k->flags;
+}
+
+
+
+// Called by texload.c once the image for tex is loaded, before any of it is uploaded. hash is the
+// hash of the image data. If r_dedup is set and another texture with the same flags has identical
+// data, tex becomes an alias for it and TRUE is returned, the image should be dropped then. The
+// name stays with tex, so lookups and materials keep using it, only the GPU copy is shared.
+// Otherwise tex is recorded as having this data and FALSE is returned.
+int zDedupTexture(ZTexture *tex, unsigned long long hash)
+{
+    ZTextureContentKey key;
+    ZTexture *found;
+
+    assert(!tex->alias && hash);
 
-    for (i = 0; i < Z_TEX_HASH_SIZE; i++) {
+    key.hash  = hash;
+    key.flags = tex->flags;
 
-        cur = textures[i];
+    found = zTableFind(&texture_contents, (unsigned int) hash, zMatchTextureContent, &key);
 
-        while (cur != NULL) {
-            iter(cur, data);
-            cur = cur->next;
+    // Reloading after eviction finds the texture itself. Textures that were recorded before are
+    // never turned into aliases, others may already be sharing them.
+    if (found == tex) return FALSE;
+
+    if (!found || tex->content_hash) {
+
+        if (tex->content_hash)
+            zTableRemove(&texture_contents, (unsigned int) tex->content_hash, tex);
+
+        tex->content_hash = hash;
+
+        // If this fails the texture just can't be shared.
+        if (!zTableInsert(&texture_contents, (unsigned int) hash, tex))
+            tex->content_hash = 0;
+
+        return FALSE;
+    }
+
+    if (fs_printdiskload)
+        zDebug("Texture \"%s\" is identical to \"%s\", sharing it.", tex->name, found->name);
+
+    // Drop the placeholder, the alias won't be drawn with itself.
+    if (tex->array) zFreeTextureLayer(tex->array, tex->layer);
+    tex->array = NULL;
+
+    glDeleteTextures(1, &(tex->gltexname));
+    tex->gltexname = 0;
+
+    tex->content_hash = hash;
+    tex->alias = found;
+    found->refcount++;
+
+    return TRUE;
+}
+
+
+
+// Count the textures that share another texture's image and the bytes that saves.
+void zTextureDedupStats(unsigned int *count, size_t *saved)
+{
+    unsigned int i;
+    ZTexture *tex;
+
+    *count = 0;
+    *saved = 0;
+
+    for (i = 0; i < textures.size; i++) {
+        if ( (tex = textures.items[i]) && tex->alias ) {
+            (*count)++;
+            *saved += tex->alias->size;
         }
     }
 }
 
 
 
+// Returns the total size of all textures in bytes.
+size_t zGetTextureBytes(void)
+{
+    return texture_bytes;
+}
+
 
+
+static int zCompareLastUsed(const void *a, const void *b)
+{
+    const ZTexture *ta = *(const ZTexture **) a, *tb = *(const ZTexture **) b;
+
+    if (ta->last_used < tb->last_used) return -1;
+    if (ta->last_used > tb->last_used) return 1;
+    return 0;
+}
+
+
+
+// Evict the least recently used textures until the total is back within r_texbudget. Textures used
+// in the last couple of frames are left alone, evicting those would just have them reloaded right
+// away. Should be called once per frame.
+void zEnforceTextureBudget(void)
+{
+    static int warned;
+    size_t budget = (size_t) r_texbudget * 1024 * 1024;
+    ZTexture **candidates, *cur;
+    unsigned int i;
+    int num = 0;
+
+    if (!r_texbudget || texture_bytes <= budget) {
+        warned = 0;
+        return;
+    }
+
+    for (i = 0; i < textures.size; i++) {
+        cur = textures.items[i];
+        if (cur && cur->size && !cur->load && frame_count - cur->last_used > 1)
+            num++;
+    }
+
+    if (num && (candidates = malloc(num * sizeof(ZTexture *))) ) {
+
+        num = 0;
+
+        for (i = 0; i < textures.size; i++) {
+            cur = textures.items[i];
+            if (cur && cur->size && !cur->load && frame_count - cur->last_used > 1)
+                candidates[num++] = cur;
+        }
+
+        qsort(candidates, num, sizeof(ZTexture *), zCompareLastUsed);
+
+        for (i = 0; i < (unsigned int) num && texture_bytes > budget; i++)
+            zEvictTexture(candidates[i]);
+
+        free(candidates);
+    }
+
+    if (texture_bytes > budget && !warned) {
+        zWarning("Textures in use take up %u MB, which is more than r_texbudget allows.",
+            (unsigned int) (texture_bytes / (1024*1024)));
+        warned = 1;
+    }
+}
@@ -19,31 +19,75 @@
 #define Z_TEX_FILTER_NEAREST    1
 #define Z_TEX_FILTER_LINEAR     2
 
+// Texture flags, passed to zLookupTexture.
+#define Z_TEX_NORMALMAP 1 // Texture is a normal map, affects how it's compressed.
+#define Z_TEX_COLOR     2 // Texture holds sRGB colors (a diffuse map), so mipmaps are filtered in
+                          // linear light. Other maps hold data and are filtered as-is.
+
+// The GLEW headers bundled for vc9 predate ARB_sampler_objects, builds against those always set
+// texture parameters on the textures themselves.
+#ifdef GL_ARB_sampler_objects
+    #define Z_SAMPLER_OBJECTS GLEW_ARB_sampler_objects
+#else
+    #define Z_SAMPLER_OBJECTS 0
+#endif
+
 
 typedef struct ZTexture
 {
-    char name[Z_RESOURCE_NAME_SIZE];
+    const char *name; // Interned, see intern.h.
 
     GLuint gltexname; // If this is 0, the texture was not yet uploaded.
 
+    unsigned int flags; // Z_TEX_* flags the texture was loaded with.
+
+    GLenum format; // Internal format the texture was (or will be, while loading) uploaded with.
+
+    struct ZTextureLoad *load; // Background load in progress, NULL once done.
+
+    unsigned int size;      // Bytes of texture data uploaded so far (not counting the placeholder).
+    unsigned int last_used; // Value of frame_count when the texture was last bound for drawing.
+    int evicted;            // Set if the texture data was dropped to stay within r_texbudget.
+
+    // Number of resident materials using the texture, and the value of sceneload_count when that
+    // last dropped to 0. Unused textures are deleted by zCollectTextures.
+    int refcount;
+    unsigned int released;
+
+    // Array and layer holding the texture when texture arrays are used (see texarray.c), gltexname
+    // is 0 then.
+    struct ZTextureArray *array;
+    int layer;
+
+    // Hash of the loaded image data, 0 until the first load is done. If r_dedup is set and another
+    // texture turns out to have identical data, alias points to it and this texture has no image of
+    // its own, materials using it draw with alias instead (see zDedupTexture).
+    unsigned long long content_hash;
+    struct ZTexture *alias;
+
     // Currently set texture parameters, these are used to determine wether texture parameters need
     // to be changed when a material is made active.
     unsigned char wrap_mode;
     unsigned char min_filter;
     unsigned char mag_filter;
 
-    struct ZTexture *next;
-
 } ZTexture;
 
 
 
+// All names in a material are interned (see intern.h), and are empty strings when not set.
 typedef struct ZMaterial
 {
-    char name[Z_RESOURCE_NAME_SIZE];
+    const char *name;
 
     int is_resident;
 
+    // Number of mesh groups using the material, and the value of sceneload_count when that last
+    // dropped to 0. Unused materials are made non-resident by zCollectMaterials, which releases
+    // their textures and shader program.
+    int refcount;
+    unsigned int released;
+
     // Material flags
     unsigned int flags;
 
@@ -60,26 +104,45 @@ typedef struct ZMaterial
     unsigned char wrap_mode;
     unsigned char min_filter;
     unsigned char mag_filter;
-    char diffuse_map_name[Z_RESOURCE_NAME_SIZE];
-    char normal_map_name[Z_RESOURCE_NAME_SIZE];
-    char specular_map_name[Z_RESOURCE_NAME_SIZE];
+    const char *diffuse_map_name;
+    const char *normal_map_name;
+    const char *specular_map_name;
+    const char *virtual_map_name; // Image for a virtual texture, see vtexture.h.
 
     // Pointers to loaded texture maps.
     ZTexture *diffuse_map;
     ZTexture *normal_map;
     ZTexture *specular_map;
+    ZVirtualTexture *virtual_map;
 
     // Shaders
-    char vertex_shader[Z_RESOURCE_NAME_SIZE];
-    char fragment_shader[Z_RESOURCE_NAME_SIZE];
+    const char *vertex_shader;
+    const char *fragment_shader;
     ZShaderProgram *program;
 
-    struct ZMaterial *next;
+    struct ZMaterial *next; // Next in the list of materials local to a mesh, or in a library.
 
 } ZMaterial;
 
 
 
+// Materials defined by a material library file (like the .mtl files of .obj models). Each library
+// is parsed once and its materials are shared by all meshes referencing it. Libraries are kept
+// until none of their materials has been used for r_retainscenes scene loads.
+typedef struct ZMaterialLib
+{
+    const char *key; // Interned, identifies the file and whatever else affected parsing it.
+
+    // Interned texture name prefix in effect once the library was parsed, so reusing the library
+    // has the same effect on the materials that follow it.
+    const char *tex_prefix;
+
+    ZMaterial *materials; // Linked through next, most recently defined first.
+
+} ZMaterialLib;
+
+
+
 extern ZMaterial default_material;
 
 
@@ -100,6 +163,8 @@ void zMakeMaterialResident(ZMaterial *mat);
 
 void zMakeMaterialNonResident(ZMaterial *mat, void *ignored);
 
+void zQueueMaterialShaders(ZMaterial *mat, void *ignored);
+
 void zMakeMaterialActive(ZMaterial *mat);
 
 ZMaterial *zNewMaterial(void);
@@ -110,9 +175,19 @@ void zDeleteMaterial(ZMaterial *mat);
 
 void zResetMaterialState(void);
 
+void zReleaseMaterial(ZMaterial *mat);
+
+int zCollectMaterials(int force);
+
+ZMaterialLib *zLookupMaterialLib(const char *key);
+
+ZMaterialLib *zAddMaterialLib(const char *key, ZMaterial *materials, const char *tex_prefix);
+
+unsigned int zMaterialLibCount(void);
 
 
-ZTexture *zLookupTexture(const char *name);
+
+ZTexture *zLookupTexture(const char *name, unsigned int flags);
 
 void zDeleteTexture(ZTexture *tex);
 
@@ -120,4 +195,16 @@ void zDeleteTextures(void);
 
 void zIterTextures(void (*iter)(ZTexture *, void *), void *data);
 
+void zAddTextureSize(ZTexture *tex, unsigned int size);
+
+int zDedupTexture(ZTexture *tex, unsigned long long hash);
+
+void zTextureDedupStats(unsigned int *count, size_t *saved);
+
+size_t zGetTextureBytes(void);
+
+void zEnforceTextureBudget(void);
+
+int zCollectTextures(int force);
+
 #endif
@@ -1,17 +1,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#ifndef WIN32
-    #include <strings.h>
-#endif
 #include <assert.h>
+#include <math.h>
 #include <GL/glew.h>
 
 #include "common.h"
 
-#define Z_MESH_HASH_SIZE 512
+static ZTable meshes; // Keyed on the interned mesh names.
 
-static ZMesh *meshes[Z_MESH_HASH_SIZE];
+static ZTable mesh_contents; // Meshes others may share data with, keyed on their content hashes.
+
+// Scratch arrays used to build the list of visible cluster ranges for glMultiDraw*.
+static GLsizei *cull_counts;
+static GLint *cull_firsts;
+static const GLvoid **cull_offsets;
+static unsigned int cull_size;
+
+static void zBuildMeshData(ZMesh *mesh, unsigned int load_flags);
 
 
 
@@ -25,44 +31,68 @@ void zMeshDeinit(void)
 {
     // Make meshes non-resident
     zIterMeshes(zMakeMeshNonResident, NULL);
+
+    free(cull_counts);
+    free(cull_firsts);
+    free(cull_offsets);
+    cull_counts  = NULL;
+    cull_firsts  = NULL;
+    cull_offsets = NULL;
+    cull_size    = 0;
 }
 
 
 
-// Add mesh to hash table.
-static void zAddMeshToHashTable(ZMesh *mesh)
+// Returns pointer to position of the i-th vertex in the mesh's vertex array. The position is always
+// the last component of the interleaved vertex formats.
+static inline ZVec3 *zMeshVertexPos(ZMesh *mesh, unsigned int i)
 {
-    unsigned int i;
+    return (ZVec3 *) (mesh->vertices + i*mesh->elem_size + (mesh->elem_size - 3));
+}
+
 
-    assert(mesh->next == NULL);
 
-    i = zHashString(mesh->name, Z_MESH_HASH_SIZE);
-    mesh->next = meshes[i];
-    meshes[i] = mesh;
+// Same as above, but for the vertex referenced by index/vertex offset i (so that it goes through
+// the index array for indexed meshes).
+static inline ZVec3 *zMeshElemPos(ZMesh *mesh, unsigned int i)
+{
+    if (mesh->flags & Z_MESH_VA_INDEXED)
+        return zMeshVertexPos(mesh, mesh->indices[i]);
+    else
+        return zMeshVertexPos(mesh, i);
 }
 
 
 
-// Create and upload VBOs.
-static void zMeshMakeResident(ZMesh *mesh)
+static int zMatchMesh(const void *item, const void *key)
 {
-    assert(mesh->vertices);
+    return ((const ZMesh *) item)->name == key;
+}
+
+
+
+// Create VBOs for mesh and upload the given arrays to them, which are either the mesh's own or
+// mapped from the mesh cache.
+static void zUploadMeshData(ZMesh *mesh, const float *vertices, const unsigned int *indices,
+                            const float *tangents)
+{
+    assert(vertices);
 
     // Setup VBOs and upload vertex data
     glGenBuffersARB(1, &(mesh->vertex_vbo_name));
     glBindBufferARB(GL_ARRAY_BUFFER, mesh->vertex_vbo_name);
     glBufferDataARB(GL_ARRAY_BUFFER, mesh->num_vertices * mesh->elem_size * sizeof(float),
-        mesh->vertices, GL_STATIC_DRAW);
+        vertices, GL_STATIC_DRAW);
     glBindBufferARB(GL_ARRAY_BUFFER, 0);
 
     if (mesh->flags & Z_MESH_VA_INDEXED) {
 
-        assert(mesh->indices);
+        assert(indices);
 
         glGenBuffersARB(1, &(mesh->index_vbo_name));
         glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, mesh->index_vbo_name);
         glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, mesh->num_indices * sizeof(unsigned int),
-            mesh->indices, GL_STATIC_DRAW);
+            indices, GL_STATIC_DRAW);
         glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, 0);
     }
 
@@ -70,22 +100,127 @@ static void zMeshMakeResident(ZMesh *mesh)
     if (mesh->flags & (Z_MESH_HAS_TANGENTS|Z_MESH_HAS_BITANGENTS)) {
 
         assert(mesh->flags & Z_MESH_HAS_TANGENTS);
-        assert(mesh->tangents);
+        assert(tangents);
 
         glGenBuffersARB(1, &(mesh->tangent_vbo_name));
         glBindBufferARB(GL_ARRAY_BUFFER, mesh->tangent_vbo_name);
-        if (mesh->flags & Z_MESH_HAS_BITANGENTS) {
-            glBufferDataARB(GL_ARRAY_BUFFER, mesh->num_vertices * sizeof(ZTangentTB),
-                mesh->tangents, GL_STATIC_DRAW);
-        } else {
-            glBufferDataARB(GL_ARRAY_BUFFER, mesh->num_vertices * sizeof(ZTangentT),
-                mesh->tangents, GL_STATIC_DRAW);
-        }
+        glBufferDataARB(GL_ARRAY_BUFFER, zMeshTangentsSize(mesh), tangents, GL_STATIC_DRAW);
         glBindBufferARB(GL_ARRAY_BUFFER, 0);
     }
+}
+
+
+
+// Free the in-memory copy of the data of mesh now that the mesh cache has it (see
+// zQueueMeshCacheSave). Meshes sharing the data lose their pointers to it as well.
+void zDropMeshData(ZMesh *mesh)
+{
+    ZMesh *sharer;
+
+    assert(!mesh->shared && !mesh->cache_save);
+
+    for (sharer = mesh->sharers; sharer; sharer = sharer->next_sharer) {
+        sharer->vertices = sharer->tangents = NULL;
+        sharer->indices = NULL;
+    }
+
+    free(mesh->vertices);
+    free(mesh->indices);
+    free(mesh->tangents);
+
+    mesh->vertices = mesh->tangents = NULL;
+    mesh->indices = NULL;
+    mesh->vertices_size = mesh->indices_size = 0;
+}
+
+
+
+// Read the source file of mesh again and redo the setup steps that shape its data, for when its
+// mesh cache entry has gone missing after zDropMeshData. Takes the data if it comes out the same as
+// what was dropped, returns FALSE if it doesn't.
+static int zRereadMeshData(ZMesh *mesh)
+{
+    ZMesh *read;
+    int same;
+
+    if ( !(read = zReadMesh(mesh->name, mesh->load_flags)) )
+        return FALSE;
+
+    zBuildMeshData(read, mesh->load_flags);
+
+    same = read->flags == mesh->flags && read->elem_size == mesh->elem_size &&
+           read->num_vertices == mesh->num_vertices && read->num_indices == mesh->num_indices &&
+           zHashMeshData(read, read->vertices, read->indices, read->tangents) ==
+               mesh->content_hash;
+
+    if (same) {
+        mesh->vertices      = read->vertices;
+        mesh->indices       = read->indices;
+        mesh->tangents      = read->tangents;
+        mesh->vertices_size = read->vertices_size;
+        mesh->indices_size  = read->indices_size;
+
+        read->vertices = read->tangents = NULL;
+        read->indices = NULL;
+    }
+
+    zDeleteReadMesh(read);
+
+    return same;
+}
+
+
+
+// Create and upload VBOs. If the data of mesh was dropped after an earlier upload, it is mapped in
+// from the mesh cache, or read from the source file again if that fails.
+void zMeshMakeResident(ZMesh *mesh)
+{
+    ZMeshData data;
+
+    // Meshes sharing data use the VBOs of the mesh they share with.
+    if (mesh->shared) {
+
+        if (!mesh->shared->is_resident) zMeshMakeResident(mesh->shared);
+
+        // The data is gone for good if the mesh I share with couldn't get it back.
+        if (!mesh->shared->is_resident) {
+            mesh->num_vertices = mesh->num_indices = 0;
+            return;
+        }
+
+        mesh->vertex_vbo_name  = mesh->shared->vertex_vbo_name;
+        mesh->index_vbo_name   = mesh->shared->index_vbo_name;
+        mesh->tangent_vbo_name = mesh->shared->tangent_vbo_name;
+        mesh->is_resident = 1;
+        return;
+    }
+
+    if (mesh->vertices) {
+
+        zUploadMeshData(mesh, mesh->vertices, mesh->indices, mesh->tangents);
+
+    } else if (zMapCachedMesh(mesh, &data)) {
 
+        if (fs_printdiskload) zDebug("Restoring mesh \"%s\" from the mesh cache.", mesh->name);
+
+        zUploadMeshData(mesh, data.vertices, data.indices, data.tangents);
+        zUnmapCachedMesh(&data);
+
+    } else if (zRereadMeshData(mesh)) {
+
+        zUploadMeshData(mesh, mesh->vertices, mesh->indices, mesh->tangents);
+
+    } else {
+        // Leave it empty, like a mesh that failed to load, so this isn't tried every frame.
+        zWarning("Failed to restore the data of mesh \"%s\", leaving it empty.", mesh->name);
+        mesh->num_vertices = mesh->num_indices = 0;
+        return;
+    }
 
     mesh->is_resident = 1;
+
+    // The data is dropped once a worker has written it to the mesh cache, see zUpdateMeshCache.
+    if (r_meshdropdata && mesh->vertices && !mesh->cache_save) zQueueMeshCacheSave(mesh);
 }
 
 
@@ -202,39 +337,465 @@ void zBuildTangentArray(ZMesh *mesh, int bitangent)
 
 
 
-ZMesh *zLoadMeshObj(const char *filename, unsigned int load_flags);
-ZMesh *zLoadMeshPly(const char *filename, unsigned int load_flags);
+// Calculate bounding sphere for the whole mesh.
+static void zCalcMeshBounds(ZMesh *mesh)
+{
+    unsigned int i;
+    ZVec3 min, max, d, *p;
+    float r;
 
-// Load mesh.
-static ZMesh *zLoadMesh(const char *name, unsigned int load_flags)
+    mesh->radius = 0.0f;
+    zSetFloat3(&mesh->center, 0.0f, 0.0f, 0.0f);
+
+    if (!mesh->num_vertices) return;
+
+    min = max = *zMeshVertexPos(mesh, 0);
+
+    for (i = 1; i < mesh->num_vertices; i++) {
+        p = zMeshVertexPos(mesh, i);
+        if (p->x < min.x) min.x = p->x;
+        if (p->y < min.y) min.y = p->y;
+        if (p->z < min.z) min.z = p->z;
+        if (p->x > max.x) max.x = p->x;
+        if (p->y > max.y) max.y = p->y;
+        if (p->z > max.z) max.z = p->z;
+    }
+
+    zSetFloat3(&mesh->center, (min.x+max.x)*0.5f, (min.y+max.y)*0.5f, (min.z+max.z)*0.5f);
+
+    for (i = 0; i < mesh->num_vertices; i++) {
+        zSubtractVec3r(&d, zMeshVertexPos(mesh, i), &mesh->center);
+        if ( (r = zLength3(&d)) > mesh->radius) mesh->radius = r;
+    }
+}
+
+
+
+// Calculate bounding sphere and normal cone for the triangles in cluster.
+static void zCalcClusterBounds(ZMesh *mesh, ZMeshCluster *cluster)
 {
-    ZMesh *mesh;
-    char *ext = zGetFileExtension(name);
-    const char *realpath = zGetPath(name, NULL, Z_FILE_REWRITE_DIRSEP | Z_FILE_TRYUSER);
+    unsigned int i, end = cluster->start + cluster->count;
+    ZVec3 min, max, d, e1, e2, n, *p;
+    float r, mindp = 1.0f;
+
+    zSetFloat3(&cluster->cone_axis, 0.0f, 0.0f, 0.0f);
+    cluster->cone_cutoff = 1.0f;
+    cluster->radius = 0.0f;
+
+    min = max = *zMeshElemPos(mesh, cluster->start);
+
+    for (i = cluster->start; i < end; i++) {
+        p = zMeshElemPos(mesh, i);
+        if (p->x < min.x) min.x = p->x;
+        if (p->y < min.y) min.y = p->y;
+        if (p->z < min.z) min.z = p->z;
+        if (p->x > max.x) max.x = p->x;
+        if (p->y > max.y) max.y = p->y;
+        if (p->z > max.z) max.z = p->z;
+    }
 
-    if (fs_printdiskload) zDebug("Loading mesh \"%s\" from disk.", name);
+    zSetFloat3(&cluster->center, (min.x+max.x)*0.5f, (min.y+max.y)*0.5f, (min.z+max.z)*0.5f);
 
-    if (strlen(name) >= Z_RESOURCE_NAME_SIZE) {
-        zError("Mesh name \"%s\" exceeds RESOURCE_NAME_SIZE, not loading.", name);
-        return NULL;
+    for (i = cluster->start; i < end; i++) {
+        zSubtractVec3r(&d, zMeshElemPos(mesh, i), &cluster->center);
+        if ( (r = zLength3(&d)) > cluster->radius) cluster->radius = r;
+    }
+
+    // The cone axis is the average of the (unit) triangle normals, the cutoff is derived from the
+    // normal that deviates the most from it. I do two passes over the triangles for this.
+    for (i = cluster->start; i+2 < end; i += 3) {
+        zSubtractVec3r(&e1, zMeshElemPos(mesh, i+1), zMeshElemPos(mesh, i));
+        zSubtractVec3r(&e2, zMeshElemPos(mesh, i+2), zMeshElemPos(mesh, i));
+        n = zCross3(&e1, &e2);
+        if (zLength3(&n) > 0.0f) {
+            zNormalize3(&n);
+            zAddVec3(&cluster->cone_axis, &n);
+        }
+    }
+
+    if (zLength3(&cluster->cone_axis) < 0.0001f)
+        return;
+
+    zNormalize3(&cluster->cone_axis);
+
+    for (i = cluster->start; i+2 < end; i += 3) {
+        zSubtractVec3r(&e1, zMeshElemPos(mesh, i+1), zMeshElemPos(mesh, i));
+        zSubtractVec3r(&e2, zMeshElemPos(mesh, i+2), zMeshElemPos(mesh, i));
+        n = zCross3(&e1, &e2);
+        if (zLength3(&n) > 0.0f) {
+            zNormalize3(&n);
+            if ( (r = zDot3(&n, &cluster->cone_axis)) < mindp) mindp = r;
+        }
+    }
+
+    // If the normals are spread out too much, the cone would be useless (or invalid, if they span
+    // more than a hemisphere), so leave the cutoff at 1 to disable backface culling.
+    if (mindp > 0.1f)
+        cluster->cone_cutoff = sqrtf(1.0f - mindp*mindp);
+}
+
+
+
+// Split the groups of mesh into clusters of at most Z_MESH_CLUSTER_SIZE triangles and calculate
+// their bounds and normal cones, also calculates bounds for the mesh as a whole. Clusters never
+// straddle groups, and if breaks is given (a sorted list of index/vertex offsets where the loader
+// found an object or group boundary) they won't straddle those either, which keeps clusters
+// spatially coherent. Returns FALSE on failure, in which case the mesh is drawn without per-cluster
+// culling.
+int zBuildMeshClusters(ZMesh *mesh, const unsigned int *breaks, unsigned int num_breaks)
+{
+    unsigned int i, b = 0, total = num_breaks, start, end, next;
+    const unsigned int maxcount = Z_MESH_CLUSTER_SIZE*3;
+
+    assert(mesh->vertices);
+
+    zCalcMeshBounds(mesh);
+
+    free(mesh->clusters);
+    mesh->clusters = NULL;
+    mesh->num_clusters = 0;
+
+    // Every break splits off at most one additional cluster, so this gives me an upper bound.
+    for (i = 0; i < mesh->num_groups; i++)
+        total += (mesh->groups[i].count + maxcount - 1) / maxcount;
+
+    if (!total) return TRUE;
+
+    if ( !(mesh->clusters = malloc(total * sizeof(ZMeshCluster))) ) {
+        zWarning("Failed to allocate memory for clusters of mesh \"%s\".", mesh->name);
+        return FALSE;
+    }
+
+    for (i = 0; i < mesh->num_groups; i++) {
+
+        ZMeshGroup *group = &(mesh->groups[i]);
+
+        start = group->start;
+        end = group->start + group->count;
+
+        group->first_cluster = mesh->num_clusters;
+        group->num_clusters = 0;
+
+        // Skip over breaks that lie before (or right at the start of) this group.
+        while (b < num_breaks && breaks[b] <= start) b++;
+
+        while (start < end) {
+
+            next = start + maxcount < end ? start + maxcount : end;
+
+            if (b < num_breaks && breaks[b] < next)
+                next = breaks[b++];
+
+            assert(mesh->num_clusters < total);
+
+            mesh->clusters[mesh->num_clusters].start = start;
+            mesh->clusters[mesh->num_clusters].count = next - start;
+            zCalcClusterBounds(mesh, &(mesh->clusters[mesh->num_clusters]));
+
+            mesh->num_clusters++;
+            group->num_clusters++;
+            start = next;
+        }
+    }
+
+    return TRUE;
+}
+
+
+
+// Reorder the groups of mesh so groups using the same material end up next to each other, and merge
+// them into one group. Each material is then only made active once when the mesh is drawn. Clusters
+// move along with their groups. Returns FALSE if memory ran out, the mesh is left unchanged then.
+int zMergeMeshGroups(ZMesh *mesh)
+{
+    unsigned int i, j, n = 0, pos = 0, num_clusters = 0, num_groups = 0, stride, tstride = 0;
+    unsigned int *order;
+    unsigned char *placed;
+    ZMeshGroup *groups = NULL, *group, *merged;
+    ZMeshCluster *clusters = NULL;
+    unsigned int *indices = NULL;
+    float *vertices = NULL, *tangents = NULL;
+    int indexed = (mesh->flags & Z_MESH_VA_INDEXED) != 0;
+
+    if (mesh->num_groups < 2) return TRUE;
+
+    order = malloc(mesh->num_groups * sizeof(unsigned int));
+    placed = calloc(mesh->num_groups, 1);
+
+    if (!order || !placed) {
+        zError("%s: Failed to allocate memory while merging groups of mesh \"%s\".", __func__,
+            mesh->name);
+        free(order);
+        free(placed);
+        return FALSE;
+    }
+
+    // Order groups by the first group that uses their material, keeping the original order
+    // otherwise.
+
+    for (i = 0; i < mesh->num_groups; i++) {
+        for (j = i; j < mesh->num_groups && !placed[i]; j++) {
+            if (!placed[j] && mesh->groups[j].material == mesh->groups[i].material) {
+                order[n++] = j;
+                placed[j] = 1;
+            }
+        }
+    }
+
+    // Nothing to do if every group already has a different material than the one before it.
+    for (i = 1; i < n && (order[i] == i && mesh->groups[i].material != mesh->groups[i-1].material);
+         i++);
+
+    free(placed);
+
+    if (i >= n) {
+        free(order);
+        return TRUE;
     }
 
-    if (strcasecmp(ext, "obj") == 0) {
-        mesh = zLoadMeshObj(realpath, load_flags);
-    } else if (strcasecmp(ext, "ply") == 0) {
-        mesh = zLoadMeshPly(realpath, load_flags);
+    stride = indexed ? 1 : mesh->elem_size;
+    if (!indexed && mesh->tangents)
+        tstride = (mesh->flags & Z_MESH_HAS_BITANGENTS) ? 6 : 3;
+
+    if (indexed)
+        indices = malloc(mesh->num_indices * sizeof(unsigned int));
+    else
+        vertices = malloc(mesh->num_vertices * stride * sizeof(float));
+
+    if (tstride)
+        tangents = malloc(mesh->num_vertices * tstride * sizeof(float));
+    if (mesh->clusters)
+        clusters = malloc(mesh->num_clusters * sizeof(ZMeshCluster));
+
+    // There can't be more merged groups than original ones, the array is shrunk to fit afterwards.
+    groups = malloc(mesh->num_groups * sizeof(ZMeshGroup));
+
+    if ( (indexed ? !indices : !vertices) || (tstride && !tangents) ||
+         (mesh->clusters && !clusters) || !groups ) {
+        zError("%s: Failed to allocate memory while merging groups of mesh \"%s\".", __func__,
+            mesh->name);
+        free(order);
+        free(indices);
+        free(vertices);
+        free(tangents);
+        free(clusters);
+        free(groups);
+        return FALSE;
+    }
+
+    for (i = 0; i < n; i++) {
+
+        group = &(mesh->groups[order[i]]);
+
+        // Copy the group's indices (or vertices) and clusters to their new position.
+        if (indexed) {
+            memcpy(indices + pos, mesh->indices + group->start,
+                group->count * sizeof(unsigned int));
+        } else {
+            memcpy(vertices + pos*stride, mesh->vertices + group->start*stride,
+                group->count * stride * sizeof(float));
+            if (tstride)
+                memcpy(tangents + pos*tstride, mesh->tangents + group->start*tstride,
+                    group->count * tstride * sizeof(float));
+        }
+
+        if (clusters) {
+            for (j = 0; j < group->num_clusters; j++) {
+                clusters[num_clusters + j] = mesh->clusters[group->first_cluster + j];
+                clusters[num_clusters + j].start = clusters[num_clusters + j].start - group->start +
+                                                   pos;
+            }
+        }
+
+        // Either extend the previous group or start a new one.
+        merged = num_groups ? &(groups[num_groups-1]) : NULL;
+
+        if (merged && merged->material == group->material) {
+            merged->count += group->count;
+            merged->num_clusters += group->num_clusters;
+        } else {
+            merged = &(groups[num_groups++]);
+            merged->material      = group->material;
+            merged->start         = pos;
+            merged->count         = group->count;
+            merged->first_cluster = num_clusters;
+            merged->num_clusters  = group->num_clusters;
+        }
+
+        pos += group->count;
+        if (clusters) num_clusters += group->num_clusters;
+    }
+
+    zDebug("Merged %u groups of mesh \"%s\" into %u.", mesh->num_groups, mesh->name, num_groups);
+
+    if (indexed) {
+        free(mesh->indices);
+        mesh->indices = indices;
     } else {
-        zError("Unable to determine model format for \"%s\"", name);
-        return NULL;
+        free(mesh->vertices);
+        mesh->vertices = vertices;
+        if (tstride) {
+            free(mesh->tangents);
+            mesh->tangents = tangents;
+        }
+    }
+
+    if (clusters) {
+        free(mesh->clusters);
+        mesh->clusters = clusters;
+    }
+
+    free(order);
+    free(mesh->groups);
+
+    // Shrinking shouldn't fail, but if it does the bigger array will do just as well.
+    if ( (merged = realloc(groups, num_groups * sizeof(ZMeshGroup))) )
+        groups = merged;
+
+    mesh->groups = groups;
+    mesh->num_groups = num_groups;
+
+    return TRUE;
+}
+
+
+
+// Size of the tangent array of mesh in bytes, also if it was dropped (see zDropMeshData).
+size_t zMeshTangentsSize(const ZMesh *mesh)
+{
+    if (!(mesh->flags & Z_MESH_HAS_TANGENTS)) return 0;
+
+    return mesh->num_vertices *
+           ((mesh->flags & Z_MESH_HAS_BITANGENTS) ? sizeof(ZTangentTB) : sizeof(ZTangentT));
+}
+
+
+
+// Size of the data that mesh can share with others, in bytes.
+static size_t zMeshDataSize(const ZMesh *mesh)
+{
+    return mesh->num_vertices * mesh->elem_size * sizeof(float) +
+           mesh->num_indices * sizeof(unsigned int) + zMeshTangentsSize(mesh);
+}
+
+
+
+// Hash vertex, index and tangent arrays laid out as described by mesh (which need not be its own,
+// see zMapCachedMesh). Never returns 0, so that can mean "not hashed" in ZMesh.content_hash.
+unsigned long long zHashMeshData(const ZMesh *mesh, const float *vertices,
+                                 const unsigned int *indices, const float *tangents)
+{
+    unsigned int header[4];
+    unsigned long long hash;
+
+    header[0] = mesh->flags;
+    header[1] = mesh->elem_size;
+    header[2] = mesh->num_vertices;
+    header[3] = mesh->num_indices;
+
+    hash = zHashBlock(0, header, sizeof(header));
+    hash = zHashBlock(hash, vertices, mesh->num_vertices * mesh->elem_size * sizeof(float));
+    if (indices && (mesh->flags & Z_MESH_VA_INDEXED))
+        hash = zHashBlock(hash, indices, mesh->num_indices * sizeof(unsigned int));
+    if (tangents)
+        hash = zHashBlock(hash, tangents, zMeshTangentsSize(mesh));
+
+    return hash ? hash : 1;
+}
+
+
+
+static int zMatchMeshContent(const void *item, const void *key)
+{
+    const ZMesh *a = item, *b = key;
+
+    // Data that was dropped after uploading can't be compared, or shared.
+    if (!a->vertices) return FALSE;
+
+    // The hash is only used to find candidates, data is compared for real before sharing it.
+    return a->content_hash == b->content_hash &&
+           a->flags == b->flags && a->elem_size == b->elem_size &&
+           a->num_vertices == b->num_vertices && a->num_indices == b->num_indices &&
+           (a->tangents != NULL) == (b->tangents != NULL) &&
+           memcmp(a->vertices, b->vertices, a->num_vertices * a->elem_size * sizeof(float)) == 0 &&
+           (!a->num_indices ||
+            memcmp(a->indices, b->indices, a->num_indices * sizeof(unsigned int)) == 0) &&
+           (!a->tangents || memcmp(a->tangents, b->tangents, zMeshTangentsSize(a)) == 0);
+}
+
+
+
+// Hash the vertex data of a freshly loaded mesh, and if an already loaded mesh has identical data,
+// drop the mesh's own copy and share that one instead. Meshes copied around under different names
+// then only take up memory (and VBOs) once.
+static void zDedupMesh(ZMesh *mesh)
+{
+    ZMesh *found;
+
+    assert(!mesh->is_resident && !mesh->shared);
+
+    mesh->content_hash = zHashMeshData(mesh, mesh->vertices, mesh->indices, mesh->tangents);
+
+    found = zTableFind(&mesh_contents, (unsigned int) mesh->content_hash, zMatchMeshContent, mesh);
+
+    if (!found) {
+        // If this fails the mesh just can't be shared.
+        if (!zTableInsert(&mesh_contents, (unsigned int) mesh->content_hash, mesh))
+            mesh->content_hash = 0;
+        return;
     }
 
-    if (!mesh) return NULL;
+    if (fs_printdiskload)
+        zDebug("Mesh \"%s\" is identical to \"%s\", sharing its data.", mesh->name, found->name);
+
+    free(mesh->vertices);
+    free(mesh->indices);
+    free(mesh->tangents);
 
-    mesh->name[0] = '\0';
-    strcat(mesh->name, name);
+    mesh->vertices = found->vertices;
+    mesh->indices  = found->indices;
+    mesh->tangents = found->tangents;
 
-    mesh->next = NULL;
-    zAddMeshToHashTable(mesh);
+    // Hold on to found for as long as this mesh is around.
+    mesh->shared = found;
+    found->refcount++;
+
+    // So zDropMeshData can reach this mesh.
+    mesh->next_sharer = found->sharers;
+    found->sharers = mesh;
+}
+
+
+
+// Count the meshes that share another mesh's data and the bytes that saves (both in memory and in
+// VBOs).
+void zMeshDedupStats(unsigned int *count, size_t *saved)
+{
+    unsigned int i;
+    ZMesh *mesh;
+
+    *count = 0;
+    *saved = 0;
+
+    for (i = 0; i < meshes.size; i++) {
+        if ( (mesh = meshes.items[i]) && mesh->shared ) {
+            (*count)++;
+            *saved += zMeshDataSize(mesh);
+        }
+    }
+}
+
+
+
+// The setup steps that change the vertex, index and tangent data of mesh, fresh from zReadMesh:
+// pack its textures and build tangents. zRereadMeshData repeats these, and checks that the result
+// still matches (it won't if the r_texatlas settings changed in between).
+static void zBuildMeshData(ZMesh *mesh, unsigned int load_flags)
+{
+    // Pack small textures into shared atlases, so groups end up sharing materials and can be
+    // merged.
+    if (r_texatlas && mesh->num_groups > 1 && (mesh->flags & Z_MESH_HAS_TEXCOORDS))
+        zPackMeshTextures(mesh);
 
     // Calculate tangents if I need to, but check that they weren't already provided by the loader,
     if ( (load_flags & Z_MESH_LOAD_TANGENTS) ) {
@@ -249,71 +810,208 @@ static ZMesh *zLoadMesh(const char *name, unsigned int load_flags)
                     " normals.", mesh->name);
         }
     }
+}
 
-    // From now on I keep the local copy, needed anyway for when it needs to be reuploaded after the
-    // OpenGL context is recreated.
-    // XXX: If I ever uncomment this, add tangent stuff.
-#if 0
-    // Get rid of the local copy, if I really need to access the data in the buffer objects I can
-    // just map them with glMapBuffer.
-    // FIXME: I can't really free the data since the buffer object can get corrupted on
-    // glUnmapBuffer, so I need to keep a copy around so I can reinitialize the buffer.
-    free(mesh->vertices);
-    mesh->vertices = NULL;
 
-    if (mesh->flags & Z_MESH_VA_INDEXED) {
-        free(mesh->indices);
-        mesh->indices = NULL;
+
+// Add up the size of the vertex, index and tangent data of all meshes, split into what is kept in
+// memory and what was dropped after uploading (see r_meshdropdata). Shared data is counted once.
+void zMeshMemStats(size_t *in_memory, size_t *dropped, unsigned int *num_dropped)
+{
+    unsigned int i;
+    ZMesh *mesh;
+
+    *in_memory = 0;
+    *dropped = 0;
+    *num_dropped = 0;
+
+    for (i = 0; i < meshes.size; i++) {
+
+        if ( !(mesh = meshes.items[i]) || mesh->shared || !mesh->num_vertices )
+            continue;
+
+        if (mesh->vertices) {
+            *in_memory += zMeshDataSize(mesh);
+        } else {
+            *dropped += zMeshDataSize(mesh);
+            (*num_dropped)++;
+        }
+    }
+}
+
+
+
+// Get mesh, fresh from zReadMesh, ready for use: build its data (see zBuildMeshData), take
+// references to its materials and share its data with an identical mesh if there is one.
+static void zSetupMesh(ZMesh *mesh, unsigned int load_flags)
+{
+    unsigned int i;
+
+    zBuildMeshData(mesh, load_flags);
+
+    // Remembered in case the data needs to be read again, see zRereadMeshData.
+    mesh->load_flags = load_flags;
+
+    // Materials stay loaded as long as a mesh has groups using them, zDeleteMesh releases them.
+    for (i = 0; i < mesh->num_groups; i++) {
+        if (mesh->groups[i].material)
+            mesh->groups[i].material->refcount++;
+    }
+
+    if (r_dedup && mesh->num_vertices) zDedupMesh(mesh);
+
+    // The local copy of the data is kept for when it needs to be uploaded again after the OpenGL
+    // context is recreated, unless r_meshdropdata is set (see zDropMeshData).
+}
+
+
+
+// Load mesh, name should be interned.
+static ZMesh *zLoadMesh(const char *name, unsigned int load_flags)
+{
+    ZMesh *mesh;
+
+    if ( !(mesh = zReadMesh(name, load_flags)) )
+        return NULL;
+
+    mesh->released = sceneload_count;
+
+    zSetupMesh(mesh, load_flags);
+
+    if (!zTableInsert(&meshes, zHashPointer(name), mesh)) {
+        zDeleteMesh(mesh);
+        return NULL;
     }
-#endif
+
     return mesh;
 }
 
 
 
+// Move read, a mesh read in the background by zReadMesh, into placeholder mesh (see
+// zLookupMeshAsync), set it up and upload it. read itself is freed.
+void zFinishMeshLoad(ZMesh *mesh, ZMesh *read, unsigned int load_flags)
+{
+    assert(!mesh->num_vertices && !mesh->groups && !mesh->is_resident);
 
-// Lookup mesh with name in hash table.
-ZMesh *zLookupMesh(const char *name)
+    // Posables already point at the placeholder, so it keeps its identity.
+    read->name     = mesh->name;
+    read->refcount = mesh->refcount;
+    read->released = mesh->released;
+    read->load     = mesh->load;
+
+    *mesh = *read;
+    free(read);
+
+    zSetupMesh(mesh, load_flags);
+
+    if (renderer_active && mesh->num_vertices) {
+        zMeshMakeResident(mesh);
+        if (mesh->refcount) zQueueMeshShaders(mesh);
+    }
+}
+
+
+
+// Delete a mesh returned by zReadMesh that was never set up, and so holds no references to the
+// materials of its groups.
+void zDeleteReadMesh(ZMesh *mesh)
 {
     unsigned int i;
+
+    // zDeleteMesh releases them.
+    for (i = 0; i < mesh->num_groups; i++) {
+        if (mesh->groups[i].material)
+            mesh->groups[i].material->refcount++;
+    }
+
+    zDeleteMesh(mesh);
+}
+
+
+
+// Lookup mesh by (interned) name, loading it if it isn't loaded yet.
+ZMesh *zLookupMesh(const char *name)
+{
     ZMesh *cur;
 
     assert(name);
     assert(strlen(name) > 0);
 
     // See if it is already loaded.
-    i = zHashString(name, Z_MESH_HASH_SIZE);
-    cur = meshes[i];
+    if ( (cur = zTableFind(&meshes, zHashPointer(name), zMatchMesh, name)) )
+        return cur;
+
+    // Not found, so load it.
+    // FIXME: Make a toggle for loading with index/noindex?
+    return zLoadMesh(name, Z_MESH_LOAD_TANGENTS);
+}
+
+
+
+// Same as zLookupMesh, but if the mesh isn't loaded yet, this returns an empty placeholder right
+// away and loads the mesh into it in the background (see meshload.h). The mesh may still be
+// loading if it was looked up before, zMeshReady tells if it can be drawn.
+ZMesh *zLookupMeshAsync(const char *name)
+{
+    ZMesh *mesh;
 
-    while (cur != NULL) {
+    assert(name);
+    assert(strlen(name) > 0);
 
-        if ( strcmp(cur->name, name) == 0)
-            return cur;
+    if ( (mesh = zTableFind(&meshes, zHashPointer(name), zMatchMesh, name)) )
+        return mesh;
 
-        cur = cur->next;
+    if ( !(mesh = calloc(1, sizeof(ZMesh))) ) {
+        zError("%s: Failed to allocate memory for mesh \"%s\".", __func__, name);
+        return NULL;
     }
 
-    // Not found, so load it.
-    // FIXME: Make a toggle for loading with index/noindex?
-    return zLoadMesh(name, Z_MESH_LOAD_TANGENTS);
+    mesh->name = name;
+    mesh->released = sceneload_count;
+
+    if (!zTableInsert(&meshes, zHashPointer(name), mesh)) {
+        free(mesh);
+        return NULL;
+    }
+
+    zQueueMeshLoad(mesh, Z_MESH_LOAD_TANGENTS);
+
+    return mesh;
 }
 
 
 
-// Iterate over all the meshes in hash table and call iter for each.
-void zIterMeshes(void (*iter)(ZMesh *, void *), void *data)
+// Returns TRUE if mesh has something to draw, which isn't the case while it is loading in the
+// background (or if that failed).
+int zMeshReady(const ZMesh *mesh)
 {
-    int i;
-    ZMesh *cur;
+    return !mesh->load && mesh->num_vertices;
+}
 
-    for (i = 0; i < Z_MESH_HASH_SIZE; i++) {
 
-        cur = meshes[i];
 
-        while (cur != NULL) {
-            iter(cur, data);
-            cur = cur->next;
-        }
+// Queue shader programs for all materials used by mesh, see zQueueMaterialShaders.
+void zQueueMeshShaders(ZMesh *mesh)
+{
+    unsigned int i;
+
+    for (i = 0; i < mesh->num_groups; i++) {
+        if (mesh->groups[i].material)
+            zQueueMaterialShaders(mesh->groups[i].material, NULL);
+    }
+}
+
+
+
+// Iterate over all the meshes in hash table and call iter for each.
+void zIterMeshes(void (*iter)(ZMesh *, void *), void *data)
+{
+    unsigned int i;
+
+    for (i = 0; i < meshes.size; i++) {
+        if (meshes.items[i])
+            iter(meshes.items[i], data);
     }
 }
 
@@ -340,15 +1038,211 @@ static GLenum zGetGLVAFormat(ZMesh *mesh)
 
 
 
-// Draw mesh.
-void zDrawMesh(ZMesh *mesh)
+// Build the VBO with line segments used to visualize tangents, bitangents and normals. Each line
+// runs from the vertex to vertex + r_normalscale * vector. This is done from the local copy of the
+// vertex data so that I don't need to map the vertex VBO, or if that was dropped, from the mesh
+// cache.
+static void zBuildDebugVBO(ZMesh *mesh)
+{
+    unsigned int i, per_vertex = 0;
+    float *lines, *l;
+    const float *vertices = mesh->vertices, *tangents = mesh->tangents;
+    const ZVec3 *v, *vec;
+    const float scale = r_normalscale;
+    ZMeshData data;
+
+    memset(&data, '\0', sizeof(data));
+
+    if (!vertices) {
+
+        if (!zMapCachedMesh(mesh->shared ? mesh->shared : mesh, &data)) {
+            zDebug("No data to build debug lines for mesh \"%s\" from.", mesh->name);
+            return;
+        }
+
+        vertices = data.vertices;
+        tangents = data.tangents;
+    }
+
+    if (tangents) per_vertex = (mesh->flags & Z_MESH_HAS_BITANGENTS) ? 2 : 1;
+
+    mesh->debug_tangent_verts = mesh->num_vertices * per_vertex * 2;
+    mesh->debug_normal_verts  = (mesh->flags & Z_MESH_HAS_NORMALS) ? mesh->num_vertices * 2 : 0;
+
+    if ( !(lines = malloc((mesh->debug_tangent_verts + mesh->debug_normal_verts) * 6 *
+            sizeof(float))) ) {
+        zWarning("Failed to allocate memory for debug lines of mesh \"%s\".", mesh->name);
+        zUnmapCachedMesh(&data);
+        return;
+    }
+
+    l = lines;
+
+    // Writes a line from v to v + scale*vec in color (r, g, b) as GL_C3F_V3F.
+#define zAddDebugLine(r, g, b) \
+    l[0] = (r); l[1] = (g); l[2] = (b); \
+    l[3] = v->x; l[4] = v->y; l[5] = v->z; \
+    l[6] = (r); l[7] = (g); l[8] = (b); \
+    l[9] = v->x + scale * vec->x; l[10] = v->y + scale * vec->y; l[11] = v->z + scale * vec->z; \
+    l += 12;
+
+    // Tangents in red, bitangents in green.
+    if (per_vertex) {
+        for (i = 0; i < mesh->num_vertices; i++) {
+
+            v = (const ZVec3 *) (vertices + i*mesh->elem_size + (mesh->elem_size - 3));
+
+            if (mesh->flags & Z_MESH_HAS_BITANGENTS) {
+                vec = &(((const ZTangentTB *)tangents)[i].t);
+                zAddDebugLine(1.0f, 0.0f, 0.0f);
+                vec = &(((const ZTangentTB *)tangents)[i].b);
+                zAddDebugLine(0.0f, 1.0f, 0.0f);
+            } else {
+                vec = &(((const ZTangentT *)tangents)[i].t);
+                zAddDebugLine(1.0f, 0.0f, 0.0f);
+            }
+        }
+    }
+
+    // Normals in blue, they always immediately precede the vertex position.
+    if (mesh->flags & Z_MESH_HAS_NORMALS) {
+        for (i = 0; i < mesh->num_vertices; i++) {
+            v = (const ZVec3 *) (vertices + i*mesh->elem_size + (mesh->elem_size - 3));
+            vec = v - 1;
+            zAddDebugLine(0.0f, 0.0f, 1.0f);
+        }
+    }
+
+#undef zAddDebugLine
+
+    if (!mesh->debug_vbo_name) glGenBuffersARB(1, &(mesh->debug_vbo_name));
+
+    glBindBufferARB(GL_ARRAY_BUFFER, mesh->debug_vbo_name);
+    glBufferDataARB(GL_ARRAY_BUFFER, (l - lines) * sizeof(float), lines, GL_STATIC_DRAW);
+    glBindBufferARB(GL_ARRAY_BUFFER, 0);
+
+    free(lines);
+    zUnmapCachedMesh(&data);
+
+    mesh->debug_scale = scale;
+}
+
+
+
+// Make sure the scratch arrays used by zCullGroup can hold at least size ranges.
+static int zGrowCullArrays(unsigned int size)
+{
+    GLsizei *counts;
+    GLint *firsts;
+    const GLvoid **offsets;
+
+    if (size <= cull_size) return TRUE;
+
+    // Grow geometrically so this settles quickly.
+    if (size < cull_size*2) size = cull_size*2;
+
+    counts  = realloc(cull_counts, size * sizeof(GLsizei));
+    if (counts) cull_counts = counts;
+    firsts  = realloc(cull_firsts, size * sizeof(GLint));
+    if (firsts) cull_firsts = firsts;
+    offsets = realloc((void *) cull_offsets, size * sizeof(GLvoid *));
+    if (offsets) cull_offsets = offsets;
+
+    if (!counts || !firsts || !offsets) {
+        zWarning("Failed to allocate memory for cluster culling.");
+        return FALSE;
+    }
+
+    cull_size = size;
+
+    return TRUE;
+}
+
+
+
+// Returns TRUE if cluster is visible from frustum, i.e. it is (partially) within the frustum and
+// not entirely backfacing.
+static int zClusterVisible(const ZMeshCluster *cluster, const ZFrustum *frustum)
+{
+    ZVec3 d;
+
+    if (!zFrustumTestSphere(frustum, &cluster->center, cluster->radius))
+        return FALSE;
+
+    if (cluster->cone_cutoff < 1.0f) {
+
+        d.x = cluster->center.x - frustum->origin.x;
+        d.y = cluster->center.y - frustum->origin.y;
+        d.z = cluster->center.z - frustum->origin.z;
+
+        // The viewpoint lies within the backfacing cone (widened by the bounding sphere), so every
+        // triangle in the cluster faces away.
+        if (d.x*cluster->cone_axis.x + d.y*cluster->cone_axis.y + d.z*cluster->cone_axis.z >=
+                cluster->cone_cutoff * zLength3(&d) + cluster->radius)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+
+// Collect the visible clusters of group into the cull_* scratch arrays, merging clusters that are
+// adjacent in the index/vertex array into a single range. Returns the number of ranges (0 if the
+// whole group was culled), or -1 if the group should just be drawn whole.
+static int zCullGroup(ZMesh *mesh, ZMeshGroup *group, const ZFrustum *frustum)
+{
+    unsigned int i, end = 0;
+    int num_ranges = 0;
+
+    if (!frustum || !r_clustercull || !group->num_clusters)
+        return -1;
+
+    if (!zGrowCullArrays(group->num_clusters))
+        return -1;
+
+    for (i = group->first_cluster; i < group->first_cluster + group->num_clusters; i++) {
+
+        ZMeshCluster *cluster = &(mesh->clusters[i]);
+
+        if (!zClusterVisible(cluster, frustum))
+            continue;
+
+        if (num_ranges > 0 && end == cluster->start) {
+            cull_counts[num_ranges-1] += cluster->count;
+        } else {
+            cull_firsts[num_ranges]  = cluster->start;
+            cull_counts[num_ranges]  = cluster->count;
+            cull_offsets[num_ranges] = (const GLvoid *) (cluster->start*sizeof(unsigned int));
+            num_ranges++;
+        }
+        end = cluster->start + cluster->count;
+    }
+
+    return num_ranges;
+}
+
+
+
+// Draw mesh. If frustum is given, the mesh and its individual clusters are culled against it (see
+// r_clustercull), wires/points/normals are always drawn for the entire mesh.
+void zDrawMesh(ZMesh *mesh, const ZFrustum *frustum)
 {
     unsigned int i;
 
     assert(mesh);
 
+    // Nothing to draw yet (or ever, if loading failed).
+    if (!zMeshReady(mesh)) return;
+
+    if (frustum && r_clustercull && !zFrustumTestSphere(frustum, &mesh->center, mesh->radius))
+        return;
+
     if (!mesh->is_resident) zMeshMakeResident(mesh);
 
+    // Restoring dropped data can fail, see zMeshMakeResident.
+    if (!mesh->is_resident) return;
+
     // Save initial state.
     glPushAttrib(GL_CURRENT_BIT | GL_ENABLE_BIT | GL_POLYGON_BIT);
 
@@ -374,6 +1268,10 @@ void zDrawMesh(ZMesh *mesh)
     if (!r_nofill) {
         for (i = 0; i < mesh->num_groups; i++) {
             ZMaterial *mat = mesh->groups[i].material;
+            int num_ranges = zCullGroup(mesh, &(mesh->groups[i]), frustum);
+
+            // Don't bother switching materials if nothing in this group is visible.
+            if (num_ranges == 0) continue;
 
             zMakeMaterialActive(mat);
 
@@ -406,7 +1304,15 @@ void zDrawMesh(ZMesh *mesh)
             }
 
             // Finally, draw \o/
-            if (mesh->flags & Z_MESH_VA_INDEXED) {
+            if (num_ranges > 0) {
+                // Only the visible clusters, in as few ranges as possible.
+                if (mesh->flags & Z_MESH_VA_INDEXED) {
+                    glMultiDrawElements(GL_TRIANGLES, cull_counts, GL_UNSIGNED_INT, cull_offsets,
+                        num_ranges);
+                } else {
+                    glMultiDrawArrays(GL_TRIANGLES, cull_firsts, cull_counts, num_ranges);
+                }
+            } else if (mesh->flags & Z_MESH_VA_INDEXED) {
                 glDrawElements(GL_TRIANGLES, mesh->groups[i].count, GL_UNSIGNED_INT,
                     (void *) (mesh->groups[i].start*sizeof(unsigned int)) );
             } else {
@@ -461,93 +1367,25 @@ void zDrawMesh(ZMesh *mesh)
     }
 
 
-    // Draw tangent vectors.
-    if ( (r_drawtangents) && mesh->tangents ) {
+    // Draw tangent/bitangent/normal vectors.
+    if ( (r_drawtangents && (mesh->flags & Z_MESH_HAS_TANGENTS)) ||
+         (r_drawnormals && (mesh->flags & Z_MESH_HAS_NORMALS)) ) {
 
-        ZVec3 *v, *t, *b;
+        if (!mesh->debug_vbo_name || mesh->debug_scale != r_normalscale)
+            zBuildDebugVBO(mesh);
 
-        // Draw lines between vertex and vertex+tangent.
-        glBegin(GL_LINES);
-        for (i = 0; i < mesh->num_vertices; i++) {
+        if (mesh->debug_vbo_name) {
 
-            // I probably won't need to check for all formats since a mesh with tangents likely has
-            // texcoords and normals, but just in case..
-            if ( (mesh->flags & Z_MESH_HAS_NORMALS) && (mesh->flags & Z_MESH_HAS_TEXCOORDS))
-                v = &(((ZVertexTNV *)mesh->vertices)[i].v);
-            else if (mesh->flags & Z_MESH_HAS_NORMALS)
-                v = &(((ZVertexNV *)mesh->vertices)[i].v);
-            else if (mesh->flags & Z_MESH_HAS_TEXCOORDS)
-                v = &(((ZVertexTV *)mesh->vertices)[i].v);
-            else
-                v = &(((ZVertexV *)mesh->vertices)[i].v);
-
-            // Since mesh->tangents exists, I'll assume mesh has tangents and I only check if maybe it
-            // has bitangents as well.
-            // XXX: Make it more obvious somehow that it's not possible to only have bitangets, it's
-            // either only tangents, or both.
-            if ( mesh->flags & Z_MESH_HAS_BITANGENTS ) {
-                t = &(((ZTangentTB *)mesh->tangents)[i].t);
-                b = &(((ZTangentTB *)mesh->tangents)[i].b);
-            } else {
-                t = &(((ZTangentT *)mesh->tangents)[i].t);
-                b = NULL; // Silence compiler warning about uninitialized use.
-            }
+            // Tangent lines precede the normal lines, so any combination is a single range.
+            GLint first = r_drawtangents ? 0 : mesh->debug_tangent_verts;
+            GLsizei count = (r_drawtangents ? mesh->debug_tangent_verts : 0) +
+                            (r_drawnormals  ? mesh->debug_normal_verts  : 0);
 
-            glColor3f(1.0f, 0.0f, 0.0f);
-            glVertex3fv((float *)v);
-            glVertex3f( v->x + r_normalscale * t->x, v->y + r_normalscale * t->y,
-                v->z + r_normalscale * t->z );
-
-            if ( mesh->flags & Z_MESH_HAS_BITANGENTS) {
-                glColor3f(0.0f, 1.0f, 0.0f);
-                glVertex3fv((float *)v);
-                glVertex3f(v->x + r_normalscale * b->x, v->y + r_normalscale * b->y,
-                    v->z + r_normalscale * b->z );
-            }
-        }
-        glEnd();
-    }
-
-
-    // Draw normals as line segments.
-    // TODO: Draw from array in system memory instead.
-    // TODO: Rewrite using typecasted structs for better readability
-    if ( (r_drawnormals) && (mesh->flags & Z_MESH_HAS_NORMALS) ) {
-
-        unsigned int n_offset, v_offset, stride, texcoordsize;
-        float *vertices;
-
-        glColor3f(0.0f, 0.0f, 1.0f);
-
-        texcoordsize = (mesh->flags & Z_MESH_HAS_TEXCOORDS) ? 2 : 0;
-        stride = 3 + 3 + texcoordsize;
-        glBindBufferARB(GL_ARRAY_BUFFER, mesh->vertex_vbo_name);
-        if ( !(vertices = glMapBufferARB(GL_ARRAY_BUFFER, GL_READ_ONLY)) ) {
-            zWarning("Failed to map vertex buffer for drawing normals.");
-            glPopAttrib();
-            return;
-        }
-
-        glBegin(GL_LINES);
-
-        for (i = 0; i < mesh->num_vertices; i++) {
-
-            n_offset = (stride * i) + texcoordsize;
-            v_offset = n_offset + 3;
-
-            // Draw line from vertex to vertex + (r_normalscale * normal)
-            glVertex3fv(vertices+v_offset);
-            glVertex3f(
-                vertices[v_offset]   + r_normalscale * vertices[n_offset],
-                vertices[v_offset+1] + r_normalscale * vertices[n_offset+1],
-                vertices[v_offset+2] + r_normalscale * vertices[n_offset+2]
-            );
-        }
-
-        glEnd();
-
-        if (!glUnmapBufferARB(GL_ARRAY_BUFFER)) {
-            zWarning("Vertex buffer object became invalid, should re-upload it.");
+            glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+            glBindBufferARB(GL_ARRAY_BUFFER, mesh->debug_vbo_name);
+            glInterleavedArrays(GL_C3F_V3F, 0, 0);
+            glDrawArrays(GL_LINES, first, count);
+            glPopClientAttrib();
         }
     }
 
@@ -574,8 +1412,9 @@ int zGrowMeshBuffers(ZMesh *mesh, int type)
 
         if (mesh->num_vertices == mesh->vertices_size) {
 
-            float *tmp = (float *) realloc(mesh->vertices, (mesh->vertices_size +
-                Z_MESH_VERTICES_BUFINC) * mesh->elem_size * sizeof(float) );
+            unsigned int size = mesh->vertices_size ? mesh->vertices_size*2 :
+                                                      Z_MESH_VERTICES_INITIAL;
+            float *tmp = (float *) realloc(mesh->vertices, size * mesh->elem_size * sizeof(float));
 
             if (!tmp) {
                 zWarning("Failed to allocate memory for mesh vertex buffer.");
@@ -583,7 +1422,7 @@ int zGrowMeshBuffers(ZMesh *mesh, int type)
             }
 
             mesh->vertices = tmp;
-            mesh->vertices_size += Z_MESH_VERTICES_BUFINC;
+            mesh->vertices_size = size;
         }
 
     } else if (type == Z_MESH_GROW_INDICES) {
@@ -592,8 +1431,9 @@ int zGrowMeshBuffers(ZMesh *mesh, int type)
 
         if (mesh->num_indices == mesh->indices_size) {
 
+            unsigned int size = mesh->indices_size ? mesh->indices_size*2 : Z_MESH_INDICES_INITIAL;
             unsigned int *tmp = (unsigned int *) realloc(mesh->indices,
-                    (mesh->indices_size + Z_MESH_INDICES_BUFINC) * sizeof(unsigned int) );
+                    size * sizeof(unsigned int) );
 
             if (!tmp) {
                 zWarning("Failed to allocate memory for mesh index buffer.");
@@ -601,7 +1441,7 @@ int zGrowMeshBuffers(ZMesh *mesh, int type)
             }
 
             mesh->indices = tmp;
-            mesh->indices_size += Z_MESH_INDICES_BUFINC;
+            mesh->indices_size = size;
         }
 
     } else {
@@ -629,18 +1469,23 @@ void zMeshInfo(ZMesh *mesh)
     if (mesh->flags & Z_MESH_HAS_NORMALS)   zPrint("  mesh has normals\n");
     if (mesh->flags & Z_MESH_HAS_TEXCOORDS) zPrint("  mesh has texcoords\n");
     if (mesh->flags & Z_MESH_VA_INDEXED)    zPrint("  mesh uses indexed vertex array\n");
+    if (mesh->num_vertices && !mesh->vertices)
+        zPrint("  data was dropped after uploading, it is restored from the mesh cache\n");
 
     if (mesh->groups) {
         unsigned int i;
         zPrint("  %u groups:\n", mesh->num_groups);
         for (i = 0; i < mesh->num_groups; i++) {
             ZMaterial *mat = mesh->groups[i].material;
-            zPrint("    %u: material %s, start %u, count %u\n", i, mat->name,
-                mesh->groups[i].start, mesh->groups[i].count);
+            zPrint("    %u: material %s, start %u, count %u, %u clusters\n", i, mat->name,
+                mesh->groups[i].start, mesh->groups[i].count, mesh->groups[i].num_clusters);
         }
     } else {
         zPrint("  no groups\n");
     }
+
+    zPrint("  %u clusters, bounding sphere at (%.2f, %.2f, %.2f) radius %.2f\n",
+        mesh->num_clusters, mesh->center.x, mesh->center.y, mesh->center.z, mesh->radius);
 }
 
 
@@ -653,9 +1498,15 @@ void zMakeMeshNonResident(ZMesh *mesh, void *ignored)
 
     if (!mesh->is_resident) return;
 
-    assert(mesh->vertex_vbo_name);
-    glDeleteBuffersARB(1, &mesh->vertex_vbo_name);
-    mesh->vertex_vbo_name = 0;
+    // The VBOs of a mesh sharing data are deleted along with the mesh that owns them.
+    if (mesh->shared) {
+        mesh->vertex_vbo_name = mesh->tangent_vbo_name = mesh->index_vbo_name = 0;
+    }
+
+    if (mesh->vertex_vbo_name) {
+        glDeleteBuffersARB(1, &mesh->vertex_vbo_name);
+        mesh->vertex_vbo_name = 0;
+    }
 
     // It's possible that I built a tangent array but for whatever reason never uploaded it to
     // OpenGL, so I don't check data format flags.
@@ -664,12 +1515,16 @@ void zMakeMeshNonResident(ZMesh *mesh, void *ignored)
         mesh->tangent_vbo_name = 0;
     }
 
-    if (mesh->flags & Z_MESH_VA_INDEXED) {
-        assert(mesh->index_vbo_name);
+    if (mesh->index_vbo_name) {
         glDeleteBuffersARB(1, &mesh->index_vbo_name);
         mesh->index_vbo_name = 0;
     }
 
+    if (mesh->debug_vbo_name) {
+        glDeleteBuffersARB(1, &mesh->debug_vbo_name);
+        mesh->debug_vbo_name = 0;
+    }
+
 
     while (curmat) {
         zMakeMaterialNonResident(curmat, NULL);
@@ -684,10 +1539,31 @@ void zMakeMeshNonResident(ZMesh *mesh, void *ignored)
 // Free all resources associated with mesh.
 void zDeleteMesh(ZMesh *mesh)
 {
+    unsigned int i;
     ZMaterial *tmp, *cur;
+    ZMesh **sharer;
 
     if (!mesh) return;
 
+    zCancelMeshLoad(mesh);
+    zCancelMeshCacheSave(mesh);
+
+    // Data shared with another mesh is left alone, it just loses a user.
+    if (mesh->shared) {
+
+        // Unlink it from the meshes sharing the same data, there usually aren't many.
+        sharer = &mesh->shared->sharers;
+        while (*sharer != mesh) sharer = &(*sharer)->next_sharer;
+        *sharer = mesh->next_sharer;
+
+        mesh->index_vbo_name = mesh->vertex_vbo_name = mesh->tangent_vbo_name = 0;
+        mesh->vertices = mesh->tangents = NULL;
+        mesh->indices = NULL;
+        zReleaseMesh(mesh->shared);
+    } else if (mesh->content_hash) {
+        zTableRemove(&mesh_contents, (unsigned int) mesh->content_hash, mesh);
+    }
+
     if (mesh->index_vbo_name) {
         assert(glIsBufferARB(mesh->index_vbo_name));
         glDeleteBuffersARB(1, &(mesh->index_vbo_name));
@@ -703,11 +1579,22 @@ void zDeleteMesh(ZMesh *mesh)
         glDeleteBuffersARB(1, &(mesh->tangent_vbo_name));
     }
 
-    // Free list of materials if there are any.
+    if (mesh->debug_vbo_name) {
+        assert(glIsBufferARB(mesh->debug_vbo_name));
+        glDeleteBuffersARB(1, &(mesh->debug_vbo_name));
+    }
+
+    for (i = 0; i < mesh->num_groups; i++) {
+        if (mesh->groups[i].material)
+            zReleaseMaterial(mesh->groups[i].material);
+    }
+
+    // Free list of materials if there are any, after releasing what they hold on to.
     cur = mesh->materials;
 
     while (cur) {
         tmp = cur->next;
+        zMakeMaterialNonResident(cur, NULL);
         zDeleteMaterial(cur);
         cur = tmp;
     }
@@ -715,6 +1602,44 @@ void zDeleteMesh(ZMesh *mesh)
     free(mesh->vertices);
     free(mesh->indices);
     free(mesh->tangents);
+    free(mesh->clusters);
+    free(mesh->groups);
+    zDeleteImpostor(mesh->impostor);
     free(mesh);
 }
 
+
+
+// Drop a reference to mesh, taken for each posable that uses it.
+void zReleaseMesh(ZMesh *mesh)
+{
+    assert(mesh->refcount > 0);
+
+    if (--mesh->refcount == 0)
+        mesh->released = sceneload_count;
+}
+
+
+
+// Delete meshes that no posable has used for more than r_retainscenes scene loads (or all unused
+// ones if force is set). Returns the number of meshes deleted.
+int zCollectMeshes(int force)
+{
+    unsigned int i;
+    int count = 0;
+    ZMesh *mesh;
+
+    for (i = 0; i < meshes.size; i++) {
+
+        mesh = meshes.items[i];
+
+        if (mesh && !mesh->refcount && zResourceExpired(mesh->released, force)) {
+            zTableRemoveAt(&meshes, i);
+            zDeleteMesh(mesh);
+            count++;
+            i--; // Check the slot again, another mesh may have moved into it.
+        }
+    }
+
+    return count;
+}
@@ -4,6 +4,7 @@
 #include <GL/glew.h>
 
 #include "zmath.h"
+#include "camera.h"
 
 // Load flags (zLoadMesh)
 #define Z_MESH_LOAD_NORMALIZE  1  // Normalize normal vectors
@@ -32,10 +33,11 @@
 #define Z_MESH_GROW_INDICES  2
 
 
-#define Z_MESH_MAXGROUPS 128 // Maximum number of groups a mesh can have, can probably be lowered.
+#define Z_MESH_CLUSTER_SIZE 128 // Maximum number of triangles per cluster (see ZMeshCluster).
 
-#define Z_MESH_VERTICES_BUFINC 2000 // By how much buffers are resized during loading.
-#define Z_MESH_INDICES_BUFINC  2000
+// Initial buffer sizes for zGrowMeshBuffers, buffers are doubled in size whenever they fill up.
+#define Z_MESH_VERTICES_INITIAL 2048
+#define Z_MESH_INDICES_INITIAL  2048
 
 
 // Some structs to make accessing vertex and tangent arrays less painful. These need to be tightly
@@ -78,6 +80,27 @@ typedef struct ZTangentTB
 
 #pragma pack(pop)
 
+// ZMeshCluster - A small run of triangles within a group, with a bounding sphere and a normal cone
+// so that it can be culled independently of the rest of the mesh.
+typedef struct ZMeshCluster
+{
+    unsigned int start; // First index/vertex (same as ZMeshGroup).
+
+    unsigned int count; // Number of indices/vertices.
+
+    ZVec3 center; // Bounding sphere.
+    float radius;
+
+    // Normal cone, the cluster is entirely backfacing when viewed from inside the cone. If
+    // cone_cutoff is 1 or more, the triangle normals are too far apart and the cluster is never
+    // backface-culled.
+    ZVec3 cone_axis;
+    float cone_cutoff;
+
+} ZMeshCluster;
+
+
+
 // ZMeshGroup - A grouping of vertices or indices (depending on wether Z_MESH_VA_INDEXED is set or
 // not) associated with a material.
 typedef struct ZMeshGroup
@@ -86,6 +109,10 @@ typedef struct ZMeshGroup
 
     unsigned int count; // Number of indices/vertices to dereference/draw for this group.
 
+    // Clusters that make up this group (index into ZMesh.clusters).
+    unsigned int first_cluster;
+    unsigned int num_clusters;
+
     ZMaterial *material;
 
 } ZMeshGroup;
@@ -94,10 +121,15 @@ typedef struct ZMeshGroup
 
 typedef struct ZMesh
 {
-    char name[Z_RESOURCE_NAME_SIZE];
+    const char *name; // Interned, see intern.h.
 
     int is_resident; // Wether or not the vertex data has been uploaded to OpenGL.
 
+    // Number of posables (and meshes sharing its data) using the mesh, and the value of
+    // sceneload_count when that last dropped to 0. Unused meshes are deleted by zCollectMeshes.
+    int refcount;
+    unsigned int released;
+
     unsigned int flags; // Data format flags.
 
     unsigned int num_groups; // Number of vertex groups.
@@ -117,18 +149,52 @@ typedef struct ZMesh
     GLuint tangent_vbo_name;
     GLuint index_vbo_name;
 
-    // Vertex/tangent/index buffers
+    // Cached line segments for r_drawtangents/r_drawnormals, tangent (and bitangent) lines come
+    // first, followed by the normal lines. Rebuilt when r_normalscale no longer matches debug_scale.
+    GLuint debug_vbo_name;
+    unsigned int debug_tangent_verts;
+    unsigned int debug_normal_verts;
+    float debug_scale;
+
+    // Vertex/tangent/index buffers. All NULL (while the counts above stay) if the data was dropped
+    // after uploading it, see r_meshdropdata.
     float *vertices;
     float *tangents;
     unsigned int *indices;
 
-    // Linked list of materials local to the mesh (i.e. those loaded from a .mtl library for an .obj
-    // model). Groups may or may not refer to these. Should be freed when the mesh is deleted.
+    // Linked list of materials local to the mesh (i.e. those made for its texture atlases, materials
+    // from .mtl libraries are shared, see ZMaterialLib). Groups may or may not refer to these.
+    // Should be freed when the mesh is deleted.
     ZMaterial *materials;
 
-    ZMeshGroup groups[Z_MESH_MAXGROUPS];
+    ZMeshGroup *groups; // num_groups of them, allocated to fit.
+
+    // Clusters for all groups, see zBuildMeshClusters. May be NULL, in which case groups are always
+    // drawn whole.
+    unsigned int num_clusters;
+    ZMeshCluster *clusters;
+
+    // Bounding sphere for the entire mesh.
+    ZVec3 center;
+    float radius;
+
+    // Pre-rendered views for drawing the mesh at a distance, NULL until first needed.
+    struct ZImpostor *impostor;
+
+    // Hash of the vertex/index/tangent data, 0 if r_dedup was off when the mesh was loaded (until
+    // its data is dropped, see r_meshdropdata). If another mesh had identical data, shared points
+    // to it, and the vertex, index and tangent arrays and VBOs belong to that mesh. Groups,
+    // materials and clusters are still the mesh's own. The meshes sharing this mesh's data are
+    // linked through next_sharer, starting at sharers.
+    unsigned long long content_hash;
+    struct ZMesh *shared;
+    struct ZMesh *sharers, *next_sharer;
+
+    struct ZMeshLoad *load; // Background load in progress, NULL once done (see meshload.h).
 
-    struct ZMesh *next;
+    struct ZMeshCacheSave *cache_save; // Mesh cache write in progress (see meshcache.h).
+
+    unsigned int load_flags; // Flags the mesh was loaded with.
 
 } ZMesh;
 
@@ -141,9 +207,27 @@ void zBuildTangentArray(ZMesh *mesh, int bitangent);
 
 ZMesh *zLookupMesh(const char *name);
 
+ZMesh *zLookupMeshAsync(const char *name);
+
+int zMeshReady(const ZMesh *mesh);
+
+void zFinishMeshLoad(ZMesh *mesh, ZMesh *read, unsigned int load_flags);
+
+void zDeleteReadMesh(ZMesh *mesh);
+
+void zMeshMakeResident(ZMesh *mesh);
+
+void zDropMeshData(ZMesh *mesh);
+
+void zQueueMeshShaders(ZMesh *mesh);
+
 void zIterMeshes(void (*iter)(ZMesh *, void *), void *data);
 
-void zDrawMesh(ZMesh *mdl);
+int zBuildMeshClusters(ZMesh *mesh, const unsigned int *breaks, unsigned int num_breaks);
+
+int zMergeMeshGroups(ZMesh *mesh);
+
+void zDrawMesh(ZMesh *mesh, const ZFrustum *frustum);
 
 int zGrowMeshBuffers(ZMesh *mesh, int type);
 
@@ -153,4 +237,17 @@ void zMakeMeshNonResident(ZMesh *mesh, void *ignored);
 
 void zDeleteMesh(ZMesh *mesh);
 
+void zReleaseMesh(ZMesh *mesh);
+
+int zCollectMeshes(int force);
+
+void zMeshDedupStats(unsigned int *count, size_t *saved);
+
+void zMeshMemStats(size_t *in_memory, size_t *dropped, unsigned int *num_dropped);
+
+unsigned long long zHashMeshData(const ZMesh *mesh, const float *vertices,
+                                 const unsigned int *indices, const float *tangents);
+
+size_t zMeshTangentsSize(const ZMesh *mesh);
+
 #endif
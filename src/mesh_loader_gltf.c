@@ -0,0 +1,1097 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+
+#include "common.h"
+
+
+/* Loader for binary glTF 2.0 (.glb) models.
+ *
+ * More info: https://registry.khronos.org/glTF/specs/2.0/glTF-2.0.html
+ *
+ * A .glb file is a small header followed by a JSON chunk describing the scene and a binary chunk
+ * holding the vertex and index data, already laid out the way a GPU wants it. The file is mapped
+ * into memory, and accessor data is copied straight from the mapping into the mesh buffers, there's
+ * no per-vertex parsing going on. Where the layout already matches (meshes with just positions) a
+ * whole accessor is copied in one go, otherwise attributes are gathered into the interleaved format
+ * ZMesh uses.
+ *
+ * Limitations:
+ *
+ *  - Only meshes are loaded, the node hierarchy is ignored, so node transforms aren't applied and
+ *    every mesh in the file is loaded once, whether or not a node refers to it.
+ *
+ *  - Only triangle list primitives are supported. Primitives using any other mode are skipped.
+ *
+ *  - Only POSITION, NORMAL and TEXCOORD_0 attributes are used, and only if they are floats. Normals
+ *    and texcoords are only used if every primitive has them, since all vertices in a mesh share a
+ *    single format.
+ *
+ *  - All buffers have to be in the binary chunk, external and sparse buffers aren't supported.
+ *    Images have to be external files (referenced by a relative uri), embedded images are ignored.
+ *
+ *  - The binary chunk is assumed to be in host byte order, so this only works on little-endian
+ *    machines.
+ *
+ * Each primitive's material is turned into a ZMaterial local to the mesh. The base color becomes
+ * the diffuse color and map, the normal texture the normal map, and the metallic/roughness factors
+ * are turned into a specular color and shininess. Primitives sharing a material end up in a single
+ * group, with cluster boundaries at the primitive boundaries.
+ */
+
+
+#define GLB_MAGIC      0x46546C67 // "glTF"
+#define GLB_CHUNK_JSON 0x4E4F534A // "JSON"
+#define GLB_CHUNK_BIN  0x004E4942 // "BIN\0"
+
+#define GLB_HEADER_SIZE       12
+#define GLB_CHUNK_HEADER_SIZE 8
+
+#define GLTF_JSON_OBJECT    1
+#define GLTF_JSON_ARRAY     2
+#define GLTF_JSON_STRING    3
+#define GLTF_JSON_PRIMITIVE 4 // Numbers, true, false and null.
+
+// Nesting deeper than this is treated as an error, glTF doesn't need anywhere near as much.
+#define GLTF_JSON_MAX_DEPTH 64
+
+#define GLTF_TOKENS_INITIAL 1024
+
+// Everything used while loading comes from the scratch arena, it holds the JSON tokens and a few
+// small tables and is freed once the mesh is built.
+#define GLTF_SCRATCH_INITIAL_SIZE (256*1024)
+
+// Component types and primitive modes, these match the OpenGL enums.
+#define GLTF_UNSIGNED_BYTE  5121
+#define GLTF_UNSIGNED_SHORT 5123
+#define GLTF_UNSIGNED_INT   5125
+#define GLTF_FLOAT          5126
+
+#define GLTF_MODE_TRIANGLES 4
+
+#define GLTF_WRAP_CLAMP_TO_EDGE 33071
+
+
+// The JSON chunk is split into a flat array of tokens. Containers are followed by their contents,
+// object members being a string token for the key followed by the value.
+typedef struct gltf_token
+{
+    int type;
+
+    // Range of the token within the JSON chunk, without the quotes for strings.
+    unsigned int start;
+    unsigned int end;
+
+    unsigned int size; // Number of members (objects) or elements (arrays).
+    unsigned int next; // Index of the first token after this one and everything it contains.
+
+} gltf_token;
+
+
+// Resolved accessor, pointing into the binary chunk.
+typedef struct gltf_accessor
+{
+    const unsigned char *data;
+    unsigned int count;
+    unsigned int stride; // Bytes from one element to the next.
+    unsigned int component_type;
+    unsigned int components;
+
+} gltf_accessor;
+
+
+typedef struct gltf_primitive
+{
+    // Accessors for the attributes and indices, -1 if the primitive doesn't have them.
+    int position;
+    int normal;
+    int texcoord;
+    int indices;
+
+    int material; // Index of the glTF material, -1 for the default material.
+
+    unsigned int num_vertices;
+    unsigned int num_indices;
+    unsigned int base; // First vertex in mesh->vertices.
+
+} gltf_primitive;
+
+
+static ZMesh *mesh;
+
+static ZArena scratch;
+
+static const char *filename;      // For printing diagnostic messages.
+static const char *resource_name; // Images are looked up relative to this.
+
+static const char *json;
+static unsigned int json_size;
+static unsigned int json_pos;
+
+static const unsigned char *bin;
+static unsigned int bin_size;
+
+static gltf_token *tokens;
+static unsigned int num_tokens;
+static unsigned int tokens_size;
+
+static gltf_primitive *prims;
+static unsigned int num_prims;
+
+static ZMaterial **materials; // Created materials, by glTF material index.
+static unsigned int num_materials;
+
+
+
+static unsigned int read_u32(const unsigned char *p)
+{
+    return (unsigned int) p[0] | ((unsigned int) p[1] << 8) | ((unsigned int) p[2] << 16) |
+           ((unsigned int) p[3] << 24);
+}
+
+
+
+static void skip_whitespace(void)
+{
+    while (json_pos < json_size && (json[json_pos] == ' ' || json[json_pos] == '\t' ||
+           json[json_pos] == '\n' || json[json_pos] == '\r'))
+        json_pos++;
+}
+
+
+
+// Add a token of the given type starting at the current position. Returns its index, or -1 if
+// memory ran out.
+static int new_token(int type)
+{
+    if (num_tokens == tokens_size) {
+
+        unsigned int size = tokens_size ? tokens_size*2 : GLTF_TOKENS_INITIAL;
+        gltf_token *tmp = zArenaGrow(&scratch, tokens, tokens_size * sizeof(gltf_token),
+                                     size * sizeof(gltf_token));
+
+        if (!tmp) return -1;
+
+        tokens = tmp;
+        tokens_size = size;
+    }
+
+    memset(&(tokens[num_tokens]), '\0', sizeof(gltf_token));
+    tokens[num_tokens].type = type;
+    tokens[num_tokens].start = json_pos;
+
+    return num_tokens++;
+}
+
+
+
+// Tokenize the JSON value at json_pos, and everything it contains. Returns FALSE if it's malformed
+// or memory ran out. Numbers and literals aren't checked here, only once they are used.
+static int parse_value(unsigned int depth)
+{
+    int t;
+    char c, close;
+
+    skip_whitespace();
+
+    if (json_pos >= json_size || depth > GLTF_JSON_MAX_DEPTH)
+        return FALSE;
+
+    c = json[json_pos];
+
+    if (c == '{' || c == '[') {
+
+        if ( (t = new_token(c == '{' ? GLTF_JSON_OBJECT : GLTF_JSON_ARRAY)) < 0 )
+            return FALSE;
+
+        close = c == '{' ? '}' : ']';
+        json_pos++;
+        skip_whitespace();
+
+        if (json_pos < json_size && json[json_pos] == close) {
+            json_pos++;
+        } else {
+            for (;;) {
+
+                // Object members start with a key and a colon.
+                if (c == '{') {
+                    skip_whitespace();
+                    if (json_pos >= json_size || json[json_pos] != '"' || !parse_value(depth+1))
+                        return FALSE;
+
+                    skip_whitespace();
+                    if (json_pos >= json_size || json[json_pos++] != ':')
+                        return FALSE;
+                }
+
+                if (!parse_value(depth+1))
+                    return FALSE;
+
+                tokens[t].size++;
+
+                skip_whitespace();
+                if (json_pos >= json_size)
+                    return FALSE;
+
+                if (json[json_pos] == ',') {
+                    json_pos++;
+                } else if (json[json_pos++] == close) {
+                    break;
+                } else {
+                    return FALSE;
+                }
+            }
+        }
+
+        tokens[t].end = json_pos;
+
+    } else if (c == '"') {
+
+        if ( (t = new_token(GLTF_JSON_STRING)) < 0 )
+            return FALSE;
+
+        tokens[t].start = ++json_pos;
+
+        while (json_pos < json_size && json[json_pos] != '"') {
+            if (json[json_pos] == '\\') json_pos++;
+            json_pos++;
+        }
+
+        if (json_pos >= json_size)
+            return FALSE;
+
+        tokens[t].end = json_pos++;
+
+    } else {
+
+        if ( (t = new_token(GLTF_JSON_PRIMITIVE)) < 0 )
+            return FALSE;
+
+        while (json_pos < json_size && !strchr(",:]} \t\r\n", json[json_pos]))
+            json_pos++;
+
+        if (json_pos == tokens[t].start)
+            return FALSE;
+
+        tokens[t].end = json_pos;
+    }
+
+    tokens[t].next = num_tokens;
+
+    return TRUE;
+}
+
+
+
+// Returns TRUE if token t is the string str.
+static int token_is(int t, const char *str)
+{
+    size_t len = strlen(str);
+
+    return t >= 0 && tokens[t].type == GLTF_JSON_STRING && tokens[t].end - tokens[t].start == len &&
+           memcmp(json + tokens[t].start, str, len) == 0;
+}
+
+
+
+// Returns the value of member key in object t, or -1 if there is no such member (or t isn't an
+// object).
+static int get_member(int t, const char *key)
+{
+    unsigned int i, k;
+
+    if (t < 0 || tokens[t].type != GLTF_JSON_OBJECT)
+        return -1;
+
+    for (i = 0, k = t+1; i < tokens[t].size; i++, k = tokens[k+1].next) {
+        if (token_is(k, key))
+            return k+1;
+    }
+
+    return -1;
+}
+
+
+
+// Returns element n of array t, or -1 if there's no such element (or t isn't an array).
+static int get_element(int t, int n)
+{
+    unsigned int k;
+
+    if (t < 0 || n < 0 || tokens[t].type != GLTF_JSON_ARRAY || (unsigned int) n >= tokens[t].size)
+        return -1;
+
+    for (k = t+1; n > 0; n--)
+        k = tokens[k].next;
+
+    return k;
+}
+
+
+
+// Returns the number in token t, or def if t is missing or isn't a number. Numbers are parsed by
+// hand since strtod depends on the locale.
+static double get_number(int t, double def)
+{
+    const char *p, *end;
+    double value = 0.0, scale = 1.0;
+    int negative = FALSE, exponent = 0, exp_negative = FALSE;
+
+    if (t < 0 || tokens[t].type != GLTF_JSON_PRIMITIVE)
+        return def;
+
+    p = json + tokens[t].start;
+    end = json + tokens[t].end;
+
+    if (p < end && *p == '-') {
+        negative = TRUE;
+        p++;
+    }
+
+    if (p == end || *p < '0' || *p > '9')
+        return def;
+
+    while (p < end && *p >= '0' && *p <= '9')
+        value = value*10.0 + (*p++ - '0');
+
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+            scale /= 10.0;
+            value += (*p - '0') * scale;
+        }
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+
+        p++;
+        if (p < end && (*p == '-' || *p == '+'))
+            exp_negative = *p++ == '-';
+
+        while (p < end && *p >= '0' && *p <= '9' && exponent < 400)
+            exponent = exponent*10 + (*p++ - '0');
+
+        while (exponent-- > 0)
+            value = exp_negative ? value / 10.0 : value * 10.0;
+    }
+
+    if (p != end)
+        return def;
+
+    return negative ? -value : value;
+}
+
+
+
+// Returns the index in token t, or -1 if t is missing or isn't a valid index.
+static int get_index(int t)
+{
+    double value = get_number(t, -1.0);
+
+    if (value < 0.0 || value > 2147483647.0 || value != (int) value)
+        return -1;
+
+    return (int) value;
+}
+
+
+
+// Returns the byte offset/length/count in token t, or def if t is missing or invalid.
+static unsigned int get_uint(int t, unsigned int def)
+{
+    double value = get_number(t, -1.0);
+
+    if (value < 0.0 || value > 4294967295.0 || value != (unsigned int) value)
+        return def;
+
+    return (unsigned int) value;
+}
+
+
+
+// Copy string token t to buf, undoing escapes (\u escapes just become '?', they aren't useful in
+// the strings I use). Returns FALSE if t isn't a string or doesn't fit in size bytes.
+static int get_string(int t, char *buf, size_t size)
+{
+    const char *p, *end;
+    size_t len = 0;
+
+    if (t < 0 || tokens[t].type != GLTF_JSON_STRING)
+        return FALSE;
+
+    for (p = json + tokens[t].start, end = json + tokens[t].end; p < end; p++) {
+
+        if (len + 1 >= size)
+            return FALSE;
+
+        if (*p != '\\') {
+            buf[len++] = *p;
+            continue;
+        }
+
+        if (++p == end) break;
+
+        switch (*p) {
+            case 'n': buf[len++] = '\n'; break;
+            case 't': buf[len++] = '\t'; break;
+            case 'r': buf[len++] = '\r'; break;
+            case 'b': buf[len++] = '\b'; break;
+            case 'f': buf[len++] = '\f'; break;
+            case 'u':
+                buf[len++] = '?';
+                p += MIN(4, end - p - 1);
+                break;
+            default:  buf[len++] = *p; break;
+        }
+    }
+
+    buf[len] = '\0';
+
+    return TRUE;
+}
+
+
+
+// Decode %XX escapes in uri, in place.
+static void decode_uri(char *uri)
+{
+    char *o = uri, hex[3] = { 0, 0, 0 };
+
+    while (*uri) {
+        if (uri[0] == '%' && isxdigit((unsigned char) uri[1]) && isxdigit((unsigned char) uri[2])) {
+            hex[0] = uri[1];
+            hex[1] = uri[2];
+            *o++ = (char) strtol(hex, NULL, 16);
+            uri += 3;
+        } else {
+            *o++ = *uri++;
+        }
+    }
+
+    *o = '\0';
+}
+
+
+
+// Check the GLB header, find the JSON and binary chunks and tokenize the JSON. Returns FALSE if the
+// file is malformed.
+static int parse_glb(const unsigned char *data, size_t size)
+{
+    unsigned int length, chunk_length, bin_start;
+
+    if (size < GLB_HEADER_SIZE + GLB_CHUNK_HEADER_SIZE || read_u32(data) != GLB_MAGIC) {
+        zError("Failed to load \"%s\", this does not seem to be a binary glTF model.", filename);
+        return FALSE;
+    }
+
+    if (read_u32(data+4) != 2) {
+        zError("Failed to load \"%s\", unsupported glTF version %u.", filename, read_u32(data+4));
+        return FALSE;
+    }
+
+    // The header has the total length, anything beyond that is ignored.
+    length = read_u32(data+8);
+
+    if (length > size || length < GLB_HEADER_SIZE + GLB_CHUNK_HEADER_SIZE) {
+        zError("Failed to load \"%s\", file is truncated.", filename);
+        return FALSE;
+    }
+
+    chunk_length = read_u32(data + GLB_HEADER_SIZE);
+
+    if ( read_u32(data + GLB_HEADER_SIZE + 4) != GLB_CHUNK_JSON ||
+         chunk_length > length - GLB_HEADER_SIZE - GLB_CHUNK_HEADER_SIZE ) {
+        zError("Failed to load \"%s\", missing or truncated JSON chunk.", filename);
+        return FALSE;
+    }
+
+    json = (const char *) data + GLB_HEADER_SIZE + GLB_CHUNK_HEADER_SIZE;
+    json_size = chunk_length;
+    json_pos = 0;
+
+    // The binary chunk is optional, and should be the second chunk if present.
+    bin = NULL;
+    bin_size = 0;
+    bin_start = GLB_HEADER_SIZE + GLB_CHUNK_HEADER_SIZE + chunk_length;
+
+    if (length - bin_start >= GLB_CHUNK_HEADER_SIZE &&
+        read_u32(data + bin_start + 4) == GLB_CHUNK_BIN) {
+
+        chunk_length = read_u32(data + bin_start);
+
+        if (chunk_length > length - bin_start - GLB_CHUNK_HEADER_SIZE) {
+            zError("Failed to load \"%s\", truncated binary chunk.", filename);
+            return FALSE;
+        }
+
+        bin = data + bin_start + GLB_CHUNK_HEADER_SIZE;
+        bin_size = chunk_length;
+    }
+
+    if (!parse_value(0) || tokens[0].type != GLTF_JSON_OBJECT) {
+        zError("Failed to parse JSON chunk of \"%s\" near offset %u.", filename, json_pos);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+
+// Resolve accessor index into acc. Returns FALSE if it doesn't exist, isn't backed by the binary
+// chunk, or its data doesn't fit in its buffer view.
+static int get_accessor(int index, gltf_accessor *acc)
+{
+    int a = get_element(get_member(0, "accessors"), index), v, type;
+    unsigned int view_offset, view_length, offset, elem_size, component_size;
+    unsigned long long last;
+
+    if (a < 0 || get_member(a, "sparse") >= 0)
+        return FALSE;
+
+    v = get_element(get_member(0, "bufferViews"), get_index(get_member(a, "bufferView")));
+
+    // Only the buffer stored in the binary chunk (which has no uri) is supported.
+    if (v < 0 || !bin || get_uint(get_member(v, "buffer"), 1) != 0 ||
+        get_member(get_element(get_member(0, "buffers"), 0), "uri") >= 0)
+        return FALSE;
+
+    view_offset = get_uint(get_member(v, "byteOffset"), 0);
+    view_length = get_uint(get_member(v, "byteLength"), 0);
+    offset = get_uint(get_member(a, "byteOffset"), 0);
+
+    acc->count = get_uint(get_member(a, "count"), 0);
+    acc->component_type = get_uint(get_member(a, "componentType"), 0);
+
+    type = get_member(a, "type");
+
+    if      (token_is(type, "SCALAR")) acc->components = 1;
+    else if (token_is(type, "VEC2"))   acc->components = 2;
+    else if (token_is(type, "VEC3"))   acc->components = 3;
+    else if (token_is(type, "VEC4"))   acc->components = 4;
+    else return FALSE;
+
+    switch (acc->component_type) {
+        case GLTF_UNSIGNED_BYTE:  component_size = 1; break;
+        case GLTF_UNSIGNED_SHORT: component_size = 2; break;
+        case GLTF_UNSIGNED_INT:
+        case GLTF_FLOAT:          component_size = 4; break;
+        default: return FALSE;
+    }
+
+    elem_size = acc->components * component_size;
+    acc->stride = get_uint(get_member(v, "byteStride"), elem_size);
+
+    if (!acc->count || acc->stride < elem_size || (unsigned long long) view_offset + view_length >
+        bin_size)
+        return FALSE;
+
+    last = (unsigned long long) offset + (unsigned long long) (acc->count-1) * acc->stride +
+           elem_size;
+
+    if (last > view_length)
+        return FALSE;
+
+    acc->data = bin + view_offset + offset;
+
+    return TRUE;
+}
+
+
+
+// Returns attribute accessor index if it is usable as components floats, with count elements,
+// or -1 otherwise.
+static int get_float_attribute(int attributes, const char *name, unsigned int components,
+    unsigned int count)
+{
+    int index = get_index(get_member(attributes, name));
+    gltf_accessor acc;
+
+    if (index < 0)
+        return -1;
+
+    if ( !get_accessor(index, &acc) || acc.component_type != GLTF_FLOAT ||
+         acc.components != components || (count && acc.count != count) ) {
+        zWarning("Ignoring unsupported %s attribute in \"%s\".", name, filename);
+        return -1;
+    }
+
+    return index;
+}
+
+
+
+// Collect all triangle primitives of all meshes in prims. Returns FALSE if there are none, or
+// memory ran out.
+static int collect_primitives(void)
+{
+    int meshes = get_member(0, "meshes"), m, list, p, attributes;
+    unsigned int i, j, total = 0, skipped = 0;
+    gltf_primitive *prim;
+    gltf_accessor acc;
+
+    // Count them first so prims can be allocated in one go.
+    for (i = 0; (m = get_element(meshes, i)) >= 0; i++) {
+        if ( (list = get_member(m, "primitives")) >= 0 && tokens[list].type == GLTF_JSON_ARRAY )
+            total += tokens[list].size;
+    }
+
+    if (!total) {
+        zError("Failed to load \"%s\", it has no meshes.", filename);
+        return FALSE;
+    }
+
+    if ( !(prims = zArenaAlloc(&scratch, total * sizeof(gltf_primitive))) ) {
+        zError("%s: Failed to allocate memory while loading \"%s\".", __func__, filename);
+        return FALSE;
+    }
+
+    num_prims = 0;
+
+    for (i = 0; (m = get_element(meshes, i)) >= 0; i++) {
+
+        list = get_member(m, "primitives");
+
+        for (j = 0; (p = get_element(list, j)) >= 0; j++) {
+
+            prim = &(prims[num_prims]);
+            attributes = get_member(p, "attributes");
+
+            if (get_uint(get_member(p, "mode"), GLTF_MODE_TRIANGLES) != GLTF_MODE_TRIANGLES) {
+                skipped++;
+                continue;
+            }
+
+            if ( (prim->position = get_float_attribute(attributes, "POSITION", 3, 0)) < 0 ) {
+                skipped++;
+                continue;
+            }
+
+            get_accessor(prim->position, &acc);
+            prim->num_vertices = acc.count;
+
+            prim->normal = get_float_attribute(attributes, "NORMAL", 3, prim->num_vertices);
+            prim->texcoord = get_float_attribute(attributes, "TEXCOORD_0", 2, prim->num_vertices);
+
+            // Without indices, the vertices are listed in order.
+            if ( (prim->indices = get_index(get_member(p, "indices"))) >= 0 ) {
+
+                if (!get_accessor(prim->indices, &acc) || acc.components != 1 ||
+                    acc.component_type == GLTF_FLOAT) {
+                    zWarning("Ignoring primitive with unsupported indices in \"%s\".", filename);
+                    skipped++;
+                    continue;
+                }
+
+                prim->num_indices = acc.count;
+            } else {
+                prim->num_indices = prim->num_vertices;
+            }
+
+            if (prim->num_indices < 3) {
+                skipped++;
+                continue;
+            }
+
+            prim->material = get_index(get_member(p, "material"));
+
+            if (prim->material >= 0 && get_element(get_member(0, "materials"), prim->material) < 0)
+                prim->material = -1;
+
+            num_prims++;
+        }
+    }
+
+    if (skipped) {
+        zWarning("%u unsupported primitives were ignored while loading \"%s\".", skipped,
+            filename);
+    }
+
+    if (!num_prims) {
+        zError("Failed to load \"%s\", it has no supported primitives.", filename);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+
+// Look up the image used by texture info object info (like baseColorTexture) and write its name,
+// relative to the data directory, to dest. If it has a sampler that clamps, wrap_mode is set.
+static void set_texname(const char **dest, int info, unsigned char *wrap_mode)
+{
+    char uri[Z_RESOURCE_NAME_SIZE];
+    int texture, image, sampler;
+    const char *path;
+
+    if (info < 0) return;
+
+    texture = get_element(get_member(0, "textures"), get_index(get_member(info, "index")));
+    image = get_element(get_member(0, "images"), get_index(get_member(texture, "source")));
+
+    if (image < 0) return;
+
+    if (!get_string(get_member(image, "uri"), uri, sizeof(uri)) || strncmp(uri, "data:", 5) == 0) {
+        zWarning("Ignoring embedded or unsupported image in \"%s\".", filename);
+        return;
+    }
+
+    decode_uri(uri);
+
+    if ( !(path = zGetSiblingPath(resource_name, uri)) || strlen(path) >= Z_RESOURCE_NAME_SIZE ) {
+        zWarning("Texture name exceeded RESOURCE_NAME_SIZE, ignoring.");
+        return;
+    }
+
+    *dest = zIntern(path);
+
+    sampler = get_element(get_member(0, "samplers"), get_index(get_member(texture, "sampler")));
+
+    if (wrap_mode && get_uint(get_member(sampler, "wrapS"), 0) == GLTF_WRAP_CLAMP_TO_EDGE)
+        *wrap_mode = Z_TEX_WRAP_CLAMPEDGE;
+}
+
+
+
+// Returns the material for glTF material index, creating it if needed. Falls back on the default
+// material if index is -1 or if something went wrong.
+static ZMaterial *get_material(int index)
+{
+    char name[Z_RESOURCE_NAME_SIZE], matname[Z_RESOURCE_NAME_SIZE];
+    int m = get_element(get_member(0, "materials"), index), pbr, color, i, len;
+    float metallic, roughness;
+    ZMaterial *mat;
+
+    if (m < 0) return &default_material;
+
+    if (materials[index]) return materials[index];
+
+    // Materials are named after the file and the glTF material name, or its index if it has no
+    // name or the result doesn't fit.
+    len = -1;
+
+    if (get_string(get_member(m, "name"), matname, sizeof(matname)) && matname[0])
+        len = snprintf(name, sizeof(name), "%s#%s", resource_name, matname);
+
+    if (len < 0 || len >= (int) sizeof(name))
+        len = snprintf(name, sizeof(name), "%s#material%d", resource_name, index);
+
+    if (len < 0 || len >= (int) sizeof(name)) {
+        zWarning("Material name exceeded RESOURCE_NAME_SIZE, using default material.");
+        return &default_material;
+    }
+
+    if ( !(mat = zCopyMaterial(&default_material)) )
+        return &default_material;
+
+    mat->name = zIntern(name);
+
+    pbr = get_member(m, "pbrMetallicRoughness");
+    color = get_member(pbr, "baseColorFactor");
+
+    for (i = 0; i < 4; i++)
+        mat->diffuse_color[i] = (float) get_number(get_element(color, i), 1.0);
+
+    color = get_member(m, "emissiveFactor");
+
+    for (i = 0; i < 3; i++)
+        mat->emission_color[i] = (float) get_number(get_element(color, i), 0.0);
+
+    mat->ambient_color[3] = mat->specular_color[3] = mat->emission_color[3] = 1.0f;
+
+    // There's no metallic/roughness in the fixed-function model, so approximate it: metals reflect
+    // their base color, dielectrics about 4% white, and smoother surfaces get sharper highlights.
+    metallic = (float) get_number(get_member(pbr, "metallicFactor"), 1.0);
+    roughness = (float) get_number(get_member(pbr, "roughnessFactor"), 1.0);
+
+    for (i = 0; i < 3; i++)
+        mat->specular_color[i] = 0.04f * (1.0f - metallic) + mat->diffuse_color[i] * metallic;
+
+    mat->shininess = 128.0f * (1.0f - roughness) * (1.0f - roughness);
+
+    if (token_is(get_member(m, "alphaMode"), "BLEND"))
+        mat->blend_type = Z_MTL_BLEND_ALPHA;
+
+    set_texname(&(mat->diffuse_map_name), get_member(pbr, "baseColorTexture"), &(mat->wrap_mode));
+    set_texname(&(mat->normal_map_name), get_member(m, "normalTexture"), NULL);
+
+    // Materials are local to the mesh and deleted along with it.
+    mat->next = mesh->materials;
+    mesh->materials = mat;
+
+    materials[index] = mat;
+
+    return mat;
+}
+
+
+
+// Copy the attributes of prim into mesh->vertices, starting at vertex prim->base.
+static void copy_vertices(const gltf_primitive *prim)
+{
+    gltf_accessor pos, norm, tex;
+    float *dest = mesh->vertices + prim->base * mesh->elem_size;
+    unsigned int i;
+
+    get_accessor(prim->position, &pos);
+
+    // Positions only, and tightly packed, so it can be copied as is.
+    if (mesh->elem_size == 3 && pos.stride == 3*sizeof(float)) {
+        memcpy(dest, pos.data, prim->num_vertices * 3*sizeof(float));
+        return;
+    }
+
+    if (mesh->flags & Z_MESH_HAS_TEXCOORDS) get_accessor(prim->texcoord, &tex);
+    if (mesh->flags & Z_MESH_HAS_NORMALS) get_accessor(prim->normal, &norm);
+
+    // Gather the attributes into the interleaved T2F_N3F_V3F (or a subset) format.
+    for (i = 0; i < prim->num_vertices; i++) {
+
+        if (mesh->flags & Z_MESH_HAS_TEXCOORDS) {
+            memcpy(dest, tex.data + i*tex.stride, 2*sizeof(float));
+            // glTF has the origin at the top left, images are loaded bottom row first.
+            dest[1] = 1.0f - dest[1];
+            dest += 2;
+        }
+
+        if (mesh->flags & Z_MESH_HAS_NORMALS) {
+            memcpy(dest, norm.data + i*norm.stride, 3*sizeof(float));
+            dest += 3;
+        }
+
+        memcpy(dest, pos.data + i*pos.stride, 3*sizeof(float));
+        dest += 3;
+    }
+}
+
+
+
+// Append the indices of prim to mesh->indices, offset by its base vertex. Returns FALSE if any of
+// them is out of range.
+static int copy_indices(const gltf_primitive *prim)
+{
+    gltf_accessor acc;
+    unsigned int i, index, *dest = mesh->indices + mesh->num_indices;
+    const unsigned char *src;
+
+    if (prim->indices < 0) {
+        for (i = 0; i < prim->num_indices; i++)
+            dest[i] = prim->base + i;
+
+        mesh->num_indices += prim->num_indices;
+        return TRUE;
+    }
+
+    get_accessor(prim->indices, &acc);
+
+    for (i = 0, src = acc.data; i < prim->num_indices; i++, src += acc.stride) {
+
+        if (acc.component_type == GLTF_UNSIGNED_INT)
+            memcpy(&index, src, sizeof(unsigned int));
+        else if (acc.component_type == GLTF_UNSIGNED_SHORT)
+            index = ((const unsigned short *) src)[0];
+        else
+            index = *src;
+
+        if (index >= prim->num_vertices)
+            return FALSE;
+
+        dest[i] = prim->base + index;
+    }
+
+    mesh->num_indices += prim->num_indices;
+
+    return TRUE;
+}
+
+
+
+// Build the mesh from the collected primitives. Returns FALSE on failure.
+static int build_mesh(void)
+{
+    unsigned long long total_vertices = 0, total_indices = 0;
+    unsigned int i, j, num_breaks = 0, has_normals = TRUE, has_texcoords = TRUE;
+    unsigned int *breaks;
+    unsigned char *grouped;
+    ZMaterial *mat;
+
+    // All vertices share one format, so only use what every primitive has.
+    for (i = 0; i < num_prims; i++) {
+        if (prims[i].normal < 0) has_normals = FALSE;
+        if (prims[i].texcoord < 0) has_texcoords = FALSE;
+    }
+
+    mesh->flags |= Z_MESH_VA_INDEXED;
+    if (has_normals) mesh->flags |= Z_MESH_HAS_NORMALS;
+    if (has_texcoords) mesh->flags |= Z_MESH_HAS_TEXCOORDS;
+
+    mesh->elem_size = 3 + (has_normals ? 3 : 0) + (has_texcoords ? 2 : 0);
+
+    // Primitives often share their vertices and only differ in material and indices, so vertices
+    // are only copied for the first primitive using a given set of attributes.
+    for (i = 0; i < num_prims; i++) {
+
+        for (j = 0; j < i; j++) {
+            if (prims[j].position == prims[i].position &&
+                (!has_normals || prims[j].normal == prims[i].normal) &&
+                (!has_texcoords || prims[j].texcoord == prims[i].texcoord))
+                break;
+        }
+
+        if (j < i) {
+            prims[i].base = prims[j].base;
+            continue;
+        }
+
+        prims[i].base = (unsigned int) total_vertices;
+        total_vertices += prims[i].num_vertices;
+    }
+
+    for (i = 0; i < num_prims; i++)
+        total_indices += prims[i].num_indices;
+
+    // The counts are 32-bit, anything that big wouldn't fit in memory anyway.
+    if (total_vertices > (unsigned int) -1 / (8*sizeof(float)) ||
+        total_indices > (unsigned int) -1 / sizeof(unsigned int)) {
+        zError("Failed to load \"%s\", too many vertices.", filename);
+        return FALSE;
+    }
+
+    mesh->vertices_size = (unsigned int) total_vertices;
+    mesh->indices_size = (unsigned int) total_indices;
+
+    materials = zArenaAlloc(&scratch, MAX(num_materials, 1) * sizeof(ZMaterial *));
+    breaks = zArenaAlloc(&scratch, num_prims * sizeof(unsigned int));
+    grouped = zArenaAlloc(&scratch, num_prims);
+    mesh->vertices = malloc(mesh->vertices_size * mesh->elem_size * sizeof(float));
+    mesh->indices = malloc(mesh->indices_size * sizeof(unsigned int));
+    mesh->groups = malloc(num_prims * sizeof(ZMeshGroup));
+
+    if (!materials || !breaks || !grouped || !mesh->vertices || !mesh->indices || !mesh->groups) {
+        zError("%s: Failed to allocate memory while loading \"%s\".", __func__, filename);
+        return FALSE;
+    }
+
+    memset(materials, '\0', MAX(num_materials, 1) * sizeof(ZMaterial *));
+    memset(grouped, '\0', num_prims);
+
+    for (i = 0; i < num_prims; i++) {
+        if (prims[i].base == mesh->num_vertices) {
+            copy_vertices(&(prims[i]));
+            mesh->num_vertices += prims[i].num_vertices;
+        }
+    }
+
+    // One group per material, made up of the primitives using it in the order they're listed.
+    for (i = 0; i < num_prims; i++) {
+
+        if (grouped[i]) continue;
+
+        mat = get_material(prims[i].material);
+
+        mesh->groups[mesh->num_groups].material = mat;
+        mesh->groups[mesh->num_groups].start = mesh->num_indices;
+
+        for (j = i; j < num_prims; j++) {
+
+            if (grouped[j] || prims[j].material != prims[i].material)
+                continue;
+
+            // Keep clusters from straddling primitives, they're usually separate parts.
+            if (mesh->num_indices > mesh->groups[mesh->num_groups].start)
+                breaks[num_breaks++] = mesh->num_indices;
+
+            if (!copy_indices(&(prims[j]))) {
+                zError("Failed to load \"%s\", index out of range.", filename);
+                return FALSE;
+            }
+
+            grouped[j] = TRUE;
+        }
+
+        mesh->groups[mesh->num_groups].count = mesh->num_indices -
+                                               mesh->groups[mesh->num_groups].start;
+        mesh->num_groups++;
+    }
+
+    zBuildMeshClusters(mesh, breaks, num_breaks);
+
+    return TRUE;
+}
+
+
+
+// Load mesh from a binary glTF file. Images are looked up relative to name, the name of the mesh.
+ZMesh *zLoadMeshGltf(const char *file, const char *name, unsigned int load_flags)
+{
+    const unsigned char *data;
+    size_t size;
+    int list;
+    ZMaterial *cur;
+    ZMesh *result = NULL;
+
+    filename = file;
+    resource_name = name;
+
+    if ( !(data = zMapFile(file, &size)) ) {
+        zWarning("Failed to open glTF mesh \"%s\".", file);
+        return NULL;
+    }
+
+    if ( !(mesh = calloc(1, sizeof(ZMesh))) ) {
+        zError("%s: Failed to allocate memory while loading \"%s\".", __func__, file);
+        zUnmapFile(data, size);
+        return NULL;
+    }
+
+    zArenaInit(&scratch, GLTF_SCRATCH_INITIAL_SIZE);
+
+    tokens = NULL;
+    tokens_size = num_tokens = 0;
+    prims = NULL;
+    num_prims = 0;
+    materials = NULL;
+
+    if (parse_glb(data, size) && collect_primitives()) {
+
+        list = get_member(0, "materials");
+        num_materials = list >= 0 && tokens[list].type == GLTF_JSON_ARRAY ? tokens[list].size : 0;
+
+        if (build_mesh()) {
+            result = mesh;
+        } else {
+            // Nothing took a reference to the materials yet.
+            while ( (cur = mesh->materials) ) {
+                mesh->materials = cur->next;
+                zDeleteMaterial(cur);
+            }
+
+            free(mesh->vertices);
+            free(mesh->indices);
+            free(mesh->groups);
+            free(mesh->clusters);
+            free(mesh);
+        }
+    } else {
+        free(mesh);
+    }
+
+    zDebug("Used %u KB of scratch memory while loading \"%s\".",
+        (unsigned int) (scratch.total / 1024), file);
+    zArenaFree(&scratch);
+    zUnmapFile(data, size);
+
+    mesh = NULL;
+    json = NULL;
+    bin = NULL;
+    tokens = NULL;
+    tokens_size = num_tokens = 0;
+    prims = NULL;
+    num_prims = 0;
+    materials = NULL;
+    num_materials = 0;
+
+    return result;
+}
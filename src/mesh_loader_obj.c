@@ -13,7 +13,8 @@
 /* This code can read Wavefront .OBJ model files (and referenced material libraries) with a bunch of
  * limitations and modifications:
  *
- *  - Only supports the basic v/vn/vt/f geometry keywords.
+ *  - Only supports the basic v/vn/vt/f geometry keywords. The o/g keywords don't create separate
+ *    groups, they are only used as hints for splitting the mesh into clusters.
  *
  *  - Only supports 2 dimensional texture coordinates, if given, the w component will be ignored.
  *
@@ -43,13 +44,14 @@
 #define OBJ_LINE_BUFFER_SIZE 2000
 #define OBJ_TOKEN_SIZE 100
 
-// Increase filled-up buffers by these values * sizeof(vec3). On windows, anything above 1500
-// doesn't give much improvement anymore. On Linux, any value works. Maybe realloc-ing isn't a good
-// idea on Windows?
-#define OBJ_VEC3_BUFFER_INC   5000
+// All buffers used while parsing come from the scratch arena, which is freed in one go once the
+// mesh is built. These are the initial number of elements for them, filled-up buffers are doubled
+// in size so large files don't spend most of their time copying.
+#define OBJ_VEC3_BUFFER_INITIAL   4096
+#define OBJ_VERTEX_BUFFER_INITIAL 1024
+#define OBJ_INDEX_BUFFER_INITIAL  1024
 
-#define OBJ_VERTEX_BUFFER_INC  1000
-#define OBJ_INDEX_BUFFER_INC   1000
+#define OBJ_SCRATCH_INITIAL_SIZE (1024*1024)
 
 // How far to search back when looking for shared vertices.
 #define OBJ_VERTEX_SEARCH_WINDOW 512
@@ -60,6 +62,8 @@
 
 static ZMesh *mesh;
 
+static ZArena scratch;
+
 static const char *filename; // For printing diagnostic messages.
 
 // Special processing options
@@ -84,7 +88,8 @@ static ZVec3 *texcoords;
 // Using seperate groups for each material enountered. Once done parsing I transform them into a
 // single vertex/index array and fill mesh->groups. This way I can reuse existing groups more easily
 // when lots of groups using the same materials are listed in a random order in the model file.
-static struct {
+typedef struct obj_group
+{
     float *vertices;
     unsigned int *indices;
     unsigned int num_vertices;
@@ -92,11 +97,33 @@ static struct {
     size_t indices_size;
     size_t vertices_size;
     ZMaterial *material;
-} groups[Z_MESH_MAXGROUPS];
-
+    unsigned int *breaks; // Offsets into indices (or vertices) where a new object/group started.
+    unsigned int num_breaks;
+    unsigned int breaks_size;
+} obj_group;
+
+// There's no limit to the number of groups, the array is grown like the other buffers.
+static obj_group *groups;
+static unsigned int groups_size;
 static unsigned int num_groups;
 static int cur_group;
 
+#define OBJ_GROUPS_INITIAL_SIZE 8
+
+// Material libraries referenced by the mesh, in the order they were referenced. Libraries are
+// parsed once and then shared by all meshes, see ZMaterialLib.
+static ZMaterialLib **libs;
+static unsigned int num_libs;
+static unsigned int libs_size;
+
+// Materials of the library being parsed, handed over to zAddMaterialLib once it's done.
+static ZMaterial *lib_materials;
+
+// Object/group boundaries for the whole mesh after transform_groups_to_mesh, passed on to
+// zBuildMeshClusters so that clusters don't span multiple objects.
+static unsigned int *mesh_breaks;
+static unsigned int num_mesh_breaks;
+
 // These hold the number of vec3's the currently allocated memory can hold.
 static unsigned int vertices_size;
 static unsigned int normals_size;
@@ -184,8 +211,8 @@ static void parse_vec3(int type)
     // Increase size of buffer if neccesary.
     if (*buffer_count >= *buffer_size) {
 
-        if ( ( *buffer = (ZVec3 *)
-                    realloc(*buffer, (*buffer_size+OBJ_VEC3_BUFFER_INC) * sizeof(ZVec3)) ) == NULL) {
+        if ( ( *buffer = (ZVec3 *) zArenaGrow(&scratch, *buffer, *buffer_size * sizeof(ZVec3),
+                    *buffer_size * 2 * sizeof(ZVec3)) ) == NULL) {
 
             zFatal("%s: Failed to (re)allocate more memory for datatype data while parsing \"%s\".",
                 __func__, filename);
@@ -193,7 +220,7 @@ static void parse_vec3(int type)
             exit(EXIT_FAILURE);
         }
 
-        *buffer_size += OBJ_VEC3_BUFFER_INC;
+        *buffer_size *= 2;
     }
 
     // Parse vertex coordinates, if one or more component is not parsed due to a malformed string,
@@ -333,9 +360,11 @@ static inline int grow_group_buffers(int type)
 
         if (groups[cur_group].num_vertices == groups[cur_group].vertices_size) {
 
-            float *tmp = (float *) realloc(groups[cur_group].vertices,
-                (groups[cur_group].vertices_size +
-                OBJ_VERTEX_BUFFER_INC) * mesh->elem_size * sizeof(float) );
+            size_t size = groups[cur_group].vertices_size ? groups[cur_group].vertices_size*2 :
+                                                            OBJ_VERTEX_BUFFER_INITIAL;
+            float *tmp = (float *) zArenaGrow(&scratch, groups[cur_group].vertices,
+                groups[cur_group].vertices_size * mesh->elem_size * sizeof(float),
+                size * mesh->elem_size * sizeof(float) );
 
             if (!tmp) {
                 zWarning("Failed to allocate memory for mesh vertex buffer.");
@@ -343,7 +372,7 @@ static inline int grow_group_buffers(int type)
             }
 
             groups[cur_group].vertices = tmp;
-            groups[cur_group].vertices_size += OBJ_VERTEX_BUFFER_INC;
+            groups[cur_group].vertices_size = size;
         }
 
     } else if (type == OBJ_GROW_INDICES) {
@@ -352,8 +381,11 @@ static inline int grow_group_buffers(int type)
 
         if (groups[cur_group].num_indices == groups[cur_group].indices_size) {
 
-            unsigned int *tmp = (unsigned int *) realloc(groups[cur_group].indices,
-                (groups[cur_group].indices_size + OBJ_INDEX_BUFFER_INC) * sizeof(unsigned int) );
+            size_t size = groups[cur_group].indices_size ? groups[cur_group].indices_size*2 :
+                                                           OBJ_INDEX_BUFFER_INITIAL;
+            unsigned int *tmp = (unsigned int *) zArenaGrow(&scratch, groups[cur_group].indices,
+                groups[cur_group].indices_size * sizeof(unsigned int),
+                size * sizeof(unsigned int) );
 
             if (!tmp) {
                 zWarning("Failed to allocate memory for mesh index buffer.");
@@ -361,7 +393,7 @@ static inline int grow_group_buffers(int type)
             }
 
             groups[cur_group].indices = tmp;
-            groups[cur_group].indices_size += OBJ_INDEX_BUFFER_INC;
+            groups[cur_group].indices_size = size;
         }
 
     } else {
@@ -556,7 +588,7 @@ static void parse_scale(void)
 
 
 
-// Add copy of default material to local material list and rename it with given name. Returns a
+// Add copy of default material to the library being parsed and rename it with given name. Returns a
 // pointer to the added material or NULL on error.
 static ZMaterial *add_new_material(const char *name)
 {
@@ -583,12 +615,11 @@ static ZMaterial *add_new_material(const char *name)
         mat->emission_color[3] = 1.0f;
 
         // Overwrite name.
-        mat->name[0] = '\0';
-        strncat(mat->name, name, Z_RESOURCE_NAME_SIZE-1);
+        mat->name = zIntern(name);
 
-        // Add material to this mesh's list.
-        mat->next = mesh->materials;
-        mesh->materials = mat;
+        // Add material to the library's list.
+        mat->next = lib_materials;
+        lib_materials = mat;
 
         return mat;
     }
@@ -646,11 +677,12 @@ static void parse_mtl_shininess(float *result)
 
 // Write texname prefixed with tex_prefix to dest. dest must be a char array of size
 // Z_RESOURCE_NAME_SIZE.
-static void set_texname(char *dest, char *texname)
+static void set_texname(const char **dest, char *texname)
 {
+    char buf[Z_RESOURCE_NAME_SIZE];
     int len;
 
-    dest[0] = '\0';
+    *dest = zIntern("");
 
     // Make sure the prefix and token lengths are < Z_RESOURCE_NAME_SIZE
     len = strlen(tex_prefix);
@@ -661,20 +693,49 @@ static void set_texname(char *dest, char *texname)
         return;
     }
 
-    strcat(dest, tex_prefix);
-    strcat(dest, texname);
+    buf[0] = '\0';
+    strcat(buf, tex_prefix);
+    strcat(buf, texname);
+
+    *dest = zIntern(buf);
 }
 
 
 
-// Parse a material library.
+// Add lib to the libraries materials are looked up in.
+static void add_lib(ZMaterialLib *lib)
+{
+    if (num_libs == libs_size) {
+
+        unsigned int size = libs_size ? libs_size*2 : 4;
+        ZMaterialLib **tmp = zArenaGrow(&scratch, libs, libs_size * sizeof(ZMaterialLib *),
+                                        size * sizeof(ZMaterialLib *));
+
+        if (!tmp) {
+            zWarning("Failed to allocate memory for material library while parsing \"%s\".",
+                filename);
+            return;
+        }
+
+        libs = tmp;
+        libs_size = size;
+    }
+
+    libs[num_libs++] = lib;
+}
+
+
+
+// Parse a material library, or reuse it if it was parsed before.
 static void parse_mtllib(void)
 {
-    const char *mtlpath;
+    const char *mtlpath, *key;
+    char keybuf[Z_PATH_SIZE + OBJ_TOKEN_SIZE + 1];
     FILE *fd;
     unsigned int line_count = 0;
     ZMaterial *mat = NULL; // Pointer to most recently added material. Will be NULL initially or if
                            // there was an error parsing a newmtl directive.
+    ZMaterialLib *lib;
 
     // Get filename.
     if ( !parse_token() ) {
@@ -690,12 +751,24 @@ static void parse_mtllib(void)
         return;
     }
 
+    // The texture prefix ends up in the texture names, so it's part of the key along with the path.
+    snprintf(keybuf, sizeof(keybuf), "%s\n%s", mtlpath, tex_prefix);
+    key = zIntern(keybuf);
+
+    if ( (lib = zLookupMaterialLib(key)) ) {
+        strcpy(tex_prefix, lib->tex_prefix);
+        add_lib(lib);
+        return;
+    }
+
     // Open file, start parsing lines.
     if ( (fd = fopen(mtlpath, "rb")) == NULL ) {
         zWarning("Failed to open material library \"%s\".", mtlpath);
         return;
     }
 
+    lib_materials = NULL;
+
     // If this becomes false, I need to check size of token when handling *_shader tokens..
     assert(Z_RESOURCE_NAME_SIZE > OBJ_TOKEN_SIZE);
 
@@ -734,15 +807,15 @@ static void parse_mtllib(void)
             // either as it might be part of a comment. For now I'm just going to leave it like this.
             else if (strcmp("map_Kd", token) == 0) {
                 if ( parse_token() ) {
-                    set_texname(mat->diffuse_map_name, token);
+                    set_texname(&(mat->diffuse_map_name), token);
                 }
             } else if (strcmp("map_Ks", token) == 0) {
                 if ( parse_token() ) {
-                    set_texname(mat->specular_map_name, token);
+                    set_texname(&(mat->specular_map_name), token);
                 }
             } else if (strcmp("bump", token) == 0) {
                 if ( parse_token() ) {
-                    set_texname(mat->normal_map_name, token);
+                    set_texname(&(mat->normal_map_name), token);
                 }
             } else if (strcmp("tex_wrap", token) == 0) {
                 if ( parse_token() ) {
@@ -764,13 +837,11 @@ static void parse_mtllib(void)
                 }
             } else if (strcmp("vertex_shader", token) == 0) {
                 if ( parse_token() ) {
-                    mat->vertex_shader[0] = '\0';
-                    strcat(mat->vertex_shader, token);
+                    mat->vertex_shader = zIntern(token);
                 }
             } else if (strcmp("fragment_shader", token) == 0) {
                 if ( parse_token() ) {
-                    mat->fragment_shader[0] = '\0';
-                    strcat(mat->fragment_shader, token);
+                    mat->fragment_shader = zIntern(token);
                 }
             }
             // Silently ignore comments and a bunch of unsupported keywords:
@@ -788,26 +859,41 @@ static void parse_mtllib(void)
 
     fclose(fd);
 
+    if ( (lib = zAddMaterialLib(key, lib_materials, zIntern(tex_prefix))) ) {
+        add_lib(lib);
+    } else {
+        zWarning("Failed to add material library \"%s\".", mtlpath);
+        while (lib_materials) {
+            mat = lib_materials->next;
+            zDeleteMaterial(lib_materials);
+            lib_materials = mat;
+        }
+    }
+
+    lib_materials = NULL;
 }
 
 
 
-// Lookup material for given name. Try local material list first, if that fails use the global list
-// (zLookupMaterial), if that fails too a pointer to the default material is returned.
+// Lookup material for given name. Try the material libraries first, the most recently referenced
+// one first. If that fails use the global list (zLookupMaterial), if that fails too a pointer to
+// the default material is returned.
 static ZMaterial *lookup_material(const char *name)
 {
-    ZMaterial *cur = mesh->materials;
+    ZMaterial *cur;
+    const char *interned = zIntern(name);
+    unsigned int i;
 
-    // Lookup in local list.
-    while (cur) {
-        if ( strcmp(cur->name, name) == 0) {
-            return cur;
+    // Lookup in the libraries.
+    for (i = num_libs; i-- > 0; ) {
+        for (cur = libs[i]->materials; cur; cur = cur->next) {
+            if (cur->name == interned)
+                return cur;
         }
-        cur = cur->next;
     }
 
     // If that fails use global list.
-    if ( (cur = zLookupMaterial(name)) ) {
+    if ( (cur = zLookupMaterial(interned)) ) {
         return cur;
     }
 
@@ -818,6 +904,31 @@ static ZMaterial *lookup_material(const char *name)
 
 
 
+// Add a new, empty group using material mat and make it the current one. Returns FALSE if memory
+// ran out.
+static int add_group(ZMaterial *mat)
+{
+    if (num_groups == groups_size) {
+
+        unsigned int size = groups_size ? groups_size*2 : OBJ_GROUPS_INITIAL_SIZE;
+        obj_group *tmp = zArenaGrow(&scratch, groups, groups_size * sizeof(obj_group),
+                                    size * sizeof(obj_group));
+
+        if (!tmp) return FALSE;
+
+        groups = tmp;
+        groups_size = size;
+    }
+
+    memset(&(groups[num_groups]), '\0', sizeof(obj_group));
+    groups[num_groups].material = mat;
+    cur_group = num_groups++;
+
+    return TRUE;
+}
+
+
+
 // Parse a material name.
 static void parse_usemtl(void)
 {
@@ -844,12 +955,8 @@ static void parse_usemtl(void)
     // Or if that fails, create a new group if the current one isn't still empty.
     if (groups[cur_group].num_vertices) {
 
-        // Add group if there's room
-        if (num_groups < Z_MESH_MAXGROUPS) {
-            cur_group = num_groups++;
-            groups[cur_group].material = mat;
-        } else {
-            zWarning("Unable to process material \"%s\" for \"%s\", reached MAXGROUPS.", token,
+        if (!add_group(mat)) {
+            zWarning("Failed to allocate memory for material \"%s\" while parsing \"%s\".", token,
                 filename);
         }
     } else {
@@ -860,19 +967,59 @@ static void parse_usemtl(void)
 
 
 
-// Transform the vertex/index data in groups into a single array in mesh. Returns TRUE on success,
-// or else FALSE. After this function completes it is guaranteed that the group vertex/index buffers
-// are freed.
+// Handle o/g keywords. I don't keep these as separate groups but I do remember where they start
+// in every material group so that clusters can be split along object boundaries later on.
+static void parse_object(void)
+{
+    unsigned int i, offset;
+
+    for (i = 0; i < num_groups; i++) {
+
+        offset = (mesh->flags & Z_MESH_VA_INDEXED) ? groups[i].num_indices : groups[i].num_vertices;
+
+        // Skip if nothing was added to this group since the last break.
+        if (offset == 0 || (groups[i].num_breaks && groups[i].breaks[groups[i].num_breaks-1] ==
+                offset))
+            continue;
+
+        if (groups[i].num_breaks == groups[i].breaks_size) {
+
+            unsigned int size = groups[i].breaks_size ? groups[i].breaks_size*2 : 16;
+            unsigned int *tmp = zArenaGrow(&scratch, groups[i].breaks,
+                groups[i].breaks_size * sizeof(unsigned int), size * sizeof(unsigned int));
+
+            // Not fatal, clusters just won't follow object boundaries as closely.
+            if (!tmp) return;
+
+            groups[i].breaks = tmp;
+            groups[i].breaks_size = size;
+        }
+
+        groups[i].breaks[groups[i].num_breaks++] = offset;
+    }
+}
+
+
+
+// Transform the vertex/index data in groups into a single array in mesh, sized exactly to hold
+// it. Returns TRUE on success, or else FALSE. The group buffers are left in the scratch arena.
 static int transform_groups_to_mesh(void)
 {
     unsigned int i, j;
 
+    unsigned int total_breaks = 0;
+
     // Figure out how much memory needs to be allocated for the unified vertex/index buffers.
     for (i = 0; i < num_groups; i++) {
         mesh->vertices_size += groups[i].num_vertices;
         mesh->indices_size += groups[i].num_indices;
+        total_breaks += groups[i].num_breaks;
     }
 
+    // Failing this isn't fatal, so I don't go to error_cleanup if it fails.
+    num_mesh_breaks = 0;
+    mesh_breaks = total_breaks ? zArenaAlloc(&scratch, total_breaks * sizeof(unsigned int)) : NULL;
+
     // Allocated the arrays.
     if (mesh->vertices_size) {
         mesh->vertices = malloc(mesh->vertices_size * mesh-> elem_size * sizeof(float));
@@ -886,6 +1033,10 @@ static int transform_groups_to_mesh(void)
             goto error_cleanup;
     }
 
+    // The mesh gets exactly as many groups as were used.
+    if ( !(mesh->groups = malloc(num_groups * sizeof(ZMeshGroup))) )
+        goto error_cleanup;
+
     // Iterate over all the groups, copy vertices / indices into arrays, update mesh group
     // start/counts.
     for (i = 0; i < num_groups; i++) {
@@ -902,6 +1053,12 @@ static int transform_groups_to_mesh(void)
         }
         mesh->num_groups++;
 
+        // Object boundaries are relative to the group start.
+        if (mesh_breaks) {
+            for (j = 0; j < groups[i].num_breaks; j++)
+                mesh_breaks[num_mesh_breaks++] = mesh->groups[i].start + groups[i].breaks[j];
+        }
+
         // Append vertices.
         memcpy(mesh->vertices+(mesh->num_vertices*mesh->elem_size), groups[i].vertices,
             groups[i].num_vertices*mesh->elem_size*sizeof(float));
@@ -914,10 +1071,6 @@ static int transform_groups_to_mesh(void)
             }
         }
         mesh->num_vertices += groups[i].num_vertices;
-
-        // Free this group's buffers.
-        free(groups[i].vertices);
-        free(groups[i].indices);
     }
     return TRUE;
 
@@ -927,13 +1080,11 @@ error_cleanup:
 
     free(mesh->vertices);
     free(mesh->indices);
+    free(mesh->groups);
     mesh->indices = NULL;
     mesh->vertices = NULL;
+    mesh->groups = NULL;
 
-    for (i = 0; i < num_groups; i++) {
-        free(groups[i].vertices);
-        free(groups[i].indices);
-    }
     return FALSE;
 }
 
@@ -944,7 +1095,7 @@ ZMesh *zLoadMeshObj(const char *file, unsigned int flags)
 {
     FILE *fd;
     filename = file;
-    vertices_size = normals_size = texcoords_size = OBJ_VEC3_BUFFER_INC;
+    vertices_size = normals_size = texcoords_size = OBJ_VEC3_BUFFER_INITIAL;
     vertex_count = normal_count = texcoord_count = ignored_faces = 0;
     warned_inconsistency = triangle_count = line_count = format_picked = face_vertex_count = 0;
     scale = 0.0f;
@@ -952,35 +1103,35 @@ ZMesh *zLoadMeshObj(const char *file, unsigned int flags)
 
     load_flags = flags;
 
-    mesh      = malloc(sizeof(ZMesh));
-    vertices  = malloc(OBJ_VEC3_BUFFER_INC * sizeof(ZVec3));
-    normals   = malloc(OBJ_VEC3_BUFFER_INC * sizeof(ZVec3));
-    texcoords = malloc(OBJ_VEC3_BUFFER_INC * sizeof(ZVec3));
+    groups = NULL;
+    groups_size = num_groups = 0;
+    libs = NULL;
+    libs_size = num_libs = 0;
+    mesh_breaks = NULL;
+    num_mesh_breaks = 0;
 
     if ( (fd = fopen(file, "rb")) == NULL ) {
         zWarning("Failed to open OBJ mesh \"%s\".", file);
         return NULL;
     }
 
+    zArenaInit(&scratch, OBJ_SCRATCH_INITIAL_SIZE);
 
-    if (!mesh || !vertices || !normals || !texcoords ) {
+    mesh      = calloc(1, sizeof(ZMesh));
+    vertices  = zArenaAlloc(&scratch, OBJ_VEC3_BUFFER_INITIAL * sizeof(ZVec3));
+    normals   = zArenaAlloc(&scratch, OBJ_VEC3_BUFFER_INITIAL * sizeof(ZVec3));
+    texcoords = zArenaAlloc(&scratch, OBJ_VEC3_BUFFER_INITIAL * sizeof(ZVec3));
+
+    // Setup initial group.
+    if (!mesh || !vertices || !normals || !texcoords || !add_group(&default_material)) {
 
         zFatal("%s: Failed to allocate memory while parsing \"%s\". Aborting.", __func__, filename);
+        fclose(fd);
         free(mesh);
-        free(vertices);
-        free(normals);
-        free(texcoords);
+        zArenaFree(&scratch);
         return NULL;
     }
 
-    memset(mesh, '\0', sizeof(ZMesh));
-
-    // Initialize groups and setup initial group.
-    memset(groups, '\0', sizeof(groups));
-    num_groups = 1;
-    cur_group = 0;
-    groups[0].material = &default_material;
-
     // By default I use indexed vertex arrays, unless the NOINDEX load flags was given. If it later
     // turns out (after loading, see below) that no vertices were shared I remove the indices and
     // unset the VA_INDEXED bit again.
@@ -1004,11 +1155,11 @@ ZMesh *zLoadMeshObj(const char *file, unsigned int flags)
             else if (strcmp("mtllib", token) == 0)  parse_mtllib();
             else if (strcmp("usemtl", token) == 0)  parse_usemtl();
             else if (strcmp("normalize", token) == 0) load_flags |= Z_MESH_LOAD_NORMALIZE;
+            else if (strcmp("o", token) == 0)       parse_object();
+            else if (strcmp("g", token) == 0)       parse_object();
 
             // These are silently ignored.
             else if (strcmp("s", token) == 0);
-            else if (strcmp("o", token) == 0);
-            else if (strcmp("g", token) == 0);
             else if (strcmp("#", token) == 0);
             else {
                 zWarning("Unknown keyword encountered on line %d in file \"%s\". Ignoring.",
@@ -1017,11 +1168,8 @@ ZMesh *zLoadMeshObj(const char *file, unsigned int flags)
         }
     }
 
-    // We're now done with parsing and dereferencing v/vn/vt so I can close the file and get rid of
-    // those buffers.
-    free(vertices);
-    free(normals);
-    free(texcoords);
+    // We're now done with parsing and dereferencing v/vn/vt so I can close the file, the buffers go
+    // along with the rest of the scratch arena below.
     fclose(fd);
 
     if (transform_groups_to_mesh()) {
@@ -1036,10 +1184,27 @@ ZMesh *zLoadMeshObj(const char *file, unsigned int flags)
             mesh->indices = NULL;
             mesh->num_indices = 0;
         }
+
+        // Since no vertices were shared in that case, the index offsets of the object boundaries
+        // are equal to the vertex offsets, so they remain valid.
+        if (mesh->num_vertices) zBuildMeshClusters(mesh, mesh_breaks, num_mesh_breaks);
     } else {
+        free(mesh);
         mesh = NULL;
     }
 
+    // Everything used while parsing goes in one go.
+    zDebug("Used %u KB of scratch memory while loading \"%s\".",
+        (unsigned int) (scratch.total / 1024), file);
+    zArenaFree(&scratch);
+
+    vertices = normals = texcoords = NULL;
+    groups = NULL;
+    groups_size = num_groups = 0;
+    libs = NULL;
+    libs_size = num_libs = 0;
+    mesh_breaks = NULL;
+
     if (ignored_faces) {
         zWarning("%u faces were ignored due to parsing errors in \"%s\".", ignored_faces, filename);
     }
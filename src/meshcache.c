@@ -0,0 +1,459 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "common.h"
+
+
+#define Z_MESHCACHE_MAGIC   0x434d525a // "ZRMC"
+#define Z_MESHCACHE_VERSION 1
+
+// Header at the start of each file in the mesh cache, followed by the vertex, index and tangent
+// arrays, exactly as they are uploaded. The header is a multiple of 8 bytes, so the arrays are
+// properly aligned when the file is mapped.
+typedef struct ZMeshCacheHeader
+{
+    unsigned long long content_hash; // See ZMesh.content_hash.
+
+    unsigned int magic;
+    unsigned int version;
+    unsigned int flags;
+    unsigned int elem_size;
+    unsigned int num_vertices;
+    unsigned int num_indices;
+
+} ZMeshCacheHeader;
+
+
+// A mesh being written to the mesh cache by a worker, see zQueueMeshCacheSave.
+typedef struct ZMeshCacheSave
+{
+    // Mesh being saved, only touched by the main thread. Set to NULL if the mesh is deleted before
+    // the save is done, the save then owns the arrays and frees them.
+    ZMesh *mesh;
+
+    // What the worker gets to see of the mesh: a shallow copy of which only the name, layout,
+    // arrays and content hash are used. The worker fills in the hash if it isn't set yet.
+    ZMesh copy;
+
+    unsigned long long limit; // fs_meshcachemb in bytes, when the save was queued.
+    int ok;                   // Set by the worker if the mesh cache has the data.
+
+    struct ZMeshCacheSave *next;
+
+} ZMeshCacheSave;
+
+
+// Mesh cache entry found by zTrimMeshCache.
+typedef struct ZMeshCacheEntry
+{
+    char name[24];
+    unsigned long long size, mtime;
+
+} ZMeshCacheEntry;
+
+typedef struct ZMeshCacheList
+{
+    ZMeshCacheEntry *entries;
+    unsigned int count, size;
+    unsigned long long total;
+
+} ZMeshCacheList;
+
+
+static ZMutex *save_lock;
+static ZMeshCacheSave *done_saves; // Saves finished by the workers (protected by save_lock).
+
+static ZMutex *trim_lock;
+static unsigned long long cache_size; // Bytes in the mesh cache, as far as I know (protected by
+                                      // trim_lock).
+static unsigned long long start_limit; // fs_meshcachemb for the trim at startup.
+
+
+
+// Returns the name of the mesh cache entry for mesh. The returned string is only valid until the
+// next call from the same thread.
+static const char *zMeshCacheFile(const ZMesh *mesh)
+{
+    static Z_THREAD_LOCAL char filename[32];
+    unsigned long long key;
+
+    key = zHashData(Z_HASH_INIT, mesh->name, strlen(mesh->name));
+    key = zHashData(key, &mesh->content_hash, sizeof(mesh->content_hash));
+
+    snprintf(filename, sizeof(filename), "%016llx.zmc", key);
+    filename[sizeof(filename)-1] = '\0';
+
+    return filename;
+}
+
+
+
+// Sizes of the arrays of mesh in bytes.
+static void zMeshCacheSizes(const ZMesh *mesh, size_t *vertices, size_t *indices, size_t *tangents)
+{
+    *vertices = (size_t) mesh->num_vertices * mesh->elem_size * sizeof(float);
+    *indices  = (mesh->flags & Z_MESH_VA_INDEXED) ? mesh->num_indices * sizeof(unsigned int) : 0;
+    *tangents = zMeshTangentsSize(mesh);
+}
+
+
+
+// Map the mesh cache entry for mesh and point data at its arrays. Returns FALSE if there is no
+// entry, or it doesn't hold the data mesh had when it was stored. data must be passed to
+// zUnmapCachedMesh when done.
+int zMapCachedMesh(const ZMesh *mesh, ZMeshData *data)
+{
+    const ZMeshCacheHeader *header;
+    const char *path, *pos;
+    size_t vertices_size, indices_size, tangents_size;
+
+    memset(data, '\0', sizeof(ZMeshData));
+
+    if (!mesh->content_hash) return FALSE;
+
+    if ( !(path = zGetPath(zMeshCacheFile(mesh), Z_MESHCACHE_DIR, Z_FILE_FORCEUSER)) ||
+         !(data->map = zMapFile(path, &data->map_size)) )
+        return FALSE;
+
+    zMeshCacheSizes(mesh, &vertices_size, &indices_size, &tangents_size);
+
+    header = data->map;
+
+    if ( data->map_size != sizeof(ZMeshCacheHeader) + vertices_size + indices_size +
+                           tangents_size ||
+         header->magic != Z_MESHCACHE_MAGIC || header->version != Z_MESHCACHE_VERSION ||
+         header->content_hash != mesh->content_hash || header->flags != mesh->flags ||
+         header->elem_size != mesh->elem_size || header->num_vertices != mesh->num_vertices ||
+         header->num_indices != mesh->num_indices ) {
+        zWarning("Ignoring invalid mesh cache entry for \"%s\".", mesh->name);
+        zUnmapCachedMesh(data);
+        return FALSE;
+    }
+
+    pos = (const char *) (header + 1);
+
+    data->vertices = (const float *) pos;
+    data->indices  = indices_size  ? (const unsigned int *) (pos + vertices_size) : NULL;
+    data->tangents = tangents_size ? (const float *) (pos + vertices_size + indices_size) : NULL;
+
+    // The header could match by accident (or the file got damaged), so check the data for real.
+    if (zHashMeshData(mesh, data->vertices, data->indices, data->tangents) != mesh->content_hash) {
+        zWarning("Mesh cache entry for \"%s\" doesn't match the mesh.", mesh->name);
+        zUnmapCachedMesh(data);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+
+void zUnmapCachedMesh(ZMeshData *data)
+{
+    zUnmapFile(data->map, data->map_size);
+    memset(data, '\0', sizeof(ZMeshData));
+}
+
+
+
+// Store the data of mesh in the mesh cache, unless it is already there. mesh->content_hash must be
+// set (see zHashMeshData). Adds the size of the entry to *written if it had to be written, returns
+// FALSE on failure.
+static int zSaveCachedMesh(const ZMesh *mesh, unsigned long long *written)
+{
+    FILE *fp;
+    ZMeshCacheHeader header;
+    ZMeshData data;
+    const char *dir;
+    size_t vertices_size, indices_size, tangents_size;
+    int ok;
+
+    assert(mesh->content_hash && mesh->vertices);
+
+    // An entry from an earlier run (or an earlier drop, see zDropMeshData) will do fine.
+    if (zMapCachedMesh(mesh, &data)) {
+        zUnmapCachedMesh(&data);
+        return TRUE;
+    }
+
+    if ( !(dir = zGetPath(Z_MESHCACHE_DIR, NULL, Z_FILE_FORCEUSER)) || !zMakeDir(dir) )
+        return FALSE;
+
+    if ( !(fp = zOpenFile(zMeshCacheFile(mesh), Z_MESHCACHE_DIR, NULL,
+                          Z_FILE_FORCEUSER | Z_FILE_WRITE)) ) {
+        zWarning("Failed to open mesh cache entry for \"%s\" for writing.", mesh->name);
+        return FALSE;
+    }
+
+    zMeshCacheSizes(mesh, &vertices_size, &indices_size, &tangents_size);
+
+    memset(&header, '\0', sizeof(header));
+    header.content_hash = mesh->content_hash;
+    header.magic        = Z_MESHCACHE_MAGIC;
+    header.version      = Z_MESHCACHE_VERSION;
+    header.flags        = mesh->flags;
+    header.elem_size    = mesh->elem_size;
+    header.num_vertices = mesh->num_vertices;
+    header.num_indices  = mesh->num_indices;
+
+    ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+         fwrite(mesh->vertices, vertices_size, 1, fp) == 1 &&
+         (!indices_size  || fwrite(mesh->indices, indices_size, 1, fp) == 1) &&
+         (!tangents_size || fwrite(mesh->tangents, tangents_size, 1, fp) == 1);
+
+    // A truncated entry fails the size check in zMapCachedMesh, so it doesn't need to be removed.
+    if (fclose(fp) != 0) ok = FALSE;
+
+    if (!ok) zWarning("Failed to write mesh cache entry for \"%s\".", mesh->name);
+    else *written += sizeof(header) + vertices_size + indices_size + tangents_size;
+
+    return ok;
+}
+
+
+
+// zIterDir callback for zTrimMeshCache, adds file to the ZMeshCacheList in data if it looks like a
+// mesh cache entry.
+static void zAddMeshCacheEntry(const char *file, void *data)
+{
+    ZMeshCacheList *list = data;
+    ZMeshCacheEntry *entry;
+    const char *name = strrchr(file, *Z_DIR_SEPARATOR);
+    unsigned long long size, mtime;
+
+    name = name ? name + 1 : file;
+
+    if ( strlen(name) != 20 || strcmp(name + 16, ".zmc") != 0 ||
+         !zGetFileStat(file, &size, &mtime) )
+        return;
+
+    if (list->count == list->size) {
+
+        unsigned int size = list->size ? list->size * 2 : 64;
+
+        if ( !(entry = realloc(list->entries, size * sizeof(ZMeshCacheEntry))) )
+            return;
+
+        list->entries = entry;
+        list->size = size;
+    }
+
+    entry = &list->entries[list->count++];
+    strcpy(entry->name, name);
+    entry->size  = size;
+    entry->mtime = mtime;
+
+    list->total += size;
+}
+
+
+
+static int zCompareEntryAge(const void *a, const void *b)
+{
+    const ZMeshCacheEntry *ea = a, *eb = b;
+
+    return ea->mtime < eb->mtime ? -1 : ea->mtime > eb->mtime;
+}
+
+
+
+// Add up the size of the mesh cache and, if it's over limit (and limit isn't 0), delete the oldest
+// entries until it's down to 3/4 of limit, so the next few writes don't have to trim again. A
+// mesh whose entry gets deleted while its data is dropped is read from its source file again when
+// needed (see zMeshMakeResident).
+static void zTrimMeshCache(unsigned long long limit)
+{
+    ZMeshCacheList list;
+    const char *path;
+    char dir[Z_PATH_SIZE];
+    unsigned int i;
+
+    memset(&list, '\0', sizeof(list));
+
+    if ( !(path = zGetPath(Z_MESHCACHE_DIR, NULL, Z_FILE_FORCEUSER)) )
+        return;
+
+    strcpy(dir, path);
+
+    if (trim_lock) zLockMutex(trim_lock);
+
+    zIterDir(dir, zAddMeshCacheEntry, &list);
+
+    if (limit && list.total > limit) {
+
+        qsort(list.entries, list.count, sizeof(ZMeshCacheEntry), zCompareEntryAge);
+
+        for (i = 0; i < list.count && list.total > limit / 4 * 3; i++) {
+
+            if ( !(path = zGetPath(list.entries[i].name, Z_MESHCACHE_DIR, Z_FILE_FORCEUSER)) ||
+                 !zDeleteFile(path) )
+                continue;
+
+            list.total -= list.entries[i].size;
+        }
+
+        if (fs_printdiskload)
+            zDebug("Trimmed mesh cache to %llu KB.", list.total / 1024);
+    }
+
+    cache_size = list.total;
+
+    if (trim_lock) zUnlockMutex(trim_lock);
+
+    free(list.entries);
+}
+
+
+
+static void zTrimMeshCacheJob(void *data)
+{
+    zTrimMeshCache(start_limit);
+}
+
+
+
+void zMeshCacheInit(void)
+{
+    assert(!save_lock && !trim_lock);
+
+    // Without locks meshes are simply saved on the main thread (see zQueueMeshCacheSave).
+    if ( !(save_lock = zCreateMutex()) || !(trim_lock = zCreateMutex()) ) {
+        zWarning("Failed to create mesh cache locks, saving meshes on the main thread.");
+        if (save_lock) zDeleteMutex(save_lock);
+        save_lock = NULL;
+    }
+
+    // Entries from earlier runs count towards the limit as well.
+    start_limit = (unsigned long long) fs_meshcachemb * 1024 * 1024;
+
+    if (save_lock)
+        zAddJob(zTrimMeshCacheJob, NULL);
+    else
+        zTrimMeshCache(start_limit);
+}
+
+
+
+void zMeshCacheDeinit(void)
+{
+    // Make sure no worker is still writing an entry, then let the meshes have their results.
+    zFlushJobs();
+    zUpdateMeshCache();
+
+    if (save_lock) zDeleteMutex(save_lock);
+    if (trim_lock) zDeleteMutex(trim_lock);
+    save_lock = trim_lock = NULL;
+}
+
+
+
+static void zMeshCacheSaveJob(void *data)
+{
+    ZMeshCacheSave *save = data;
+    ZMesh *copy = &save->copy;
+    unsigned long long written = 0;
+    int trim;
+
+    if (!copy->content_hash)
+        copy->content_hash = zHashMeshData(copy, copy->vertices, copy->indices, copy->tangents);
+
+    save->ok = zSaveCachedMesh(copy, &written);
+
+    if (written) {
+
+        if (trim_lock) zLockMutex(trim_lock);
+        cache_size += written;
+        trim = save->limit && cache_size > save->limit;
+        if (trim_lock) zUnlockMutex(trim_lock);
+
+        if (trim) zTrimMeshCache(save->limit);
+    }
+
+    if (save_lock) zLockMutex(save_lock);
+    save->next = done_saves;
+    done_saves = save;
+    if (save_lock) zUnlockMutex(save_lock);
+}
+
+
+
+// Start writing the data of mesh to the mesh cache on a worker, so it can be dropped from memory
+// (see r_meshdropdata). The data stays with the mesh until zUpdateMeshCache sees that the entry is
+// written, and must not change in the meantime.
+void zQueueMeshCacheSave(ZMesh *mesh)
+{
+    ZMeshCacheSave *save;
+
+    assert(!mesh->shared && mesh->vertices && !mesh->cache_save);
+
+    if ( !(save = malloc(sizeof(ZMeshCacheSave))) ) {
+        zError("%s: Failed to allocate memory while saving mesh \"%s\".", __func__, mesh->name);
+        return;
+    }
+
+    memset(save, '\0', sizeof(ZMeshCacheSave));
+    save->mesh  = mesh;
+    save->copy  = *mesh;
+    save->limit = (unsigned long long) fs_meshcachemb * 1024 * 1024;
+
+    mesh->cache_save = save;
+
+    if (save_lock)
+        zAddJob(zMeshCacheSaveJob, save);
+    else
+        zMeshCacheSaveJob(save);
+}
+
+
+
+// Stop caring about the save for mesh (because mesh is about to be deleted). The save takes over
+// the data of mesh, so the mesh must not free it.
+void zCancelMeshCacheSave(ZMesh *mesh)
+{
+    if (!mesh->cache_save) return;
+
+    mesh->cache_save->mesh = NULL;
+    mesh->cache_save = NULL;
+
+    mesh->vertices = mesh->tangents = NULL;
+    mesh->indices = NULL;
+}
+
+
+
+// Drop the data of meshes whose mesh cache entries the workers have written. Should be called once
+// per frame.
+void zUpdateMeshCache(void)
+{
+    ZMeshCacheSave *done, *save;
+
+    if (save_lock) zLockMutex(save_lock);
+    done = done_saves;
+    done_saves = NULL;
+    if (save_lock) zUnlockMutex(save_lock);
+
+    while ( (save = done) ) {
+
+        done = save->next;
+
+        if (save->mesh) {
+
+            save->mesh->cache_save = NULL;
+
+            // Without a cache entry there would be no way back, so the mesh keeps its data then.
+            if (save->ok && r_meshdropdata) {
+                save->mesh->content_hash = save->copy.content_hash;
+                zDropMeshData(save->mesh);
+            }
+
+        } else {
+            free(save->copy.vertices);
+            free(save->copy.indices);
+            free(save->copy.tangents);
+        }
+
+        free(save);
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef __MESHCACHE_H__
+#define __MESHCACHE_H__
+
+#include "mesh.h"
+
+// The mesh cache keeps the final vertex, index and tangent data of meshes (after atlas packing and
+// tangent generation) in the user directory, so a mesh can drop its in-memory copy once it is
+// uploaded (see r_meshdropdata) and map it back in whenever the VBOs need to be rebuilt. Entries
+// are keyed on the mesh name and the hash of its data, and only used if the data hashes the same.
+// Entries are written by the job pool, and the oldest are deleted when the cache grows beyond
+// fs_meshcachemb.
+
+#define Z_MESHCACHE_DIR "meshcache"
+
+
+// ZMeshData - Data of a mesh mapped in from the mesh cache, the arrays point into the mapping and
+// are laid out as in ZMesh.
+typedef struct ZMeshData
+{
+    const float *vertices;
+    const unsigned int *indices; // NULL if the mesh isn't indexed.
+    const float *tangents;       // NULL if the mesh has no tangents.
+
+    const void *map;
+    size_t map_size;
+
+} ZMeshData;
+
+
+
+void zMeshCacheInit(void);
+
+void zMeshCacheDeinit(void);
+
+void zQueueMeshCacheSave(ZMesh *mesh);
+
+void zCancelMeshCacheSave(ZMesh *mesh);
+
+void zUpdateMeshCache(void);
+
+int zMapCachedMesh(const ZMesh *mesh, ZMeshData *data);
+
+void zUnmapCachedMesh(ZMeshData *data);
+
+#endif
@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+    #include <strings.h>
+#endif
+#include <assert.h>
+
+#include "common.h"
+
+
+typedef struct ZMeshLoad
+{
+    // Placeholder being loaded, only touched by the main thread. Set to NULL if the placeholder is
+    // deleted before the load is done, the result is then just thrown away.
+    ZMesh *mesh;
+
+    const char *name; // Interned, so the worker doesn't need to look at the placeholder.
+    unsigned int load_flags;
+
+    ZMesh *result; // Mesh read by zReadMesh, NULL if that failed.
+
+    struct ZMeshLoad *next;
+
+} ZMeshLoad;
+
+
+ZMesh *zLoadMeshObj(const char *filename, unsigned int load_flags);
+ZMesh *zLoadMeshPly(const char *filename, unsigned int load_flags);
+ZMesh *zLoadMeshGltf(const char *filename, const char *name, unsigned int load_flags);
+
+
+static ZMutex *read_lock; // Held while a loader runs.
+
+static ZMutex *done_lock;
+static ZMeshLoad *done_loads; // Loads finished by the workers, newest first (protected by
+                              // done_lock).
+
+static ZMeshLoad *upload_head; // Loads waiting to be uploaded, oldest first (main thread only).
+static ZMeshLoad *upload_tail;
+
+static int pending; // Loads queued and not yet deleted (main thread only).
+
+
+
+void zMeshLoadInit(void)
+{
+    assert(!done_lock && !read_lock);
+
+    // Without locks meshes are simply loaded on the main thread (see zQueueMeshLoad).
+    if ( !(read_lock = zCreateMutex()) || !(done_lock = zCreateMutex()) ) {
+        zWarning("Failed to create mesh load locks, loading meshes on the main thread.");
+        if (read_lock) zDeleteMutex(read_lock);
+        read_lock = NULL;
+    }
+}
+
+
+
+static void zDeleteMeshLoad(ZMeshLoad *load)
+{
+    if (load->mesh) load->mesh->load = NULL;
+
+    if (load->result) zDeleteReadMesh(load->result);
+
+    pending--;
+    free(load);
+}
+
+
+
+void zMeshLoadDeinit(void)
+{
+    ZMeshLoad *tmp;
+
+    // Make sure no worker is still working on a load.
+    zFlushJobs();
+
+    while (done_loads) {
+        tmp = done_loads->next;
+        zDeleteMeshLoad(done_loads);
+        done_loads = tmp;
+    }
+
+    while (upload_head) {
+        tmp = upload_head->next;
+        zDeleteMeshLoad(upload_head);
+        upload_head = tmp;
+    }
+
+    upload_tail = NULL;
+
+    if (done_lock) zDeleteMutex(done_lock);
+    if (read_lock) zDeleteMutex(read_lock);
+    done_lock = read_lock = NULL;
+}
+
+
+
+// Read mesh name (which should be interned) from disk with the loader for its format, and split it
+// into clusters. The mesh isn't registered or set up any further, see zLoadMesh and
+// zFinishMeshLoad for that. Returns NULL on failure. Safe to call from any thread.
+ZMesh *zReadMesh(const char *name, unsigned int load_flags)
+{
+    ZMesh *mesh;
+    char *ext = zGetFileExtension(name);
+    const char *realpath;
+
+    if (fs_printdiskload) zDebug("Loading mesh \"%s\" from disk.", name);
+
+    if (strlen(name) >= Z_RESOURCE_NAME_SIZE) {
+        zError("Mesh name \"%s\" exceeds RESOURCE_NAME_SIZE, not loading.", name);
+        return NULL;
+    }
+
+    if (strcasecmp(ext, "obj") != 0 && strcasecmp(ext, "ply") != 0 &&
+        strcasecmp(ext, "glb") != 0) {
+        zError("Unable to determine model format for \"%s\"", name);
+        return NULL;
+    }
+
+    realpath = zGetPath(name, NULL, Z_FILE_REWRITE_DIRSEP | Z_FILE_TRYUSER);
+
+    if (read_lock) zLockMutex(read_lock);
+
+    if (strcasecmp(ext, "obj") == 0)
+        mesh = zLoadMeshObj(realpath, load_flags);
+    else if (strcasecmp(ext, "ply") == 0)
+        mesh = zLoadMeshPly(realpath, load_flags);
+    else
+        mesh = zLoadMeshGltf(realpath, name, load_flags);
+
+    if (read_lock) zUnlockMutex(read_lock);
+
+    if (!mesh) return NULL;
+
+    mesh->name = name;
+
+    // The loader may already have built clusters if it knows about object boundaries.
+    if (!mesh->clusters && mesh->num_vertices)
+        zBuildMeshClusters(mesh, NULL, 0);
+
+    return mesh;
+}
+
+
+
+// Runs on a worker thread. Fills in load->result and hands the load back to the main thread.
+static void zMeshLoadJob(void *data)
+{
+    ZMeshLoad *load = data;
+
+    load->result = zReadMesh(load->name, load->load_flags);
+
+    if (done_lock) zLockMutex(done_lock);
+    load->next = done_loads;
+    done_loads = load;
+    if (done_lock) zUnlockMutex(done_lock);
+}
+
+
+
+// Start loading the data for placeholder mesh in the background, zUpdateMeshLoads moves it into
+// the placeholder once it's read.
+void zQueueMeshLoad(ZMesh *mesh, unsigned int load_flags)
+{
+    ZMeshLoad *load;
+
+    assert(!mesh->load);
+
+    if ( !(load = malloc(sizeof(ZMeshLoad))) ) {
+        zError("%s: Failed to allocate memory while loading mesh \"%s\".", __func__, mesh->name);
+        return;
+    }
+
+    memset(load, '\0', sizeof(ZMeshLoad));
+    load->mesh = mesh;
+    load->name = mesh->name;
+    load->load_flags = load_flags;
+
+    mesh->load = load;
+    pending++;
+
+    if (done_lock)
+        zAddJob(zMeshLoadJob, load);
+    else
+        zMeshLoadJob(load);
+}
+
+
+
+// Stop caring about the load for mesh (because mesh is about to be deleted).
+void zCancelMeshLoad(ZMesh *mesh)
+{
+    if (!mesh->load) return;
+
+    mesh->load->mesh = NULL;
+    mesh->load = NULL;
+}
+
+
+
+// Returns TRUE while any mesh load is unfinished. Meshes that were read but not yet set up refer to
+// materials they hold no references to, so material libraries shouldn't be deleted until then.
+int zMeshLoadsPending(void)
+{
+    return pending > 0;
+}
+
+
+
+// Take the meshes the workers have read, and set up and upload as many of them as the per-frame
+// budget allows. Should be called once per frame.
+void zUpdateMeshLoads(void)
+{
+    ZMeshLoad *done, *load, *tmp = NULL;
+    unsigned int budget = r_meshuploadkb * 1024, used = 0, size;
+
+    // Grab finished loads and add them to the upload queue, in the order they were finished.
+    if (done_lock) zLockMutex(done_lock);
+    done = done_loads;
+    done_loads = NULL;
+    if (done_lock) zUnlockMutex(done_lock);
+
+    // The done list is newest first, so reverse it before appending it to the upload queue.
+    while (done) {
+        load = done;
+        done = done->next;
+        load->next = tmp;
+        tmp = load;
+    }
+
+    while (tmp) {
+
+        load = tmp;
+        tmp = tmp->next;
+        load->next = NULL;
+
+        if (upload_tail)
+            upload_tail->next = load;
+        else
+            upload_head = load;
+
+        upload_tail = load;
+    }
+
+    while ( (load = upload_head) ) {
+
+        if (load->mesh && load->result) {
+
+            size = (load->result->num_vertices * load->result->elem_size +
+                    load->result->num_indices) * sizeof(float);
+
+            // Always finish at least one mesh per frame, or large meshes would never make it.
+            if (used && used + size > budget)
+                break;
+
+            zFinishMeshLoad(load->mesh, load->result, load->load_flags);
+            load->result = NULL;
+            used += size;
+
+        } else if (load->mesh) {
+            zWarning("Failed to load mesh \"%s\", leaving it empty.", load->name);
+        }
+
+        upload_head = load->next;
+        if (!upload_head) upload_tail = NULL;
+
+        zDeleteMeshLoad(load);
+    }
+}
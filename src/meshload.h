@@ -0,0 +1,28 @@
+#ifndef __MESHLOAD_H__
+#define __MESHLOAD_H__
+
+#include "mesh.h"
+
+// Meshes can be loaded in the background. zLookupMeshAsync hands out an empty placeholder right
+// away and zQueueMeshLoad has a worker thread read the file. zUpdateMeshLoads then moves the result
+// into the placeholder and uploads it, staying under r_meshuploadkb per frame. Placeholders have no
+// vertices until then, and aren't drawn (see zMeshReady).
+//
+// The loaders keep their state in static variables, so only one mesh is read at a time, whether
+// in the background or by zLookupMesh (both go through zReadMesh).
+
+void zMeshLoadInit(void);
+
+void zMeshLoadDeinit(void);
+
+ZMesh *zReadMesh(const char *name, unsigned int load_flags);
+
+void zQueueMeshLoad(ZMesh *mesh, unsigned int load_flags);
+
+void zCancelMeshLoad(ZMesh *mesh);
+
+int zMeshLoadsPending(void);
+
+void zUpdateMeshLoads(void);
+
+#endif
@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include "common.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define Z_MIPMAP_SSE
+#include <emmintrin.h>
+#endif
+
+
+#define Z_MIPMAP_MAX_TAPS  4    // Enough for a scale factor in [2, 3).
+#define Z_MIPMAP_BAND_ROWS 32   // Minimum number of output rows per band.
+#define Z_LINEAR_STEPS     4096 // Size of the linear to sRGB table.
+
+
+// Source pixels (along one axis) covered by one output pixel, and how much each contributes.
+typedef struct ZMipTaps
+{
+    int first;
+    int count;
+    float weight[Z_MIPMAP_MAX_TAPS];
+
+} ZMipTaps;
+
+
+// Everything zDownsampleBand needs to filter its part of a level.
+typedef struct ZDownsample
+{
+    const unsigned char *src;
+    int width;
+    int height;
+
+    unsigned char *dst;
+    int new_width;
+    int new_height;
+
+    const ZMipTaps *htaps;
+    const ZMipTaps *vtaps;
+
+    int normalmap;
+    int color; // Filter the RGB channels in linear light (see Z_TEX_COLOR).
+    int band_rows;
+
+    float *acc; // new_width RGBA floats of scratch space per band.
+
+} ZDownsample;
+
+
+static float srgb_to_linear[256];  // sRGB byte to linear float.
+static float byte_to_unit[256];    // Plain byte to [0, 1], for alpha.
+static float byte_to_signed[256];  // Plain byte to [-1, 1], for normal map vectors.
+static unsigned char linear_to_srgb[Z_LINEAR_STEPS+1];
+
+
+
+// Set up the conversion tables. Must be called before any thread uses zDownsample.
+void zMipmapInit(void)
+{
+    float c;
+    int i;
+
+    for (i = 0; i < 256; i++) {
+
+        c = i / 255.0f;
+
+        srgb_to_linear[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+        byte_to_unit[i]   = c;
+        byte_to_signed[i] = c * 2.0f - 1.0f;
+    }
+
+    for (i = 0; i <= Z_LINEAR_STEPS; i++) {
+
+        c = (float) i / Z_LINEAR_STEPS;
+        c = c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f/2.4f) - 0.055f;
+
+        linear_to_srgb[i] = (unsigned char) (c * 255.0f + 0.5f);
+    }
+}
+
+
+
+// Work out which source pixels each of the dst_size output pixels covers. Each output pixel covers
+// src_size/dst_size source pixels, which isn't a whole number for odd sizes, so the pixels on the
+// edges of its footprint are weighted by how much of them it covers.
+static void zComputeTaps(ZMipTaps *taps, int src_size, int dst_size)
+{
+    float scale = (float) src_size / dst_size, lo, hi;
+    int i, s;
+
+    for (i = 0; i < dst_size; i++) {
+
+        lo = i * scale;
+        hi = (i+1) * scale;
+
+        taps[i].first = (int) lo;
+        taps[i].count = 0;
+
+        for (s = taps[i].first; s < hi && s < src_size && taps[i].count < Z_MIPMAP_MAX_TAPS; s++) {
+            taps[i].weight[taps[i].count++] = (MIN(s+1, hi) - (s > lo ? s : lo)) / scale;
+        }
+    }
+}
+
+
+
+// Add weight times row, filtered horizontally, to acc (new_width RGBA floats).
+static void zAccumulateRow(float *acc, const unsigned char *row, const ZMipTaps *htaps,
+    int new_width, float weight, const float * const *tables)
+{
+    const unsigned char *p;
+    int x, k;
+
+#ifdef Z_MIPMAP_SSE
+    __m128 vweight = _mm_set1_ps(weight), sum, px;
+
+    for (x = 0; x < new_width; x++, acc += 4) {
+
+        sum = _mm_setzero_ps();
+
+        for (k = 0, p = row + htaps[x].first*4; k < htaps[x].count; k++, p += 4) {
+            px  = _mm_set_ps(tables[3][p[3]], tables[2][p[2]], tables[1][p[1]], tables[0][p[0]]);
+            sum = _mm_add_ps(sum, _mm_mul_ps(px, _mm_set1_ps(htaps[x].weight[k])));
+        }
+
+        _mm_storeu_ps(acc, _mm_add_ps(_mm_loadu_ps(acc), _mm_mul_ps(sum, vweight)));
+    }
+#else
+    float sum[4], w;
+    int c;
+
+    for (x = 0; x < new_width; x++, acc += 4) {
+
+        sum[0] = sum[1] = sum[2] = sum[3] = 0.0f;
+
+        for (k = 0, p = row + htaps[x].first*4; k < htaps[x].count; k++, p += 4) {
+            w = htaps[x].weight[k];
+            for (c = 0; c < 4; c++)
+                sum[c] += tables[c][p[c]] * w;
+        }
+
+        for (c = 0; c < 4; c++)
+            acc[c] += sum[c] * weight;
+    }
+#endif
+}
+
+
+
+static unsigned char zUnitToByte(float c)
+{
+    if (c <= 0.0f) return 0;
+    if (c >= 1.0f) return 255;
+    return (unsigned char) (c * 255.0f + 0.5f);
+}
+
+
+
+// Convert a row of filtered pixels back to bytes.
+static void zEncodeRow(unsigned char *dst, const float *acc, int new_width, int normalmap,
+    int color)
+{
+    float len;
+    int x, c;
+
+    for (x = 0; x < new_width; x++, acc += 4, dst += 4) {
+
+        if (normalmap) {
+
+            // Averaging shortens the vectors, so stretch them back to unit length.
+            len = sqrtf(acc[0]*acc[0] + acc[1]*acc[1] + acc[2]*acc[2]);
+            len = len > 1e-6f ? 1.0f / len : 0.0f;
+
+            for (c = 0; c < 3; c++)
+                dst[c] = zUnitToByte(acc[c] * len * 0.5f + 0.5f);
+
+        } else if (!color) {
+
+            for (c = 0; c < 3; c++)
+                dst[c] = zUnitToByte(acc[c]);
+
+        } else {
+
+            for (c = 0; c < 3; c++) {
+                if (acc[c] <= 0.0f)
+                    dst[c] = linear_to_srgb[0];
+                else if (acc[c] >= 1.0f)
+                    dst[c] = linear_to_srgb[Z_LINEAR_STEPS];
+                else
+                    dst[c] = linear_to_srgb[(int) (acc[c]*Z_LINEAR_STEPS + 0.5f)];
+            }
+        }
+
+        dst[3] = zUnitToByte(acc[3]);
+    }
+}
+
+
+
+// Filter one band of rows of a level, called through zParallelFor.
+static void zDownsampleBand(void *data, int band)
+{
+    const ZDownsample *ds = data;
+    const float *tables[4];
+    float *acc = ds->acc + (size_t) band * ds->new_width * 4;
+    int y, y_end, k;
+
+    if (ds->normalmap)
+        tables[0] = tables[1] = tables[2] = byte_to_signed;
+    else if (ds->color)
+        tables[0] = tables[1] = tables[2] = srgb_to_linear;
+    else
+        tables[0] = tables[1] = tables[2] = byte_to_unit;
+
+    tables[3] = byte_to_unit;
+
+    y     = band * ds->band_rows;
+    y_end = MIN(y + ds->band_rows, ds->new_height);
+
+    for (; y < y_end; y++) {
+
+        const ZMipTaps *vtaps = ds->vtaps + y;
+
+        memset(acc, '\0', ds->new_width * 4 * sizeof(float));
+
+        for (k = 0; k < vtaps->count; k++) {
+            zAccumulateRow(acc, ds->src + (vtaps->first + k) * ds->width * 4, ds->htaps,
+                ds->new_width, vtaps->weight[k], tables);
+        }
+
+        zEncodeRow(ds->dst + y * ds->new_width * 4, acc, ds->new_width, ds->normalmap,
+            ds->color);
+    }
+}
+
+
+
+// Build the next mipmap level for a width x height RGBA image into dst, which is half its size
+// (rounded down) in each dimension. flags are the Z_TEX_* flags of the texture. Returns FALSE on
+// failure.
+int zDownsample(const unsigned char *src, int width, int height, unsigned int flags,
+    unsigned char *dst)
+{
+    ZDownsample ds;
+    ZMipTaps *taps;
+    int num_bands;
+
+    ds.src        = src;
+    ds.width      = width;
+    ds.height     = height;
+    ds.dst        = dst;
+    ds.new_width  = width > 1  ? width/2  : 1;
+    ds.new_height = height > 1 ? height/2 : 1;
+    ds.normalmap  = (flags & Z_TEX_NORMALMAP) != 0;
+    ds.color      = !ds.normalmap && (flags & Z_TEX_COLOR);
+
+    if ( !(taps = malloc((ds.new_width + ds.new_height) * sizeof(ZMipTaps))) ) {
+        zError("%s: Failed to allocate memory.", __func__);
+        return FALSE;
+    }
+
+    zComputeTaps(taps, width, ds.new_width);
+    zComputeTaps(taps + ds.new_width, height, ds.new_height);
+
+    ds.htaps = taps;
+    ds.vtaps = taps + ds.new_width;
+
+    // Only split up levels that are large enough to be worth it.
+    num_bands = MIN(ds.new_height / Z_MIPMAP_BAND_ROWS, Z_JOBS_MAX_THREADS+1);
+    if (num_bands < 1) num_bands = 1;
+
+    ds.band_rows = (ds.new_height + num_bands - 1) / num_bands;
+
+    // Scratch space is allocated up front, so the bands themselves can't fail.
+    if ( !(ds.acc = malloc((size_t) num_bands * ds.new_width * 4 * sizeof(float))) ) {
+        zError("%s: Failed to allocate memory.", __func__);
+        free(taps);
+        return FALSE;
+    }
+
+    zParallelFor(num_bands, zDownsampleBand, &ds);
+
+    free(ds.acc);
+    free(taps);
+
+    return TRUE;
+}
@@ -0,0 +1,16 @@
+#ifndef __MIPMAP_H__
+#define __MIPMAP_H__
+
+// Mipmap generation for RGBA images. Each level is box filtered from the one above it, with the
+// channels of color maps (Z_TEX_COLOR) averaged in linear space rather than as sRGB values, and
+// with exact coverage weights so non-power-of-two sizes don't need rescaling first. Normal maps are
+// averaged as vectors and renormalized instead, other data maps are averaged as they are. Large
+// levels are split into bands of rows that are filtered in parallel (see zParallelFor), and SSE is
+// used where available.
+
+void zMipmapInit(void);
+
+int zDownsample(const unsigned char *src, int width, int height, unsigned int flags,
+    unsigned char *dst);
+
+#endif
@@ -1,4 +1,5 @@
-#define _POSIX_C_SOURCE 199309L // For nanosleep (from time.h)
+#define _POSIX_C_SOURCE 200809L // For nanosleep (from time.h), pthreads and pread
+#define _FILE_OFFSET_BITS 64    // So pread can reach beyond 2GB on 32-bit systems
 #define __USE_POSIX             // For signal stuff
 
 #include <stdio.h>
@@ -12,12 +13,16 @@
 #include <pwd.h>
 #include <sys/types.h> // required by sys/stat.h?
 #include <sys/stat.h>  // stat
+#include <sys/mman.h>  // mmap
 #include <sys/time.h>  // gettimeofday
 #include <X11/Xlib.h>
 #include <X11/keysym.h>
 #include <X11/extensions/Xrandr.h>
 #include <GL/glew.h>
 #include <dirent.h> // opendir etc.
+#include <fcntl.h>  // open
+#include <pthread.h>
+#include <semaphore.h>
 
 // older versions of glxew.h have a stray 'uint' in them, make sure compiler doesn't error out on it
 // (was only an issue for me with -std=c99)
@@ -124,8 +129,14 @@ int main(int argc, char** argv)
 
 void zSleep(float ms)
 {
-    static struct timespec ts = { 0, 0 };
-    ts.tv_nsec = (unsigned int) ms*1000000;
+    // Local, since this gets called from worker threads too.
+    struct timespec ts;
+
+    if (ms <= 0.0f) return;
+
+    ts.tv_sec  = (time_t) (ms / 1000.0f);
+    ts.tv_nsec = (long) ((ms - ts.tv_sec * 1000.0f) * 1000000.0f);
+    if (ts.tv_nsec > 999999999) ts.tv_nsec = 999999999;
 
     nanosleep(&ts, NULL);
 }
@@ -1542,6 +1553,153 @@ int zPathExists(const char *path)
 
 
 
+int zMakeDir(const char *path)
+{
+    int exists = zPathExists(path);
+
+    if (exists == Z_EXISTS_DIR)
+        return TRUE;
+
+    if (exists) {
+        zWarning("\"%s\" exists but is not a directory.", path);
+        return FALSE;
+    }
+
+    if (mkdir(path, 0755) != 0) {
+        zWarning("Failed to create directory \"%s\".", path);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+
+int zGetFileStat(const char *path, unsigned long long *size, unsigned long long *mtime)
+{
+    struct stat s;
+
+    if (stat(path, &s) != 0)
+        return FALSE;
+
+    *size  = s.st_size;
+    *mtime = s.st_mtime;
+
+    return TRUE;
+}
+
+
+
+int zReadFileRange(const char *path, unsigned long long offset, void *buf, size_t size)
+{
+    int fd;
+    ssize_t result;
+    size_t done = 0;
+
+    if ( (fd = open(path, O_RDONLY)) < 0 )
+        return FALSE;
+
+    while (done < size) {
+        if ( (result = pread(fd, (char *) buf + done, size - done, (off_t) (offset + done))) <= 0 )
+            break;
+        done += result;
+    }
+
+    close(fd);
+
+    return done == size;
+}
+
+
+
+const void *zMapFile(const char *path, size_t *size)
+{
+    int fd;
+    struct stat s;
+    void *data;
+
+    if ( (fd = open(path, O_RDONLY)) < 0 )
+        return NULL;
+
+    if (fstat(fd, &s) != 0 || s.st_size <= 0 || (unsigned long long) s.st_size > (size_t) -1) {
+        close(fd);
+        return NULL;
+    }
+
+    data = mmap(NULL, (size_t) s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    // The mapping holds on to the file by itself.
+    close(fd);
+
+    if (data == MAP_FAILED)
+        return NULL;
+
+    *size = (size_t) s.st_size;
+
+    return data;
+}
+
+
+
+void zUnmapFile(const void *data, size_t size)
+{
+    if (data) munmap((void *) data, size);
+}
+
+
+
+int zIterDir(const char *path, void (*func)(const char *file, void *data), void *data)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char file[Z_PATH_SIZE];
+
+    if ( !(dir = opendir(path)) )
+        return FALSE;
+
+    while ( (entry = readdir(dir)) ) {
+
+        if (snprintf(file, sizeof(file), "%s%s%s", path, Z_DIR_SEPARATOR, entry->d_name) >=
+                (int) sizeof(file))
+            continue;
+
+        if (zPathExists(file) == Z_EXISTS_REGULAR)
+            func(file, data);
+    }
+
+    closedir(dir);
+
+    return TRUE;
+}
+
+
+
+int zDeleteFile(const char *path)
+{
+    return unlink(path) == 0;
+}
+
+
+
+size_t zGetProcessRSS(void)
+{
+    FILE *fp;
+    unsigned long pages_total, pages_resident;
+    long page_size = sysconf(_SC_PAGESIZE);
+    int ok;
+
+    if ( page_size <= 0 || !(fp = fopen("/proc/self/statm", "r")) )
+        return 0;
+
+    // First field is the total program size, the second the resident set, both in pages.
+    ok = fscanf(fp, "%lu %lu", &pages_total, &pages_resident) == 2;
+    fclose(fp);
+
+    return ok ? (size_t) pages_resident * (size_t) page_size : 0;
+}
+
+
+
 char *zGetFileFromDir(const char *path)
 {
     static int start = 1;
@@ -1607,3 +1765,154 @@ char *zGetFileFromDir(const char *path)
     return NULL;
 }
 
+
+
+struct ZThread
+{
+    pthread_t thread;
+
+    void (*func)(void *);
+    void *data;
+};
+
+struct ZMutex
+{
+    pthread_mutex_t mutex;
+};
+
+struct ZSemaphore
+{
+    sem_t sem;
+};
+
+
+
+int zGetNumCPUs(void)
+{
+    long num = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return num > 0 ? (int) num : 1;
+}
+
+
+
+// pthreads wants a function returning void *, this just calls the real thread function.
+static void *zThreadStart(void *data)
+{
+    ZThread *thread = data;
+
+    thread->func(thread->data);
+
+    return NULL;
+}
+
+
+
+ZThread *zCreateThread(void (*func)(void *), void *data)
+{
+    ZThread *thread;
+
+    if ( !(thread = malloc(sizeof(ZThread))) )
+        return NULL;
+
+    thread->func = func;
+    thread->data = data;
+
+    if (pthread_create(&thread->thread, NULL, zThreadStart, thread) != 0) {
+        zError("%s: Failed to create thread.", __func__);
+        free(thread);
+        return NULL;
+    }
+
+    return thread;
+}
+
+
+
+void zJoinThread(ZThread *thread)
+{
+    pthread_join(thread->thread, NULL);
+    free(thread);
+}
+
+
+
+ZMutex *zCreateMutex(void)
+{
+    ZMutex *mutex;
+
+    if ( !(mutex = malloc(sizeof(ZMutex))) )
+        return NULL;
+
+    if (pthread_mutex_init(&mutex->mutex, NULL) != 0) {
+        zError("%s: Failed to create mutex.", __func__);
+        free(mutex);
+        return NULL;
+    }
+
+    return mutex;
+}
+
+
+
+void zDeleteMutex(ZMutex *mutex)
+{
+    pthread_mutex_destroy(&mutex->mutex);
+    free(mutex);
+}
+
+
+
+void zLockMutex(ZMutex *mutex)
+{
+    pthread_mutex_lock(&mutex->mutex);
+}
+
+
+
+void zUnlockMutex(ZMutex *mutex)
+{
+    pthread_mutex_unlock(&mutex->mutex);
+}
+
+
+
+ZSemaphore *zCreateSemaphore(unsigned int count)
+{
+    ZSemaphore *sem;
+
+    if ( !(sem = malloc(sizeof(ZSemaphore))) )
+        return NULL;
+
+    if (sem_init(&sem->sem, 0, count) != 0) {
+        zError("%s: Failed to create semaphore.", __func__);
+        free(sem);
+        return NULL;
+    }
+
+    return sem;
+}
+
+
+
+void zDeleteSemaphore(ZSemaphore *sem)
+{
+    sem_destroy(&sem->sem);
+    free(sem);
+}
+
+
+
+void zWaitSemaphore(ZSemaphore *sem)
+{
+    // Retry if interrupted by a signal.
+    while (sem_wait(&sem->sem) != 0)
+        ;
+}
+
+
+
+void zPostSemaphore(ZSemaphore *sem)
+{
+    sem_post(&sem->sem);
+}
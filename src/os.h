@@ -54,6 +54,70 @@ char *zGetUserDir(void);
 // Returns one of Z_EXISTS_* (depending on type of file), or 0 if path doesn't exist.
 int zPathExists(const char *path);
 
+// Create directory at path if it doesn't exist yet. Returns TRUE if path is a directory afterwards,
+// FALSE otherwise.
+int zMakeDir(const char *path);
+
+// Look up size (in bytes) and modification time (in some OS-specific unit) of file at path. Returns
+// FALSE if the file couldn't be found.
+int zGetFileStat(const char *path, unsigned long long *size, unsigned long long *mtime);
+
+// Read size bytes at offset (which may be beyond 4GB) from the file at path into buf. Returns FALSE
+// if the file couldn't be opened or is too short. Safe to call from any thread.
+int zReadFileRange(const char *path, unsigned long long offset, void *buf, size_t size);
+
+// Map the entire file at path into memory, read-only, and write its size to *size. Returns NULL if
+// the file couldn't be opened or mapped (empty files can't be mapped either). The mapping stays
+// valid until it is passed to zUnmapFile, along with the same size.
+const void *zMapFile(const char *path, size_t *size);
+
+void zUnmapFile(const void *data, size_t size);
+
+// Call func with the full path of each regular file in the directory at path, which (unlike for
+// zGetFileFromDir) is a full path itself. Safe to call from any thread. Returns FALSE if the
+// directory couldn't be opened.
+int zIterDir(const char *path, void (*func)(const char *file, void *data), void *data);
+
+// Delete the file at path. Returns FALSE if that failed.
+int zDeleteFile(const char *path);
+
+// Returns the resident set size of the process (the memory it actually occupies) in bytes, or 0 if
+// the OS won't tell.
+size_t zGetProcessRSS(void);
+
+
+
+// Threading primitives, just enough for the job pool in jobs.c. These are opaque and allocated by
+// the create functions, which return NULL on failure.
+typedef struct ZThread ZThread;
+typedef struct ZMutex ZMutex;
+typedef struct ZSemaphore ZSemaphore;
+
+// Returns the number of CPUs (cores) available, at least 1.
+int zGetNumCPUs(void);
+
+ZThread *zCreateThread(void (*func)(void *), void *data);
+
+// Wait for thread to return and free it.
+void zJoinThread(ZThread *thread);
+
+ZMutex *zCreateMutex(void);
+
+void zDeleteMutex(ZMutex *mutex);
+
+void zLockMutex(ZMutex *mutex);
+
+void zUnlockMutex(ZMutex *mutex);
+
+ZSemaphore *zCreateSemaphore(unsigned int count);
+
+void zDeleteSemaphore(ZSemaphore *sem);
+
+// Wait until the count is above zero, then decrement it.
+void zWaitSemaphore(ZSemaphore *sem);
+
+void zPostSemaphore(ZSemaphore *sem);
+
 // Returns strings for each regular file found in directory 'path' (path is relative to data
 // directory). Returns NULL when no more files are found. This function should only be called in a
 // while loop that terminates when NULL is returned so it can clean up after itself. For ease of
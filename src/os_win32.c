@@ -1,13 +1,16 @@
 #define UNICODE
 #include <windows.h>
 #include <shlobj.h>
+#include <psapi.h>   // GetProcessMemoryInfo
 #include <io.h>
+#include <process.h> // _beginthreadex
 #include <conio.h>
 #include <crtdbg.h>
 
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <assert.h>
 #include <GL/glew.h>
 #include <GL/wglew.h>
@@ -999,6 +1002,202 @@ int zPathExists(const char *path)
 
 
 
+int zMakeDir(const char *path)
+{
+    WCHAR pathwide[MAX_PATH];
+    int exists = zPathExists(path);
+
+    if (exists == Z_EXISTS_DIR)
+        return TRUE;
+
+    if (exists) {
+        zWarning("\"%s\" exists but is not a directory.", path);
+        return FALSE;
+    }
+
+    if ( !MultiByteToWideChar(CP_UTF8, 0, path, -1, pathwide, MAX_PATH) ) {
+        zError("%s: Character set conversion for path \"%s\" failed", __func__, path);
+        return FALSE;
+    }
+
+    if (!CreateDirectoryW(pathwide, NULL)) {
+        zWarning("Failed to create directory \"%s\".", path);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+
+int zGetFileStat(const char *path, unsigned long long *size, unsigned long long *mtime)
+{
+    WCHAR pathwide[MAX_PATH];
+    WIN32_FILE_ATTRIBUTE_DATA attrib;
+
+    if ( !MultiByteToWideChar(CP_UTF8, 0, path, -1, pathwide, MAX_PATH) ) {
+        zError("%s: Character set conversion for path \"%s\" failed", __func__, path);
+        return FALSE;
+    }
+
+    if (!GetFileAttributesExW(pathwide, GetFileExInfoStandard, &attrib))
+        return FALSE;
+
+    *size  = ((unsigned long long) attrib.nFileSizeHigh << 32) | attrib.nFileSizeLow;
+    *mtime = ((unsigned long long) attrib.ftLastWriteTime.dwHighDateTime << 32) |
+             attrib.ftLastWriteTime.dwLowDateTime;
+
+    return TRUE;
+}
+
+
+
+int zReadFileRange(const char *path, unsigned long long offset, void *buf, size_t size)
+{
+    WCHAR pathwide[MAX_PATH];
+    HANDLE file;
+    OVERLAPPED overlapped;
+    DWORD read = 0;
+    int ok;
+
+    if ( !MultiByteToWideChar(CP_UTF8, 0, path, -1, pathwide, MAX_PATH) ) {
+        zError("%s: Character set conversion for path \"%s\" failed", __func__, path);
+        return FALSE;
+    }
+
+    file = CreateFileW(pathwide, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (file == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    // The offset goes in the OVERLAPPED structure so there's no shared file position to seek.
+    ZeroMemory(&overlapped, sizeof(overlapped));
+    overlapped.Offset     = (DWORD) offset;
+    overlapped.OffsetHigh = (DWORD) (offset >> 32);
+
+    ok = ReadFile(file, buf, (DWORD) size, &read, &overlapped) && read == size;
+
+    CloseHandle(file);
+
+    return ok;
+}
+
+
+
+const void *zMapFile(const char *path, size_t *size)
+{
+    WCHAR pathwide[MAX_PATH];
+    HANDLE file, mapping;
+    LARGE_INTEGER file_size;
+    const void *data = NULL;
+
+    if ( !MultiByteToWideChar(CP_UTF8, 0, path, -1, pathwide, MAX_PATH) ) {
+        zError("%s: Character set conversion for path \"%s\" failed", __func__, path);
+        return NULL;
+    }
+
+    file = CreateFileW(pathwide, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    if ( GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0 &&
+         (unsigned long long) file_size.QuadPart <= (size_t) -1 &&
+         (mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL)) ) {
+
+        // The view keeps the mapping (and the file) open by itself.
+        data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
+    }
+
+    CloseHandle(file);
+
+    if (data) *size = (size_t) file_size.QuadPart;
+
+    return data;
+}
+
+
+
+void zUnmapFile(const void *data, size_t size)
+{
+    if (data) UnmapViewOfFile(data);
+}
+
+
+
+int zIterDir(const char *path, void (*func)(const char *file, void *data), void *data)
+{
+    WCHAR search_path[MAX_PATH];
+    WIN32_FIND_DATAW entry;
+    HANDLE handle;
+    char filename[Z_PATH_SIZE], file[Z_PATH_SIZE];
+
+    if ( (strlen(path) + 3) > (MAX_PATH-1) ) {
+        zWarning("Failed to open directory \"%s\", path length exceeded MAX_PATH.", path);
+        return FALSE;
+    }
+
+    snprintf(file, sizeof(file), "%s%s*", path, Z_DIR_SEPARATOR);
+
+    if ( !MultiByteToWideChar(CP_UTF8, 0, file, -1, search_path, MAX_PATH) ) {
+        zError("%s: Character set conversion for path \"%s\" failed", __func__, path);
+        return FALSE;
+    }
+
+    if ( (handle = FindFirstFileW(search_path, &entry)) == INVALID_HANDLE_VALUE )
+        return FALSE;
+
+    do {
+        if ( !WideCharToMultiByte(CP_UTF8, 0, entry.cFileName, -1, filename, Z_PATH_SIZE, NULL,
+                NULL) )
+            continue;
+
+        if ( (strlen(path) + strlen(filename) + 1) > (MAX_PATH-1) )
+            continue;
+
+        snprintf(file, sizeof(file), "%s%s%s", path, Z_DIR_SEPARATOR, filename);
+
+        if (zPathExists(file) == Z_EXISTS_REGULAR)
+            func(file, data);
+
+    } while (FindNextFileW(handle, &entry));
+
+    FindClose(handle);
+
+    return TRUE;
+}
+
+
+
+int zDeleteFile(const char *path)
+{
+    WCHAR pathwide[MAX_PATH];
+
+    if ( !MultiByteToWideChar(CP_UTF8, 0, path, -1, pathwide, MAX_PATH) ) {
+        zError("%s: Character set conversion for path \"%s\" failed", __func__, path);
+        return FALSE;
+    }
+
+    return DeleteFileW(pathwide) != 0;
+}
+
+
+
+size_t zGetProcessRSS(void)
+{
+    PROCESS_MEMORY_COUNTERS counters;
+
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+
+    return counters.WorkingSetSize;
+}
+
+
+
 char *zGetFileFromDir(const char *path)
 {
     int len;
@@ -1086,3 +1285,151 @@ char *zGetFileFromDir(const char *path)
 }
 
 
+
+struct ZThread
+{
+    HANDLE handle;
+
+    void (*func)(void *);
+    void *data;
+};
+
+struct ZMutex
+{
+    CRITICAL_SECTION cs;
+};
+
+struct ZSemaphore
+{
+    HANDLE handle;
+};
+
+
+
+int zGetNumCPUs(void)
+{
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+
+    return info.dwNumberOfProcessors > 0 ? (int) info.dwNumberOfProcessors : 1;
+}
+
+
+
+// Using _beginthreadex rather than CreateThread so the CRT is set up properly for the new thread,
+// this just calls the real thread function.
+static unsigned __stdcall zThreadStart(void *data)
+{
+    ZThread *thread = data;
+
+    thread->func(thread->data);
+
+    return 0;
+}
+
+
+
+ZThread *zCreateThread(void (*func)(void *), void *data)
+{
+    ZThread *thread;
+
+    if ( !(thread = malloc(sizeof(ZThread))) )
+        return NULL;
+
+    thread->func = func;
+    thread->data = data;
+
+    if ( !(thread->handle = (HANDLE) _beginthreadex(NULL, 0, zThreadStart, thread, 0, NULL)) ) {
+        zError("%s: Failed to create thread.", __func__);
+        free(thread);
+        return NULL;
+    }
+
+    return thread;
+}
+
+
+
+void zJoinThread(ZThread *thread)
+{
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+    free(thread);
+}
+
+
+
+ZMutex *zCreateMutex(void)
+{
+    ZMutex *mutex;
+
+    if ( !(mutex = malloc(sizeof(ZMutex))) )
+        return NULL;
+
+    InitializeCriticalSection(&mutex->cs);
+
+    return mutex;
+}
+
+
+
+void zDeleteMutex(ZMutex *mutex)
+{
+    DeleteCriticalSection(&mutex->cs);
+    free(mutex);
+}
+
+
+
+void zLockMutex(ZMutex *mutex)
+{
+    EnterCriticalSection(&mutex->cs);
+}
+
+
+
+void zUnlockMutex(ZMutex *mutex)
+{
+    LeaveCriticalSection(&mutex->cs);
+}
+
+
+
+ZSemaphore *zCreateSemaphore(unsigned int count)
+{
+    ZSemaphore *sem;
+
+    if ( !(sem = malloc(sizeof(ZSemaphore))) )
+        return NULL;
+
+    if ( !(sem->handle = CreateSemaphore(NULL, count, LONG_MAX, NULL)) ) {
+        zError("%s: Failed to create semaphore.", __func__);
+        free(sem);
+        return NULL;
+    }
+
+    return sem;
+}
+
+
+
+void zDeleteSemaphore(ZSemaphore *sem)
+{
+    CloseHandle(sem->handle);
+    free(sem);
+}
+
+
+
+void zWaitSemaphore(ZSemaphore *sem)
+{
+    WaitForSingleObject(sem->handle, INFINITE);
+}
+
+
+
+void zPostSemaphore(ZSemaphore *sem)
+{
+    ReleaseSemaphore(sem->handle, 1, NULL);
+}
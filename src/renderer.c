@@ -98,8 +98,17 @@ void zRendererInit(void)
     zMeshInit();
     zMaterialInit();
     zShaderInit();
+    zStreamInit();
+    zTextureArrayInit();
+    zTextureLoadInit();
+    zVirtualTextureInit();
     zTextRenderInit();
 
+    // Get shader programs for all loaded materials and the current scene compiling up front, so
+    // they are less likely to cause hitches when first drawn.
+    zIterMaterials(zQueueMaterialShaders, NULL);
+    if (scene) zQueueSceneShaders(scene);
+
     renderer_active = 1;
 }
 
@@ -113,9 +122,14 @@ void zRendererDeinit(void)
     // Mark current scene non-resident.
     if (scene) zMakeSceneNonResident(scene);
 
+    zImpostorDeinit();
     zMeshDeinit();
     zMaterialDeinit();
+    zTextureLoadDeinit();
+    zTextureArrayDeinit();
+    zVirtualTextureDeinit();
     zShaderDeinit();
+    zStreamDeinit();
     zTextRenderDeinit();
 
     // Release currently pressed keys. I used to skip running key bindings here for some reason (I
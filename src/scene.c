@@ -7,6 +7,7 @@
 #include "common.h"
 
 unsigned int sceneload_count;
+int collect_pending;
 
 // Making a scene resident involves setting OpenGL state (i.e. set up the OpenGL lights), usually
 // done once after load or after the OpenGL context has been destroyed.
@@ -130,6 +131,7 @@ void zDrawScene(ZScene *scene)
 {
     //unsigned int i;
     ZPosable *cur_pos;
+    ZFrustum frustum;
 
     if (!scene->is_resident) zMakeSceneResident(scene);
 
@@ -143,6 +145,7 @@ void zDrawScene(ZScene *scene)
     glDepthRange(0.0, 1.0-r_skydepthsize);
     zCameraApplyViewing(&scene->camera, 0);
     zCameraApplyProjection(&scene->camera);
+    zCameraGetFrustum(&scene->camera, &frustum, 0);
 
     /*
     // Update light positions.
@@ -166,10 +169,13 @@ void zDrawScene(ZScene *scene)
         // TODO: apply posable transormations.
         switch (cur_pos->type) {
             case Z_POSABLE_STATICMESH:
+                // Meshes still loading in the background are skipped until they're ready.
+                if (!zMeshReady(cur_pos->subject.mesh)) break;
                 //glPushMatrix();
                 //glRotatef(23.4f, 1.0f, 0.0f, 0.0f);
                 //glRotatef(time_elapsed*10.0f, 0.0f, 1.0f, 0.0f);
-                zDrawMesh(cur_pos->subject.mesh);
+                if (!zQueueImpostor(cur_pos->subject.mesh, &frustum))
+                    zDrawMesh(cur_pos->subject.mesh, &frustum);
                 //zDrawMesh(cur_pos->subject.mesh);
                 //glPopMatrix();
                 break;
@@ -177,16 +183,20 @@ void zDrawScene(ZScene *scene)
         cur_pos = cur_pos->next;
     }
 
+    // Draw far away meshes that were queued as impostors above.
+    zDrawImpostors(&frustum);
+
     // Draw sky posables.
     if (!r_nosky) {
         glDepthRange(1.0-r_skydepthsize, 1.0);
         zCameraApplyViewing(&scene->camera, 1);
+        zCameraGetFrustum(&scene->camera, &frustum, 1);
         cur_pos = scene->sky_posables;
 
         while (cur_pos) {
             switch (cur_pos->type) {
                 case Z_POSABLE_STATICMESH:
-                    zDrawMesh(cur_pos->subject.mesh);
+                    zDrawMesh(cur_pos->subject.mesh, &frustum);
                     break;
             }
             cur_pos = cur_pos->next;
@@ -199,6 +209,30 @@ void zDrawScene(ZScene *scene)
 
 
 
+// Draw the scene for the virtual texture feedback pass (see vtexture.c). Only normal posables are
+// drawn, and all of them as meshes, since impostors and the sky don't use virtual textures.
+void zDrawSceneFeedback(ZScene *scene)
+{
+    ZPosable *cur_pos;
+    ZFrustum frustum;
+
+    if (!scene->is_resident) zMakeSceneResident(scene);
+
+    glEnable(GL_DEPTH_TEST);
+
+    glDepthRange(0.0, 1.0-r_skydepthsize);
+    zCameraApplyViewing(&scene->camera, 0);
+    zCameraApplyProjection(&scene->camera);
+    zCameraGetFrustum(&scene->camera, &frustum, 0);
+
+    for (cur_pos = scene->posables; cur_pos; cur_pos = cur_pos->next) {
+        if (cur_pos->type == Z_POSABLE_STATICMESH)
+            zDrawMesh(cur_pos->subject.mesh, &frustum);
+    }
+}
+
+
+
 // Add posable to scene.
 void zAddPosableToScene(ZScene *scene, ZPosable *posable, int sky)
 {
@@ -217,6 +251,26 @@ void zAddPosableToScene(ZScene *scene, ZPosable *posable, int sky)
 
 
 
+// Queue shader programs for everything in scene, so they can compile in the background before
+// the scene is first drawn.
+void zQueueSceneShaders(ZScene *scene)
+{
+    ZPosable *lists[2], *cur;
+    int i;
+
+    lists[0] = scene->sky_posables;
+    lists[1] = scene->posables;
+
+    for (i = 0; i < 2; i++) {
+        for (cur = lists[i]; cur; cur = cur->next) {
+            if (cur->type == Z_POSABLE_STATICMESH)
+                zQueueMeshShaders(cur->subject.mesh);
+        }
+    }
+}
+
+
+
 void zAddMeshToScene(ZScene *scene, const char *name, int sky)
 {
     ZPosable *pos;
@@ -224,7 +278,8 @@ void zAddMeshToScene(ZScene *scene, const char *name, int sky)
 
     assert(name && strlen(name));
 
-    mesh = zLookupMesh(name);
+    // The mesh is drawn once it's loaded, so this doesn't hold up the frame.
+    mesh = zLookupMeshAsync(zIntern(name));
 
     if (!mesh) {
         zError("Failed to add mesh \"%s\" to scene.", name);
@@ -242,8 +297,15 @@ void zAddMeshToScene(ZScene *scene, const char *name, int sky)
     pos->subject.mesh = mesh;
     pos->next = NULL;
 
+    mesh->refcount++;
+
     // Add posable to posables list.
     zAddPosableToScene(scene, pos, sky);
+
+    // Get its shaders compiling while the mesh isn't drawn yet, if there's no renderer this happens
+    // in zRendererInit instead. A mesh that is still loading has no groups yet, zFinishMeshLoad
+    // takes care of it then.
+    if (renderer_active) zQueueMeshShaders(mesh);
 }
 
 
@@ -258,28 +320,72 @@ void zMakeSceneNonResident(ZScene *scene)
 
 
 
-// Delete scene and all objects in it.
-void zDeleteScene(ZScene *scene)
+// Free a list of posables, releasing whatever they pose.
+static void zDeletePosables(ZPosable *pos)
 {
     ZPosable *pos_tmp;
 
+    while (pos) {
+        pos_tmp = pos->next;
+        if (pos->type == Z_POSABLE_STATICMESH)
+            zReleaseMesh(pos->subject.mesh);
+        free(pos);
+        pos = pos_tmp;
+    }
+}
+
+
+
+// Delete scene and all objects in it.
+void zDeleteScene(ZScene *scene)
+{
     assert(scene);
 
-    // Delete posables
-    while (scene->posables) {
-        pos_tmp = scene->posables->next;
-        free(scene->posables);
-        scene->posables = pos_tmp;
-    }
+    zDeletePosables(scene->posables);
+    zDeletePosables(scene->sky_posables);
 
-    // FIXME: I should unload all resources at this point, to not end up wasting memory after
-    // switching scenes, but I'll not bother implementing that until I decide how to properly manage
-    // resources. Ideally I would just do some refcounting on the loaded resources and
-    // garbage collect them, in which case everything is taken care of automatically and I don't
-    // have to do anything here..
+    // Resources that are no longer used are freed by zCollectResources, but not right away, the
+    // next scene likely gets set up right after this and may want some of them.
+    collect_pending = 1;
 
     free(scene);
 }
 
 
 
+// Returns TRUE if a resource that was last released at scene load count released has gone unused
+// for long enough to be collected, see zCollectResources.
+int zResourceExpired(unsigned int released, int force)
+{
+    return force || sceneload_count - released > (unsigned int) r_retainscenes;
+}
+
+
+
+// Free meshes, textures and shader programs that are no longer used by any scene, and make unused
+// materials non-resident. Resources used by one of the last r_retainscenes scenes are kept (unless
+// force is set), so switching back and forth between scenes doesn't reload everything from disk.
+// This needs the OpenGL context, so it is called from zDrawFrame when collect_pending is set.
+void zCollectResources(int force)
+{
+    int meshes, materials, textures, vtextures, programs;
+
+    collect_pending = 0;
+
+    // Each step releases what the next one collects.
+    meshes    = zCollectMeshes(force);
+    materials = zCollectMaterials(force);
+    textures  = zCollectTextures(force);
+    vtextures = zCollectVirtualTextures(force);
+    programs  = zCollectShaderPrograms(force);
+
+    // The previously active material may be gone.
+    zResetMaterialState();
+
+    if (fs_printdiskload || force)
+        zPrint("Collected %d meshes, %d materials, %d textures, %d virtual textures and %d shader "
+            "programs.\n", meshes, materials, textures, vtextures, programs);
+}
+
+
+
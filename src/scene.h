@@ -77,6 +77,7 @@ typedef struct ZScene
 
 
 extern unsigned int sceneload_count;
+extern int collect_pending; // Set when zCollectResources should run before the next frame.
 
 ZScene *zLoadScene(const char *name);
 
@@ -86,13 +87,21 @@ void zUpdateScene(ZScene *scene, float frametime);
 
 void zDrawScene(ZScene *scene);
 
+void zDrawSceneFeedback(ZScene *scene);
+
 void zAddPosableToScene(ZScene *scene, ZPosable *posable, int sky);
 
 void zAddMeshToScene(ZScene *scene, const char *name, int sky);
 
+void zQueueSceneShaders(ZScene *scene);
+
 void zMakeSceneNonResident(ZScene *scene);
 
 void zDeleteScene(ZScene *scene);
 
+int zResourceExpired(unsigned int released, int force);
+
+void zCollectResources(int force);
+
 
 #endif // __SCENE_H__
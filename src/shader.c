@@ -8,7 +8,19 @@
 #define Z_SHADER_VERTEX   1
 #define Z_SHADER_FRAGMENT 2
 
-#define Z_SHADER_HASH_SIZE 128
+#define Z_SHADERCACHE_DIR     "shadercache"
+#define Z_SHADERCACHE_MAGIC   0x4250525a // "ZRPB"
+#define Z_SHADERCACHE_VERSION 1
+
+// Header at the start of each file in the shader cache, followed by the program binary itself.
+typedef struct ZProgramBinaryHeader
+{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int format; // Binary format returned by glGetProgramBinary.
+    unsigned int length; // Size of the binary in bytes.
+
+} ZProgramBinaryHeader;
 
 // XXX: These arrays need to match the enums!
 static char *uniform_names[Z_UNIFORM_NUM] = {
@@ -17,7 +29,12 @@ static char *uniform_names[Z_UNIFORM_NUM] = {
     "z_tex_s",
     "z_tex_n",
     "z_sun_direction",
-    "z_sun_color"
+    "z_sun_color",
+    "z_tex_layers",
+    "z_vt_indirection",
+    "z_vt_cache",
+    "z_vt_params",
+    "z_vt_layout"
 };
 
 static char *attrib_names[Z_ATTRIB_NUM] = {
@@ -26,57 +43,80 @@ static char *attrib_names[Z_ATTRIB_NUM] = {
 };
 
 
-static ZShader *shaders[Z_SHADER_HASH_SIZE];
-static ZShaderProgram *programs[Z_SHADER_HASH_SIZE];
+// Shaders are keyed on their (interned) name and flags, programs on both shader names and flags.
+static ZTable shaders;
+static ZTable programs;
+
+static int num_pending; // Number of programs queued with zQueueShaderProgram that aren't finished.
+
+// The GLEW headers bundled for vc9 predate KHR_parallel_shader_compile, builds against those always
+// finish one program per frame in zPollShaderPrograms.
+#ifdef GL_KHR_parallel_shader_compile
+    #define Z_PARALLEL_COMPILE GLEW_KHR_parallel_shader_compile
+#else
+    #define Z_PARALLEL_COMPILE 0
+#endif
 
 
 
 void zShaderInit(void)
 {
+#ifdef GL_KHR_parallel_shader_compile
+    // Let the driver use as many threads as it likes for compiling queued programs.
+    if (GLEW_KHR_parallel_shader_compile)
+        glMaxShaderCompilerThreadsKHR(0xffffffff);
+#endif
 }
 
 
 
 static void zDeleteShaderPrograms(void)
 {
-    int i;
-    ZShaderProgram *cur, *tmp;
-
-    for (i = 0; i < Z_SHADER_HASH_SIZE; i++) {
-
-        cur = programs[i];
+    unsigned int i;
+    ZShaderProgram *cur;
 
-        while (cur != NULL) {
-            tmp = cur->next;
+    for (i = 0; i < programs.size; i++) {
+        if ( (cur = programs.items[i]) ) {
             glDeleteProgram(cur->handle);
             free(cur);
-            cur = tmp;
         }
-
-        programs[i] = NULL;
     }
+
+    zTableClear(&programs);
+    num_pending = 0;
 }
 
 
 
 static void zDeleteShaders(void)
 {
-    int i;
-    ZShader *cur, *tmp;
-
-    for (i = 0; i < Z_SHADER_HASH_SIZE; i++) {
-
-        cur = shaders[i];
+    unsigned int i;
+    ZShader *cur;
 
-        while (cur != NULL) {
-            tmp = cur->next;
+    for (i = 0; i < shaders.size; i++) {
+        if ( (cur = shaders.items[i]) ) {
             glDeleteShader(cur->handle);
             free(cur);
-            cur = tmp;
         }
-
-        shaders[i] = NULL;
     }
+
+    zTableClear(&shaders);
+}
+
+
+
+// Hash for the shaders table, shader is an interned name.
+static unsigned int zHashShader(unsigned int flags, const char *shader)
+{
+    return zHashPointer(shader) ^ (flags * 0x9e3779b9U);
+}
+
+
+
+// Hash for the programs table, vshader and fshader are interned names.
+static unsigned int zHashProgram(unsigned int flags, const char *vshader, const char *fshader)
+{
+    return zHashPointer(vshader) ^ (zHashPointer(fshader) * 31) ^ (flags * 0x9e3779b9U);
 }
 
 
@@ -112,6 +152,12 @@ void zUpdateShaderProgram(ZShaderProgram *program)
         if (program->uniforms[Z_UNIFORM_SAMPLER_S] >= 0)
             glUniform1i(program->uniforms[Z_UNIFORM_SAMPLER_S], 2);
 
+        if (program->uniforms[Z_UNIFORM_VT_INDIRECTION] >= 0)
+            glUniform1i(program->uniforms[Z_UNIFORM_VT_INDIRECTION], Z_VT_UNIT_INDIRECTION);
+
+        if (program->uniforms[Z_UNIFORM_VT_CACHE] >= 0)
+            glUniform1i(program->uniforms[Z_UNIFORM_VT_CACHE], Z_VT_UNIT_CACHE);
+
     }
 
     // Update stuff for newly loaded scenes.
@@ -128,14 +174,12 @@ void zUpdateShaderProgram(ZShaderProgram *program)
 
 
 
-// Load shader from source and compile it into a shader object. Returns valid shader object
-// reference, or 0 on error. sourcefile should not contain more than Z_RESOURCE_NAME_SIZE-1
-// character bytes.
-static ZShader *zCompileShader(unsigned int flags, const char *sourcefile, GLenum type)
+// Load shader from source and submit it for compilation into a shader object, without waiting for
+// the result (see zFinishShader). Returns NULL on error. sourcefile should be interned.
+static ZShader *zSubmitShader(unsigned int flags, const char *sourcefile, GLenum type)
 {
     GLchar *shader_source;
     GLuint shader_object;
-    GLint shader_compiled;
     ZShader *new;
     int i = 0;
 #define SOURCE_NUM_STRINGS 10
@@ -160,12 +204,18 @@ static ZShader *zCompileShader(unsigned int flags, const char *sourcefile, GLenu
     }
 
     // Generate header
-    if (flags & Z_SHADER_NORMALMAP)   source[i++] = "#define NORMALMAP 1\n";
-    else                              source[i++] = "#define NORMALMAP 0\n";
-    if (flags & Z_SHADER_SPECULARMAP) source[i++] = "#define SPECULARMAP 1\n";
-    else                              source[i++] = "#define SPECULARMAP 0\n";
-    if (flags & Z_SHADER_FRESNEL)     source[i++] = "#define FRESNEL 1\n";
-    else                              source[i++] = "#define FRESNEL 0\n";
+    if (flags & Z_SHADER_NORMALMAP)    source[i++] = "#define NORMALMAP 1\n";
+    else                               source[i++] = "#define NORMALMAP 0\n";
+    if (flags & Z_SHADER_SPECULARMAP)  source[i++] = "#define SPECULARMAP 1\n";
+    else                               source[i++] = "#define SPECULARMAP 0\n";
+    if (flags & Z_SHADER_FRESNEL)      source[i++] = "#define FRESNEL 1\n";
+    else                               source[i++] = "#define FRESNEL 0\n";
+    if (flags & Z_SHADER_NORMALMAP_RG) source[i++] = "#define NORMALMAP_RG 1\n";
+    else                               source[i++] = "#define NORMALMAP_RG 0\n";
+    if (flags & Z_SHADER_TEXARRAY)     source[i++] = "#define TEXARRAY 1\n";
+    else                               source[i++] = "#define TEXARRAY 0\n";
+    if (flags & Z_SHADER_VTEXTURE)     source[i++] = "#define VTEXTURE 1\n";
+    else                               source[i++] = "#define VTEXTURE 0\n";
     source[i++] = shader_source;
     assert(i < SOURCE_NUM_STRINGS);
 
@@ -173,19 +223,46 @@ static ZShader *zCompileShader(unsigned int flags, const char *sourcefile, GLenu
     glCompileShader(shader_object);
     free(shader_source);
 
-    glGetShaderiv(shader_object, GL_COMPILE_STATUS, &shader_compiled);
+    new = malloc(sizeof(ZShader));
+    if (!new) {
+        zError("Failed to allocate memory for ZShader.");
+        glDeleteShader(shader_object);
+        return NULL;
+    }
+
+    memset(new, '\0', sizeof(ZShader));
+    new->flags = flags;
+    new->name = sourcefile;
+    new->handle = shader_object;
+    new->status = Z_COMPILE_PENDING;
+
+    return new;
+}
+
+
+
+// Wait for shader to finish compiling (if it wasn't checked already) and check the result, printing
+// the compilation log if needed. Returns TRUE if shader compiled succesfully.
+static int zFinishShader(ZShader *shader)
+{
+    GLint shader_compiled;
+
+    if (shader->status != Z_COMPILE_PENDING)
+        return shader->status == Z_COMPILE_DONE;
+
+    glGetShaderiv(shader->handle, GL_COMPILE_STATUS, &shader_compiled);
 
     if (r_shaderlog || !shader_compiled) {
 
         GLint log_length;
 
-        glGetShaderiv(shader_object, GL_INFO_LOG_LENGTH, &log_length);
+        glGetShaderiv(shader->handle, GL_INFO_LOG_LENGTH, &log_length);
 
         if (log_length > 1) {
 
             char *log;
 
-            zPrint("Shader compilation log (length %d) for %s: \n", log_length, sourcefile);
+            zPrint("Shader compilation log (length %d) for %s: \n", log_length, shader->name);
 
             log = malloc(log_length+1);
 
@@ -193,7 +270,7 @@ static ZShader *zCompileShader(unsigned int flags, const char *sourcefile, GLenu
 
                 GLsizei log_return_length = 0;
 
-                glGetShaderInfoLog(shader_object, log_length, &log_return_length, log);
+                glGetShaderInfoLog(shader->handle, log_length, &log_return_length, log);
 
                 if (log_return_length)
                     zPrint("  %s\n", log);
@@ -209,64 +286,28 @@ static ZShader *zCompileShader(unsigned int flags, const char *sourcefile, GLenu
     }
 
     if (!shader_compiled) {
-        zError("Failed to compile shader while processing \"%s\".", sourcefile);
-        glDeleteShader(shader_object);
-        return NULL;
-    }
-
-    new = malloc(sizeof(ZShader));
-    if (!new) {
-        zError("Failed to allocate memory for ZShader.");
-        glDeleteShader(shader_object);
-        return NULL;
+        zError("Failed to compile shader while processing \"%s\".", shader->name);
+        glDeleteShader(shader->handle);
+        shader->handle = 0;
+        shader->status = Z_COMPILE_FAILED;
+        return FALSE;
     }
 
-    memset(new, '\0', sizeof(ZShader));
-    new->flags = flags;
-    strcat(new->name, sourcefile);
-    new->handle = shader_object;
+    shader->status = Z_COMPILE_DONE;
 
-    return new;
+    return TRUE;
 }
 
 
 
-// Create OpenGL shader program object using vshader and fshader. Either of them may be NULL, but
-// not both. Returns 0 on failure, or a valid OpenGL shader program handle on success.
-static ZShaderProgram *zLinkProgram(unsigned int flags, ZShader *vshader, ZShader *fshader)
+// Allocate a ZShaderProgram for program object handle. The vshader/fshader names are only stored
+// in the ZShaderProgram, and should be interned. Returns NULL on failure, in which case handle is
+// deleted.
+static ZShaderProgram *zAllocShaderProgram(unsigned int flags, GLuint handle, const char *vshader,
+    const char *fshader)
 {
-    int i;
-    GLint program_linked = 0;
-    GLint validate_status = 0;
-    GLuint handle;
     ZShaderProgram *program;
 
-    if ( vshader || fshader ) {
-
-        handle = glCreateProgram();
-
-        if (handle) {
-
-            if (vshader) glAttachShader(handle, vshader->handle);
-            if (fshader) glAttachShader(handle, fshader->handle);
-
-            glLinkProgram(handle);
-            glGetProgramiv(handle, GL_LINK_STATUS, &program_linked);
-
-            if (!program_linked) {
-                glDeleteProgram(handle);
-                zWarning("Failed to link program.");
-                return NULL;
-            }
-        } else {
-            zError("Failed to create new shader program.");
-            return NULL;
-        }
-    } else {
-        assert(0 && "zLinkProgram called with both vshader and fshader NULL...");
-        return NULL;
-    }
-
     program = malloc(sizeof(ZShaderProgram));
 
     if (!program) {
@@ -278,36 +319,51 @@ static ZShaderProgram *zLinkProgram(unsigned int flags, ZShader *vshader, ZShade
     memset(program, '\0', sizeof(ZShaderProgram));
     program->flags = flags;
 
+    program->vertex_shader = vshader;
+    program->fragment_shader = fshader;
+    program->handle = handle;
+
+    // Count new programs as released just now, so ones that were queued for the current scene but
+    // aren't used yet are not collected right away.
+    program->released = sceneload_count;
+
+    return program;
+}
+
+
+
+// Look up uniform/attrib locations for a succesfully linked program and validate it.
+static void zSetupShaderProgram(ZShaderProgram *program)
+{
+    int i;
+    GLint validate_status = 0;
+
     // Retrieve uniform/attrib locations.
     for (i = 0; i < Z_UNIFORM_NUM; i++) {
         //zDebug("looking for uniform with name \"%s\"", uniform_names[i]);
-        program->uniforms[i] = glGetUniformLocation(handle, uniform_names[i]);
+        program->uniforms[i] = glGetUniformLocation(program->handle, uniform_names[i]);
         //if (program->uniforms[i] >= 0) zDebug("found uniform location for \"%s\"", uniform_names[i]);
     }
 
     for (i = 0; i < Z_ATTRIB_NUM; i++) {
-        program->attributes[i] = glGetAttribLocation(handle, attrib_names[i]);
+        program->attributes[i] = glGetAttribLocation(program->handle, attrib_names[i]);
         //if (program->attributes[i]) zDebug("got attrib location %d for %s",
         //    program->attributes[i], attrib_names[i] );
     }
 
 
-    if (vshader) strcat(program->vertex_shader, vshader->name);
-    if (fshader) strcat(program->fragment_shader, fshader->name);
-    program->handle = handle;
-
     // Validate program.
     // XXX: Should this maybe be done after uniforms have been assigned? If so, I could probably
     // check for some validated flag and do it in zUpdateShaderProgram..
-    glValidateProgram(handle);
+    glValidateProgram(program->handle);
 
-    glGetProgramiv(handle, GL_VALIDATE_STATUS, &validate_status);
+    glGetProgramiv(program->handle, GL_VALIDATE_STATUS, &validate_status);
 
     if (r_shaderlog || !validate_status) {
 
         GLint log_length;
 
-        glGetProgramiv(handle, GL_INFO_LOG_LENGTH, &log_length);
+        glGetProgramiv(program->handle, GL_INFO_LOG_LENGTH, &log_length);
 
         if (log_length > 1) {
 
@@ -322,7 +378,7 @@ static ZShaderProgram *zLinkProgram(unsigned int flags, ZShader *vshader, ZShade
 
                 GLsizei log_return_length = 0;
 
-                glGetProgramInfoLog(handle, log_length, &log_return_length, log);
+                glGetProgramInfoLog(program->handle, log_length, &log_return_length, log);
 
                 if (log_return_length)
                     zPrint("  %s\n", log);
@@ -340,43 +396,326 @@ static ZShaderProgram *zLinkProgram(unsigned int flags, ZShader *vshader, ZShade
         zWarning("Failed to validate program for shaders %s and %s.", program->vertex_shader,
             program->fragment_shader);
     }
+}
+
+
+
+// Submit vshader and fshader for linking into a new program object, without waiting for them to
+// be compiled or for the result of linking (see zFinishShaderProgram). Either of them may be NULL,
+// but not both. Returns NULL on failure.
+static ZShaderProgram *zSubmitProgram(unsigned int flags, ZShader *vshader, ZShader *fshader)
+{
+    GLuint handle;
+    ZShaderProgram *program;
+
+    if ( !vshader && !fshader ) {
+        assert(0 && "zSubmitProgram called with both vshader and fshader NULL...");
+        return NULL;
+    }
 
+    if ( !(handle = glCreateProgram()) ) {
+        zError("Failed to create new shader program.");
+        return NULL;
+    }
+
+    if (vshader) glAttachShader(handle, vshader->handle);
+    if (fshader) glAttachShader(handle, fshader->handle);
+
+#ifdef GL_ARB_get_program_binary
+    // Some drivers only keep around what is needed for glGetProgramBinary when asked to.
+    if (r_shadercache && GLEW_ARB_get_program_binary)
+        glProgramParameteri(handle, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+#endif
+
+    glLinkProgram(handle);
+
+    program = zAllocShaderProgram(flags, handle, vshader ? vshader->name : zIntern(""),
+        fshader ? fshader->name : zIntern(""));
+
+    if (program) {
+        program->pending = 1;
+        program->pending_vshader = vshader;
+        program->pending_fshader = fshader;
+        num_pending++;
+    }
 
     return program;
 }
 
 
 
-// Look up a compiled shader, or load and compile from disk if not found. If an error occurs or
-// shader is an empty string, NULL is returned, otherwise a valid pointer to the shader.
-ZShader *zLookupShader(unsigned int flags, const char *shader, int type)
+#ifdef GL_ARB_get_program_binary
+
+// Compute the key a program is stored under in the shader cache. It covers everything that ends up
+// in the binary: the flags (which select the #defines prepended to the source), the shader names
+// and source text, and the driver, since binaries are only valid for the driver that produced
+// them. Returns 0 if the program shouldn't be cached, i.e. if the cache is disabled or not
+// supported, or if a source file couldn't be read (compiling will fail and complain about it).
+static unsigned long long zShaderCacheKey(unsigned int flags, const char *vshader,
+    const char *fshader)
 {
-    ZShader *cur, *new;
-    unsigned int i;
+    unsigned long long key = Z_HASH_INIT;
+    const char *names[2];
+    GLenum driver[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+    int i;
+
+    if (!r_shadercache || !GLEW_ARB_get_program_binary)
+        return 0;
+
+    names[0] = vshader;
+    names[1] = fshader;
+
+    key = zHashData(key, &flags, sizeof(flags));
+
+    for (i = 0; i < 2; i++) {
+
+        const char *path;
+        char *source;
+
+        // Include the terminator so "ab" + "" and "a" + "b" don't hash the same.
+        key = zHashData(key, names[i], strlen(names[i])+1);
+
+        if (!names[i][0]) continue;
+
+        if ( !(path = zGetPath(names[i], NULL, Z_FILE_TRYUSER)) ||
+             !(source = zGetStringFromFile(path)) )
+            return 0;
+
+        key = zHashData(key, source, strlen(source));
+        free(source);
+    }
+
+    for (i = 0; i < 3; i++) {
+
+        const char *str = (const char *) glGetString(driver[i]);
+
+        if (!str) return 0;
+
+        key = zHashData(key, str, strlen(str)+1);
+    }
+
+    // 0 means 'don't cache', so avoid it (however unlikely).
+    return key ? key : 1;
+}
+
+
+
+// Returns the name of the shader cache file for key.
+static const char *zShaderCacheFile(unsigned long long key)
+{
+    static char filename[32];
+
+    snprintf(filename, sizeof(filename), "%016llx.bin", key);
+    filename[sizeof(filename)-1] = '\0';
+
+    return filename;
+}
+
+
+
+// Try to create a program from the binary stored in the shader cache under key. Returns NULL if
+// there is no (usable) binary, which is normal if the program was never cached or if the driver
+// rejects the binary (i.e. after a driver update that didn't change the version string).
+static ZShaderProgram *zLoadCachedProgram(unsigned long long key, unsigned int flags,
+    const char *vshader, const char *fshader)
+{
+    FILE *fp;
+    ZProgramBinaryHeader header;
+    void *binary;
+    GLuint handle;
+    GLint program_linked = 0;
+    ZShaderProgram *program;
+
+    if ( !(fp = zOpenFile(zShaderCacheFile(key), Z_SHADERCACHE_DIR, NULL, Z_FILE_FORCEUSER)) )
+        return NULL;
+
+    if ( fread(&header, sizeof(header), 1, fp) != 1 || header.magic != Z_SHADERCACHE_MAGIC ||
+         header.version != Z_SHADERCACHE_VERSION || header.length == 0 ) {
+        zWarning("Ignoring invalid shader cache file for shaders \"%s\" and \"%s\".", vshader,
+            fshader);
+        fclose(fp);
+        return NULL;
+    }
+
+    if ( !(binary = malloc(header.length)) ) {
+        zError("Failed to allocate memory for program binary.");
+        fclose(fp);
+        return NULL;
+    }
+
+    if (fread(binary, header.length, 1, fp) != 1) {
+        zWarning("Shader cache file for shaders \"%s\" and \"%s\" is truncated.", vshader,
+            fshader);
+        free(binary);
+        fclose(fp);
+        return NULL;
+    }
+
+    fclose(fp);
+
+    if ( !(handle = glCreateProgram()) ) {
+        zError("Failed to create new shader program.");
+        free(binary);
+        return NULL;
+    }
+
+    glProgramBinary(handle, header.format, binary, header.length);
+    free(binary);
+
+    glGetProgramiv(handle, GL_LINK_STATUS, &program_linked);
+
+    if (!program_linked) {
+        zDebug("Cached binary for shaders \"%s\" and \"%s\" was rejected, recompiling.", vshader,
+            fshader);
+        glDeleteProgram(handle);
+        return NULL;
+    }
+
+    if (fs_printdiskload)
+        zDebug("Loaded program for shaders \"%s\" and \"%s\" with flags %#x from shader cache.",
+            vshader, fshader, flags);
+
+    if ( (program = zAllocShaderProgram(flags, handle, vshader, fshader)) )
+        zSetupShaderProgram(program);
+
+    return program;
+}
+
+
+
+// Store the binary for the freshly linked program in the shader cache under key.
+static void zSaveCachedProgram(unsigned long long key, ZShaderProgram *program)
+{
+    FILE *fp;
+    ZProgramBinaryHeader header;
+    GLint length = 0;
+    GLenum format = 0;
+    void *binary;
+    const char *dir;
 
-    i = zHashString(shader, Z_SHADER_HASH_SIZE);
-    cur = shaders[i];
+    glGetProgramiv(program->handle, GL_PROGRAM_BINARY_LENGTH, &length);
 
-    while (cur) {
-        // Check wether flags and name match.
-        if ( cur->flags == flags && strcmp(cur->name, shader) == 0)
-            return cur;
+    // Drivers are allowed to not hand out binaries at all.
+    if (length <= 0) return;
 
-        cur = cur->next;
+    if ( !(binary = malloc(length)) ) {
+        zError("Failed to allocate memory for program binary.");
+        return;
     }
 
+    glGetProgramBinary(program->handle, length, &length, &format, binary);
+
+    if (length <= 0) {
+        free(binary);
+        return;
+    }
+
+    // Make sure the cache directory exists.
+    if ( !(dir = zGetPath(Z_SHADERCACHE_DIR, NULL, Z_FILE_FORCEUSER)) || !zMakeDir(dir) ) {
+        free(binary);
+        return;
+    }
+
+    if ( !(fp = zOpenFile(zShaderCacheFile(key), Z_SHADERCACHE_DIR, NULL,
+                          Z_FILE_FORCEUSER | Z_FILE_WRITE)) ) {
+        zWarning("Failed to open shader cache file for writing.");
+        free(binary);
+        return;
+    }
+
+    header.magic   = Z_SHADERCACHE_MAGIC;
+    header.version = Z_SHADERCACHE_VERSION;
+    header.format  = format;
+    header.length  = length;
+
+    if ( fwrite(&header, sizeof(header), 1, fp) != 1 || fwrite(binary, length, 1, fp) != 1 )
+        zWarning("Failed to write shader cache file.");
+
+    fclose(fp);
+    free(binary);
+}
+
+#else
+
+// The GLEW headers bundled for vc9 predate ARB_get_program_binary, builds against those go without
+// the shader cache.
+static unsigned long long zShaderCacheKey(unsigned int flags, const char *vshader,
+    const char *fshader)
+{
+    return 0;
+}
+
+
+
+static ZShaderProgram *zLoadCachedProgram(unsigned long long key, unsigned int flags,
+    const char *vshader, const char *fshader)
+{
+    return NULL;
+}
+
+
+
+static void zSaveCachedProgram(unsigned long long key, ZShaderProgram *program)
+{
+}
+
+#endif
+
+
+
+// Key for looking up shaders in the shaders table.
+typedef struct ZShaderKey
+{
+    unsigned int flags;
+    const char *shader;
+
+} ZShaderKey;
+
+
+
+static int zMatchShader(const void *item, const void *key)
+{
+    const ZShader *shader = item;
+    const ZShaderKey *k = key;
+
+    return shader->flags == k->flags && shader->name == k->shader;
+}
+
+
+
+// Look up a shader, or load it from disk and submit it for compilation if not found. The shader
+// returned may still be compiling, use zFinishShader to wait for it. If an error occurs, shader
+// failed to compile earlier, or shader is an empty string, NULL is returned. shader should be
+// interned.
+ZShader *zLookupShader(unsigned int flags, const char *shader, int type)
+{
+    ZShader *cur, *new;
+    ZShaderKey key;
+    unsigned int hash = zHashShader(flags, shader);
+
+    key.flags = flags;
+    key.shader = shader;
+
+    // Shaders that failed to compile are kept around so I don't keep trying (and spamming errors)
+    // for every program that uses them.
+    if ( (cur = zTableFind(&shaders, hash, zMatchShader, &key)) )
+        return cur->status == Z_COMPILE_FAILED ? NULL : cur;
+
     // Not found, so load/add it.
     if (type == Z_SHADER_VERTEX) {
-        new = zCompileShader(flags, shader, GL_VERTEX_SHADER);
+        new = zSubmitShader(flags, shader, GL_VERTEX_SHADER);
     } else if (type == Z_SHADER_FRAGMENT) {
-        new = zCompileShader(flags, shader, GL_FRAGMENT_SHADER);
+        new = zSubmitShader(flags, shader, GL_FRAGMENT_SHADER);
     } else {
         assert(0 && "Invalid shader type.");
     }
 
     if (new) {
-        new->next = shaders[i];
-        shaders[i] = new;
+        if (!zTableInsert(&shaders, hash, new)) {
+            glDeleteShader(new->handle);
+            free(new);
+            return NULL;
+        }
         return new;
     }
 
@@ -385,42 +724,130 @@ ZShader *zLookupShader(unsigned int flags, const char *shader, int type)
 
 
 
-// Look up a shader program that matches vshader/fshader, or attempt to load it if not found.
-// Returns NULL on failure. The vshader/fshader may not be NULL (but may be empty strings) and
-// should each have no more than Z_RESOURCE_NAME_SIZE-1 character bytes. Either vshader or fhader
-// needs to be non-empty.
-ZShaderProgram *zLookupShaderProgram(unsigned int flags, const char *vshader, const char *fshader)
+// Wait for program to finish compiling and linking (if it wasn't checked already) and check the
+// result. On success the program is set up for use and stored in the shader cache. Returns FALSE if
+// compiling or linking failed, in which case the caller should remove it with
+// zRemoveShaderProgram.
+static int zFinishShaderProgram(ZShaderProgram *program)
 {
-    unsigned int i;
-    char programconcat[Z_RESOURCE_NAME_SIZE*2] = {'\0'};
+    GLint program_linked = 0;
+
+    if (!program->pending) return TRUE;
+
+    program->pending = 0;
+    num_pending--;
+
+    // Check the shaders first so their compilation logs get printed if anything went wrong.
+    if (program->pending_vshader && !zFinishShader(program->pending_vshader)) {
+        zError("Failed to load vertex shader \"%s\".", program->vertex_shader);
+        return FALSE;
+    }
+
+    if (program->pending_fshader && !zFinishShader(program->pending_fshader)) {
+        zError("Failed to load fragment shader \"%s\".", program->fragment_shader);
+        return FALSE;
+    }
+
+    program->pending_vshader = program->pending_fshader = NULL;
+
+    glGetProgramiv(program->handle, GL_LINK_STATUS, &program_linked);
+
+    if (!program_linked) {
+        zWarning("Failed to link program.");
+        return FALSE;
+    }
+
+    zSetupShaderProgram(program);
+
+    if (program->cache_key) zSaveCachedProgram(program->cache_key, program);
+
+    return TRUE;
+}
+
+
+
+// Unlink program from the programs hash table and delete it.
+static void zRemoveShaderProgram(ZShaderProgram *program)
+{
+    int removed = zTableRemove(&programs, zHashProgram(program->flags, program->vertex_shader,
+                                                       program->fragment_shader), program);
+
+    assert(removed);
+    (void) removed;
+
+    if (program->pending) num_pending--;
+
+    glDeleteProgram(program->handle);
+    free(program);
+}
+
+
+
+// Key for looking up programs in the programs table.
+typedef struct ZProgramKey
+{
+    unsigned int flags;
+    const char *vshader;
+    const char *fshader;
+
+} ZProgramKey;
+
+
+
+static int zMatchProgram(const void *item, const void *key)
+{
+    const ZShaderProgram *program = item;
+    const ZProgramKey *k = key;
+
+    return program->flags == k->flags && program->vertex_shader == k->vshader &&
+           program->fragment_shader == k->fshader;
+}
+
+
+
+// Queue up a shader program for vshader/fshader so it gets compiled in the background, without
+// waiting for it. Returns the (possibly still pending) program, or NULL if it could not be
+// submitted. The arguments are the same as for zLookupShaderProgram, which should still be used to
+// get the program when it is actually needed.
+ZShaderProgram *zQueueShaderProgram(unsigned int flags, const char *vshader, const char *fshader)
+{
+    unsigned int hash;
+    unsigned long long key;
     ZShaderProgram *cur, *new;
     ZShader *vertex_shader = NULL, *fragment_shader = NULL;
+    ZProgramKey lookup;
 
     assert( vshader[0] || fshader[0] );
 
     //zDebug("Looking up shader program for %s and %s.", vshader, fshader);
 
-    // Check if I have a program loaded that matches given vshader/fshader, if so, return pointer to
-    // it. To keep things simple I just concatenate the vshader/fshader names and use that to do a
-    // lookup in the hashtable.
-    strcat(programconcat, vshader);
-    strcat(programconcat, fshader);
-    i = zHashString(programconcat, Z_SHADER_HASH_SIZE);
-    cur = programs[i];
-
-    while (cur != NULL) {
-        // Check if flags and shader names match.
-        if ( cur->flags == flags && strcmp(cur->vertex_shader, vshader) == 0 &&
-             strcmp(cur->fragment_shader, fshader) == 0  ) {
-            return cur;
-        }
-        cur = cur->next;
-    }
+    // Check if I have a program loaded (or queued) that matches given vshader/fshader, if so,
+    // return pointer to it.
+    hash = zHashProgram(flags, vshader, fshader);
+    lookup.flags = flags;
+    lookup.vshader = vshader;
+    lookup.fshader = fshader;
+
+    if ( (cur = zTableFind(&programs, hash, zMatchProgram, &lookup)) )
+        return cur;
 
     //zDebug("No currently loaded program found for shaders %s and %s. Will load them now..",
     //    vshader, fshader);
 
-    // If not, lookup the vertex and fragment shader and link them into a new program.
+    // Skip compiling entirely if the shader cache has a binary for this program.
+    if ( (key = zShaderCacheKey(flags, vshader, fshader)) &&
+         (new = zLoadCachedProgram(key, flags, vshader, fshader)) ) {
+        if (!zTableInsert(&programs, hash, new)) {
+            glDeleteProgram(new->handle);
+            free(new);
+            return NULL;
+        }
+        return new;
+    }
+
+    // If not, lookup the vertex and fragment shader and submit them for linking into a new
+    // program. All compiling and linking is just submitted here, nothing is checked until
+    // zFinishShaderProgram so the driver can work on it in the background.
     if (strlen(vshader)) {
         if ( !(vertex_shader = zLookupShader(flags, vshader, Z_SHADER_VERTEX)) ) {
             zError("Failed to load vertex shader \"%s\".", vshader);
@@ -437,10 +864,16 @@ ZShaderProgram *zLookupShaderProgram(unsigned int flags, const char *vshader, co
         }
     }
 
-    if ( (new = zLinkProgram(flags, vertex_shader, fragment_shader)) ) {
-        // Reusing hash (i) from the lookup above!
-        new->next = programs[i];
-        programs[i] = new;
+    if ( (new = zSubmitProgram(flags, vertex_shader, fragment_shader)) ) {
+
+        new->cache_key = key;
+
+        if (!zTableInsert(&programs, hash, new)) {
+            glDeleteProgram(new->handle);
+            free(new);
+            num_pending--;
+            return NULL;
+        }
         return new;
     } else {
         return NULL;
@@ -449,39 +882,121 @@ ZShaderProgram *zLookupShaderProgram(unsigned int flags, const char *vshader, co
 
 
 
+// Look up a shader program that matches vshader/fshader, or attempt to load it if not found.
+// Returns NULL on failure. The vshader/fshader may not be NULL (but may be empty strings) and
+// should be interned. Either vshader or fhader needs to be non-empty. If the program was queued
+// but isn't done compiling yet, this blocks until it is.
+ZShaderProgram *zLookupShaderProgram(unsigned int flags, const char *vshader, const char *fshader)
+{
+    ZShaderProgram *program;
 
-void zIterShaderPrograms(void (*iter)(ZShaderProgram *, void *), void *data)
+    if ( !(program = zQueueShaderProgram(flags, vshader, fshader)) )
+        return NULL;
+
+    if (!zFinishShaderProgram(program)) {
+        zRemoveShaderProgram(program);
+        return NULL;
+    }
+
+    return program;
+}
+
+
+
+// Check on programs queued with zQueueShaderProgram and finish those that are done compiling, this
+// should be called once per frame. Without KHR_parallel_shader_compile there is no way to ask
+// whether a program is done without blocking, so I just finish one program per frame instead to
+// spread out the hitches.
+void zPollShaderPrograms(void)
 {
-    int i;
+    unsigned int i;
     ZShaderProgram *cur;
+    GLint done;
+
+    if (!num_pending) return;
 
-    for (i = 0; i < Z_SHADER_HASH_SIZE; i++) {
+    for (i = 0; i < programs.size; i++) {
 
-        cur = programs[i];
+        if ( !(cur = programs.items[i]) || !cur->pending ) continue;
+
+        done = 1;
+
+#ifdef GL_KHR_parallel_shader_compile
+        if (GLEW_KHR_parallel_shader_compile)
+            glGetProgramiv(cur->handle, GL_COMPLETION_STATUS_KHR, &done);
+#endif
+
+        if (done) {
+
+            if (!zFinishShaderProgram(cur)) {
+                zRemoveShaderProgram(cur);
+                i--; // Check the slot again, another program may have moved into it.
+            }
 
-        while (cur != NULL) {
-            iter(cur, data);
-            cur = cur->next;
+            if (!Z_PARALLEL_COMPILE) return;
         }
     }
 }
 
 
 
-void zIterShaders(void (*iter)(ZShader *, void *), void *data)
+
+// Drop a reference to program, taken by zMakeMaterialResident.
+void zReleaseShaderProgram(ZShaderProgram *program)
 {
-    int i;
-    ZShader *cur;
+    assert(program->refcount > 0);
+
+    if (--program->refcount == 0)
+        program->released = sceneload_count;
+}
+
+
+
+// Delete shader programs that no material has used for more than r_retainscenes scene loads (or
+// all unused ones if force is set). Programs still compiling are left alone. Returns the number of
+// programs deleted. The shaders themselves are kept, they're cheap and likely to be linked again.
+int zCollectShaderPrograms(int force)
+{
+    unsigned int i;
+    int count = 0;
+    ZShaderProgram *cur;
 
-    for (i = 0; i < Z_SHADER_HASH_SIZE; i++) {
+    for (i = 0; i < programs.size; i++) {
 
-        cur = shaders[i];
+        cur = programs.items[i];
 
-        while (cur != NULL) {
-            iter(cur, data);
-            cur = cur->next;
+        if (cur && !cur->refcount && !cur->pending && zResourceExpired(cur->released, force)) {
+            zRemoveShaderProgram(cur);
+            count++;
+            i--; // Check the slot again, another program may have moved into it.
         }
     }
+
+    return count;
+}
+
+
+
+void zIterShaderPrograms(void (*iter)(ZShaderProgram *, void *), void *data)
+{
+    unsigned int i;
+
+    for (i = 0; i < programs.size; i++) {
+        if (programs.items[i])
+            iter(programs.items[i], data);
+    }
+}
+
+
+
+void zIterShaders(void (*iter)(ZShader *, void *), void *data)
+{
+    unsigned int i;
+
+    for (i = 0; i < shaders.size; i++) {
+        if (shaders.items[i])
+            iter(shaders.items[i], data);
+    }
 }
 
 
@@ -3,9 +3,17 @@
 
 #include <GL/glew.h>
 
-#define Z_SHADER_NORMALMAP   1
-#define Z_SHADER_SPECULARMAP 2
-#define Z_SHADER_FRESNEL     4
+#define Z_SHADER_NORMALMAP    1
+#define Z_SHADER_SPECULARMAP  2
+#define Z_SHADER_FRESNEL      4
+#define Z_SHADER_NORMALMAP_RG 8  // Normal map only has X/Y, Z needs to be reconstructed.
+#define Z_SHADER_TEXARRAY     16 // Textures are layers of sampler2DArrays, see texarray.h.
+#define Z_SHADER_VTEXTURE     32 // Material has a virtual texture, see vtexture.h.
+
+// Compilation status for ZShader.
+#define Z_COMPILE_PENDING 0 // Submitted for compilation but the result wasn't checked yet.
+#define Z_COMPILE_DONE    1
+#define Z_COMPILE_FAILED  2
 
 typedef enum ZShaderUniform
 {
@@ -15,6 +23,11 @@ typedef enum ZShaderUniform
     Z_UNIFORM_SAMPLER_N,
     Z_UNIFORM_SUN_DIRECTION,
     Z_UNIFORM_SUN_COLOR,
+    Z_UNIFORM_TEX_LAYERS,
+    Z_UNIFORM_VT_INDIRECTION,
+    Z_UNIFORM_VT_CACHE,
+    Z_UNIFORM_VT_PARAMS,
+    Z_UNIFORM_VT_LAYOUT,
     Z_UNIFORM_NUM
 } ZShaderUniform;
 
@@ -29,21 +42,22 @@ typedef enum ZShaderAttrib
 
 typedef struct ZShader
 {
-    char name[Z_RESOURCE_NAME_SIZE];
+    const char *name; // Interned, see intern.h.
 
     unsigned int flags;
 
     GLuint handle;
 
-    struct ZShader *next;
+    int status; // One of Z_COMPILE_*.
 
 } ZShader;
 
 
 typedef struct ZShaderProgram
 {
-    char vertex_shader[Z_RESOURCE_NAME_SIZE];
-    char fragment_shader[Z_RESOURCE_NAME_SIZE];
+    // Interned names of the shaders, either may be an empty string.
+    const char *vertex_shader;
+    const char *fragment_shader;
 
     unsigned int flags;
 
@@ -61,7 +75,19 @@ typedef struct ZShaderProgram
     GLint uniforms[Z_UNIFORM_NUM];
     GLint attributes[Z_ATTRIB_NUM];
 
-    struct ZShaderProgram *next;
+    // Set while the program was queued for compiling/linking but the result wasn't checked yet (see
+    // zQueueShaderProgram), the uniform/attrib locations aren't valid until it is cleared. The
+    // shaders are kept so their status can be checked when the program is finished.
+    int pending;
+    ZShader *pending_vshader;
+    ZShader *pending_fshader;
+
+    unsigned long long cache_key; // Key for storing the program in the shader cache, 0 if none.
+
+    // Number of resident materials using the program, and the value of sceneload_count when that
+    // last dropped to 0. Unused programs are deleted by zCollectShaderPrograms.
+    int refcount;
+    unsigned int released;
 
 } ZShaderProgram;
 
@@ -73,8 +99,16 @@ void zShaderDeinit(void);
 
 void zUpdateShaderProgram(ZShaderProgram *program);
 
+ZShaderProgram *zQueueShaderProgram(unsigned int flags, const char *vshader, const char *fshader);
+
 ZShaderProgram *zLookupShaderProgram(unsigned int flags, const char *vshader, const char *fshader);
 
+void zPollShaderPrograms(void);
+
+void zReleaseShaderProgram(ZShaderProgram *program);
+
+int zCollectShaderPrograms(int force);
+
 void zIterShaderPrograms(void (*iter)(ZShaderProgram *, void *), void *data);
 
 void zIterShaders(void (*iter)(ZShader *, void *), void *data);
@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <GL/glew.h>
+
+#include "common.h"
+
+
+#define Z_STREAM_SEGMENT_SIZE (Z_STREAM_SIZE / Z_STREAM_SEGMENTS)
+
+// The GLEW headers bundled for vc9 predate ARB_buffer_storage and ARB_sync, builds against those
+// only get Z_STREAM_ORPHAN.
+#if defined(GL_ARB_buffer_storage) && defined(GL_ARB_sync)
+    #define Z_STREAM_HAVE_PERSISTENT
+#endif
+
+int stream_mode;
+
+static GLuint stream_vbo;
+
+static unsigned char *persistent_ptr; // Only for Z_STREAM_PERSISTENT.
+
+#ifdef Z_STREAM_HAVE_PERSISTENT
+static GLsync fences[Z_STREAM_SEGMENTS];
+#endif
+static unsigned int segment;
+
+// Range of the buffer that can be allocated from for the current frame.
+static GLintptr head;
+static GLintptr limit;
+
+static int in_frame;
+static int mapped;      // Set if zStreamMap mapped the buffer and zStreamUnmap needs to unmap it.
+static int warned_full; // So I only warn about the buffer being full once.
+
+
+
+// Create the stream buffer and pick the best way of mapping it that is supported.
+void zStreamInit(void)
+{
+    assert(!stream_vbo);
+
+    stream_mode = Z_STREAM_NONE;
+    segment = 0;
+    in_frame = mapped = warned_full = 0;
+
+    if (r_nostream) return;
+
+#ifdef Z_STREAM_HAVE_PERSISTENT
+    if (GLEW_ARB_buffer_storage && GLEW_ARB_sync) {
+
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+        glGenBuffersARB(1, &stream_vbo);
+        glBindBufferARB(GL_ARRAY_BUFFER, stream_vbo);
+        glBufferStorage(GL_ARRAY_BUFFER, Z_STREAM_SIZE, NULL, flags);
+
+        if ( (persistent_ptr = glMapBufferRange(GL_ARRAY_BUFFER, 0, Z_STREAM_SIZE, flags)) ) {
+            stream_mode = Z_STREAM_PERSISTENT;
+        } else {
+            // Storage is immutable so I can't reuse the buffer for the fallback below.
+            zWarning("Failed to persistently map stream buffer.");
+            glDeleteBuffersARB(1, &stream_vbo);
+            stream_vbo = 0;
+        }
+    }
+#endif
+
+    if (stream_mode == Z_STREAM_NONE && GLEW_ARB_map_buffer_range) {
+
+        glGenBuffersARB(1, &stream_vbo);
+        glBindBufferARB(GL_ARRAY_BUFFER, stream_vbo);
+        glBufferDataARB(GL_ARRAY_BUFFER, Z_STREAM_SIZE, NULL, GL_STREAM_DRAW);
+
+        stream_mode = Z_STREAM_ORPHAN;
+    }
+
+    glBindBufferARB(GL_ARRAY_BUFFER, 0);
+
+    if (stream_mode == Z_STREAM_NONE)
+        zDebug("Stream buffer not supported, using client-side arrays for dynamic geometry.");
+}
+
+
+
+void zStreamDeinit(void)
+{
+#ifdef Z_STREAM_HAVE_PERSISTENT
+    unsigned int i;
+
+    for (i = 0; i < Z_STREAM_SEGMENTS; i++) {
+        if (fences[i]) {
+            glDeleteSync(fences[i]);
+            fences[i] = 0;
+        }
+    }
+#endif
+
+    if (stream_vbo) {
+
+        if (persistent_ptr || mapped) {
+            glBindBufferARB(GL_ARRAY_BUFFER, stream_vbo);
+            glUnmapBufferARB(GL_ARRAY_BUFFER);
+            glBindBufferARB(GL_ARRAY_BUFFER, 0);
+        }
+
+        glDeleteBuffersARB(1, &stream_vbo);
+        stream_vbo = 0;
+    }
+
+    persistent_ptr = NULL;
+    stream_mode = Z_STREAM_NONE;
+}
+
+
+
+// Make the next part of the buffer available for allocations, must be called before anything is
+// drawn for the frame.
+void zStreamBeginFrame(void)
+{
+#ifdef Z_STREAM_HAVE_PERSISTENT
+    if (stream_mode == Z_STREAM_PERSISTENT) {
+
+        // Wait until the GPU is done with what I wrote to this segment Z_STREAM_SEGMENTS frames
+        // ago, this should rarely block.
+        if (fences[segment]) {
+
+            GLenum result;
+
+            do {
+                result = glClientWaitSync(fences[segment], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+            } while (result == GL_TIMEOUT_EXPIRED);
+
+            glDeleteSync(fences[segment]);
+            fences[segment] = 0;
+        }
+
+        head  = segment * Z_STREAM_SEGMENT_SIZE;
+        limit = head + Z_STREAM_SEGMENT_SIZE;
+    }
+#endif
+
+    if (stream_mode == Z_STREAM_ORPHAN) {
+
+        // Orphan the old storage, the driver hands me fresh memory while the GPU keeps reading
+        // from the old.
+        glBindBufferARB(GL_ARRAY_BUFFER, stream_vbo);
+        glBufferDataARB(GL_ARRAY_BUFFER, Z_STREAM_SIZE, NULL, GL_STREAM_DRAW);
+        glBindBufferARB(GL_ARRAY_BUFFER, 0);
+
+        head  = 0;
+        limit = Z_STREAM_SIZE;
+    }
+
+    in_frame = 1;
+}
+
+
+
+// Fence the part of the buffer that was used this frame, must be called after everything is drawn.
+void zStreamEndFrame(void)
+{
+    assert(!mapped);
+
+#ifdef Z_STREAM_HAVE_PERSISTENT
+    if (stream_mode == Z_STREAM_PERSISTENT) {
+        fences[segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        segment = (segment + 1) % Z_STREAM_SEGMENTS;
+    }
+#endif
+
+    in_frame = 0;
+}
+
+
+
+// Allocate size bytes from the stream buffer, which is left bound to GL_ARRAY_BUFFER. Returns a
+// pointer the data can be written to, and stores the offset in the buffer (for use with
+// gl*Pointer) in offset. Data must be written before zStreamUnmap is called, which must happen
+// before drawing with it. The allocation is only valid until the end of the frame. Returns NULL if
+// the stream buffer isn't supported or full, in which case the caller should fall back to
+// client-side arrays.
+void *zStreamMap(GLsizeiptr size, GLintptr *offset)
+{
+    GLintptr start = (head + Z_STREAM_ALIGNMENT - 1) & ~((GLintptr) Z_STREAM_ALIGNMENT - 1);
+    void *ptr;
+
+    assert(!mapped);
+
+    if (stream_mode == Z_STREAM_NONE || !in_frame)
+        return NULL;
+
+    if (start + size > limit) {
+        if (!warned_full) {
+            zWarning("Stream buffer is full, falling back to client-side arrays.");
+            warned_full = 1;
+        }
+        return NULL;
+    }
+
+    glBindBufferARB(GL_ARRAY_BUFFER, stream_vbo);
+
+    if (stream_mode == Z_STREAM_PERSISTENT) {
+        ptr = persistent_ptr + start;
+    } else {
+        // The range was orphaned at the start of the frame and nothing drawn this frame uses it,
+        // so there is no need to synchronize.
+        ptr = glMapBufferRange(GL_ARRAY_BUFFER, start, size,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+
+        if (!ptr) {
+            glBindBufferARB(GL_ARRAY_BUFFER, 0);
+            return NULL;
+        }
+        mapped = 1;
+    }
+
+    head = start + size;
+    *offset = start;
+
+    return ptr;
+}
+
+
+
+// Finish writing to the last allocation, the stream buffer remains bound to GL_ARRAY_BUFFER.
+void zStreamUnmap(void)
+{
+    if (!mapped) return;
+
+    glBindBufferARB(GL_ARRAY_BUFFER, stream_vbo);
+    if (!glUnmapBufferARB(GL_ARRAY_BUFFER))
+        zWarning("Stream buffer contents became invalid while mapped.");
+
+    mapped = 0;
+}
+
+
+
+// Returns the name of the stream buffer object, for binding it to other targets (i.e.
+// GL_ELEMENT_ARRAY_BUFFER).
+GLuint zStreamBuffer(void)
+{
+    return stream_vbo;
+}
@@ -0,0 +1,37 @@
+#ifndef __STREAM_H__
+#define __STREAM_H__
+
+#include <GL/glew.h>
+
+// The stream buffer is a single large buffer object that per-frame (transient) vertex/index data is
+// suballocated from, so nothing needs to create buffers or draw in immediate mode for dynamic
+// geometry. It is split into Z_STREAM_SEGMENTS parts, one per frame, each guarded by a fence so I
+// never write to a part the GPU may still be reading from.
+
+#define Z_STREAM_SIZE      (4*1024*1024) // Size of the whole buffer in bytes.
+#define Z_STREAM_SEGMENTS  3             // Number of frames that can be in flight.
+#define Z_STREAM_ALIGNMENT 16            // Alignment of each allocation in bytes.
+
+// Ways the buffer can be mapped, depending on what the OpenGL implementation supports.
+#define Z_STREAM_NONE       0 // Not supported, zStreamMap always fails.
+#define Z_STREAM_PERSISTENT 1 // ARB_buffer_storage + ARB_sync, mapped once for its lifetime.
+#define Z_STREAM_ORPHAN     2 // ARB_map_buffer_range, orphaned every frame.
+
+
+extern int stream_mode;
+
+void zStreamInit(void);
+
+void zStreamDeinit(void);
+
+void zStreamBeginFrame(void);
+
+void zStreamEndFrame(void);
+
+void *zStreamMap(GLsizeiptr size, GLintptr *offset);
+
+void zStreamUnmap(void);
+
+GLuint zStreamBuffer(void);
+
+#endif
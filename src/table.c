@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <assert.h>
+
+#include "common.h"
+
+
+#define Z_TABLE_MIN_SIZE 16
+
+
+
+// Find the item with the given hash for which match returns TRUE, or NULL if there is none. Hashes
+// are compared first, so match is only called for likely candidates.
+void *zTableFind(const ZTable *table, unsigned int hash, ZTableMatchFunc match, const void *key)
+{
+    unsigned int i, mask = table->size - 1;
+
+    if (!table->count) return NULL;
+
+    for (i = hash & mask; table->items[i]; i = (i + 1) & mask) {
+        if (table->hashes[i] == hash && match(table->items[i], key))
+            return table->items[i];
+    }
+
+    return NULL;
+}
+
+
+
+// Put item in the first free slot from its hash on, the table is assumed to have room.
+static void zTablePlace(ZTable *table, unsigned int hash, void *item)
+{
+    unsigned int i, mask = table->size - 1;
+
+    for (i = hash & mask; table->items[i]; i = (i + 1) & mask);
+
+    table->hashes[i] = hash;
+    table->items[i] = item;
+}
+
+
+
+// Resize table to size slots and reinsert all items. Returns FALSE if memory ran out, the table is
+// left unchanged then.
+static int zTableResize(ZTable *table, unsigned int size)
+{
+    unsigned int i, old_size = table->size;
+    unsigned int *old_hashes = table->hashes;
+    void **old_items = table->items;
+    unsigned int *hashes = malloc(size * sizeof(unsigned int));
+    void **items = calloc(size, sizeof(void *));
+
+    if (!hashes || !items) {
+        free(hashes);
+        free(items);
+        return FALSE;
+    }
+
+    table->size = size;
+    table->hashes = hashes;
+    table->items = items;
+
+    for (i = 0; i < old_size; i++) {
+        if (old_items[i])
+            zTablePlace(table, old_hashes[i], old_items[i]);
+    }
+
+    free(old_hashes);
+    free(old_items);
+
+    return TRUE;
+}
+
+
+
+// Add item to table, growing it if needed. The table doesn't check for duplicates. Returns FALSE
+// if memory ran out.
+int zTableInsert(ZTable *table, unsigned int hash, void *item)
+{
+    assert(item);
+
+    if ( (table->count + 1) * 4 > table->size * 3 &&
+         !zTableResize(table, table->size ? table->size * 2 : Z_TABLE_MIN_SIZE) ) {
+        zError("%s: Failed to allocate memory.", __func__);
+        return FALSE;
+    }
+
+    zTablePlace(table, hash, item);
+    table->count++;
+
+    return TRUE;
+}
+
+
+
+// Remove the item in slot index. Items following it that would no longer be reachable from their
+// hash are shifted back into the hole.
+void zTableRemoveAt(ZTable *table, unsigned int index)
+{
+    unsigned int home, i = index, j = index, mask = table->size - 1;
+
+    assert(index < table->size && table->items[index]);
+
+    table->items[i] = NULL;
+    table->count--;
+
+    for (;;) {
+
+        j = (j + 1) & mask;
+
+        if (!table->items[j]) return;
+
+        // An item can stay if its home slot lies (cyclically) after the hole, up to where it is.
+        home = table->hashes[j] & mask;
+
+        if ( i <= j ? (i < home && home <= j) : (i < home || home <= j) )
+            continue;
+
+        table->hashes[i] = table->hashes[j];
+        table->items[i] = table->items[j];
+        table->items[j] = NULL;
+        i = j;
+    }
+}
+
+
+
+// Remove item, which was inserted with hash. Returns FALSE if it isn't in the table.
+int zTableRemove(ZTable *table, unsigned int hash, const void *item)
+{
+    unsigned int i, mask = table->size - 1;
+
+    if (!table->count) return FALSE;
+
+    for (i = hash & mask; table->items[i]; i = (i + 1) & mask) {
+        if (table->items[i] == item) {
+            zTableRemoveAt(table, i);
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+
+// Free the slots of table, the items themselves are up to the caller.
+void zTableClear(ZTable *table)
+{
+    free(table->hashes);
+    free(table->items);
+
+    table->size = table->count = 0;
+    table->hashes = NULL;
+    table->items = NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef __TABLE_H__
+#define __TABLE_H__
+
+// Open-addressed hash table of pointers, used for the resource registries. The table stores each
+// item along with its hash and knows nothing about keys, lookups pass a function that checks an
+// item against whatever key the caller uses. Collisions are resolved with linear probing, the table
+// doubles in size when it gets 3/4 full, and removing an item shifts the ones after it back so no
+// tombstones are needed.
+//
+// To visit all items, loop over the slots and skip the empty ones:
+//
+//   for (i = 0; i < table.size; i++) {
+//       if (table.items[i]) ...
+//   }
+//
+// Items may be removed with zTableRemoveAt while doing so, as long as the same slot is checked
+// again afterwards, since a following item may have been shifted into it.
+
+typedef int (*ZTableMatchFunc)(const void *item, const void *key);
+
+typedef struct ZTable
+{
+    unsigned int size;  // Number of slots, a power of two, or 0 before the first insert.
+    unsigned int count; // Number of items.
+
+    unsigned int *hashes;
+    void **items; // NULL for empty slots.
+
+} ZTable;
+
+
+void *zTableFind(const ZTable *table, unsigned int hash, ZTableMatchFunc match, const void *key);
+
+int zTableInsert(ZTable *table, unsigned int hash, void *item);
+
+void zTableRemoveAt(ZTable *table, unsigned int index);
+
+int zTableRemove(ZTable *table, unsigned int hash, const void *item);
+
+void zTableClear(ZTable *table);
+
+#endif
@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <GL/glew.h>
+
+#include "common.h"
+
+
+int texarrays_active;
+
+static ZTextureArray *arrays;
+
+// Layer 0 is white, layer 1 a flat normal.
+static ZTextureArray placeholder;
+static unsigned char placeholder_used[2] = { 1, 1 };
+
+
+
+// Decide whether texture arrays can be used and set up the placeholder array. Must be called before
+// any textures are created or shaders queued, since it decides how both work.
+void zTextureArrayInit(void)
+{
+    static const unsigned char pixels[8] = { 255, 255, 255, 255, 128, 128, 255, 255 };
+
+    assert(!arrays && !placeholder.gltexname);
+
+    texarrays_active = 0;
+
+    if (!r_texarrays) return;
+
+    // The fixed-function pipeline can't sample from array textures, and texture parameters should
+    // come from sampler objects, since setting them on a shared array affects all of its textures
+    // (zSetTextureArrayParams still does that if the samplers run out).
+    if (r_noshaders || !GLEW_EXT_texture_array || !Z_SAMPLER_OBJECTS) {
+        zWarning("Texture arrays need shaders, EXT_texture_array and ARB_sampler_objects, not using"
+            " them.");
+        return;
+    }
+
+    glGenTextures(1, &(placeholder.gltexname));
+    glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, placeholder.gltexname);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY_EXT, GL_TEXTURE_MAX_LEVEL, 0);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY_EXT, 0, GL_RGBA, 1, 1, 2, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, 0);
+
+    placeholder.format     = GL_RGBA;
+    placeholder.width      = 1;
+    placeholder.height     = 1;
+    placeholder.num_levels = 1;
+    placeholder.num_layers = 2;
+    placeholder.num_used   = 2;
+    placeholder.layer_used = placeholder_used;
+
+    texarrays_active = 1;
+}
+
+
+
+static void zDeleteTextureArray(ZTextureArray *array)
+{
+    glDeleteTextures(1, &(array->gltexname));
+    free(array->layer_used);
+    free(array);
+}
+
+
+
+void zTextureArrayDeinit(void)
+{
+    ZTextureArray *tmp;
+
+    // Textures should have given back their layers by now, but clean up anyway.
+    while (arrays) {
+        tmp = arrays->next;
+        zDeleteTextureArray(arrays);
+        arrays = tmp;
+    }
+
+    glDeleteTextures(1, &(placeholder.gltexname));
+    placeholder.gltexname = 0;
+    placeholder.wrap_mode = placeholder.min_filter = placeholder.mag_filter = 0;
+
+    texarrays_active = 0;
+}
+
+
+
+// Returns the placeholder array and sets layer to the placeholder to use for textures with the
+// given Z_TEX_* flags.
+ZTextureArray *zGetPlaceholderArray(unsigned int flags, int *layer)
+{
+    assert(texarrays_active);
+
+    *layer = (flags & Z_TEX_NORMALMAP) ? 1 : 0;
+
+    return &placeholder;
+}
+
+
+
+// Create an array for textures like mimg, with num_levels mipmap levels.
+static ZTextureArray *zNewTextureArray(const ZMipImage *mimg, int num_levels)
+{
+    ZTextureArray *array;
+    int i, width, height;
+
+    if ( !(array = malloc(sizeof(ZTextureArray))) ) {
+        zError("%s: Failed to allocate memory for texture array.", __func__);
+        return NULL;
+    }
+
+    memset(array, '\0', sizeof(ZTextureArray));
+    array->format     = mimg->format;
+    array->width      = mimg->width;
+    array->height     = mimg->height;
+    array->num_levels = num_levels;
+    array->num_layers = r_texarraylayers;
+
+    if ( !(array->layer_used = calloc(array->num_layers, 1)) ) {
+        zError("%s: Failed to allocate memory for texture array.", __func__);
+        free(array);
+        return NULL;
+    }
+
+    glGenTextures(1, &(array->gltexname));
+    glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, array->gltexname);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY_EXT, GL_TEXTURE_MAX_LEVEL, num_levels-1);
+
+    // Allocate storage for all layers up front, they are filled in by zUploadTextureLayer.
+    for (i = 0; i < num_levels; i++) {
+
+        width  = mimg->width  >> i ? mimg->width  >> i : 1;
+        height = mimg->height >> i ? mimg->height >> i : 1;
+
+        if (mimg->format == GL_RGBA)
+            glTexImage3D(GL_TEXTURE_2D_ARRAY_EXT, i, GL_RGBA, width, height, array->num_layers, 0,
+                GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        else
+            glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY_EXT, i, mimg->format, width, height,
+                array->num_layers, 0, mimg->level_size[i] * array->num_layers, NULL);
+    }
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, 0);
+
+    zDebug("Created %dx%d texture array with %d layers.", array->width, array->height,
+        array->num_layers);
+
+    return array;
+}
+
+
+
+// Find a free layer for a texture like mimg, with num_levels mipmap levels, creating a new array if
+// needed. Returns the array and sets layer, or returns NULL on failure.
+ZTextureArray *zAllocTextureLayer(const ZMipImage *mimg, int num_levels, int *layer)
+{
+    ZTextureArray *array;
+    int i;
+
+    assert(texarrays_active);
+
+    for (array = arrays; array; array = array->next) {
+        if (array->format == mimg->format && array->width == mimg->width &&
+            array->height == mimg->height && array->num_levels == num_levels &&
+            array->num_used < array->num_layers)
+            break;
+    }
+
+    if (!array) {
+
+        if ( !(array = zNewTextureArray(mimg, num_levels)) )
+            return NULL;
+
+        array->next = arrays;
+        arrays = array;
+    }
+
+    for (i = 0; array->layer_used[i]; i++);
+
+    array->layer_used[i] = 1;
+    array->num_used++;
+
+    *layer = i;
+
+    return array;
+}
+
+
+
+// Give back a layer, arrays are deleted once their last layer is freed.
+void zFreeTextureLayer(ZTextureArray *array, int layer)
+{
+    ZTextureArray **prev;
+
+    if (array == &placeholder) return;
+
+    assert(array->layer_used[layer]);
+
+    array->layer_used[layer] = 0;
+
+    if (--array->num_used > 0) return;
+
+    for (prev = &arrays; *prev != array; prev = &((*prev)->next));
+
+    *prev = array->next;
+    zDeleteTextureArray(array);
+}
+
+
+
+// Upload level of mimg to layer of array. data is either the level data or, if a pixel unpack
+// buffer is bound, an offset into it.
+void zUploadTextureLayer(ZTextureArray *array, int layer, const ZMipImage *mimg, int level,
+    const void *data)
+{
+    int width  = mimg->width  >> level ? mimg->width  >> level : 1;
+    int height = mimg->height >> level ? mimg->height >> level : 1;
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, array->gltexname);
+
+    if (mimg->format == GL_RGBA)
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY_EXT, level, 0, 0, layer, width, height, 1, GL_RGBA,
+            GL_UNSIGNED_BYTE, data);
+    else
+        glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY_EXT, level, 0, 0, layer, width, height, 1,
+            mimg->format, mimg->level_size[level], data);
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, 0);
+}
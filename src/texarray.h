@@ -0,0 +1,57 @@
+#ifndef __TEXARRAY_H__
+#define __TEXARRAY_H__
+
+#include <GL/glew.h>
+
+#include "texcache.h"
+
+// With r_texarrays set, textures are stored as layers of 2D array textures instead of as separate
+// texture objects. Textures with the same size, format and number of mipmap levels share an array
+// of r_texarraylayers layers, so materials using similar textures end up with the same bindings and
+// only differ in the layer indices passed to the shader (through the z_tex_layers uniform). Shaders
+// are compiled with TEXARRAY defined and must sample from sampler2DArray in that case. Placeholders
+// for textures that are still loading live in a separate two-layer array.
+//
+// None of the shaders that come with the engine handle TEXARRAY yet, so for now this is only
+// infrastructure for materials with shaders that do, and r_texarrays is off by default.
+
+typedef struct ZTextureArray
+{
+    GLuint gltexname;
+
+    GLenum format;
+    int width;
+    int height;
+    int num_levels;
+
+    int num_layers;
+    int num_used;
+    unsigned char *layer_used;
+
+    // Texture parameters currently set on the array, for when there are no sampler objects to use
+    // (see zSetTextureArrayParams). 0 means not set yet.
+    unsigned char wrap_mode;
+    unsigned char min_filter;
+    unsigned char mag_filter;
+
+    struct ZTextureArray *next;
+
+} ZTextureArray;
+
+
+extern int texarrays_active;
+
+void zTextureArrayInit(void);
+
+void zTextureArrayDeinit(void);
+
+ZTextureArray *zGetPlaceholderArray(unsigned int flags, int *layer);
+
+ZTextureArray *zAllocTextureLayer(const ZMipImage *mimg, int num_levels, int *layer);
+
+void zFreeTextureLayer(ZTextureArray *array, int layer);
+
+void zUploadTextureLayer(ZTextureArray *array, int layer, const ZMipImage *mimg, int level,
+    const void *data);
+
+#endif
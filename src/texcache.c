@@ -0,0 +1,747 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <limits.h>
+#include <GL/glew.h>
+
+#include "common.h"
+
+
+#define Z_TEXCACHE_MAGIC   0x4354525a // "ZRTC"
+#define Z_TEXCACHE_VERSION 2 // 2: data maps are no longer filtered as sRGB.
+
+// Header at the start of each file in the texture cache, followed by the data for each mipmap level
+// (sizes follow from format and dimensions).
+typedef struct ZTexCacheHeader
+{
+    // Size and modification time of the source image when the entry was created.
+    unsigned long long source_size;
+    unsigned long long source_mtime;
+
+    unsigned int magic;
+    unsigned int version;
+    unsigned int flags;  // Z_TEX_* flags the texture was compressed for.
+    unsigned int format;
+
+    int width;
+    int height;
+    int num_levels;
+
+} ZTexCacheHeader;
+
+
+
+// Returns the compressed format to use for a texture with flags, and wether it has any
+// non-opaque pixels. Returns 0 if the texture shouldn't (or can't) be compressed.
+GLenum zTexCacheFormat(unsigned int flags, int alpha)
+{
+    if (flags & Z_TEX_NORMALMAP) {
+
+        // BC1 destroys normal maps, so it's BC5 or nothing. Since BC5 only has two channels
+        // shaders need to reconstruct Z, so this needs to be enabled explicitly.
+        if (r_texcompressnormals && GLEW_ARB_texture_compression_rgtc)
+            return GL_COMPRESSED_RG_RGTC2;
+
+        return 0;
+    }
+
+    if (!GLEW_EXT_texture_compression_s3tc)
+        return 0;
+
+    return alpha ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+}
+
+
+
+// Returns the number of bytes needed for a width x height image in format.
+static unsigned int zMipLevelSize(GLenum format, int width, int height)
+{
+    unsigned int block_size = (format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT) ? 8 : 16;
+
+    if (format == GL_RGBA)
+        return width * height * 4;
+
+    return ((width+3)/4) * ((height+3)/4) * block_size;
+}
+
+
+
+// Fill in level_size for each level of mimg and return the total size of all levels.
+static unsigned int zMipLevelSizes(ZMipImage *mimg)
+{
+    int i, width = mimg->width, height = mimg->height;
+    unsigned int total = 0;
+
+    for (i = 0; i < mimg->num_levels; i++) {
+
+        mimg->level_size[i] = zMipLevelSize(mimg->format, width, height);
+        total += mimg->level_size[i];
+
+        if (width > 1)  width  /= 2;
+        if (height > 1) height /= 2;
+    }
+
+    return total;
+}
+
+
+
+// Allocate a ZMipImage along with the storage for all of its levels. Returns NULL on
+// failure.
+static ZMipImage *zNewMipImage(GLenum format, int width, int height, int num_levels)
+{
+    ZMipImage *mimg;
+    unsigned int total;
+    unsigned char *pos;
+    int i;
+
+    assert(num_levels > 0 && num_levels <= Z_TEXCACHE_MAX_LEVELS);
+
+    if ( !(mimg = malloc(sizeof(ZMipImage))) ) {
+        zError("%s: Failed to allocate memory.", __func__);
+        return NULL;
+    }
+
+    memset(mimg, '\0', sizeof(ZMipImage));
+    mimg->format     = format;
+    mimg->width      = width;
+    mimg->height     = height;
+    mimg->num_levels = num_levels;
+
+    total = zMipLevelSizes(mimg);
+
+    if ( !(mimg->data = malloc(total)) ) {
+        zError("%s: Failed to allocate memory.", __func__);
+        free(mimg);
+        return NULL;
+    }
+
+    for (i = 0, pos = mimg->data; i < num_levels; pos += mimg->level_size[i++])
+        mimg->level_data[i] = pos;
+
+    return mimg;
+}
+
+
+
+void zDeleteMipImage(ZMipImage *mimg)
+{
+    if (!mimg) return;
+
+    free(mimg->data);
+    free(mimg);
+}
+
+
+
+// Block compression ------------------------------------------------------------------------------
+//
+// Nothing fancy, I just fit endpoints to the bounding box of the block and pick the nearest palette
+// entry for each pixel. This is a lot worse than what the offline tools can do with their cluster
+// fits, but it is fast and good enough for most textures.
+
+static unsigned short zPack565(const int *rgb)
+{
+    return (unsigned short) ( (((rgb[0]*31 + 127) / 255) << 11) |
+                              (((rgb[1]*63 + 127) / 255) << 5)  |
+                               ((rgb[2]*31 + 127) / 255) );
+}
+
+
+
+static void zUnpack565(unsigned short c, int *rgb)
+{
+    int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+
+    rgb[0] = (r << 3) | (r >> 2);
+    rgb[1] = (g << 2) | (g >> 4);
+    rgb[2] = (b << 3) | (b >> 2);
+}
+
+
+
+// Encode the RGB channels of a 4x4 block of RGBA pixels into 8 bytes of BC1 data. Always uses the
+// four color mode (no punch-through alpha), so the result is also valid as the color part of BC3.
+static void zEncodeBC1(const unsigned char *block, unsigned char *out)
+{
+    int min[3] = { 255, 255, 255 }, max[3] = { 0, 0, 0 };
+    int palette[4][3];
+    unsigned short c0, c1, tmp;
+    unsigned int indices = 0;
+    int i, j, k;
+
+    for (i = 0; i < 16; i++) {
+        for (j = 0; j < 3; j++) {
+            if (block[i*4+j] < min[j]) min[j] = block[i*4+j];
+            if (block[i*4+j] > max[j]) max[j] = block[i*4+j];
+        }
+    }
+
+    // Pull the endpoints in a bit, this reduces the error for the colors in between.
+    for (j = 0; j < 3; j++) {
+        int inset = (max[j] - min[j]) / 16;
+        min[j] += inset;
+        max[j] -= inset;
+    }
+
+    // The bounding box has four diagonals, and the colors may well lie along one that doesn't run
+    // from min to max. So flip a channel if it runs opposite to the channel with the largest
+    // range.
+    for (j = 1, k = 0; j < 3; j++) {
+        if (max[j] - min[j] > max[k] - min[k]) k = j;
+    }
+
+    for (j = 0; j < 3; j++) {
+
+        int cov = 0;
+
+        if (j == k) continue;
+
+        for (i = 0; i < 16; i++)
+            cov += (block[i*4+j] - (min[j] + max[j])/2) * (block[i*4+k] - (min[k] + max[k])/2);
+
+        if (cov < 0) {
+            int swap = min[j];
+            min[j] = max[j];
+            max[j] = swap;
+        }
+    }
+
+    c0 = zPack565(max);
+    c1 = zPack565(min);
+
+    // c0 > c1 selects the four color mode.
+    if (c0 < c1) {
+        tmp = c0;
+        c0 = c1;
+        c1 = tmp;
+    }
+
+    if (c0 != c1) {
+
+        zUnpack565(c0, palette[0]);
+        zUnpack565(c1, palette[1]);
+
+        for (j = 0; j < 3; j++) {
+            palette[2][j] = (2*palette[0][j] + palette[1][j]) / 3;
+            palette[3][j] = (palette[0][j] + 2*palette[1][j]) / 3;
+        }
+
+        for (i = 0; i < 16; i++) {
+
+            int best = 0, best_dist = INT_MAX;
+
+            for (k = 0; k < 4; k++) {
+
+                int dist = 0;
+
+                for (j = 0; j < 3; j++)
+                    dist += (block[i*4+j] - palette[k][j]) * (block[i*4+j] - palette[k][j]);
+
+                if (dist < best_dist) {
+                    best_dist = dist;
+                    best = k;
+                }
+            }
+
+            indices |= best << (2*i);
+        }
+    }
+
+    out[0] = c0 & 0xff;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xff;
+    out[3] = c1 >> 8;
+    out[4] = indices & 0xff;
+    out[5] = (indices >> 8) & 0xff;
+    out[6] = (indices >> 16) & 0xff;
+    out[7] = (indices >> 24) & 0xff;
+}
+
+
+
+// Encode a single channel of a 4x4 block of RGBA pixels into 8 bytes of BC4 data (the alpha part
+// of BC3, and each half of BC5 use the same encoding).
+static void zEncodeBC4(const unsigned char *block, int channel, unsigned char *out)
+{
+    int lo = 255, hi = 0, values[8];
+    unsigned long long indices = 0;
+    int i, k;
+
+    for (i = 0; i < 16; i++) {
+        if (block[i*4+channel] < lo) lo = block[i*4+channel];
+        if (block[i*4+channel] > hi) hi = block[i*4+channel];
+    }
+
+    // hi > lo selects the eight value mode.
+    if (hi != lo) {
+
+        values[0] = hi;
+        values[1] = lo;
+
+        for (k = 2; k < 8; k++)
+            values[k] = ((8-k)*hi + (k-1)*lo + 3) / 7;
+
+        for (i = 0; i < 16; i++) {
+
+            int best = 0, best_dist = INT_MAX;
+
+            for (k = 0; k < 8; k++) {
+
+                int dist = abs(block[i*4+channel] - values[k]);
+
+                if (dist < best_dist) {
+                    best_dist = dist;
+                    best = k;
+                }
+            }
+
+            indices |= (unsigned long long) best << (3*i);
+        }
+    }
+
+    out[0] = hi;
+    out[1] = lo;
+
+    for (i = 0; i < 6; i++)
+        out[2+i] = (indices >> (8*i)) & 0xff;
+}
+
+
+
+// Copy the 4x4 block at block coordinates bx, by out of an RGBA image, repeating the edge pixels
+// for blocks that stick out of the image.
+static void zFetchBlock(const unsigned char *pixels, int width, int height, int bx, int by,
+    unsigned char *block)
+{
+    int x, y;
+
+    for (y = 0; y < 4; y++) {
+
+        int sy = MIN(by*4 + y, height-1);
+
+        for (x = 0; x < 4; x++) {
+
+            int sx = MIN(bx*4 + x, width-1);
+
+            memcpy(block + (y*4 + x)*4, pixels + (sy*width + sx)*4, 4);
+        }
+    }
+}
+
+
+
+// Compress a width x height RGBA image into out.
+static void zEncodeLevel(GLenum format, const unsigned char *pixels, int width, int height,
+    unsigned char *out)
+{
+    unsigned char block[64];
+    int bx, by;
+
+    for (by = 0; by < (height+3)/4; by++) {
+        for (bx = 0; bx < (width+3)/4; bx++) {
+
+            zFetchBlock(pixels, width, height, bx, by, block);
+
+            if (format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT) {
+                zEncodeBC1(block, out);
+                out += 8;
+            } else if (format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT) {
+                zEncodeBC4(block, 3, out);
+                zEncodeBC1(block, out+8);
+                out += 16;
+            } else {
+                assert(format == GL_COMPRESSED_RG_RGTC2);
+                zEncodeBC4(block, 0, out);
+                zEncodeBC4(block, 1, out+8);
+                out += 16;
+            }
+        }
+    }
+}
+
+
+
+// Returns the number of levels in a full mipmap chain for a width x height image.
+static int zNumMipLevels(int width, int height)
+{
+    int num_levels = 1, size;
+
+    for (size = width > height ? width : height; size > 1; size /= 2)
+        num_levels++;
+
+    return num_levels;
+}
+
+
+
+// Fill in the levels of mimg from pixels (width x height RGBA, the size of mimg), downsampling it
+// for each level (see mipmap.c) and encoding it if mimg has a compressed format. pixels may point
+// to the first level of mimg itself. flags are the Z_TEX_* flags of the texture. Returns FALSE on
+// failure.
+static int zFillMipImage(ZMipImage *mimg, const unsigned char *pixels, unsigned int flags)
+{
+    int width = mimg->width, height = mimg->height, i;
+    unsigned int scratch_size[2];
+    unsigned char *scratch = NULL, *next;
+
+    // Uncompressed levels are built straight from the level above them.
+    if (mimg->format == GL_RGBA) {
+
+        if (pixels != mimg->level_data[0])
+            memcpy(mimg->level_data[0], pixels, mimg->level_size[0]);
+
+        for (i = 1; i < mimg->num_levels; i++) {
+
+            if (!zDownsample(mimg->level_data[i-1], width, height, flags, mimg->level_data[i]))
+                return FALSE;
+
+            if (width > 1)  width  /= 2;
+            if (height > 1) height /= 2;
+        }
+
+        return TRUE;
+    }
+
+    // Compressed levels can't be downsampled from, so the RGBA version of each level goes in a
+    // scratch buffer. It has room for levels 1 and 2, and each next level goes in whichever half
+    // the level it is built from isn't in.
+    scratch_size[0] = zMipLevelSize(GL_RGBA, MAX(width/2, 1), MAX(height/2, 1));
+    scratch_size[1] = zMipLevelSize(GL_RGBA, MAX(width/4, 1), MAX(height/4, 1));
+
+    if ( mimg->num_levels > 1 && !(scratch = malloc(scratch_size[0] + scratch_size[1])) ) {
+        zError("%s: Failed to allocate memory.", __func__);
+        return FALSE;
+    }
+
+    for (i = 0; i < mimg->num_levels; i++) {
+
+        zEncodeLevel(mimg->format, pixels, width, height, mimg->level_data[i]);
+
+        if (i+1 == mimg->num_levels) break;
+
+        next = scratch + (i % 2 ? scratch_size[0] : 0);
+
+        if (!zDownsample(pixels, width, height, flags, next)) {
+            free(scratch);
+            return FALSE;
+        }
+
+        pixels = next;
+
+        if (width > 1)  width  /= 2;
+        if (height > 1) height /= 2;
+    }
+
+    free(scratch);
+
+    return TRUE;
+}
+
+
+
+// Compress img (and its mipmap chain, which is built here) into the format picked by
+// zTexCacheFormat. Returns NULL on failure or if img shouldn't be compressed.
+ZMipImage *zCompressImage(const ZImage *img, unsigned int flags)
+{
+    ZMipImage *mimg;
+    GLenum format;
+    int alpha = 0, num_levels, i;
+
+    // Only need BC3 if there is something to put in the alpha channel.
+    if ( !(flags & Z_TEX_NORMALMAP) ) {
+        for (i = 0; i < img->width*img->height && !alpha; i++)
+            alpha = img->data[i*4+3] != 255;
+    }
+
+    if ( !(format = zTexCacheFormat(flags, alpha)) )
+        return NULL;
+
+    if ( (num_levels = zNumMipLevels(img->width, img->height)) > Z_TEXCACHE_MAX_LEVELS ) {
+        zWarning("%s: Image is too large to compress.", __func__);
+        return NULL;
+    }
+
+    if ( !(mimg = zNewMipImage(format, img->width, img->height, num_levels)) )
+        return NULL;
+
+    if (!zFillMipImage(mimg, img->data, flags)) {
+        zDeleteMipImage(mimg);
+        return NULL;
+    }
+
+    return mimg;
+}
+
+
+
+// Build an uncompressed (GL_RGBA) ZMipImage from img, with a full mipmap chain if mipmap is set or
+// just the one level otherwise. flags are the Z_TEX_* flags of the texture. Returns NULL on
+// failure.
+ZMipImage *zBuildMipImage(const ZImage *img, unsigned int flags, int mipmap)
+{
+    ZMipImage *mimg;
+    int num_levels = mipmap ? zNumMipLevels(img->width, img->height) : 1;
+
+    if (num_levels > Z_TEXCACHE_MAX_LEVELS) {
+        zWarning("%s: Image is too large.", __func__);
+        return NULL;
+    }
+
+    if ( !(mimg = zNewMipImage(GL_RGBA, img->width, img->height, num_levels)) )
+        return NULL;
+
+    if (!zFillMipImage(mimg, img->data, flags)) {
+        zDeleteMipImage(mimg);
+        return NULL;
+    }
+
+    return mimg;
+}
+
+
+
+// Passed to zAllocMipImage through zDecodeImage.
+typedef struct ZMipImageAlloc
+{
+    unsigned int flags;
+    int mipmap;
+    ZMipImage *mimg;
+
+} ZMipImageAlloc;
+
+
+
+static void *zAllocMipImage(void *data, int width, int height)
+{
+    ZMipImageAlloc *alloc = data;
+    int num_levels = alloc->mipmap ? zNumMipLevels(width, height) : 1;
+
+    if (num_levels > Z_TEXCACHE_MAX_LEVELS) {
+        zWarning("%s: Image is too large.", __func__);
+        return NULL;
+    }
+
+    if ( !(alloc->mimg = zNewMipImage(GL_RGBA, width, height, num_levels)) )
+        return NULL;
+
+    return alloc->mimg->level_data[0];
+}
+
+
+
+// Like zBuildMipImage, but decodes the image at path straight into the first level, without going
+// through a ZImage. Returns NULL on failure.
+ZMipImage *zDecodeMipImage(const char *path, unsigned int flags, int mipmap)
+{
+    ZMipImageAlloc alloc;
+
+    alloc.flags  = flags;
+    alloc.mipmap = mipmap;
+    alloc.mimg   = NULL;
+
+    if ( !zDecodeImage(path, zAllocMipImage, &alloc) ||
+         !zFillMipImage(alloc.mimg, alloc.mimg->level_data[0], flags) ) {
+        zDeleteMipImage(alloc.mimg);
+        return NULL;
+    }
+
+    return alloc.mimg;
+}
+
+
+
+// Returns the name of the cache file for the texture name with flags.
+static const char *zTexCacheFile(const char *name, unsigned int flags)
+{
+    static Z_THREAD_LOCAL char filename[32];
+    unsigned long long key;
+
+    key = zHashData(Z_HASH_INIT, name, strlen(name));
+    key = zHashData(key, &flags, sizeof(flags));
+
+    snprintf(filename, sizeof(filename), "%016llx.ztc", key);
+    filename[sizeof(filename)-1] = '\0';
+
+    return filename;
+}
+
+
+
+// Look up size and modification time of the source image for texture name. Returns FALSE if it
+// couldn't be found.
+static int zTexSourceStat(const char *name, unsigned long long *size, unsigned long long *mtime)
+{
+    const char *path = zGetPath(name, NULL, Z_FILE_REWRITE_DIRSEP | Z_FILE_TRYUSER);
+
+    return path && zGetFileStat(path, size, mtime);
+}
+
+
+
+// Load the compressed version of texture name from the texture cache. Returns NULL if there is no
+// entry, the entry is out of date, or the format isn't usable with the current settings or OpenGL
+// implementation.
+ZMipImage *zLoadCachedTexture(const char *name, unsigned int flags)
+{
+    FILE *fp;
+    ZTexCacheHeader header;
+    ZMipImage *mimg;
+    unsigned long long size, mtime;
+    unsigned int total, i;
+
+    if (!r_texcompress) return NULL;
+
+    if (!zTexSourceStat(name, &size, &mtime))
+        return NULL;
+
+    if ( !(fp = zOpenFile(zTexCacheFile(name, flags), Z_TEXCACHE_DIR, NULL, Z_FILE_FORCEUSER)) )
+        return NULL;
+
+    if ( fread(&header, sizeof(header), 1, fp) != 1 || header.magic != Z_TEXCACHE_MAGIC ||
+         header.version != Z_TEXCACHE_VERSION || header.flags != flags || header.width <= 0 ||
+         header.height <= 0 || header.num_levels <= 0 ||
+         header.num_levels > Z_TEXCACHE_MAX_LEVELS ) {
+        zWarning("Ignoring invalid texture cache entry for \"%s\".", name);
+        fclose(fp);
+        return NULL;
+    }
+
+    if (header.source_size != size || header.source_mtime != mtime) {
+        zDebug("Texture cache entry for \"%s\" is out of date.", name);
+        fclose(fp);
+        return NULL;
+    }
+
+    if (header.format != zTexCacheFormat(flags,
+                             header.format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT)) {
+        fclose(fp);
+        return NULL;
+    }
+
+    if ( !(mimg = zNewMipImage(header.format, header.width, header.height,
+                                      header.num_levels)) ) {
+        fclose(fp);
+        return NULL;
+    }
+
+    for (i = 0, total = 0; i < (unsigned int) mimg->num_levels; i++)
+        total += mimg->level_size[i];
+
+    if (fread(mimg->data, total, 1, fp) != 1) {
+        zWarning("Texture cache entry for \"%s\" is truncated.", name);
+        zDeleteMipImage(mimg);
+        fclose(fp);
+        return NULL;
+    }
+
+    fclose(fp);
+
+    if (fs_printdiskload) zDebug("Loaded texture \"%s\" from texture cache.", name);
+
+    return mimg;
+}
+
+
+
+// Store mimg in the texture cache as the compressed version of texture name. Returns FALSE on
+// failure.
+int zSaveCachedTexture(const char *name, unsigned int flags, const ZMipImage *mimg)
+{
+    FILE *fp;
+    ZTexCacheHeader header;
+    const char *dir;
+    int i, ok;
+
+    memset(&header, '\0', sizeof(header));
+
+    if (!zTexSourceStat(name, &header.source_size, &header.source_mtime))
+        return FALSE;
+
+    if ( !(dir = zGetPath(Z_TEXCACHE_DIR, NULL, Z_FILE_FORCEUSER)) || !zMakeDir(dir) )
+        return FALSE;
+
+    if ( !(fp = zOpenFile(zTexCacheFile(name, flags), Z_TEXCACHE_DIR, NULL,
+                          Z_FILE_FORCEUSER | Z_FILE_WRITE)) ) {
+        zWarning("Failed to open texture cache entry for \"%s\" for writing.", name);
+        return FALSE;
+    }
+
+    header.magic      = Z_TEXCACHE_MAGIC;
+    header.version    = Z_TEXCACHE_VERSION;
+    header.flags      = flags;
+    header.format     = mimg->format;
+    header.width      = mimg->width;
+    header.height     = mimg->height;
+    header.num_levels = mimg->num_levels;
+
+    ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+    for (i = 0; i < mimg->num_levels && ok; i++)
+        ok = fwrite(mimg->level_data[i], mimg->level_size[i], 1, fp) == 1;
+
+    fclose(fp);
+
+    if (!ok) zWarning("Failed to write texture cache entry for \"%s\".", name);
+
+    return ok;
+}
+
+
+
+// Load texture name from disk, compress it and store it in the texture cache. This is what the
+// "compresstextures" console command uses to fill the cache ahead of time. Returns FALSE on failure
+// or if the texture isn't compressed with the current settings.
+int zCompressTexture(const char *name, unsigned int flags)
+{
+    const char *path;
+    ZImage *img;
+    ZMipImage *mimg;
+    int ok;
+
+    if ( !(path = zGetPath(name, NULL, Z_FILE_REWRITE_DIRSEP | Z_FILE_TRYUSER)) ||
+         !(img = zLoadImage(path)) ) {
+        zWarning("Failed to load texture \"%s\" for compressing.", name);
+        return FALSE;
+    }
+
+    mimg = zCompressImage(img, flags);
+    zDeleteImage(img);
+
+    if (!mimg) return FALSE;
+
+    ok = zSaveCachedTexture(name, flags, mimg);
+    zDeleteMipImage(mimg);
+
+    return ok;
+}
+
+
+
+// Upload a single level of mimg to the texture bound to GL_TEXTURE_2D, reading from data (which is
+// either level_data[level], or an offset into the bound GL_PIXEL_UNPACK_BUFFER).
+void zUploadMipLevel(const ZMipImage *mimg, int level, const void *data)
+{
+    int width  = mimg->width  >> level ? mimg->width  >> level : 1;
+    int height = mimg->height >> level ? mimg->height >> level : 1;
+
+    if (mimg->format == GL_RGBA)
+        glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+            data);
+    else
+        glCompressedTexImage2D(GL_TEXTURE_2D, level, mimg->format, width, height, 0,
+            mimg->level_size[level], data);
+}
+
+
+
+// Upload mimg to the texture bound to GL_TEXTURE_2D. Only the first level is uploaded if mipmap
+// is not set.
+void zUploadMipImage(const ZMipImage *mimg, int mipmap)
+{
+    int i;
+
+    for (i = 0; i < (mipmap ? mimg->num_levels : 1); i++)
+        zUploadMipLevel(mimg, i, mimg->level_data[i]);
+}
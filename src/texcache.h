@@ -0,0 +1,56 @@
+#ifndef __TEXCACHE_H__
+#define __TEXCACHE_H__
+
+#include <GL/glew.h>
+
+#include "image.h"
+
+// The texture cache keeps textures in the user directory in a block-compressed format (BC1 for
+// opaque textures, BC3 for ones with alpha, BC5 for normal maps), with all mipmap levels already
+// built, so they can be passed to glCompressedTexImage2D as-is. Entries store the size and
+// modification time of the source image and are ignored once it changes.
+
+#define Z_TEXCACHE_DIR        "texcache"
+#define Z_TEXCACHE_MAX_LEVELS 16 // Enough for 32768x32768.
+
+
+// ZMipImage - An image with its mipmap chain, ready to be uploaded. Either block-compressed (as
+// stored in the texture cache) or plain RGBA.
+typedef struct ZMipImage
+{
+    GLenum format; // One of the GL_COMPRESSED_* formats, or GL_RGBA.
+
+    int width;
+    int height;
+
+    int num_levels;
+    unsigned int level_size[Z_TEXCACHE_MAX_LEVELS];
+    unsigned char *level_data[Z_TEXCACHE_MAX_LEVELS]; // Pointers into data.
+
+    unsigned char *data;
+
+} ZMipImage;
+
+
+
+GLenum zTexCacheFormat(unsigned int flags, int alpha);
+
+ZMipImage *zCompressImage(const ZImage *img, unsigned int flags);
+
+ZMipImage *zBuildMipImage(const ZImage *img, unsigned int flags, int mipmap);
+
+ZMipImage *zDecodeMipImage(const char *path, unsigned int flags, int mipmap);
+
+ZMipImage *zLoadCachedTexture(const char *name, unsigned int flags);
+
+int zSaveCachedTexture(const char *name, unsigned int flags, const ZMipImage *mimg);
+
+int zCompressTexture(const char *name, unsigned int flags);
+
+void zUploadMipLevel(const ZMipImage *mimg, int level, const void *data);
+
+void zUploadMipImage(const ZMipImage *mimg, int mipmap);
+
+void zDeleteMipImage(ZMipImage *mimg);
+
+#endif
@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <GL/glew.h>
+
+#include "common.h"
+
+
+typedef struct ZTextureLoad
+{
+    // Texture being loaded, only touched by the main thread. Set to NULL if the texture is deleted
+    // before the load is done, the result is then just thrown away.
+    ZTexture *tex;
+
+    // Copied from the texture for the worker thread.
+    char name[Z_RESOURCE_NAME_SIZE];
+    unsigned int flags;
+    GLenum format;
+    int mipmap;
+
+    ZMipImage *image; // Result, NULL if loading failed.
+
+    int dedup;               // Copied from r_dedup.
+    unsigned long long hash; // Hash of image if dedup is set, see zDedupTexture.
+
+    int next_level; // Next level to upload, counting down to 0.
+
+    // Layer the image is being uploaded to if texture arrays are used. The texture only switches
+    // over to it once all levels are uploaded.
+    ZTextureArray *array;
+    int layer;
+
+    struct ZTextureLoad *next;
+
+} ZTextureLoad;
+
+
+static ZMutex *done_lock;
+static ZTextureLoad *done_loads; // Loads finished by the workers, newest first (protected by
+                                 // done_lock).
+
+static ZTextureLoad *upload_head; // Loads waiting to be uploaded, oldest first (main thread only).
+static ZTextureLoad *upload_tail;
+
+static GLuint pbo;
+
+
+
+void zTextureLoadInit(void)
+{
+    assert(!done_lock);
+
+    // Without a lock I can't take results from the worker threads, so loads run on the main thread
+    // instead (see zQueueTextureLoad).
+    if ( !(done_lock = zCreateMutex()) )
+        zWarning("Failed to create texture load lock, loading textures on the main thread.");
+
+    if (GLEW_ARB_pixel_buffer_object)
+        glGenBuffersARB(1, &pbo);
+}
+
+
+
+static void zDeleteTextureLoad(ZTextureLoad *load)
+{
+    if (load->tex) load->tex->load = NULL;
+
+    if (load->array) zFreeTextureLayer(load->array, load->layer);
+
+    zDeleteMipImage(load->image);
+    free(load);
+}
+
+
+
+void zTextureLoadDeinit(void)
+{
+    ZTextureLoad *tmp;
+
+    // Make sure no worker is still working on a load.
+    zFlushJobs();
+
+    while (done_loads) {
+        tmp = done_loads->next;
+        zDeleteTextureLoad(done_loads);
+        done_loads = tmp;
+    }
+
+    while (upload_head) {
+        tmp = upload_head->next;
+        zDeleteTextureLoad(upload_head);
+        upload_head = tmp;
+    }
+
+    upload_tail = NULL;
+
+    if (done_lock) zDeleteMutex(done_lock);
+    done_lock = NULL;
+
+    if (pbo) glDeleteBuffersARB(1, &pbo);
+    pbo = 0;
+}
+
+
+
+// Returns the hash of the data that ends up in the texture, never 0.
+static unsigned long long zHashMipImage(const ZMipImage *mimg)
+{
+    unsigned int header[4];
+    unsigned long long hash;
+    int i;
+
+    header[0] = mimg->format;
+    header[1] = mimg->width;
+    header[2] = mimg->height;
+    header[3] = mimg->num_levels;
+
+    hash = zHashBlock(0, header, sizeof(header));
+
+    for (i = 0; i < mimg->num_levels; i++)
+        hash = zHashBlock(hash, mimg->level_data[i], mimg->level_size[i]);
+
+    return hash ? hash : 1;
+}
+
+
+
+// Runs on a worker thread. Fills in load->image and hands the load back to the main thread.
+static void zTextureLoadJob(void *data)
+{
+    ZTextureLoad *load = data;
+    const char *path;
+    ZImage *img;
+
+    // Try the texture cache first, this skips decoding the image and building mipmaps entirely.
+    load->image = zLoadCachedTexture(load->name, load->flags);
+
+    if (!load->image) {
+
+        if (fs_printdiskload) zDebug("Loading texture \"%s\" from disk.", load->name);
+
+        path = zGetPath(load->name, NULL, Z_FILE_REWRITE_DIRSEP | Z_FILE_TRYUSER);
+
+        // Compress the texture and add it to the cache if desired, so the next load can skip all
+        // this. If the texture was promised to be compressed it must be compressed now.
+        if ( path && (r_texcompress == 2 || load->format != GL_RGBA) ) {
+
+            if ( (img = zLoadImage(path)) ) {
+
+                if ( (load->image = zCompressImage(img, load->flags)) )
+                    zSaveCachedTexture(load->name, load->flags, load->image);
+
+                if (!load->image)
+                    load->image = zBuildMipImage(img, load->flags, load->mipmap);
+
+                zDeleteImage(img);
+            }
+
+        } else if (path) {
+
+            // Decode straight into the first level of the upload image.
+            load->image = zDecodeMipImage(path, load->flags, load->mipmap);
+        }
+    }
+
+    if (load->image && load->dedup)
+        load->hash = zHashMipImage(load->image);
+
+    if (done_lock) zLockMutex(done_lock);
+    load->next = done_loads;
+    done_loads = load;
+    if (done_lock) zUnlockMutex(done_lock);
+}
+
+
+
+// Start loading the image data for tex in the background. The texture should already have a
+// placeholder uploaded, it is replaced by zUpdateTextureLoads once the data is available.
+void zQueueTextureLoad(ZTexture *tex)
+{
+    ZTextureLoad *load;
+
+    assert(!tex->load);
+
+    if ( !(load = malloc(sizeof(ZTextureLoad))) ) {
+        zError("%s: Failed to allocate memory while loading texture \"%s\".", __func__, tex->name);
+        return;
+    }
+
+    memset(load, '\0', sizeof(ZTextureLoad));
+    load->tex = tex;
+    strcpy(load->name, tex->name);
+    load->flags  = tex->flags;
+    load->format = tex->format;
+    load->mipmap = r_mipmap;
+    load->dedup  = r_dedup;
+
+    tex->load = load;
+
+    if (done_lock)
+        zAddJob(zTextureLoadJob, load);
+    else
+        zTextureLoadJob(load);
+}
+
+
+
+// Stop caring about the load for tex (because tex is about to be deleted).
+void zCancelTextureLoad(ZTexture *tex)
+{
+    if (!tex->load) return;
+
+    tex->load->tex = NULL;
+    tex->load = NULL;
+}
+
+
+
+// Upload a single level of the image for load to its texture (or texture array layer).
+static void zUploadTextureLevel(ZTextureLoad *load, int level)
+{
+    const ZMipImage *mimg = load->image;
+    unsigned int size = mimg->level_size[level];
+    const void *data = mimg->level_data[level];
+    void *ptr;
+
+    // Stage the data in the PBO so the driver can do the actual transfer asynchronously. The
+    // storage is orphaned every time, so this never has to wait for a previous transfer. With the
+    // PBO bound the data pointer is an offset into it.
+    if (pbo) {
+
+        glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, pbo);
+        glBufferDataARB(GL_PIXEL_UNPACK_BUFFER_ARB, size, NULL, GL_STREAM_DRAW_ARB);
+
+        if ( (ptr = glMapBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, GL_WRITE_ONLY_ARB)) ) {
+            memcpy(ptr, data, size);
+            if (glUnmapBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB))
+                data = NULL;
+        }
+
+        if (data) glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+    }
+
+    if (load->array) {
+
+        zUploadTextureLayer(load->array, load->layer, mimg, level, data);
+
+    } else {
+
+        glBindTexture(GL_TEXTURE_2D, load->tex->gltexname);
+
+        // Limit the levels used for sampling to the ones uploaded so far, so the texture remains
+        // complete while the larger levels are still on their way.
+        if (level == (load->mipmap ? mimg->num_levels-1 : 0))
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level);
+
+        zUploadMipLevel(mimg, level, data);
+
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    if (pbo && !data) glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+
+    zAddTextureSize(load->tex, size);
+}
+
+
+
+// Switch the texture for load over to the uploaded image.
+static void zFinishTextureLoad(ZTextureLoad *load)
+{
+    ZTexture *tex = load->tex;
+
+    tex->format = load->image->format;
+
+    if (load->array) {
+        zFreeTextureLayer(tex->array, tex->layer);
+        tex->array = load->array;
+        tex->layer = load->layer;
+        load->array = NULL;
+    }
+}
+
+
+
+// Take the loads the workers have finished and upload as much of them as the per-frame budget
+// allows. Should be called once per frame.
+void zUpdateTextureLoads(void)
+{
+    ZTextureLoad *done, *load, *tmp = NULL;
+    unsigned int budget = r_texuploadkb * 1024, used = 0, size;
+
+    // Grab finished loads and add them to the upload queue, in the order they were finished.
+    if (done_lock) zLockMutex(done_lock);
+    done = done_loads;
+    done_loads = NULL;
+    if (done_lock) zUnlockMutex(done_lock);
+
+    // The done list is newest first, so reverse it before appending it to the upload queue.
+    while (done) {
+        load = done;
+        done = done->next;
+        load->next = tmp;
+        tmp = load;
+    }
+
+    while (tmp) {
+
+        load = tmp;
+        tmp = tmp->next;
+        load->next = NULL;
+
+        // If the texture turns out to be a copy of another one, the image isn't needed at all.
+        if (load->tex && load->hash && zDedupTexture(load->tex, load->hash))
+            zCancelTextureLoad(load->tex);
+
+        if (load->image)
+            load->next_level = load->mipmap ? load->image->num_levels-1 : 0;
+
+        if (upload_tail)
+            upload_tail->next = load;
+        else
+            upload_head = load;
+
+        upload_tail = load;
+    }
+
+    while ( (load = upload_head) ) {
+
+        if (load->tex && !load->image)
+            zWarning("Failed to load texture \"%s\", keeping placeholder.", load->name);
+
+        // Reserve a layer before the first level goes up.
+        if (load->tex && load->image && texarrays_active && !load->array) {
+
+            load->array = zAllocTextureLayer(load->image, load->next_level+1, &(load->layer));
+
+            if (!load->array) {
+                zWarning("Failed to find texture array layer for \"%s\".", load->name);
+                zDeleteMipImage(load->image);
+                load->image = NULL;
+            }
+        }
+
+        if (load->tex && load->image) {
+
+            size = load->image->level_size[load->next_level];
+
+            // Always upload at least one level per frame, or large levels would never make it.
+            if (used && used + size > budget)
+                break;
+
+            zUploadTextureLevel(load, load->next_level);
+            used += size;
+
+            if (load->next_level-- > 0)
+                continue;
+
+            // That was the last one.
+            zFinishTextureLoad(load);
+        }
+
+        upload_head = load->next;
+        if (!upload_head) upload_tail = NULL;
+
+        zDeleteTextureLoad(load);
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef __TEXLOAD_H__
+#define __TEXLOAD_H__
+
+#include "material.h"
+
+// Textures are loaded in the background. zQueueTextureLoad hands a texture to a worker thread that
+// reads it from the texture cache, or decodes the image and builds its mipmaps. zUpdateTextureLoads
+// then uploads the results through a pixel buffer object a level at a time, smallest level first,
+// staying under r_texuploadkb per frame. Until the first level arrives the texture holds a 1x1
+// placeholder.
+
+void zTextureLoadInit(void);
+
+void zTextureLoadDeinit(void);
+
+void zQueueTextureLoad(ZTexture *tex);
+
+void zCancelTextureLoad(ZTexture *tex);
+
+void zUpdateTextureLoads(void);
+
+#endif
@@ -1,166 +1,489 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <GL/glew.h>
 
-#include "common.h"
-
-#ifdef HAVE_CAPITALIZED_FTGL_H
-#include <FTGL/FTGL.h>
-#else
-#include <FTGL/ftgl.h>
-#endif
+#include <ft2build.h>
+#include FT_FREETYPE_H
 
+#include "common.h"
 
-// XXX: Quick and ugly hack for some basic text-rendering
 
-#define Z_CURSOR_BYTES 512
+// Text is rendered from glyphs cached in a single alpha texture atlas. Every string drawn during a
+// frame is appended to one vertex array as textured quads, which is drawn with a single call by
+// zTextRenderFlush at the end of the frame.
 
 #define Z_CONSOLE_TEXTSIZE  13
 #define Z_CONSOLE_FONT      "dejavu-sans-mono-bold.ttf"
 
+#define Z_ATLAS_SIZE 512 // Width/height of the glyph atlas.
 
-static FTGLfont *font_console;
-static GLubyte textcursor_console[Z_CURSOR_BYTES];
+#define Z_GLYPH_DIRECT    256 // Glyphs for codepoints below this are looked up directly by index..
+#define Z_GLYPH_HASH_SIZE 64  // .. others through a small hash table.
 
+#define Z_TEXT_BATCH_INC 1024 // By how many quads the batch grows when full.
 
 
-static void zInitCursor(GLubyte *pixels, int height)
+typedef struct ZGlyph
 {
-    int i;
+    unsigned int codepoint;
+
+    int loaded; // Set once the glyph was rasterized (or failed to).
+
+    float advance; // Horizontal advance in pixels.
+
+    // Quad relative to the pen position on the baseline, and its texture coordinates in the atlas.
+    // Glyphs without an image (i.e. space) have width/height 0.
+    float x0, y0, x1, y1;
+    float s0, t0, s1, t1;
+
+    struct ZGlyph *next;
+
+} ZGlyph;
+
+
+
+typedef struct ZFont
+{
+    FT_Face face;
+
+    float height; // Nominal height, used for the cursor.
+
+    ZGlyph direct[Z_GLYPH_DIRECT];
+    ZGlyph *hashed[Z_GLYPH_HASH_SIZE];
+
+} ZFont;
+
+
+
+#pragma pack(push, 1)
+
+// Vertex layout matching GL_T2F_C4UB_V3F.
+typedef struct ZTextVertex
+{
+    float s, t;
+    GLubyte color[4];
+    float x, y, z;
+
+} ZTextVertex;
+
+#pragma pack(pop)
+
+
+
+static FT_Library ft_library;
+
+static ZFont font_console;
+
+// The atlas is filled row by row (shelf packing), rows are as high as the tallest glyph in them.
+static GLuint atlas_texture;
+static int atlas_x, atlas_y, atlas_row_height;
+static int warned_atlas_full;
+
+// Frame batch of quads (4 vertices each).
+static ZTextVertex *batch;
+static unsigned int batch_quads;
+static unsigned int batch_size;
+
+static GLubyte text_color[4] = { 255, 255, 255, 255 };
 
-    assert( (height * 4) <= Z_CURSOR_BYTES );
 
-    // Generate cursor image.
-    for (i = 0; i < height; i++) {
 
-        pixels[(i*4)]   = 255;
-        pixels[(i*4)+1] = 255;
-        pixels[(i*4)+2] = 255;
-        pixels[(i*4)+3] = 255;
+// Returns the font for font_type.
+static ZFont *zGetFont(unsigned int font_type)
+{
+    switch (font_type) {
+        case Z_FONT_CONSOLE:
+            return &font_console;
+        default:
+            assert(0 && "No valid font type given");
     }
+    return NULL;
 }
 
 
 
-// Destroy fonts and uninitialize.
-void zTextRenderDeinit(void)
+// Reserve a w*h area in the atlas, stores its position in x/y. Returns FALSE if the atlas is full.
+static int zAtlasReserve(int w, int h, int *x, int *y)
 {
-    if (font_console) {
-        ftglDestroyFont(font_console);
-        font_console = NULL;
+    // Leave a pixel of padding around each glyph so filtering doesn't bleed between them.
+    w += 1;
+    h += 1;
+
+    if (atlas_x + w > Z_ATLAS_SIZE) {
+        atlas_y += atlas_row_height;
+        atlas_x = 0;
+        atlas_row_height = 0;
     }
+
+    if (w > Z_ATLAS_SIZE || atlas_y + h > Z_ATLAS_SIZE)
+        return FALSE;
+
+    *x = atlas_x;
+    *y = atlas_y;
+
+    atlas_x += w;
+    if (h > atlas_row_height) atlas_row_height = h;
+
+    return TRUE;
 }
 
 
 
-void zTextRenderInit(void)
+// Rasterize glyph for codepoint into the atlas and fill in its metrics.
+static void zLoadGlyph(ZFont *font, ZGlyph *glyph, unsigned int codepoint)
 {
-    // Load font/cursor for console.
-    if( !(font_console = ftglCreateBufferFont(zGetPath(Z_CONSOLE_FONT, "fonts", Z_FILE_TRYUSER))) ) {
-        zDebug("Failed to open font.");
-        exit(EXIT_FAILURE);
+    FT_GlyphSlot slot = font->face->glyph;
+    FT_Bitmap *bitmap = &(slot->bitmap);
+    int x, y;
+
+    glyph->codepoint = codepoint;
+    glyph->loaded = 1;
+
+    if (FT_Load_Char(font->face, codepoint, FT_LOAD_RENDER)) {
+        zDebug("Failed to load glyph for codepoint %u.", codepoint);
+        return;
     }
 
-    ftglSetFontFaceSize(font_console, Z_CONSOLE_TEXTSIZE, 0);
-    zInitCursor(textcursor_console, Z_CONSOLE_TEXTSIZE);
+    glyph->advance = slot->advance.x / 64.0f;
+
+    if (!bitmap->width || !bitmap->rows)
+        return;
+
+    if (!zAtlasReserve((int) bitmap->width, (int) bitmap->rows, &x, &y)) {
+        if (!warned_atlas_full) {
+            zWarning("Glyph atlas is full, some characters will not be drawn.");
+            warned_atlas_full = 1;
+        }
+        return;
+    }
+
+    // Glyph bitmaps are tightly packed 8-bit rows.
+    glPushClientAttrib(GL_CLIENT_PIXEL_STORE_BIT);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, bitmap->pitch);
+
+    glBindTexture(GL_TEXTURE_2D, atlas_texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, bitmap->width, bitmap->rows, GL_ALPHA,
+        GL_UNSIGNED_BYTE, bitmap->buffer);
+    glBindTexture(GL_TEXTURE_2D, 0);
 
-    //zDebug("Font line height is %f", ftglGetFontLineHeight(font_console));
-    //zDebug("Font global ascender height is %f", ftglGetFontAscender(font_console));
-    //zDebug("Font global descender height is %f", ftglGetFontDescender(font_console));
-    //ftglSetFontOutset(font, 4.0, 4.0);
+    glPopClientAttrib();
+
+    // The bitmap is stored top row first, so t0 is the top of the glyph.
+    glyph->x0 = (float) slot->bitmap_left;
+    glyph->x1 = (float) (slot->bitmap_left + (int) bitmap->width);
+    glyph->y1 = (float) slot->bitmap_top;
+    glyph->y0 = (float) (slot->bitmap_top - (int) bitmap->rows);
+
+    glyph->s0 = (float) x / Z_ATLAS_SIZE;
+    glyph->s1 = (float) (x + (int) bitmap->width) / Z_ATLAS_SIZE;
+    glyph->t0 = (float) y / Z_ATLAS_SIZE;
+    glyph->t1 = (float) (y + (int) bitmap->rows) / Z_ATLAS_SIZE;
 }
 
 
-// Returns cursor offset.
-static float zTextCursorAdvance(ZTextBuffer *textbuf, unsigned int font_type)
+
+// Lookup glyph for codepoint, loading it if needed. Returns NULL only if memory allocation fails.
+static ZGlyph *zGetGlyph(ZFont *font, unsigned int codepoint)
 {
-    FTGLfont *font;
+    ZGlyph *glyph;
+    unsigned int i;
 
-    //if (!initialized) zTextRenderInit();
+    if (codepoint < Z_GLYPH_DIRECT) {
+        glyph = &(font->direct[codepoint]);
+        if (!glyph->loaded) zLoadGlyph(font, glyph, codepoint);
+        return glyph;
+    }
 
-    switch (font_type) {
-        case Z_FONT_CONSOLE:
-            font = font_console;
-            break;
-        default:
-            assert(0 && "No valid font type given");
+    i = codepoint % Z_GLYPH_HASH_SIZE;
+
+    for (glyph = font->hashed[i]; glyph; glyph = glyph->next) {
+        if (glyph->codepoint == codepoint)
+            return glyph;
     }
 
-    // Make sure buffer was initialized first
-    if (textbuf->buf) {
+    if ( !(glyph = malloc(sizeof(ZGlyph))) )
+        return NULL;
 
-        // Copy buf up until cursor_bytes into shadow buffer and use it to lookup advance.
-        strncpy(textbuf->buf_shadow, textbuf->buf, textbuf->cursor_bytes);
-        textbuf->buf_shadow[textbuf->cursor_bytes] = '\0';
+    memset(glyph, '\0', sizeof(ZGlyph));
+    zLoadGlyph(font, glyph, codepoint);
 
-        return ftglGetFontAdvance(font, textbuf->buf_shadow);
+    glyph->next = font->hashed[i];
+    font->hashed[i] = glyph;
+
+    return glyph;
+}
+
+
+
+// Make sure the batch can hold count more quads, returns FALSE on failure.
+static int zGrowBatch(unsigned int count)
+{
+    ZTextVertex *tmp;
+    unsigned int size;
+
+    if (batch_quads + count <= batch_size) return TRUE;
+
+    size = batch_size + (count > Z_TEXT_BATCH_INC ? count : Z_TEXT_BATCH_INC);
+
+    if ( !(tmp = realloc(batch, size * 4 * sizeof(ZTextVertex))) ) {
+        zWarning("Failed to allocate memory for text batch.");
+        return FALSE;
     }
 
-    return 0;
+    batch = tmp;
+    batch_size = size;
+
+    return TRUE;
 }
 
 
-void zTextRenderString(float x, float y, const char *str, unsigned int font_type)
+
+// Append a quad to the batch.
+static void zBatchQuad(float x0, float y0, float x1, float y1, float s0, float t0, float s1,
+    float t1)
 {
-    FTGLfont *font;
+    ZTextVertex *v = batch + batch_quads*4;
+    int i;
 
-    switch (font_type) {
-        case Z_FONT_CONSOLE:
-            font = font_console;
-            break;
-        default:
-            assert(0 && "No valid font type given");
+    // Bottom left, bottom right, top right, top left (t0 is at the top).
+    v[0].s = s0; v[0].t = t1; v[0].x = x0; v[0].y = y0;
+    v[1].s = s1; v[1].t = t1; v[1].x = x1; v[1].y = y0;
+    v[2].s = s1; v[2].t = t0; v[2].x = x1; v[2].y = y1;
+    v[3].s = s0; v[3].t = t0; v[3].x = x0; v[3].y = y1;
+
+    for (i = 0; i < 4; i++) {
+        v[i].z = 0.0f;
+        memcpy(v[i].color, text_color, 4);
     }
 
-    glPushMatrix();
-    glTranslatef(x, y, 0.0f);
-    ftglRenderFont(font, str, FTGL_RENDER_ALL);
-    glPopMatrix();
+    batch_quads++;
 }
 
 
 
-void zTextRenderBuf(float x, float y, ZTextBuffer *textbuf, int draw_cursor, unsigned int font_type)
+// Lay out str (up to len bytes) starting with the pen at x, y and append the glyph quads to the
+// batch. If cursor_x is not NULL, the pen position at byte offset cursor_bytes is stored in it
+// so the cursor doesn't need to be measured separately. Returns the pen position after the text.
+static float zLayoutText(ZFont *font, float x, float y, const char *str, size_t len,
+    size_t cursor_bytes, float *cursor_x)
 {
-    FTGLfont *font;
-    GLubyte *cursor;
-    int cursor_height;
+    const char *pos = str, *end = str + len;
+    ZGlyph *glyph;
 
-    float cursor_offset;
+    // Worst case every byte is a glyph.
+    if (!zGrowBatch(len)) return x;
 
-    switch (font_type) {
-        case Z_FONT_CONSOLE:
-            font = font_console;
-            cursor = textcursor_console;
-            cursor_height = Z_CONSOLE_TEXTSIZE;
-            break;
-        default:
-            assert(0 && "No valid font type given");
+    while (pos < end && *pos != '\0') {
+
+        if (cursor_x && (size_t) (pos - str) == cursor_bytes)
+            *cursor_x = x;
+
+        if ( !(glyph = zGetGlyph(font, zUTF8DecodeChar(&pos))) )
+            continue;
+
+        if (glyph->x1 > glyph->x0) {
+            zBatchQuad(x + glyph->x0, y + glyph->y0, x + glyph->x1, y + glyph->y1,
+                glyph->s0, glyph->t0, glyph->s1, glyph->t1);
+        }
+
+        x += glyph->advance;
+    }
+
+    if (cursor_x && (size_t) (pos - str) <= cursor_bytes)
+        *cursor_x = x;
+
+    return x;
+}
+
+
+
+// Load face and setup atlas for font.
+static int zInitFont(ZFont *font, const char *filename, int size)
+{
+    unsigned int i;
+
+    memset(font, '\0', sizeof(ZFont));
+
+    if (FT_New_Face(ft_library, zGetPath(filename, "fonts", Z_FILE_TRYUSER), 0, &(font->face)))
+        return FALSE;
+
+    FT_Set_Pixel_Sizes(font->face, 0, size);
+    font->height = (float) size;
+
+    // Pre-load printable ASCII, anything else is loaded when first used.
+    for (i = 32; i < 127; i++)
+        zGetGlyph(font, i);
+
+    return TRUE;
+}
+
+
+
+static void zDeinitFont(ZFont *font)
+{
+    unsigned int i;
+    ZGlyph *cur, *next;
+
+    for (i = 0; i < Z_GLYPH_HASH_SIZE; i++) {
+        for (cur = font->hashed[i]; cur; cur = next) {
+            next = cur->next;
+            free(cur);
+        }
+    }
+
+    if (font->face) FT_Done_Face(font->face);
+
+    memset(font, '\0', sizeof(ZFont));
+}
+
+
+
+// Destroy fonts and uninitialize.
+void zTextRenderDeinit(void)
+{
+    zDeinitFont(&font_console);
+
+    if (ft_library) {
+        FT_Done_FreeType(ft_library);
+        ft_library = NULL;
+    }
+
+    if (atlas_texture) {
+        glDeleteTextures(1, &atlas_texture);
+        atlas_texture = 0;
     }
 
-    glPushMatrix();
+    free(batch);
+    batch = NULL;
+    batch_size = batch_quads = 0;
+}
+
+
+
+void zTextRenderInit(void)
+{
+    // A white block in the corner of the atlas, used for solid quads like the cursor.
+    static const GLubyte white[4] = { 255, 255, 255, 255 };
+    int x, y;
 
-    // Don't bother if buffer contains no text.
-    if (textbuf->bytes) {
-        glTranslatef(x, y, 0.0f);
-        ftglRenderFont(font, textbuf->buf, FTGL_RENDER_ALL);
+    if (FT_Init_FreeType(&ft_library)) {
+        zFatal("Failed to initialize FreeType.");
+        exit(EXIT_FAILURE);
     }
 
-    if (draw_cursor) {
+    atlas_x = atlas_y = atlas_row_height = warned_atlas_full = 0;
+
+    glGenTextures(1, &atlas_texture);
+    glBindTexture(GL_TEXTURE_2D, atlas_texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA8, Z_ATLAS_SIZE, Z_ATLAS_SIZE, 0, GL_ALPHA,
+        GL_UNSIGNED_BYTE, NULL);
 
-        cursor_offset = zTextCursorAdvance(textbuf, font_type);
-        glWindowPos2f(x+cursor_offset, y-3.0f);
-        glDrawPixels(1, cursor_height, GL_RGBA, GL_UNSIGNED_BYTE, cursor);
+    glPushClientAttrib(GL_CLIENT_PIXEL_STORE_BIT);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    zAtlasReserve(2, 2, &x, &y);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, 2, 2, GL_ALPHA, GL_UNSIGNED_BYTE, white);
+    glPopClientAttrib();
 
-        //glTranslatef(cursor_offset, 0.0f, 0.0f);
-        //ftglRenderFont(font, "_", FTGL_RENDER_ALL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // Load font for console.
+    if (!zInitFont(&font_console, Z_CONSOLE_FONT, Z_CONSOLE_TEXTSIZE)) {
+        zFatal("Failed to open font \"%s\".", Z_CONSOLE_FONT);
+        exit(EXIT_FAILURE);
     }
+}
+
+
 
-    glPopMatrix();
+// Set color for text drawn after this call.
+void zTextRenderColor(float r, float g, float b, float a)
+{
+    text_color[0] = (GLubyte) (r * 255.0f);
+    text_color[1] = (GLubyte) (g * 255.0f);
+    text_color[2] = (GLubyte) (b * 255.0f);
+    text_color[3] = (GLubyte) (a * 255.0f);
 }
 
 
 
+void zTextRenderString(float x, float y, const char *str, unsigned int font_type)
+{
+    zLayoutText(zGetFont(font_type), x, y, str, strlen(str), 0, NULL);
+}
+
 
 
+void zTextRenderBuf(float x, float y, ZTextBuffer *textbuf, int draw_cursor, unsigned int font_type)
+{
+    ZFont *font = zGetFont(font_type);
+    float cursor_x = x;
 
+    // Make sure buffer was initialized first
+    if (textbuf->buf && textbuf->bytes) {
+        zLayoutText(font, x, y, textbuf->buf, textbuf->bytes, textbuf->cursor_bytes,
+            draw_cursor ? &cursor_x : NULL);
+    }
+
+    // The cursor is a 1 pixel wide quad using the white block in the atlas.
+    if (draw_cursor && zGrowBatch(1)) {
+        zBatchQuad(cursor_x, y-3.0f, cursor_x+1.0f, y-3.0f+font->height, 0.5f/Z_ATLAS_SIZE,
+            0.5f/Z_ATLAS_SIZE, 1.5f/Z_ATLAS_SIZE, 1.5f/Z_ATLAS_SIZE);
+    }
+}
+
+
+
+// Draw all text batched up since the last flush, in a single draw call. Expects the GUI transforms
+// to be set up.
+void zTextRenderFlush(void)
+{
+    GLsizeiptr size = batch_quads * 4 * sizeof(ZTextVertex);
+    GLintptr offset;
+    void *dest;
+
+    if (!batch_quads) return;
+
+    if ( (dest = zStreamMap(size, &offset)) ) {
+        memcpy(dest, batch, size);
+        zStreamUnmap();
+    } else {
+        glBindBufferARB(GL_ARRAY_BUFFER, 0);
+        offset = (GLintptr) batch;
+    }
+
+    glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_TEXTURE_BIT);
+    glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+
+    // Material state gets clobbered below, and the glyph atlas needs the material's samplers
+    // unbound.
+    zResetMaterialState();
+
+    glDisable(GL_LIGHTING);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    glActiveTexture(GL_TEXTURE0);
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, atlas_texture);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+
+    glInterleavedArrays(GL_T2F_C4UB_V3F, 0, (void *) offset);
+    glDrawArrays(GL_QUADS, 0, batch_quads * 4);
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindBufferARB(GL_ARRAY_BUFFER, 0);
+
+    glPopClientAttrib();
+    glPopAttrib();
+
+    batch_quads = 0;
+}
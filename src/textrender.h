@@ -13,4 +13,8 @@ void zTextRenderString(float x, float y, const char *str, unsigned int font_type
 
 void zTextRenderBuf(float x, float y, ZTextBuffer *textbuf, int draw_cursor, unsigned int font_type);
 
+void zTextRenderColor(float r, float g, float b, float a);
+
+void zTextRenderFlush(void);
+
 #endif
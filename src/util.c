@@ -212,7 +212,7 @@ const char *zGetSiblingPath(const char *filename, const char *sibling)
 // more foolproof.. I think
 const char *zGetPath(const char *filename, const char *prefix, int flags)
 {
-    static char path[Z_PATH_SIZE];
+    static Z_THREAD_LOCAL char path[Z_PATH_SIZE]; // Texture loading calls this from worker threads.
     char *userdir = zGetUserDir();
     size_t reqsize = 0;
     size_t prefix_len = prefix ? strlen(prefix) : 0;
@@ -348,31 +348,159 @@ char *zGetStringFromFile(const char *filename)
 
 
 
-// Return hash for given string and table size. Current hash function may not be ideal but seems
-// decent enough for my purposes. Some links if I ever want to improve this:
-// http://burtleburtle.net/bob/hash/doobs.html / http://www.azillionmonkeys.com/qed/hash.html
-unsigned int zHashString(const char *str, int tablesize)
+// Return hash for given string, for picking hash table slots. This is FNV-1a with the final mix
+// of MurmurHash3 on top, since plain FNV doesn't spread short, similar names (like the numbered
+// files textures tend to come in) over the low bits all that well.
+unsigned int zHashString(const char *str)
 {
-    unsigned int tmp = 0, hash = 0;
-    int shift = 0;
+    unsigned int hash = 2166136261U;
 
     assert(str);
 
-    // Turn every 4 characters into an uint and add to hash.
-    while ( *str != '\0' ) {
+    while (*str)
+        hash = (hash ^ (unsigned char) *str++) * 16777619U;
 
-        tmp += *str++ << shift++;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bU;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35U;
+    hash ^= hash >> 16;
 
-        if (shift == 4) {
-            hash += tmp;
-            tmp = shift = 0;
-        }
+    return hash;
+}
+
+
+
+// Return hash for a pointer, for tables keyed on addresses (i.e. interned names). Allocations are
+// aligned, so the low bits alone would make for lots of collisions.
+unsigned int zHashPointer(const void *ptr)
+{
+    unsigned long long x = (unsigned long long) (size_t) ptr;
+
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+
+    return (unsigned int) x;
+}
+
+
+
+// Add len bytes of data to a 64-bit FNV-1a hash and return the result. Start with Z_HASH_INIT and
+// feed it the result of the previous call to hash multiple blocks of data. Unlike zHashString this
+// is meant for identifying data (i.e. cache keys), not for picking hash table buckets.
+unsigned long long zHashData(unsigned long long hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    while (len--) {
+        hash ^= *p++;
+        hash *= 1099511628211ULL;
     }
 
-    // Add any left overs.
-    hash += tmp;
+    return hash;
+}
+
+
+
+#define Z_XXH_PRIME1 11400714785074694791ULL
+#define Z_XXH_PRIME2 14029467366897019727ULL
+#define Z_XXH_PRIME3  1609587929392839161ULL
+#define Z_XXH_PRIME4  9650029242287828579ULL
+#define Z_XXH_PRIME5  2870177450012600261ULL
 
-    return hash % tablesize;
+#define Z_XXH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+
+static inline unsigned long long zXXHRead64(const unsigned char *p)
+{
+    unsigned long long v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned int zXXHRead32(const unsigned char *p)
+{
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned long long zXXHRound(unsigned long long acc, unsigned long long input)
+{
+    acc += input * Z_XXH_PRIME2;
+    acc  = Z_XXH_ROTL(acc, 31);
+    return acc * Z_XXH_PRIME1;
+}
+
+static inline unsigned long long zXXHMerge(unsigned long long acc, unsigned long long val)
+{
+    acc ^= zXXHRound(0, val);
+    return acc * Z_XXH_PRIME1 + Z_XXH_PRIME4;
+}
+
+
+
+// Hash len bytes of data with XXH64, using the result of a previous call (or 0) as seed to hash
+// multiple blocks. This does 8 bytes at a time instead of one, so it's the one to use for big
+// payloads like image or vertex data. The result depends on byte order, so it's only good for
+// comparing data within a single run.
+unsigned long long zHashBlock(unsigned long long seed, const void *data, size_t len)
+{
+    const unsigned char *p = data, *end = p + len;
+    unsigned long long h;
+
+    if (len >= 32) {
+
+        const unsigned char *limit = end - 32;
+        unsigned long long v1 = seed + Z_XXH_PRIME1 + Z_XXH_PRIME2;
+        unsigned long long v2 = seed + Z_XXH_PRIME2;
+        unsigned long long v3 = seed;
+        unsigned long long v4 = seed - Z_XXH_PRIME1;
+
+        do {
+            v1 = zXXHRound(v1, zXXHRead64(p));
+            v2 = zXXHRound(v2, zXXHRead64(p + 8));
+            v3 = zXXHRound(v3, zXXHRead64(p + 16));
+            v4 = zXXHRound(v4, zXXHRead64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = Z_XXH_ROTL(v1, 1) + Z_XXH_ROTL(v2, 7) + Z_XXH_ROTL(v3, 12) + Z_XXH_ROTL(v4, 18);
+        h = zXXHMerge(h, v1);
+        h = zXXHMerge(h, v2);
+        h = zXXHMerge(h, v3);
+        h = zXXHMerge(h, v4);
+
+    } else {
+        h = seed + Z_XXH_PRIME5;
+    }
+
+    h += (unsigned long long) len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= zXXHRound(0, zXXHRead64(p));
+        h  = Z_XXH_ROTL(h, 27) * Z_XXH_PRIME1 + Z_XXH_PRIME4;
+    }
+
+    if (p + 4 <= end) {
+        h ^= (unsigned long long) zXXHRead32(p) * Z_XXH_PRIME1;
+        h  = Z_XXH_ROTL(h, 23) * Z_XXH_PRIME2 + Z_XXH_PRIME3;
+        p += 4;
+    }
+
+    for (; p < end; p++) {
+        h ^= (*p) * Z_XXH_PRIME5;
+        h  = Z_XXH_ROTL(h, 11) * Z_XXH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= Z_XXH_PRIME2;
+    h ^= h >> 29;
+    h *= Z_XXH_PRIME3;
+    h ^= h >> 32;
+
+    return h;
 }
 
 
@@ -425,6 +553,44 @@ char *zUTF8FindNextChar(const char *pos)
 
 
 
+// Decode the character at *pos into a unicode codepoint and advance *pos past it. Malformed
+// sequences are decoded as U+FFFD, skipping a single byte.
+unsigned int zUTF8DecodeChar(const char **pos)
+{
+    const unsigned char *p = (const unsigned char *) *pos;
+    unsigned int c, len, i;
+
+    if (p[0] < 0x80) {
+        *pos += 1;
+        return p[0];
+    } else if ((p[0] & 0xe0) == 0xc0) {
+        c = p[0] & 0x1f;
+        len = 2;
+    } else if ((p[0] & 0xf0) == 0xe0) {
+        c = p[0] & 0x0f;
+        len = 3;
+    } else if ((p[0] & 0xf8) == 0xf0) {
+        c = p[0] & 0x07;
+        len = 4;
+    } else {
+        *pos += 1;
+        return 0xfffd;
+    }
+
+    for (i = 1; i < len; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            *pos += 1;
+            return 0xfffd;
+        }
+        c = (c << 6) | (p[i] & 0x3f);
+    }
+
+    *pos += len;
+    return c;
+}
+
+
+
 // Time elapsed in seconds.
 float time_elapsed;
 
@@ -57,7 +57,14 @@ char *zGetStringFromFile(const char *filename);
 
 
 // Misc stuff
-unsigned int zHashString(const char *str, int tablesize);
+unsigned int zHashString(const char *str);
+
+unsigned int zHashPointer(const void *ptr);
+
+#define Z_HASH_INIT 14695981039346656037ULL
+unsigned long long zHashData(unsigned long long hash, const void *data, size_t len);
+
+unsigned long long zHashBlock(unsigned long long seed, const void *data, size_t len);
 
 int zUTF8IsPrintable(const char *str);
 
@@ -65,6 +72,8 @@ char *zUTF8FindPrevChar(const char *src, const char *pos);
 
 char *zUTF8FindNextChar(const char *pos);
 
+unsigned int zUTF8DecodeChar(const char **pos);
+
 
 extern float time_elapsed;
 float zFrameTime(void);
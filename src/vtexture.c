@@ -0,0 +1,1123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <GL/glew.h>
+
+#include "common.h"
+
+
+#define Z_VT_MAGIC   0x5854565a // "ZVTX"
+#define Z_VT_VERSION 1
+
+// States for ZVirtualTexture.page_slot besides a slot index.
+#define Z_VT_PAGE_NONE    -1 // Not resident.
+#define Z_VT_PAGE_WANTED  -2 // Requested by the feedback being processed, see zProcessFeedback.
+#define Z_VT_PAGE_LOADING -3
+#define Z_VT_PAGE_FAILED  -4 // Couldn't be read, so I don't keep trying.
+
+#define Z_VT_MAX_LOADS 32 // Maximum number of page loads in flight (including ones waiting to be
+                          // uploaded).
+
+
+// Header at the start of each page file, followed by the pages of each level (finest first), each
+// level row by row, each page Z_VT_PAGE_BYTES of RGBA.
+typedef struct ZVirtualTextureHeader
+{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int width;  // Size of the source image.
+    unsigned int height;
+    unsigned int pages;  // Pages per side at level 0.
+    unsigned int num_levels;
+    unsigned int page_size;
+    unsigned int border;
+
+} ZVirtualTextureHeader;
+
+
+// A slot in the physical page cache.
+typedef struct ZVTSlot
+{
+    ZVirtualTexture *vt; // NULL if the slot is free.
+    int page;
+
+    unsigned int last_used; // Frame the page was last seen in the feedback.
+    int pinned;             // Set for pages of the coarsest level, these are never evicted.
+
+} ZVTSlot;
+
+
+typedef struct ZVTPageLoad
+{
+    ZVirtualTexture *vt;
+    int page;
+    int pinned;
+
+    unsigned char *data; // Result, NULL if reading failed.
+
+    struct ZVTPageLoad *next;
+
+} ZVTPageLoad;
+
+
+typedef struct ZVTRequest
+{
+    ZVirtualTexture *vt;
+    int page;
+    int level;
+
+} ZVTRequest;
+
+
+int vtextures_active;
+int vt_feedback;
+
+static ZTable vtextures; // Keyed on the interned names.
+static ZVirtualTexture *vtextures_by_id[Z_VT_MAX_TEXTURES+1];
+
+static GLuint cache_texture;
+static int cache_pages; // Per side.
+static ZVTSlot *slots;
+static int warned_full;
+
+static GLuint feedback_program;
+static GLint feedback_id_loc;
+static GLint feedback_params_loc;
+static GLint feedback_info_loc;
+static ZVirtualTexture *feedback_vt; // Last virtual texture passed to zApplyVirtualFeedback.
+static int feedback_vt_set;
+
+static GLuint feedback_fbo;
+static GLuint feedback_color;
+static GLuint feedback_depth;
+static int feedback_width;
+static int feedback_height;
+static GLuint feedback_pbo;
+static int feedback_pending;           // Set if feedback is being read into feedback_pbo.
+static unsigned char *feedback_pixels; // For reading back feedback without a PBO.
+static unsigned int feedback_frame;    // Frame the last feedback was processed in.
+
+static ZVTRequest *requests;
+static int max_requests;
+
+static ZMutex *done_lock;
+static ZVTPageLoad *done_loads;  // Loads finished by the workers (protected by done_lock).
+static ZVTPageLoad *upload_list; // Loads waiting to be uploaded (main thread only).
+static int num_loads;
+
+static const char *feedback_vshader =
+    "varying vec2 uv;\n"
+    "void main()\n"
+    "{\n"
+    "    gl_Position = ftransform();\n"
+    "    uv = gl_MultiTexCoord0.xy;\n"
+    "}\n";
+
+// Writes out the page each pixel needs as (x, y, level and the high bits of x and y, id), see
+// zProcessFeedback. z_vt_params is the same as for material shaders, z_vt_info holds the page
+// content size and a LOD bias that makes up for the feedback buffer being smaller than the screen.
+static const char *feedback_fshader =
+    "uniform float z_vt_id;\n"
+    "uniform vec4 z_vt_params;\n"
+    "uniform vec2 z_vt_info;\n"
+    "varying vec2 uv;\n"
+    "void main()\n"
+    "{\n"
+    "    if (z_vt_id == 0.0) {\n"
+    "        gl_FragColor = vec4(0.0);\n"
+    "    } else {\n"
+    "        vec2 texel = uv * z_vt_params.xy * z_vt_params.z * z_vt_info.x;\n"
+    "        vec2 dx = dFdx(texel);\n"
+    "        vec2 dy = dFdy(texel);\n"
+    "        float level = floor(0.5*log2(max(dot(dx, dx), dot(dy, dy))) + z_vt_info.y);\n"
+    "        level = clamp(level, 0.0, z_vt_params.w);\n"
+    "        float size = z_vt_params.z * exp2(-level);\n"
+    "        vec2 page = min(floor(fract(uv) * z_vt_params.xy * size), size - 1.0);\n"
+    "        vec2 high = floor(page / 256.0);\n"
+    "        float bits = level + 16.0*high.x + 64.0*high.y;\n"
+    "        gl_FragColor = vec4(page - high*256.0, bits, z_vt_id) / 255.0;\n"
+    "    }\n"
+    "}\n";
+
+
+
+static GLuint zCompileFeedbackShader(GLenum type, const char *source)
+{
+    GLuint shader;
+    GLint status = GL_FALSE;
+
+    if ( !(shader = glCreateShader(type)) )
+        return 0;
+
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+
+    if (status != GL_TRUE) {
+        glDeleteShader(shader);
+        return 0;
+    }
+
+    return shader;
+}
+
+
+
+// Build the shader program used for the feedback pass. Returns FALSE on failure.
+static int zCreateFeedbackProgram(void)
+{
+    GLuint vshader, fshader;
+    GLint status = GL_FALSE;
+
+    vshader = zCompileFeedbackShader(GL_VERTEX_SHADER, feedback_vshader);
+    fshader = zCompileFeedbackShader(GL_FRAGMENT_SHADER, feedback_fshader);
+
+    if (vshader && fshader && (feedback_program = glCreateProgram()) ) {
+
+        glAttachShader(feedback_program, vshader);
+        glAttachShader(feedback_program, fshader);
+        glLinkProgram(feedback_program);
+        glGetProgramiv(feedback_program, GL_LINK_STATUS, &status);
+
+        if (status != GL_TRUE) {
+            glDeleteProgram(feedback_program);
+            feedback_program = 0;
+        }
+    }
+
+    // The program keeps the shaders alive as long as it needs them.
+    if (vshader) glDeleteShader(vshader);
+    if (fshader) glDeleteShader(fshader);
+
+    if (!feedback_program) return FALSE;
+
+    feedback_id_loc     = glGetUniformLocation(feedback_program, "z_vt_id");
+    feedback_params_loc = glGetUniformLocation(feedback_program, "z_vt_params");
+    feedback_info_loc   = glGetUniformLocation(feedback_program, "z_vt_info");
+
+    return TRUE;
+}
+
+
+
+void zVirtualTextureInit(void)
+{
+    GLint max_size;
+
+    assert(!cache_texture);
+
+    vtextures_active = 0;
+
+    if (r_noshaders || !GLEW_EXT_framebuffer_object) {
+        zDebug("Virtual textures need shaders and framebuffer objects, disabling them.");
+        return;
+    }
+
+    if ( !(done_lock = zCreateMutex()) ) {
+        zWarning("Failed to create virtual texture load lock, disabling virtual textures.");
+        return;
+    }
+
+    if (!zCreateFeedbackProgram()) {
+        zWarning("Failed to build virtual texture feedback shader, disabling virtual textures.");
+        zDeleteMutex(done_lock);
+        done_lock = NULL;
+        return;
+    }
+
+    // Make sure the cache fits in a texture.
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    cache_pages = MIN(r_vtcachepages, max_size / Z_VT_PAGE_SIZE);
+
+    if ( !(slots = calloc(cache_pages * cache_pages, sizeof(ZVTSlot))) ) {
+        zError("%s: Failed to allocate memory.", __func__);
+        glDeleteProgram(feedback_program);
+        feedback_program = 0;
+        zDeleteMutex(done_lock);
+        done_lock = NULL;
+        return;
+    }
+
+    // Pages carry their own borders so plain bilinear filtering works, there are no mipmaps since
+    // each page is sampled from the level that matches its screen size.
+    glGenTextures(1, &cache_texture);
+    glBindTexture(GL_TEXTURE_2D, cache_texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, cache_pages * Z_VT_PAGE_SIZE,
+        cache_pages * Z_VT_PAGE_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    if (GLEW_ARB_pixel_buffer_object)
+        glGenBuffersARB(1, &feedback_pbo);
+
+    warned_full = 0;
+    vtextures_active = 1;
+}
+
+
+
+static void zDeleteFeedbackBuffer(void)
+{
+    if (feedback_fbo) {
+        glDeleteFramebuffersEXT(1, &feedback_fbo);
+        glDeleteRenderbuffersEXT(1, &feedback_color);
+        glDeleteRenderbuffersEXT(1, &feedback_depth);
+    }
+
+    free(feedback_pixels);
+
+    feedback_fbo = feedback_color = feedback_depth = 0;
+    feedback_pixels = NULL;
+    feedback_width = feedback_height = 0;
+}
+
+
+
+// Free vt and everything it holds, along with its pages in the cache. There must be no page loads
+// in flight for it.
+static void zDeleteVirtualTexture(ZVirtualTexture *vt)
+{
+    int i;
+
+    assert(!vt->loads);
+
+    for (i = 0; i < cache_pages * cache_pages; i++) {
+        if (slots[i].vt == vt)
+            slots[i].vt = NULL;
+    }
+
+    if (feedback_vt == vt) feedback_vt_set = 0;
+
+    vtextures_by_id[vt->id] = NULL;
+
+    glDeleteTextures(1, &(vt->indirection));
+    free(vt->page_slot);
+    free(vt->indirection_data);
+    free(vt);
+}
+
+
+
+void zVirtualTextureDeinit(void)
+{
+    unsigned int i;
+    ZVTPageLoad *load;
+
+    // Make sure no worker is still reading a page.
+    zFlushJobs();
+
+    while (done_loads) {
+        load = done_loads;
+        done_loads = load->next;
+        load->vt->loads--;
+        free(load->data);
+        free(load);
+    }
+
+    while (upload_list) {
+        load = upload_list;
+        upload_list = load->next;
+        load->vt->loads--;
+        free(load->data);
+        free(load);
+    }
+
+    for (i = 0; i < vtextures.size; i++) {
+        if (vtextures.items[i])
+            zDeleteVirtualTexture(vtextures.items[i]);
+    }
+
+    zTableClear(&vtextures);
+
+    zDeleteFeedbackBuffer();
+
+    if (feedback_pbo) {
+        glDeleteBuffersARB(1, &feedback_pbo);
+        feedback_pbo = 0;
+    }
+
+    if (feedback_program) {
+        glDeleteProgram(feedback_program);
+        feedback_program = 0;
+    }
+
+    if (cache_texture) {
+        glDeleteTextures(1, &cache_texture);
+        cache_texture = 0;
+    }
+
+    if (done_lock) {
+        zDeleteMutex(done_lock);
+        done_lock = NULL;
+    }
+
+    free(slots);
+    free(requests);
+    slots = NULL;
+    requests = NULL;
+    max_requests = 0;
+    num_loads = 0;
+    feedback_pending = 0;
+    vtextures_active = 0;
+}
+
+
+
+// Returns the name of the page file for name (inside Z_VT_DIR).
+static const char *zVirtualTextureFile(const char *name)
+{
+    static char filename[32];
+
+    snprintf(filename, sizeof(filename), "%016llx.zvt",
+        zHashData(Z_HASH_INIT, name, strlen(name)));
+    filename[sizeof(filename)-1] = '\0';
+
+    return filename;
+}
+
+
+
+// Runs on a worker thread. Reads the page and hands the load back to the main thread.
+static void zPageLoadJob(void *data)
+{
+    ZVTPageLoad *load = data;
+    unsigned long long offset = sizeof(ZVirtualTextureHeader) +
+                                (unsigned long long) load->page * Z_VT_PAGE_BYTES;
+
+    if ( (load->data = malloc(Z_VT_PAGE_BYTES)) &&
+         !zReadFileRange(load->vt->path, offset, load->data, Z_VT_PAGE_BYTES) ) {
+        free(load->data);
+        load->data = NULL;
+    }
+
+    zLockMutex(done_lock);
+    load->next = done_loads;
+    done_loads = load;
+    zUnlockMutex(done_lock);
+}
+
+
+
+static void zRequestPage(ZVirtualTexture *vt, int page, int pinned)
+{
+    ZVTPageLoad *load;
+
+    if ( !(load = malloc(sizeof(ZVTPageLoad))) ) {
+        zError("%s: Failed to allocate memory.", __func__);
+        vt->page_slot[page] = Z_VT_PAGE_NONE;
+        return;
+    }
+
+    load->vt     = vt;
+    load->page   = page;
+    load->pinned = pinned;
+    load->data   = NULL;
+    load->next   = NULL;
+
+    vt->page_slot[page] = Z_VT_PAGE_LOADING;
+    vt->loads++;
+    num_loads++;
+
+    zAddJob(zPageLoadJob, load);
+}
+
+
+
+static int zMatchVirtualTexture(const void *item, const void *key)
+{
+    return ((const ZVirtualTexture *) item)->name == key;
+}
+
+
+
+// Open the page file for virtual texture name (which should be interned) and set up its
+// indirection texture. Returns NULL on failure.
+static ZVirtualTexture *zLoadVirtualTexture(const char *name, unsigned int hash)
+{
+    FILE *fp;
+    const char *path;
+    ZVirtualTextureHeader header;
+    ZVirtualTexture *vt;
+    int i, id, size;
+
+    for (id = 1; id <= Z_VT_MAX_TEXTURES && vtextures_by_id[id]; id++);
+
+    if (id > Z_VT_MAX_TEXTURES) {
+        zError("Can't load more than %d virtual textures.", Z_VT_MAX_TEXTURES);
+        return NULL;
+    }
+
+    if ( !(path = zGetPath(zVirtualTextureFile(name), Z_VT_DIR, Z_FILE_FORCEUSER)) ||
+         !(fp = fopen(path, "rb")) ) {
+        zError("No page file found for virtual texture \"%s\", use buildvtex(\"%s\") to make one.",
+            name, name);
+        return NULL;
+    }
+
+    i = fread(&header, sizeof(header), 1, fp);
+    fclose(fp);
+
+    if ( i != 1 || header.magic != Z_VT_MAGIC || header.version != Z_VT_VERSION ||
+         header.page_size != Z_VT_PAGE_SIZE || header.border != Z_VT_BORDER ||
+         header.pages < 1 || header.pages > Z_VT_MAX_PAGES || (header.pages & (header.pages-1)) ||
+         header.num_levels < 1 || header.num_levels > Z_VT_MAX_LEVELS ||
+         (header.pages >> (header.num_levels-1)) != 1 || header.width < 1 || header.height < 1 ||
+         header.width > header.pages * Z_VT_PAGE_CONTENT ||
+         header.height > header.pages * Z_VT_PAGE_CONTENT ) {
+        zError("Page file for virtual texture \"%s\" is invalid or out of date.", name);
+        return NULL;
+    }
+
+    if ( !(vt = malloc(sizeof(ZVirtualTexture))) ) {
+        zError("%s: Failed to allocate memory.", __func__);
+        return NULL;
+    }
+
+    memset(vt, '\0', sizeof(ZVirtualTexture));
+    vt->name = name;
+    strncpy(vt->path, path, Z_PATH_SIZE);
+    vt->path[Z_PATH_SIZE-1] = '\0';
+
+    vt->id         = id;
+    vt->width      = header.width;
+    vt->height     = header.height;
+    vt->pages      = header.pages;
+    vt->num_levels = header.num_levels;
+
+    for (i = 0; i < vt->num_levels; i++) {
+        size = vt->pages >> i;
+        vt->level_start[i] = vt->num_pages;
+        vt->num_pages += size * size;
+    }
+
+    vt->page_slot        = malloc(vt->num_pages * sizeof(short));
+    vt->indirection_data = calloc(vt->num_pages, 4);
+
+    if ( !vt->page_slot || !vt->indirection_data || !zTableInsert(&vtextures, hash, vt) ) {
+        zError("%s: Failed to allocate memory.", __func__);
+        free(vt->page_slot);
+        free(vt->indirection_data);
+        free(vt);
+        return NULL;
+    }
+
+    for (i = 0; i < vt->num_pages; i++)
+        vt->page_slot[i] = Z_VT_PAGE_NONE;
+
+    // One texel per page, with nearest filtering so entries are never blended.
+    glGenTextures(1, &(vt->indirection));
+    glBindTexture(GL_TEXTURE_2D, vt->indirection);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, vt->num_levels-1);
+
+    for (i = 0; i < vt->num_levels; i++) {
+        size = vt->pages >> i;
+        glTexImage2D(GL_TEXTURE_2D, i, GL_RGBA8, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+            vt->indirection_data + vt->level_start[i]*4);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    vtextures_by_id[id] = vt;
+
+    // The coarsest level is a single page that stays resident, so there's always something to show.
+    zRequestPage(vt, vt->level_start[vt->num_levels-1], 1);
+
+    return vt;
+}
+
+
+
+// Returns the virtual texture for name (which should be interned), loading it if needed. Returns
+// NULL if virtual textures aren't supported or it failed to load.
+ZVirtualTexture *zLookupVirtualTexture(const char *name)
+{
+    ZVirtualTexture *vt;
+    unsigned int hash = zHashPointer(name);
+
+    if (!vtextures_active) return NULL;
+
+    if ( (vt = zTableFind(&vtextures, hash, zMatchVirtualTexture, name)) )
+        return vt;
+
+    return zLoadVirtualTexture(name, hash);
+}
+
+
+
+// Drop a reference to vt, taken by zMakeMaterialResident.
+void zReleaseVirtualTexture(ZVirtualTexture *vt)
+{
+    assert(vt->refcount > 0);
+
+    if (--vt->refcount == 0)
+        vt->released = sceneload_count;
+}
+
+
+
+// Delete virtual textures that no material has used for more than r_retainscenes scene loads (or
+// all unused ones if force is set). Ones with page loads in flight are left for the next time.
+// Returns the number of virtual textures deleted.
+int zCollectVirtualTextures(int force)
+{
+    unsigned int i;
+    int count = 0;
+    ZVirtualTexture *vt;
+
+    for (i = 0; i < vtextures.size; i++) {
+
+        vt = vtextures.items[i];
+
+        if (vt && !vt->refcount && !vt->loads && zResourceExpired(vt->released, force)) {
+            zTableRemoveAt(&vtextures, i);
+            zDeleteVirtualTexture(vt);
+            count++;
+            i--; // Check the slot again, another texture may have moved into it.
+        }
+    }
+
+    return count;
+}
+
+
+
+// Bind the textures for vt and set its uniforms for the (already bound) program.
+void zBindVirtualTexture(ZVirtualTexture *vt, ZShaderProgram *program)
+{
+    if (!vt || !program) return;
+
+    glActiveTexture(GL_TEXTURE0 + Z_VT_UNIT_INDIRECTION);
+    glBindTexture(GL_TEXTURE_2D, vt->indirection);
+    glActiveTexture(GL_TEXTURE0 + Z_VT_UNIT_CACHE);
+    glBindTexture(GL_TEXTURE_2D, cache_texture);
+    glActiveTexture(GL_TEXTURE0);
+
+    if (program->uniforms[Z_UNIFORM_VT_PARAMS] >= 0) {
+        glUniform4f(program->uniforms[Z_UNIFORM_VT_PARAMS],
+            (float) vt->width  / (vt->pages * Z_VT_PAGE_CONTENT),
+            (float) vt->height / (vt->pages * Z_VT_PAGE_CONTENT),
+            vt->pages, vt->num_levels-1);
+    }
+
+    if (program->uniforms[Z_UNIFORM_VT_LAYOUT] >= 0) {
+        glUniform4f(program->uniforms[Z_UNIFORM_VT_LAYOUT], cache_pages, Z_VT_PAGE_SIZE,
+            Z_VT_BORDER, log((double) Z_VT_PAGE_CONTENT) / log(2.0));
+    }
+}
+
+
+
+// Set up the feedback program for drawing something with vt (NULL for materials without one).
+void zApplyVirtualFeedback(ZVirtualTexture *vt)
+{
+    if (feedback_vt_set && feedback_vt == vt) return;
+
+    glUniform1f(feedback_id_loc, vt ? vt->id : 0.0f);
+
+    if (vt) {
+        glUniform4f(feedback_params_loc,
+            (float) vt->width  / (vt->pages * Z_VT_PAGE_CONTENT),
+            (float) vt->height / (vt->pages * Z_VT_PAGE_CONTENT),
+            vt->pages, vt->num_levels-1);
+    }
+
+    feedback_vt = vt;
+    feedback_vt_set = 1;
+}
+
+
+
+// (Re)create the feedback buffer at the given size. Returns FALSE on failure.
+static int zCreateFeedbackBuffer(int width, int height)
+{
+    GLenum status;
+
+    zDeleteFeedbackBuffer();
+
+    glGenFramebuffersEXT(1, &feedback_fbo);
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, feedback_fbo);
+
+    glGenRenderbuffersEXT(1, &feedback_color);
+    glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, feedback_color);
+    glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_RGBA8, width, height);
+    glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_RENDERBUFFER_EXT,
+        feedback_color);
+
+    glGenRenderbuffersEXT(1, &feedback_depth);
+    glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, feedback_depth);
+    glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT, GL_RENDERBUFFER_EXT,
+        feedback_depth);
+
+    status = glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT);
+
+    glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, 0);
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+
+    if (status != GL_FRAMEBUFFER_COMPLETE_EXT) {
+        zWarning("Virtual texture feedback buffer is incomplete (status %#x).", status);
+        zDeleteFeedbackBuffer();
+        return FALSE;
+    }
+
+    if (feedback_pbo) {
+        glBindBufferARB(GL_PIXEL_PACK_BUFFER, feedback_pbo);
+        glBufferDataARB(GL_PIXEL_PACK_BUFFER, width * height * 4, NULL, GL_STREAM_READ);
+        glBindBufferARB(GL_PIXEL_PACK_BUFFER, 0);
+    } else if ( !(feedback_pixels = malloc(width * height * 4)) ) {
+        zError("%s: Failed to allocate memory.", __func__);
+        zDeleteFeedbackBuffer();
+        return FALSE;
+    }
+
+    feedback_width  = width;
+    feedback_height = height;
+
+    return TRUE;
+}
+
+
+
+static int zCompareRequests(const void *a, const void *b)
+{
+    const ZVTRequest *ra = a, *rb = b;
+
+    // Coarsest level first, so there's something reasonable to show as soon as possible.
+    return rb->level - ra->level;
+}
+
+
+
+// Go through the feedback pixels, mark resident pages as used and load the ones that are missing.
+static void zProcessFeedback(const unsigned char *pixels, int num_pixels)
+{
+    int i, x, y, level, size, page, num_requests = 0;
+    ZVirtualTexture *vt;
+    ZVTRequest *tmp;
+    const unsigned char *p, *prev = NULL;
+
+    feedback_frame = frame_count;
+
+    for (i = 0; i < num_pixels; i++) {
+
+        p = pixels + i*4;
+
+        // Neighbouring pixels mostly need the same page.
+        if ( !p[3] || (prev && memcmp(p, prev, 4) == 0) ) continue;
+        prev = p;
+
+        if ( !(vt = vtextures_by_id[p[3]]) ) continue;
+
+        level = p[2] & 15;
+        x = p[0] + ((p[2] >> 4) & 3) * 256;
+        y = p[1] + (p[2] >> 6) * 256;
+        size = vt->pages >> level;
+
+        if (level >= vt->num_levels || x >= size || y >= size) continue;
+
+        page = vt->level_start[level] + y*size + x;
+
+        if (vt->page_slot[page] >= 0) {
+            slots[vt->page_slot[page]].last_used = frame_count;
+        } else if (vt->page_slot[page] == Z_VT_PAGE_NONE) {
+
+            if (num_requests == max_requests) {
+                max_requests = max_requests ? max_requests*2 : 256;
+                if ( !(tmp = realloc(requests, max_requests * sizeof(ZVTRequest))) ) {
+                    zError("%s: Failed to allocate memory.", __func__);
+                    max_requests = num_requests;
+                    break;
+                }
+                requests = tmp;
+            }
+
+            requests[num_requests].vt    = vt;
+            requests[num_requests].page  = page;
+            requests[num_requests].level = level;
+            num_requests++;
+
+            vt->page_slot[page] = Z_VT_PAGE_WANTED;
+        }
+    }
+
+    qsort(requests, num_requests, sizeof(ZVTRequest), zCompareRequests);
+
+    // Load as many as I can, the rest will show up in the next feedback again if still needed.
+    for (i = 0; i < num_requests; i++) {
+        if (num_loads < Z_VT_MAX_LOADS)
+            zRequestPage(requests[i].vt, requests[i].page, 0);
+        else
+            requests[i].vt->page_slot[requests[i].page] = Z_VT_PAGE_NONE;
+    }
+}
+
+
+
+// Draw scene into the feedback buffer and start reading it back, this is done every
+// r_vtfeedbackinterval frames as long as any virtual textures are loaded.
+void zVirtualTextureFeedback(struct ZScene *scene)
+{
+    int width, height;
+
+    if (!vtextures_active || !vtextures.count || feedback_pending ||
+        frame_count % r_vtfeedbackinterval)
+        return;
+
+    width  = MAX(1, viewport_width  / r_vtfeedbackscale);
+    height = MAX(1, viewport_height / r_vtfeedbackscale);
+
+    if ( (width != feedback_width || height != feedback_height) &&
+         !zCreateFeedbackBuffer(width, height) )
+        return;
+
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, feedback_fbo);
+    glPushAttrib(GL_VIEWPORT_BIT | GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_ENABLE_BIT);
+
+    glViewport(0, 0, width, height);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glDepthMask(GL_TRUE);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glDisable(GL_BLEND);
+
+    // Derivatives in the smaller buffer are larger than on screen, so bias the level back down.
+    glUseProgram(feedback_program);
+    glUniform2f(feedback_info_loc, Z_VT_PAGE_CONTENT,
+        -log((double) viewport_width / width) / log(2.0));
+    feedback_vt_set = 0;
+
+    vt_feedback = 1;
+    zDrawSceneFeedback(scene);
+    vt_feedback = 0;
+
+    glUseProgram(0);
+
+    // With a PBO the read finishes in the background and the result is picked up next frame.
+    if (feedback_pbo) {
+        glBindBufferARB(GL_PIXEL_PACK_BUFFER, feedback_pbo);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+        glBindBufferARB(GL_PIXEL_PACK_BUFFER, 0);
+        feedback_pending = 1;
+    } else {
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, feedback_pixels);
+        zProcessFeedback(feedback_pixels, width * height);
+    }
+
+    glPopAttrib();
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+
+    zResetMaterialState();
+}
+
+
+
+// Returns a free cache slot, evicting the least recently used page if there is none. Pages seen in
+// the latest feedback aren't evicted, returns -1 if that leaves nothing.
+static int zAllocSlot(void)
+{
+    int i, best = -1;
+    ZVTSlot *slot;
+
+    for (i = 0; i < cache_pages * cache_pages; i++) {
+
+        slot = slots + i;
+
+        if (!slot->vt) return i;
+
+        if ( !slot->pinned && slot->last_used < feedback_frame &&
+             (best < 0 || slot->last_used < slots[best].last_used) )
+            best = i;
+    }
+
+    if (best >= 0) {
+        slots[best].vt->page_slot[slots[best].page] = Z_VT_PAGE_NONE;
+        slots[best].vt->dirty = 1;
+        slots[best].vt = NULL;
+    }
+
+    return best;
+}
+
+
+
+// Rebuild the indirection texture of vt from its page table. Missing pages point to the closest
+// resident page of a coarser level, so this goes from the coarsest level down.
+static void zUpdateIndirection(ZVirtualTexture *vt)
+{
+    int level, x, y, size, slot;
+    unsigned char *entry, *parent;
+
+    glBindTexture(GL_TEXTURE_2D, vt->indirection);
+
+    for (level = vt->num_levels-1; level >= 0; level--) {
+
+        size  = vt->pages >> level;
+        entry = vt->indirection_data + vt->level_start[level]*4;
+
+        for (y = 0; y < size; y++) {
+            for (x = 0; x < size; x++, entry += 4) {
+
+                slot = vt->page_slot[vt->level_start[level] + y*size + x];
+
+                if (slot >= 0) {
+                    entry[0] = slot % cache_pages;
+                    entry[1] = slot / cache_pages;
+                    entry[2] = level;
+                    entry[3] = 255;
+                } else if (level < vt->num_levels-1) {
+                    parent = vt->indirection_data +
+                             (vt->level_start[level+1] + (y/2)*(size/2) + x/2)*4;
+                    memcpy(entry, parent, 4);
+                } else {
+                    memset(entry, '\0', 4);
+                }
+            }
+        }
+
+        glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, size, size, GL_RGBA, GL_UNSIGNED_BYTE,
+            vt->indirection_data + vt->level_start[level]*4);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    vt->dirty = 0;
+}
+
+
+
+// Handle the last feedback, upload pages that finished loading (up to r_vtuploads per frame) and
+// update indirection textures. Called once per frame.
+void zUpdateVirtualTextures(void)
+{
+    ZVTPageLoad *load, *next, **link;
+    ZVirtualTexture *vt;
+    const unsigned char *pixels;
+    int slot, uploads = 0;
+    unsigned int i;
+
+    if (!vtextures_active) return;
+
+    if (feedback_pending) {
+
+        glBindBufferARB(GL_PIXEL_PACK_BUFFER, feedback_pbo);
+        if ( (pixels = glMapBufferARB(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY)) ) {
+            zProcessFeedback(pixels, feedback_width * feedback_height);
+            glUnmapBufferARB(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBufferARB(GL_PIXEL_PACK_BUFFER, 0);
+
+        feedback_pending = 0;
+    }
+
+    // Take loads from the workers and add them to the end of the upload list.
+    zLockMutex(done_lock);
+    load = done_loads;
+    done_loads = NULL;
+    zUnlockMutex(done_lock);
+
+    for (link = &upload_list; *link; link = &((*link)->next));
+    *link = load;
+
+    glBindTexture(GL_TEXTURE_2D, cache_texture);
+
+    for (link = &upload_list; (load = *link); ) {
+
+        next = load->next;
+
+        // Pinned pages don't count towards the budget, without them there is nothing to show.
+        if (load->data && !load->pinned && uploads >= r_vtuploads) {
+            link = &(load->next);
+            continue;
+        }
+
+        vt = load->vt;
+
+        if (!load->data) {
+            zWarning("Failed to read page %d of virtual texture \"%s\".", load->page, vt->name);
+            vt->page_slot[load->page] = Z_VT_PAGE_FAILED;
+        } else if ( (slot = zAllocSlot()) < 0 ) {
+            if (!warned_full) {
+                zWarning("Virtual texture cache is too small for the visible pages, try increasing "
+                         "r_vtcachepages.");
+                warned_full = 1;
+            }
+            vt->page_slot[load->page] = Z_VT_PAGE_NONE;
+        } else {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, (slot % cache_pages) * Z_VT_PAGE_SIZE,
+                (slot / cache_pages) * Z_VT_PAGE_SIZE, Z_VT_PAGE_SIZE, Z_VT_PAGE_SIZE, GL_RGBA,
+                GL_UNSIGNED_BYTE, load->data);
+
+            slots[slot].vt        = vt;
+            slots[slot].page      = load->page;
+            slots[slot].last_used = frame_count;
+            slots[slot].pinned    = load->pinned;
+
+            vt->page_slot[load->page] = slot;
+            vt->dirty = 1;
+            uploads++;
+        }
+
+        *link = next;
+        num_loads--;
+        vt->loads--;
+        free(load->data);
+        free(load);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    for (i = 0; i < vtextures.size; i++) {
+        if ( (vt = vtextures.items[i]) && vt->dirty )
+            zUpdateIndirection(vt);
+    }
+}
+
+
+
+// Cut the page at px, py out of a size x size level, with borders taken from the neighbouring
+// pages (or repeated edge texels at the edges of the level).
+static void zCutPage(const unsigned char *level, int size, int px, int py, unsigned char *page)
+{
+    int i, j, sx, sy;
+
+    for (j = 0; j < Z_VT_PAGE_SIZE; j++) {
+
+        sy = py * Z_VT_PAGE_CONTENT + j - Z_VT_BORDER;
+        sy = MIN(MAX(sy, 0), size-1);
+
+        for (i = 0; i < Z_VT_PAGE_SIZE; i++) {
+
+            sx = px * Z_VT_PAGE_CONTENT + i - Z_VT_BORDER;
+            sx = MIN(MAX(sx, 0), size-1);
+
+            memcpy(page + (j*Z_VT_PAGE_SIZE + i)*4, level + ((size_t) sy*size + sx)*4, 4);
+        }
+    }
+}
+
+
+
+// Build the page file for virtual texture name from the source image. This is what the "buildvtex"
+// console command does, it needs the whole image (padded out to a power of two number of pages) to
+// fit in memory. Returns FALSE on failure.
+int zBuildVirtualTexture(const char *name)
+{
+    ZVirtualTextureHeader header;
+    ZImage *img;
+    FILE *fp;
+    const char *path, *dir;
+    unsigned char *level = NULL, *next, *page = NULL, *row;
+    int pages, num_levels, size, x, y, px, py, i, ok = TRUE;
+
+    if ( !(path = zGetPath(name, NULL, Z_FILE_REWRITE_DIRSEP | Z_FILE_TRYUSER)) ||
+         !(img = zLoadImage(path)) ) {
+        zError("Failed to load image \"%s\".", name);
+        return FALSE;
+    }
+
+    for (pages = 1, num_levels = 1; pages * Z_VT_PAGE_CONTENT < MAX(img->width, img->height);
+         pages *= 2, num_levels++);
+
+    size = pages * Z_VT_PAGE_CONTENT;
+
+    if (pages > Z_VT_MAX_PAGES || (size_t) -1 / 4 / size < (size_t) size) {
+        zError("Image \"%s\" is too large for a virtual texture.", name);
+        zDeleteImage(img);
+        return FALSE;
+    }
+
+    if ( !(level = malloc((size_t) size * size * 4)) || !(page = malloc(Z_VT_PAGE_BYTES)) ) {
+        zError("%s: Failed to allocate memory.", __func__);
+        zDeleteImage(img);
+        free(level);
+        return FALSE;
+    }
+
+    // Pad the image out to the full virtual size by repeating its edges.
+    for (y = 0; y < size; y++) {
+
+        row = level + (size_t) y * size * 4;
+        memcpy(row, img->data + (size_t) MIN(y, img->height-1) * img->width * 4, img->width * 4);
+
+        for (x = img->width; x < size; x++)
+            memcpy(row + x*4, row + (img->width-1)*4, 4);
+    }
+
+    memset(&header, '\0', sizeof(header));
+    header.magic      = Z_VT_MAGIC;
+    header.version    = Z_VT_VERSION;
+    header.width      = img->width;
+    header.height     = img->height;
+    header.pages      = pages;
+    header.num_levels = num_levels;
+    header.page_size  = Z_VT_PAGE_SIZE;
+    header.border     = Z_VT_BORDER;
+
+    zDeleteImage(img);
+
+    if ( !(dir = zGetPath(Z_VT_DIR, NULL, Z_FILE_FORCEUSER)) || !zMakeDir(dir) ||
+         !(fp = zOpenFile(zVirtualTextureFile(name), Z_VT_DIR, NULL,
+                          Z_FILE_FORCEUSER | Z_FILE_WRITE)) ) {
+        zError("Failed to open page file for virtual texture \"%s\" for writing.", name);
+        free(level);
+        free(page);
+        return FALSE;
+    }
+
+    ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+    for (i = 0; i < num_levels && ok; i++) {
+
+        zPrint("  level %d: %dx%d pages\n", i, pages >> i, pages >> i);
+
+        for (py = 0; py < pages >> i && ok; py++) {
+            for (px = 0; px < pages >> i && ok; px++) {
+                zCutPage(level, size >> i, px, py, page);
+                ok = fwrite(page, Z_VT_PAGE_BYTES, 1, fp) == 1;
+            }
+        }
+
+        // Every level is exactly half the size of the previous one since the number of pages is a
+        // power of two.
+        if (ok && i < num_levels-1) {
+            if ( (next = malloc((size_t) (size >> (i+1)) * (size >> (i+1)) * 4)) &&
+                 zDownsample(level, size >> i, size >> i, Z_TEX_COLOR, next) ) {
+                free(level);
+                level = next;
+            } else {
+                zError("%s: Failed to build level %d.", __func__, i+1);
+                free(next);
+                ok = FALSE;
+            }
+        }
+    }
+
+    fclose(fp);
+    free(level);
+    free(page);
+
+    if (!ok) zWarning("Failed to write page file for virtual texture \"%s\".", name);
+
+    return ok;
+}
+
+
+
+// Iterate over each loaded virtual texture and call iter with it.
+void zIterVirtualTextures(void (*iter)(ZVirtualTexture *, void *), void *data)
+{
+    unsigned int i;
+
+    for (i = 0; i < vtextures.size; i++) {
+        if (vtextures.items[i])
+            iter(vtextures.items[i], data);
+    }
+}
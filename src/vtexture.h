@@ -0,0 +1,111 @@
+#ifndef __VTEXTURE_H__
+#define __VTEXTURE_H__
+
+#include <GL/glew.h>
+
+// Virtual textures are for images far too large to keep in texture memory, like terrain or aerial
+// imagery. The "buildvtex" console command cuts a source image and its mipmap levels into pages of
+// Z_VT_PAGE_SIZE texels (with a border of Z_VT_BORDER texels copied from their neighbours so
+// bilinear filtering works across pages), and stores them in a page file under Z_VT_DIR in the user
+// directory. At runtime only the pages that are actually visible are read from that file and kept
+// in a shared physical cache texture of r_vtcachepages x r_vtcachepages pages.
+//
+// To find out which pages are visible, the scene is drawn into a small feedback buffer every few
+// frames with a shader that writes out the page (and level) each pixel needs. It is read back
+// asynchronously, missing pages are loaded by the job threads and uploaded into the least recently
+// used cache slots. Each virtual texture has an indirection texture with one texel per page (with a
+// mipmap per level) that says where in the cache a page lives, or where its closest resident parent
+// lives if it isn't loaded yet. The coarsest level is always kept resident so there is something to
+// fall back on.
+//
+// Materials refer to a virtual texture with virtual_map_name (the name of the source image). Their
+// shaders are compiled with VTEXTURE defined and look up texels like this:
+//
+//   uniform sampler2D z_vt_indirection;
+//   uniform sampler2D z_vt_cache;
+//   uniform vec4 z_vt_params; // UV scale x/y, pages per side at level 0, number of levels - 1.
+//   uniform vec4 z_vt_layout; // Cache size in pages, page size, border, log2(page content).
+//
+//   vec4 zSampleVirtual(vec2 uv)
+//   {
+//       vec2 vuv = fract(uv) * z_vt_params.xy;
+//       vec4 entry = texture2D(z_vt_indirection, vuv, z_vt_layout.w) * 255.0;
+//       vec2 inpage = fract(vuv * z_vt_params.z * exp2(-entry.z));
+//       vec2 texel = entry.xy * z_vt_layout.y + z_vt_layout.z +
+//                    inpage * (z_vt_layout.y - 2.0*z_vt_layout.z);
+//       return entry.w > 0.0 ? texture2D(z_vt_cache, texel / (z_vt_layout.x*z_vt_layout.y)) :
+//                              vec4(0.5);
+//   }
+
+#define Z_VT_DIR          "vtex"
+#define Z_VT_PAGE_SIZE    128
+#define Z_VT_BORDER       1
+#define Z_VT_PAGE_CONTENT (Z_VT_PAGE_SIZE - 2*Z_VT_BORDER)
+#define Z_VT_PAGE_BYTES   (Z_VT_PAGE_SIZE * Z_VT_PAGE_SIZE * 4)
+#define Z_VT_MAX_PAGES    1024 // Per side at level 0, limited by how pages are encoded in feedback.
+#define Z_VT_MAX_LEVELS   11
+#define Z_VT_MAX_TEXTURES 255  // Feedback identifies virtual textures by 8-bit IDs, 0 means none.
+
+// Texture units the indirection and cache textures are bound to.
+#define Z_VT_UNIT_INDIRECTION 3
+#define Z_VT_UNIT_CACHE       4
+
+
+typedef struct ZVirtualTexture
+{
+    const char *name; // Interned, see intern.h.
+    char path[Z_PATH_SIZE]; // Full path to the page file, read from by the job threads.
+
+    int id;
+
+    int width;  // Size of the source image.
+    int height;
+    int pages;  // Pages per side at level 0, always a power of two.
+    int num_levels;
+
+    int level_start[Z_VT_MAX_LEVELS]; // Index of the first page of each level.
+    int num_pages;                    // Total over all levels.
+
+    short *page_slot; // Cache slot holding each page, or one of the Z_VT_PAGE_* states.
+
+    unsigned char *indirection_data; // All levels of the indirection texture.
+    GLuint indirection;
+    int dirty; // Set when page_slot changed and the indirection texture needs updating.
+    int loads; // Page loads in flight, the texture can't be deleted until they're done.
+
+    // Number of resident materials using the texture, and the value of sceneload_count when that
+    // last dropped to 0. Unused virtual textures are deleted by zCollectVirtualTextures.
+    int refcount;
+    unsigned int released;
+
+} ZVirtualTexture;
+
+
+extern int vtextures_active;
+extern int vt_feedback; // Set while the feedback pass is being drawn, see zMakeMaterialActive.
+
+struct ZScene;
+
+void zVirtualTextureInit(void);
+
+void zVirtualTextureDeinit(void);
+
+ZVirtualTexture *zLookupVirtualTexture(const char *name);
+
+void zReleaseVirtualTexture(ZVirtualTexture *vt);
+
+int zCollectVirtualTextures(int force);
+
+void zBindVirtualTexture(ZVirtualTexture *vt, ZShaderProgram *program);
+
+void zApplyVirtualFeedback(ZVirtualTexture *vt);
+
+void zVirtualTextureFeedback(struct ZScene *scene);
+
+void zUpdateVirtualTextures(void);
+
+int zBuildVirtualTexture(const char *name);
+
+void zIterVirtualTextures(void (*iter)(ZVirtualTexture *, void *), void *data);
+
+#endif
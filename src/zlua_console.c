@@ -247,6 +247,57 @@ static int zConsoleListTextures(lua_State *L)
 }
 
 
+static void zConsoleTexMemCB(ZTexture *tex, void *data)
+{
+    const char *status = "";
+
+    if (tex->alias) {
+        zPrint("  %8s     %-6s %s (shares %s)\n", "-", "-", tex->name, tex->alias->name);
+        return;
+    }
+
+    if (tex->load)         status = " (loading)";
+    else if (tex->evicted) status = " (evicted)";
+
+    zPrint("  %8u KB  %-6u %s%s\n", tex->size/1024, frame_count - tex->last_used, tex->name,
+        status);
+}
+
+
+static unsigned int zTextureSize(const ZTexture *tex)
+{
+    if (tex && tex->alias) tex = tex->alias;
+
+    return tex ? tex->size : 0;
+}
+
+
+static void zConsoleTexMemMatsCB(ZMaterial *mat, void *data)
+{
+    if (!mat->is_resident) return;
+
+    zPrint("  %8u KB  %s\n", (zTextureSize(mat->diffuse_map) + zTextureSize(mat->normal_map) +
+        zTextureSize(mat->specular_map)) / 1024, mat->name);
+}
+
+
+static int zConsoleTexMem(lua_State *L)
+{
+    zPrint("Texture memory per texture (size, frames since last use, name):\n");
+    zIterTextures(zConsoleTexMemCB, NULL);
+
+    zPrint("\nTexture memory per resident material (shared textures are counted for each):\n");
+    zIterMaterials(zConsoleTexMemMatsCB, NULL);
+
+    zPrint("\nTotal: %u KB", (unsigned int) (zGetTextureBytes() / 1024));
+    if (r_texbudget)
+        zPrint(" of %d MB budget", r_texbudget);
+    zPrint(".\n\n");
+
+    return 0;
+}
+
+
 static void zConsoleListShaderProgramsCB(ZShaderProgram *program, void *data)
 {
     zPrint("  %s / %s, flags = %#x\n", program->vertex_shader, program->fragment_shader,
@@ -294,12 +345,66 @@ static int zConsoleRendererInfo(lua_State *L)
 }
 
 
+static int zConsoleInternInfo(lua_State *L)
+{
+    zInternInfo();
+    return 0;
+}
+
+
+static int zConsoleDedupInfo(lua_State *L)
+{
+    unsigned int meshes, textures;
+    size_t mesh_bytes, texture_bytes;
+
+    zMeshDedupStats(&meshes, &mesh_bytes);
+    zTextureDedupStats(&textures, &texture_bytes);
+
+    zPrint("Meshes sharing data with an identical one: %u, saving %u KB.\n", meshes,
+        (unsigned int) (mesh_bytes / 1024));
+    zPrint("Textures sharing an identical image: %u, saving %u KB.\n", textures,
+        (unsigned int) (texture_bytes / 1024));
+
+    if (!r_dedup) zPrint("Note that r_dedup is off, newly loaded resources aren't checked.\n");
+
+    return 0;
+}
+
+
+static int zConsoleMemInfo(lua_State *L)
+{
+    size_t rss = zGetProcessRSS(), in_memory, dropped;
+    unsigned int num_dropped;
+
+    zMeshMemStats(&in_memory, &dropped, &num_dropped);
+
+    if (rss)
+        zPrint("Resident set size: %u KB\n", (unsigned int) (rss / 1024));
+    else
+        zPrint("Resident set size: unknown\n");
+
+    zPrint("Mesh data in memory: %u KB\n", (unsigned int) (in_memory / 1024));
+    zPrint("Mesh data dropped after uploading: %u KB in %u meshes\n",
+        (unsigned int) (dropped / 1024), num_dropped);
+    zPrint("Texture memory: %u KB\n", (unsigned int) (zGetTextureBytes() / 1024));
+
+    if (!r_meshdropdata && !num_dropped)
+        zPrint("Note that r_meshdropdata is off, mesh data is kept in memory after uploading.\n");
+
+    return 0;
+}
+
+
 static int zConsoleMtlInfo(lua_State *L)
 {
-    ZMaterial *mtl;
-    const char *name = luaL_checkstring(L, 1);
+    ZMaterial *mtl = NULL;
+    const char *name = luaL_checkstring(L, 1), *interned;
+
+    // If the name was never interned, there can't be a material with that name either.
+    if ( (interned = zFindInterned(name)) && interned[0] )
+        mtl = zLookupMaterial(interned);
 
-    if ( !(mtl = zLookupMaterial(name)) )
+    if (!mtl)
         zError("No material named \"%s\" found.", name);
     else
         zMaterialInfo(mtl);
@@ -309,6 +414,100 @@ static int zConsoleMtlInfo(lua_State *L)
 
 
 
+// Compress the texture maps of mat into the texture cache, data points to a counter for the number
+// of textures compressed.
+static void zConsoleCompressTexturesCB(ZMaterial *mat, void *data)
+{
+    int *count = data;
+
+    if (mat->diffuse_map_name[0] && zCompressTexture(mat->diffuse_map_name, Z_TEX_COLOR))
+        (*count)++;
+    if (mat->specular_map_name[0] && zCompressTexture(mat->specular_map_name, 0))
+        (*count)++;
+    if (mat->normal_map_name[0] && zCompressTexture(mat->normal_map_name, Z_TEX_NORMALMAP))
+        (*count)++;
+}
+
+
+
+static int zConsoleCompressTextures(lua_State *L)
+{
+    int count = 0;
+    ZPosable *pos;
+    ZMaterial *mat;
+
+    // Need a renderer to know which formats are supported.
+    if (!renderer_active) {
+        zError("Can't compress textures without an active renderer.");
+        return 0;
+    }
+
+    zPrint("Compressing textures into the texture cache...\n");
+
+    zIterMaterials(zConsoleCompressTexturesCB, &count);
+
+    // Also do materials local to meshes in the current scene.
+    if (scene) {
+        for (pos = scene->posables; pos; pos = pos->next) {
+            if (pos->type == Z_POSABLE_STATICMESH) {
+                for (mat = pos->subject.mesh->materials; mat; mat = mat->next)
+                    zConsoleCompressTexturesCB(mat, &count);
+            }
+        }
+    }
+
+    zPrint("Compressed %d textures, use restartvideo to load them.\n", count);
+
+    return 0;
+}
+
+
+
+static int zConsoleBuildVTex(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+
+    zPrint("Building virtual texture \"%s\"...\n", name);
+
+    if (zBuildVirtualTexture(name))
+        zPrint("Done, materials can now use it as their virtual_map_name.\n");
+
+    return 0;
+}
+
+
+
+static void zConsoleVTexInfoCB(ZVirtualTexture *vt, void *data)
+{
+    int i, resident = 0;
+
+    for (i = 0; i < vt->num_pages; i++) {
+        if (vt->page_slot[i] >= 0)
+            resident++;
+    }
+
+    zPrint("  %s: %dx%d, %d levels, %d of %d pages resident\n", vt->name, vt->width, vt->height,
+        vt->num_levels, resident, vt->num_pages);
+}
+
+
+
+static int zConsoleVTexInfo(lua_State *L)
+{
+    if (!vtextures_active) {
+        zPrint("Virtual textures are not active.\n");
+        return 0;
+    }
+
+    zPrint("Loaded virtual textures:\n");
+    zIterVirtualTextures(zConsoleVTexInfoCB, NULL);
+    zPrint("\n");
+
+    return 0;
+}
+
+
+
 static int zConsoleLoadScene(lua_State *L)
 {
     ZCamera cam;
@@ -339,6 +538,20 @@ static int zConsoleLoadScene(lua_State *L)
 }
 
 
+
+static int zConsoleCollect(lua_State *L)
+{
+    if (!renderer_active) {
+        zPrint("Resources can only be collected while the renderer is active.\n");
+        return 0;
+    }
+
+    zCollectResources(1);
+
+    return 0;
+}
+
+
 static int zConsoleAddMesh(lua_State *L)
 {
     const char *name;
@@ -711,11 +924,19 @@ ZLuaConsoleFunc console_funcs[] = {
     { "listmeshes",      zConsoleListMeshes,      "Lists loaded meshes.",                       NULL },
     { "listmats",        zConsoleListMats,        "Lists loaded materials.",                    NULL },
     { "listtextures",    zConsoleListTextures,    "Lists loaded textures.",                     NULL },
+    { "texmem",          zConsoleTexMem,          "Reports texture memory used per texture and material.", NULL },
     { "listshaders",     zConsoleListShaders,     "Lists loaded shaders.",                      NULL },
     { "sceneinfo",       zConsoleSceneInfo,       "Prints details on currently loaded scene.",  NULL },
     { "rendererinfo",    zConsoleRendererInfo,    "Prints details on renderer.",                NULL },
     { "mtlinfo",         zConsoleMtlInfo,         "Prints details on a material.",              "name (string)" },
+    { "interninfo",      zConsoleInternInfo,      "Prints statistics on interned resource names.", NULL },
+    { "dedupinfo",       zConsoleDedupInfo,       "Reports meshes and textures sharing data with identical ones, and the memory saved.", NULL },
+    { "meminfo",         zConsoleMemInfo,         "Reports process memory use (RSS) and the mesh data kept in memory.", NULL },
+    { "compresstextures",zConsoleCompressTextures, "Compresses textures of loaded materials into the texture cache.", NULL },
+    { "buildvtex",       zConsoleBuildVTex,       "Builds the page file for a virtual texture from a (huge) image.", "name (string)" },
+    { "vtexinfo",        zConsoleVTexInfo,        "Prints details on loaded virtual textures.", NULL },
     { "loadscene",       zConsoleLoadScene,       "Loads a new scene.",                         "name (string)" },
+    { "collect",         zConsoleCollect,         "Frees all meshes, textures and shaders not used by the current scene.", NULL },
     { "addmesh",         zConsoleAddMesh,         "Adds a mesh to the scene.",                  "filename (string), is_sky (number, optional)" },
     { "runscript",       zConsoleRunScript,       "Run a console script.",                      "filename (string)" },
     { "echo",            zConsoleEcho,            "Echoes back a message.",                     "message (string)" },